@@ -22,6 +22,8 @@
 #include <stdint.h>
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <linux/ioctl.h>
 #include <linux/usbdevice_fs.h>
 #include <linux/input.h>
@@ -247,29 +249,36 @@ ioctl_tree_read(FILE * f)
     return tree;
 }
 
-void
-ioctl_tree_write(FILE * f, const ioctl_tree * tree)
+/* write a single node, without its children and siblings */
+static void
+ioctl_tree_write_node(FILE * f, const ioctl_tree * node)
 {
     int res;
-    if (tree == NULL)
-	return;
 
     /* write indent */
-    for (int i = 0; i < tree->depth; ++i)
+    for (int i = 0; i < node->depth; ++i)
 	fputc(' ', f);
-    if (tree->id != tree->type->id) {
+    if (node->id != node->type->id) {
 	long offset;
-	offset = _IOC_NR(tree->id) - _IOC_NR(tree->type->id);
+	offset = _IOC_NR(node->id) - _IOC_NR(node->type->id);
 	assert(offset >= 0);
-	assert(offset <= tree->type->nr_range);
-	fprintf(f, "%s(%li) %i ", tree->type->name, offset, tree->ret);
+	assert(offset <= node->type->nr_range);
+	fprintf(f, "%s(%li) %i ", node->type->name, offset, node->ret);
     } else {
-	fprintf(f, "%s %i ", tree->type->name, tree->ret);
+	fprintf(f, "%s %i ", node->type->name, node->ret);
     }
-    tree->type->write(tree, f);
+    node->type->write(node, f);
     res = fputc('\n', f);
     assert(res == '\n');
+}
 
+void
+ioctl_tree_write(FILE * f, const ioctl_tree * tree)
+{
+    if (tree == NULL)
+	return;
+
+    ioctl_tree_write_node(f, tree);
     ioctl_tree_write(f, tree->child);
     ioctl_tree_write(f, tree->next);
 }
@@ -361,8 +370,11 @@ ioctl_node_list_append(ioctl_node_list * list, ioctl_tree * element)
     list->items[list->n++] = element;
 }
 
-ioctl_tree *
-ioctl_tree_execute(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id, void *arg, int *ret)
+/* lookup: whether this is for the handler itself instead of a program's
+ * request, which is not counted as executed */
+static ioctl_tree *
+ioctl_tree_execute_full(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id, void *arg, int *ret,
+			int lookup)
 {
     const ioctl_type *t;
     ioctl_tree *i;
@@ -401,10 +413,15 @@ ioctl_tree_execute(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id,
 	if (handled) {
 	    DBG(DBG_IOCTL_TREE, "    -> match, ret %i, adv: %i\n", r, handled);
 	    *ret = r;
-	    if (handled == 1)
+	    if (handled == 1) {
+		if (lookup)
+		    i->looked_up++;
+		else
+		    i->executed++;
 		return i;
-	    else
+	    } else {
 		return last;
+	    }
 	}
 
 	if (last != NULL && i == last) {
@@ -426,6 +443,119 @@ ioctl_tree_execute(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id,
     return NULL;
 }
 
+ioctl_tree *
+ioctl_tree_execute(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id, void *arg, int *ret)
+{
+    return ioctl_tree_execute_full(tree, last, id, arg, ret, FALSE);
+}
+
+/*
+ * Like ioctl_tree_execute() from the start, for handlers which need a recorded
+ * answer outside of a program's request. The node is kept by
+ * ioctl_tree_write_executed(), but does not count as executed.
+ */
+ioctl_tree *
+ioctl_tree_lookup(ioctl_tree * tree, IOCTL_REQUEST_TYPE id, void *arg, int *ret)
+{
+    return ioctl_tree_execute_full(tree, NULL, id, arg, ret, TRUE);
+}
+
+/***********************************
+ *
+ * Replay coverage
+ *
+ ***********************************/
+
+/* whether node or one of its children answered an ioctl or lookup */
+static int
+ioctl_tree_is_executed(const ioctl_tree * node)
+{
+    const ioctl_tree *c;
+
+    if (node->executed > 0 || node->looked_up > 0)
+	return TRUE;
+    for (c = node->child; c != NULL; c = c->next)
+	if (ioctl_tree_is_executed(c))
+	    return TRUE;
+    return FALSE;
+}
+
+/*
+ * Like ioctl_tree_write(), but only with the nodes which answered an ioctl
+ * in ioctl_tree_execute() or ioctl_tree_lookup(), and their parents. As whole subtrees get dropped,
+ * the remaining nodes keep their depth and order, so that the result replays
+ * the same way for these ioctls.
+ */
+void
+ioctl_tree_write_executed(FILE * f, const ioctl_tree * tree)
+{
+    const ioctl_tree *i;
+
+    for (i = tree; i != NULL; i = i->next) {
+	if (!ioctl_tree_is_executed(i))
+	    continue;
+	ioctl_tree_write_node(f, i);
+	ioctl_tree_write_executed(f, i->child);
+    }
+}
+
+/* count the executed and kept nodes of node's subtree, returns whether it
+ * gets kept */
+static int
+ioctl_tree_count_executed(const ioctl_tree * node, ioctl_tree_stats * stats)
+{
+    const ioctl_tree *c;
+    int kept = node->executed > 0 || node->looked_up > 0;
+
+    if (node->executed > 0)
+	stats->executed++;
+    for (c = node->child; c != NULL; c = c->next)
+	if (ioctl_tree_count_executed(c, stats))
+	    kept = TRUE;
+    if (kept)
+	stats->kept++;
+    return kept;
+}
+
+static size_t
+ioctl_tree_hash(const ioctl_tree * node)
+{
+    size_t h = (size_t) node->id * (size_t) 1099511628211ULL;
+
+    if (node->type->hash != NULL)
+	h ^= node->type->hash(node);
+    return h;
+}
+
+void
+ioctl_tree_get_stats(ioctl_tree * tree, ioctl_tree_stats * stats)
+{
+    const ioctl_tree *i, **seen;
+    size_t size = 16, slot;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = tree; i != NULL; i = ioctl_tree_next(i))
+	stats->nodes++;
+    for (i = tree; i != NULL; i = i->next)
+	ioctl_tree_count_executed(i, stats);
+
+    /* hash set of the distinct nodes so far, with open addressing; at most
+     * half full */
+    while (size < 2 * (size_t) stats->nodes)
+	size *= 2;
+    seen = callocx(sizeof(const ioctl_tree *), size);
+    for (i = tree; i != NULL; i = ioctl_tree_next(i)) {
+	for (slot = ioctl_tree_hash(i) & (size - 1); seen[slot] != NULL; slot = (slot + 1) & (size - 1))
+	    if (seen[slot]->id == i->id && i->type->equal(i, seen[slot]))
+		break;
+	if (seen[slot] != NULL)
+	    stats->duplicates++;
+	else
+	    seen[slot] = i;
+    }
+    free(seen);
+}
+
 /***********************************
  *
  * Utility functions for ioctl implementations
@@ -480,6 +610,115 @@ write_hex(FILE * file, const char *buf, size_t len)
 	fprintf(file, "%02X", (unsigned)(unsigned char)buf[i]);
 }
 
+/***********************************
+ *
+ * Payload store
+ *
+ ***********************************/
+
+/* Recorded payloads repeat a lot (EVIOCGBIT masks, descriptors, identical
+ * URBs), within a tree and across the trees of a testbed. Nodes share one
+ * immutable, reference counted copy of each distinct payload, so that equal
+ * payloads have equal pointers. */
+
+typedef struct ioctl_payload {
+    struct ioctl_payload *next;	/* in hash bucket */
+    size_t hash;
+    size_t len;
+    unsigned refs;
+    unsigned char data[];
+} ioctl_payload;
+
+static pthread_mutex_t payload_lock = PTHREAD_MUTEX_INITIALIZER;
+static ioctl_payload **payload_buckets;
+static size_t payload_n_buckets;
+static size_t payload_count;
+
+static size_t
+payload_hash(const void *data, size_t len)
+{
+    /* FNV-1a */
+    const unsigned char *p = data;
+    size_t h = (size_t) 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+	h = (h ^ p[i]) * (size_t) 1099511628211ULL;
+    return h ^ len;
+}
+
+/* called with payload_lock held */
+static void
+payload_store_grow(void)
+{
+    size_t n = payload_n_buckets ? payload_n_buckets * 2 : 256;
+    ioctl_payload **buckets = callocx(sizeof(ioctl_payload *), n);
+    size_t i;
+
+    for (i = 0; i < payload_n_buckets; ++i) {
+	ioctl_payload *p = payload_buckets[i];
+	while (p != NULL) {
+	    ioctl_payload *next = p->next;
+	    p->next = buckets[p->hash % n];
+	    buckets[p->hash % n] = p;
+	    p = next;
+	}
+    }
+    free(payload_buckets);
+    payload_buckets = buckets;
+    payload_n_buckets = n;
+}
+
+const void *
+ioctl_payload_intern(const void *data, size_t len)
+{
+    size_t hash = payload_hash(data, len);
+    ioctl_payload *p;
+
+    pthread_mutex_lock(&payload_lock);
+    if (payload_count >= payload_n_buckets)
+	payload_store_grow();
+
+    for (p = payload_buckets[hash % payload_n_buckets]; p != NULL; p = p->next) {
+	if (p->hash == hash && p->len == len && memcmp(p->data, data, len) == 0) {
+	    p->refs++;
+	    pthread_mutex_unlock(&payload_lock);
+	    return p->data;
+	}
+    }
+
+    p = mallocx(offsetof(ioctl_payload, data) + len);
+    p->hash = hash;
+    p->len = len;
+    p->refs = 1;
+    memcpy(p->data, data, len);
+    p->next = payload_buckets[hash % payload_n_buckets];
+    payload_buckets[hash % payload_n_buckets] = p;
+    payload_count++;
+    pthread_mutex_unlock(&payload_lock);
+    return p->data;
+}
+
+void
+ioctl_payload_unref(const void *payload)
+{
+    ioctl_payload *p, **link;
+
+    if (payload == NULL)
+	return;
+
+    p = (ioctl_payload *) ((const unsigned char *) payload - offsetof(ioctl_payload, data));
+    pthread_mutex_lock(&payload_lock);
+    if (--p->refs == 0) {
+	for (link = &payload_buckets[p->hash % payload_n_buckets]; *link != p; link = &(*link)->next)
+	    ;
+	*link = p->next;
+	payload_count--;
+	free(p);
+    }
+    pthread_mutex_unlock(&payload_lock);
+}
+
 /***********************************
  *
  * ioctls with simple struct data (i. e. no pointers)
@@ -502,8 +741,7 @@ static void
 ioctl_simplestruct_init_from_bin(ioctl_tree * node, const void *data)
 {
     DBG(DBG_IOCTL_TREE, "ioctl_simplestruct_init_from_bin: %s(%X): size is %u bytes\n", node->type->name, (unsigned) node->id, (unsigned) NSIZE(node));
-    node->data = mallocx(NSIZE(node));
-    memcpy(node->data, data, NSIZE(node));
+    node->data = (void *) ioctl_payload_intern(data, NSIZE(node));
 }
 
 static int
@@ -513,7 +751,7 @@ ioctl_simplestruct_init_from_text(ioctl_tree * node, const char *data)
      * correct length for data; this happens for variable length ioctls such as
      * EVIOCGBIT */
     size_t data_len = strlen(data) / 2;
-    node->data = mallocx(data_len);
+    char *buf = callocx(data_len ? data_len : 1, 1);
 
     if (NSIZE(node) != data_len) {
 	DBG(DBG_IOCTL_TREE, "ioctl_simplestruct_init_from_text: adjusting ioctl ID %X (size %u) to actual data length %zu\n",
@@ -521,19 +759,20 @@ ioctl_simplestruct_init_from_text(ioctl_tree * node, const char *data)
 	node->id = _IOC(_IOC_DIR(node->id), _IOC_TYPE(node->id), _IOC_NR(node->id), data_len);
     }
 
-    if (!read_hex(data, node->data, NSIZE(node))) {
+    if (!read_hex(data, buf, NSIZE(node))) {
 	DBG(DBG_IOCTL_TREE, "ioctl_simplestruct_init_from_text: failed to parse '%s'\n", data);
-	free(node->data);
+	free(buf);
 	return FALSE;
     }
+    node->data = (void *) ioctl_payload_intern(buf, NSIZE(node));
+    free(buf);
     return TRUE;
 }
 
 static void
 ioctl_simplestruct_free_data(ioctl_tree * node)
 {
-    if (node->data != NULL)
-	free(node->data);
+    ioctl_payload_unref(node->data);
 }
 
 static void
@@ -546,7 +785,14 @@ ioctl_simplestruct_write(const ioctl_tree * node, FILE * f)
 static int
 ioctl_simplestruct_equal(const ioctl_tree * n1, const ioctl_tree * n2)
 {
-    return n1->type == n2->type && memcmp(n1->data, n2->data, NSIZE(n1)) == 0;
+    /* interned payloads of the same size and contents are the same */
+    return n1->type == n2->type && n1->data == n2->data;
+}
+
+static size_t
+ioctl_simplestruct_hash(const ioctl_tree * node)
+{
+    return (size_t) node->type ^ (size_t) node->data;
 }
 
 static int
@@ -561,6 +807,20 @@ ioctl_simplestruct_in_execute(const ioctl_tree * node, IOCTL_REQUEST_TYPE id, vo
     return 0;
 }
 
+#ifdef EVIOCGMTSLOTS
+/* EVIOCGMTSLOTS gets the values of the ABS_MT_* code in the first field of
+ * the argument, so only answer with a node recorded for the same code */
+static int
+ioctl_mtslots_execute(const ioctl_tree * node, IOCTL_REQUEST_TYPE id, void *arg, int *ret)
+{
+    if (id == node->id && NSIZE(node) >= sizeof(uint32_t) &&
+	memcmp(arg, node->data, sizeof(uint32_t)) == 0)
+	return ioctl_simplestruct_in_execute(node, id, arg, ret);
+
+    return 0;
+}
+#endif
+
 /***********************************
  *
  * ioctls with dynamic length struct data, but no pointers to substructs
@@ -571,38 +831,41 @@ ioctl_simplestruct_in_execute(const ioctl_tree * node, IOCTL_REQUEST_TYPE id, vo
 
 #if 0
 
+/* The payloads are interned like the simple structs' ones, and freed with
+ * ioctl_simplestruct_free_data() */
+
 static void
 ioctl_varlenstruct_init_from_bin(ioctl_tree * node, const void *data)
 {
     size_t size = node->type->get_data_size(node->id, data);
     DBG(DBG_IOCTL_TREE, "ioctl_varlenstruct_init_from_bin: %s(%X): size is %zu bytes\n", node->type->name, (unsigned) node->id, size);
-    node->data = mallocx(size);
-    memcpy(node->data, data, size);
+    node->data = (void *) ioctl_payload_intern(data, size);
 }
 
 static int
 ioctl_varlenstruct_init_from_text(ioctl_tree * node, const char *data)
 {
     size_t data_len = strlen(data) / 2;
+    char *buf = callocx(data_len ? data_len : 1, 1);
 
-    node->data = mallocx(data_len);
-
-    if (!read_hex(data, node->data, data_len)) {
+    if (!read_hex(data, buf, data_len)) {
 	fprintf(stderr, "ioctl_varlenstruct_init_from_text: failed to parse '%s'\n", data);
-	free(node->data);
+	free(buf);
 	return FALSE;
     }
 
     /* verify that the text data size actually matches get_data_size() */
-    size_t size = node->type->get_data_size(node->id, node->data);
+    size_t size = node->type->get_data_size(node->id, buf);
 
     if (size != data_len) {
 	fprintf(stderr, "ioctl_varlenstruct_init_from_text: ioctl %X: expected data length %zu, but got %zu bytes from text data\n",
 		(unsigned) node->id, size, data_len);
-	free(node->data);
+	free(buf);
 	return FALSE;
     }
 
+    node->data = (void *) ioctl_payload_intern(buf, data_len);
+    free(buf);
     return TRUE;
 }
 
@@ -616,9 +879,14 @@ ioctl_varlenstruct_write(const ioctl_tree * node, FILE * f)
 static int
 ioctl_varlenstruct_equal(const ioctl_tree * n1, const ioctl_tree * n2)
 {
-    size_t size1 = n1->type->get_data_size(n1->id, n1->data);
-    size_t size2 = n2->type->get_data_size(n2->id, n2->data);
-    return n1->id == n2->id && size1 == size2 && memcmp(n1->data, n2->data, size1) == 0;
+    /* interned payloads of the same size and contents are the same */
+    return n1->id == n2->id && n1->data == n2->data;
+}
+
+static size_t
+ioctl_varlenstruct_hash(const ioctl_tree * node)
+{
+    return (size_t) node->id ^ (size_t) node->data;
 }
 
 static int
@@ -650,9 +918,17 @@ usbdevfs_reapurb_init_from_bin(ioctl_tree * node, const void *data)
 
     copy = callocx(sizeof(struct usbdevfs_urb), 1);
     memcpy(copy, urb, sizeof(struct usbdevfs_urb));
-    /* we need to make a copy of the buffer */
-    copy->buffer = callocx(urb->buffer_length, 1);
-    memcpy(copy->buffer, urb->buffer, urb->buffer_length);
+    /* we need to make a copy of the buffer; for input URBs only the
+     * transferred part is defined, so clear the rest to let the same
+     * transfers share their buffers */
+    if (urb->endpoint & 0x80 && urb->actual_length >= 0 && urb->actual_length < urb->buffer_length) {
+	char *buf = callocx(urb->buffer_length, 1);
+	memcpy(buf, urb->buffer, urb->actual_length);
+	copy->buffer = (void *) ioctl_payload_intern(buf, urb->buffer_length);
+	free(buf);
+    } else {
+	copy->buffer = (void *) ioctl_payload_intern(urb->buffer, urb->buffer_length);
+    }
     node->data = copy;
 }
 
@@ -660,6 +936,7 @@ static int
 usbdevfs_reapurb_init_from_text(ioctl_tree * node, const char *data)
 {
     struct usbdevfs_urb *info = callocx(sizeof(struct usbdevfs_urb), 1);
+    char *buf;
     int offset, result;
     unsigned type, endpoint;
     result = sscanf(data, "%u %u %i %u %i %i %i %n", &type, &endpoint,
@@ -675,13 +952,15 @@ usbdevfs_reapurb_init_from_text(ioctl_tree * node, const char *data)
     info->endpoint = (unsigned char)endpoint;
 
     /* read buffer */
-    info->buffer = callocx(info->buffer_length, 1);
-    if (!read_hex(data + offset, info->buffer, info->buffer_length)) {
+    buf = callocx(info->buffer_length, 1);
+    if (!read_hex(data + offset, buf, info->buffer_length)) {
 	DBG(DBG_IOCTL_TREE, "usbdevfs_reapurb_init_from_text: failed to parse buffer '%s'\n", data + offset);
-	free(info->buffer);
+	free(buf);
 	free(info);
 	return FALSE;
     };
+    info->buffer = (void *) ioctl_payload_intern(buf, info->buffer_length);
+    free(buf);
 
     node->data = info;
     return TRUE;
@@ -692,8 +971,7 @@ usbdevfs_reapurb_free_data(ioctl_tree * node)
 {
     struct usbdevfs_urb *info = node->data;
     if (info != NULL) {
-	if (info->buffer != NULL)
-	    free(info->buffer);
+	ioctl_payload_unref(info->buffer);
 	free(info);
     }
 }
@@ -725,7 +1003,16 @@ usbdevfs_reapurb_equal(const ioctl_tree * n1, const ioctl_tree * n2)
     return u1->type == u2->type && u1->endpoint == u2->endpoint &&
 	u1->status == u2->status && u1->flags == u2->flags &&
 	u1->buffer_length == u2->buffer_length &&
-	u1->actual_length == u2->actual_length && memcmp(u1->buffer, u2->buffer, u1->buffer_length) == 0;
+	u1->actual_length == u2->actual_length && u1->buffer == u2->buffer;
+}
+
+static size_t
+usbdevfs_reapurb_hash(const ioctl_tree * node)
+{
+    const struct usbdevfs_urb *urb = node->data;
+
+    /* the buffer is interned */
+    return (size_t) urb->buffer ^ (size_t) urb->endpoint;
 }
 
 static int
@@ -871,7 +1158,8 @@ ioctl_insertion_parent_stateless(ioctl_tree * tree, UNUSED ioctl_tree *_node)
      ioctl_simplestruct_init_from_bin, ioctl_simplestruct_init_from_text,      \
      ioctl_simplestruct_free_data,                                             \
      ioctl_simplestruct_write, ioctl_simplestruct_equal,                       \
-     ioctl_simplestruct_in_execute, insertion_parent_fn, NULL}
+     ioctl_simplestruct_in_execute, insertion_parent_fn, NULL,                 \
+     ioctl_simplestruct_hash}
 
 #define I_SIZED_SIMPLE_STRUCT_IN(name, size, nr_range, insertion_parent_fn) \
     I_NAMED_SIZED_SIMPLE_STRUCT_IN(name, #name, size, nr_range, insertion_parent_fn)
@@ -889,7 +1177,8 @@ ioctl_insertion_parent_stateless(ioctl_tree * tree, UNUSED ioctl_tree *_node)
      ioctl_varlenstruct_init_from_bin, ioctl_varlenstruct_init_from_text,      \
      ioctl_simplestruct_free_data,                                             \
      ioctl_varlenstruct_write, ioctl_varlenstruct_equal,                       \
-     ioctl_varlenstruct_in_execute, insertion_parent_fn, data_size_fn}
+     ioctl_varlenstruct_in_execute, insertion_parent_fn, data_size_fn,         \
+     ioctl_varlenstruct_hash}
 
 /* data with custom handlers; necessary for structs with pointers to nested
  * structs, or keeping stateful handlers */
@@ -898,7 +1187,8 @@ ioctl_insertion_parent_stateless(ioctl_tree * tree, UNUSED ioctl_tree *_node)
      fn_prefix ## _init_from_bin, fn_prefix ## _init_from_text, \
      fn_prefix ## _free_data,                                   \
      fn_prefix ## _write, fn_prefix ## _equal,                  \
-     fn_prefix ## _execute, fn_prefix ## _insertion_parent}
+     fn_prefix ## _execute, fn_prefix ## _insertion_parent,    \
+     NULL, fn_prefix ## _hash}
 
 #define I_DUMMY(name, size, nr_range)               \
     {name, size, nr_range, #name,                  \
@@ -948,7 +1238,12 @@ ioctl_type ioctl_db[] = {
 
     /* this was introduced not too long ago */
 #ifdef EVIOCGMTSLOTS
-    I_NAMED_SIMPLE_STRUCT_IN(EVIOCGMTSLOTS(32), "EVIOCGMTSLOTS", 0, ioctl_insertion_parent_stateless),
+    {EVIOCGMTSLOTS(32), -1, 0, "EVIOCGMTSLOTS",
+     ioctl_simplestruct_init_from_bin, ioctl_simplestruct_init_from_text,
+     ioctl_simplestruct_free_data,
+     ioctl_simplestruct_write, ioctl_simplestruct_equal,
+     ioctl_mtslots_execute, ioctl_insertion_parent_stateless, NULL,
+     ioctl_simplestruct_hash},
 #endif
 
     /* hidraw */
@@ -995,6 +1290,13 @@ int ioctl_data_size_by_id(IOCTL_REQUEST_TYPE id)
     return 0;
 }
 
+/* Whether id is answered the same way regardless of previous ioctls */
+int ioctl_type_is_stateless(IOCTL_REQUEST_TYPE id)
+{
+    const ioctl_type *t = ioctl_type_get_by_id(id);
+    return t != NULL && t->insertion_parent == ioctl_insertion_parent_stateless;
+}
+
 const ioctl_type *
 ioctl_type_get_by_name(const char *name, IOCTL_REQUEST_TYPE *out_id)
 {
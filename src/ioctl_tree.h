@@ -42,6 +42,9 @@ typedef struct {
      * ioctls do not encode the size; if set, and real_size < 0, this function
      * returns the length */
     size_t (*get_data_size) (IOCTL_REQUEST_TYPE, const void *);
+    /* hash of what equal() compares, so that equal nodes hash the same; if
+     * NULL, nodes only get hashed by their id */
+    size_t (*hash) (const ioctl_tree *);
 } ioctl_type;
 
 typedef struct {
@@ -62,8 +65,17 @@ struct ioctl_tree {
 
     /* below are internal private fields */
     ioctl_node_list *last_added;
+    unsigned executed;		/* number of times this node answered an ioctl */
+    unsigned looked_up;		/* number of times it answered ioctl_tree_lookup() */
 };
 
+typedef struct {
+    unsigned nodes;
+    unsigned executed;		/* nodes which answered a program's ioctl */
+    unsigned kept;		/* nodes written by ioctl_tree_write_executed() */
+    unsigned duplicates;	/* nodes equal to an earlier one */
+} ioctl_tree_stats;
+
 ioctl_tree *ioctl_tree_new_from_bin(IOCTL_REQUEST_TYPE id, const void *data, int ret);
 ioctl_tree *ioctl_tree_new_from_text(const char *line);
 void ioctl_tree_free(ioctl_tree * tree);
@@ -73,6 +85,11 @@ ioctl_tree *ioctl_tree_insert(ioctl_tree * tree, ioctl_tree * node);
 ioctl_tree *ioctl_tree_find_equal(ioctl_tree * tree, ioctl_tree * node);
 ioctl_tree *ioctl_tree_next(const ioctl_tree * node);
 ioctl_tree *ioctl_tree_execute(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id, void *arg, int *ret);
+ioctl_tree *ioctl_tree_lookup(ioctl_tree * tree, IOCTL_REQUEST_TYPE id, void *arg, int *ret);
+
+/* replay coverage */
+void ioctl_tree_write_executed(FILE * f, const ioctl_tree * tree);
+void ioctl_tree_get_stats(ioctl_tree * tree, ioctl_tree_stats * stats);
 
 /* node lists */
 ioctl_node_list *ioctl_node_list_new(void);
@@ -95,7 +112,12 @@ ioctl_tree_next_wrap(ioctl_tree * tree, ioctl_tree * node)
     return (t != NULL) ? t : tree;
 }
 
+/* payload store: nodes share one immutable copy of equal payloads */
+const void *ioctl_payload_intern(const void *data, size_t len);
+void ioctl_payload_unref(const void *payload);
+
 int ioctl_data_size_by_id(IOCTL_REQUEST_TYPE id);
+int ioctl_type_is_stateless(IOCTL_REQUEST_TYPE id);
 
 /* database of known ioctls; return NULL for unknown ones */
 const ioctl_type *ioctl_type_get_by_id(IOCTL_REQUEST_TYPE id);
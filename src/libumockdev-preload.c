@@ -42,12 +42,18 @@
 #include <string.h>
 #include <time.h>
 #include <signal.h>
+#include <poll.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/vfs.h>
 #include <sys/xattr.h>
 #include <linux/ioctl.h>
@@ -55,8 +61,12 @@
 #include <linux/netlink.h>
 #include <linux/input.h>
 #include <linux/magic.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
 #include <unistd.h>
 #include <pthread.h>
+#include <spawn.h>
 
 #include "config.h"
 #include "debug.h"
@@ -129,6 +139,18 @@ path_exists(const char *path)
     return res;
 }
 
+static inline int
+path_executable(const char *path)
+{
+    int orig_errno, res;
+    libc_func(access, int, const char*, int);
+
+    orig_errno = errno;
+    res = _access(path, X_OK);
+    errno = orig_errno;
+    return res;
+}
+
 /* multi-thread locking for trap_path users */
 pthread_mutex_t trap_path_lock = PTHREAD_MUTEX_INITIALIZER;
 static sigset_t trap_path_sig_restore;
@@ -154,6 +176,187 @@ pthread_mutex_t ioctl_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static size_t trap_path_prefix_len = 0;
 
+/* The real working directory, as the kernel has it (i. e. without symlinks);
+ * empty if unknown. It is read at startup and after chdir()/fchdir(), so that
+ * trap_path() can make relative paths absolute without realpath(). Changes
+ * of the directory within libc (like nftw() with FTW_CHDIR) are not seen.
+ * Protected by trap_path_lock. */
+static char cwd_path[PATH_MAX];
+
+static void
+cwd_update(void)
+{
+    libc_func(getcwd, char *, char *, size_t);
+    int orig_errno = errno;
+
+    if (_getcwd(cwd_path, sizeof(cwd_path)) == NULL || cwd_path[0] != '/')
+	cwd_path[0] = '\0';
+    errno = orig_errno;
+}
+
+/* Append the relative path to the absolute directory base without looking
+ * at the file system. Returns NULL if that is not possible, i. e. if a ".."
+ * follows a component which might be a symlink; leading ".." are fine if
+ * base is known to have no symlinks (physical). */
+static const char *
+join_path(const char *base, int physical, const char *path, char *buf, size_t size)
+{
+    const char *comp, *end;
+    size_t len, comp_len;
+    int plain_seen = !physical;
+
+    len = strlen(base);
+    if (base[0] != '/' || len >= size)
+	return NULL;
+    memcpy(buf, base, len + 1);
+
+    for (comp = path; *comp != '\0'; comp = *end == '/' ? end + 1 : end) {
+	end = strchrnul(comp, '/');
+	comp_len = end - comp;
+
+	if (comp_len == 0 || (comp_len == 1 && comp[0] == '.'))
+	    continue;
+
+	if (comp_len == 2 && comp[0] == '.' && comp[1] == '.') {
+	    if (plain_seen)
+		return NULL;
+	    /* drop the last component, but keep the root */
+	    len = strrchr(buf, '/') - buf;
+	    if (len == 0)
+		len = 1;
+	    buf[len] = '\0';
+	    continue;
+	}
+
+	plain_seen = 1;
+	if (len + 1 + comp_len >= size)
+	    return NULL;
+	if (len > 1)
+	    buf[len++] = '/';
+	memcpy(buf + len, comp, comp_len);
+	len += comp_len;
+	buf[len] = '\0';
+    }
+
+    return buf;
+}
+
+/* Make the relative path absolute against the working directory, see
+ * join_path(). A symlink as first component (e. g. into /sys) is followed,
+ * at the cost of one readlink() per link; deeper ones are only caught by
+ * join_path() if ".." follows them. */
+static const char *
+cwd_absolute_path(const char *path, char *buf, size_t size)
+{
+    libc_func(readlink, ssize_t, const char*, char*, size_t);
+    char link[PATH_MAX], target[PATH_MAX];
+    const char *base = cwd_path;
+    int physical = 1;
+    size_t comp_len;
+    ssize_t len;
+    int orig_errno, i;
+
+    if (cwd_path[0] == '\0')
+	return NULL;
+
+    while (path[0] == '.' && path[1] == '/')
+	path += 2;
+    while (path[0] == '/')
+	path++;
+    comp_len = strchrnul(path, '/') - path;
+    if (comp_len == 0 || (comp_len <= 2 && strncmp(path, "..", comp_len) == 0))
+	return join_path(cwd_path, 1, path, buf, size);
+
+    if (snprintf(link, sizeof(link), "%s/%.*s", cwd_path, (int) comp_len, path) >= (int) sizeof(link))
+	return NULL;
+
+    orig_errno = errno;
+    for (i = 0; i < 40; ++i) {
+	len = _readlink(link, target, sizeof(target) - 1);
+	if (len < 0)
+	    break;
+	target[len] = '\0';
+	DBG(DBG_PATH, "cwd_absolute_path: %s is a symlink to %s\n", link, target);
+	if (target[0] == '/') {
+	    memcpy(link, target, len + 1);
+	} else {
+	    /* relative to the directory of the link */
+	    *strrchr(link, '/') = '\0';
+	    if (join_path(link[0] ? link : "/", physical, target, buf, size) == NULL ||
+		strlen(buf) >= sizeof(link)) {
+		errno = orig_errno;
+		return NULL;
+	    }
+	    strcpy(link, buf);
+	}
+	/* the target may have symlinks itself */
+	physical = 0;
+    }
+    errno = orig_errno;
+    if (i == 40)
+	return NULL;
+
+    if (physical)
+	return join_path(base, 1, path, buf, size);
+    return join_path(link, 0, path + comp_len, buf, size);
+}
+
+/* With $UMOCKDEV_TRACE_FILE, append each testbed path which the program
+ * accesses to that file, once per process, for minimizing fixtures. Lines are
+ * written with a single write() on an O_APPEND fd, so that processes do not
+ * mix them up. Called with trap_path_lock held. */
+#define TRACE_SEEN_MAX 4096
+static void
+trace_path(const char *path)
+{
+    libc_func(open, int, const char *, int, ...);
+    libc_func(write, ssize_t, int, const void *, size_t);
+    static int trace_fd = -2;
+    static uint64_t seen[TRACE_SEEN_MAX];
+    static char line[PATH_MAX + 1];
+    uint64_t hash = 14695981039346656037ULL;
+    const char *c;
+    size_t len, i;
+    int orig_errno;
+
+    if (trace_fd == -1)
+	return;
+
+    orig_errno = errno;
+    if (trace_fd == -2) {
+	const char *f = getenv("UMOCKDEV_TRACE_FILE");
+	trace_fd = f != NULL ? _open(f, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644) : -1;
+	if (f != NULL && trace_fd < 0)
+	    fprintf(stderr, "umockdev: cannot open trace file %s: %m\n", f);
+    }
+
+    /* FNV-1a; 0 marks free slots. When the table is full, paths get logged
+     * again, which does not hurt. */
+    for (c = path; *c; ++c)
+	hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+    hash |= 1;
+    for (i = 0; i < TRACE_SEEN_MAX; ++i) {
+	uint64_t *slot = &seen[(hash + i) % TRACE_SEEN_MAX];
+	if (*slot == hash)
+	    goto out;
+	if (*slot == 0) {
+	    *slot = hash;
+	    break;
+	}
+    }
+
+    len = strlen(path);
+    if (trace_fd >= 0 && len < sizeof(line)) {
+	memcpy(line, path, len);
+	line[len] = '\n';
+	if (_write(trace_fd, line, len + 1) < 0)
+	    DBG(DBG_PATH, "trace_path: failed to write %s: %m\n", path);
+    }
+
+out:
+    errno = orig_errno;
+}
+
 static const char *
 trap_path(const char *path)
 {
@@ -174,9 +377,12 @@ trap_path(const char *path)
 	return path;
 
     if (path[0] != '/') {
-	int orig_errno = errno;
-	abspath = _realpath(path, abspath_buf);
-	errno = orig_errno;
+	abspath = cwd_absolute_path(path, abspath_buf, sizeof(abspath_buf));
+	if (abspath == NULL) {
+	    int orig_errno = errno;
+	    abspath = _realpath(path, abspath_buf);
+	    errno = orig_errno;
+	}
 	if (abspath)
 	    DBG(DBG_PATH, "trap_path relative %s -> absolute %s\n", path, abspath);
     }
@@ -208,9 +414,170 @@ trap_path(const char *path)
     if (check_exist && path_exists(buf) < 0)
 	return path;
 
+    trace_path(abspath);
     return buf;
 }
 
+/* Directory fds and their path as the program sees it, for translating the
+ * paths of *at() calls relative to them without asking /proc. Only
+ * directories which were opened with O_DIRECTORY or opendir() below a
+ * trapped prefix (or their parents, like /) are recorded. Protected by
+ * trap_path_lock. */
+#define DIR_FD_MAX 1024
+static char *dir_fd_paths[DIR_FD_MAX];
+
+/* Whether *at() calls relative to the directory path may need trapping */
+static int
+dir_path_is_trappable(const char *path)
+{
+    static const char * const prefixes[] = { "/sys", "/dev", "/proc", "/run" };
+    size_t i, len;
+
+    if (strcmp(path, "/") == 0)
+	return 1;
+    for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i) {
+	len = strlen(prefixes[i]);
+	if (strncmp(path, prefixes[i], len) == 0 && (path[len] == '/' || path[len] == '\0'))
+	    return 1;
+    }
+    return 0;
+}
+
+/* The path of the working directory as the program sees it, i. e. without
+ * the testbed prefix; NULL if unknown */
+static const char *
+cwd_logical_path(void)
+{
+    const char *prefix = getenv("UMOCKDEV_DIR");
+    size_t prefix_len;
+
+    if (cwd_path[0] == '\0')
+	return NULL;
+    if (prefix != NULL) {
+	prefix_len = strlen(prefix);
+	if (strncmp(cwd_path, prefix, prefix_len) == 0) {
+	    if (cwd_path[prefix_len] == '\0')
+		return "/";
+	    if (cwd_path[prefix_len] == '/')
+		return cwd_path + prefix_len;
+	}
+    }
+    return cwd_path;
+}
+
+/* The path of directory fd as the program sees it, or NULL if it is not
+ * below a trapped prefix. Recorded fds are answered from the table; others
+ * (O_PATH, dup()ed, fdopendir(), or beyond DIR_FD_MAX) are resolved through
+ * /proc/self/fd. Must be called with trap_path_lock held. */
+static const char *
+dir_fd_path(int dirfd, char *buf, size_t size)
+{
+    libc_func(readlink, ssize_t, const char*, char*, size_t);
+    const char *prefix = getenv("UMOCKDEV_DIR");
+    char link[30];
+    size_t prefix_len;
+    ssize_t len;
+    int orig_errno;
+
+    if (dirfd < 0 || prefix == NULL)
+	return NULL;
+    if (dirfd < DIR_FD_MAX && dir_fd_paths[dirfd] != NULL)
+	return dir_fd_paths[dirfd];
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%i", dirfd);
+    orig_errno = errno;
+    len = _readlink(link, buf, size - 1);
+    errno = orig_errno;
+    if (len <= 0 || buf[0] != '/')
+	return NULL;
+    buf[len] = '\0';
+
+    /* directories in the testbed */
+    prefix_len = strlen(prefix);
+    if (strncmp(buf, prefix, prefix_len) == 0) {
+	if (buf[prefix_len] == '\0')
+	    return "/";
+	if (buf[prefix_len] == '/')
+	    memmove(buf, buf + prefix_len, len - prefix_len + 1);
+    }
+
+    return dir_path_is_trappable(buf) ? buf : NULL;
+}
+
+/* Remember the directory fd which the program opened as path relative to
+ * dirfd (as for openat()) */
+static void
+dir_fd_record(int fd, int dirfd, const char *path)
+{
+    char buf[PATH_MAX], dir_buf[PATH_MAX];
+    const char *base;
+    int physical = 1;
+
+    if (fd < 0 || fd >= DIR_FD_MAX || path == NULL || getenv("UMOCKDEV_DIR") == NULL)
+	return;
+
+    if (path[0] == '/') {
+	base = "/";
+    } else if (dirfd == AT_FDCWD) {
+	base = cwd_logical_path();
+    } else {
+	base = dir_fd_path(dirfd, dir_buf, sizeof(dir_buf));
+	/* recorded paths may have symlinks */
+	physical = 0;
+    }
+    if (base == NULL || join_path(base, physical, path, buf, sizeof(buf)) == NULL ||
+	!dir_path_is_trappable(buf))
+	return;
+
+    free(dir_fd_paths[fd]);
+    dir_fd_paths[fd] = strdupx(buf);
+    DBG(DBG_PATH, "dir_fd_record: fd %i is %s\n", fd, buf);
+}
+
+/* Called when the fd gets closed or replaced */
+static void
+dir_fd_forget(int fd)
+{
+    char *path;
+
+    if (fd < 0 || fd >= DIR_FD_MAX || dir_fd_paths[fd] == NULL)
+	return;
+
+    TRAP_PATH_LOCK;
+    path = dir_fd_paths[fd];
+    dir_fd_paths[fd] = NULL;
+    TRAP_PATH_UNLOCK;
+    free(path);
+}
+
+/* trap_path() for a path relative to dirfd. Returns the path to use with
+ * dirfd, or NULL on error. *logical is set to the absolute path as the
+ * program sees it if that is known, for the emulation of the target. */
+static const char *
+trap_path_at(int dirfd, const char *path, const char **logical)
+{
+    static char logical_buf[PATH_MAX], dir_buf[PATH_MAX];
+    const char *base;
+
+    *logical = NULL;
+    if (path == NULL || path[0] == '\0')
+	return path;
+
+    if (path[0] == '/' || dirfd == AT_FDCWD) {
+	if (path[0] == '/')
+	    *logical = path;
+	return trap_path(path);
+    }
+
+    base = dir_fd_path(dirfd, dir_buf, sizeof(dir_buf));
+    if (base == NULL || join_path(base, 0, path, logical_buf, sizeof(logical_buf)) == NULL)
+	return path;
+
+    DBG(DBG_PATH, "trap_path_at %i (%s) %s -> %s\n", dirfd, base, path, logical_buf);
+    *logical = logical_buf;
+    return trap_path(logical_buf);
+}
+
 static bool
 get_rdev_maj_min(const char *nodename, uint32_t *major, uint32_t *minor)
 {
@@ -369,6 +736,65 @@ fd_map_get(fd_map * map, int fd, const void **data_out)
     return 0;
 }
 
+/********************************
+ *
+ * Testbed sockets
+ *
+ ********************************/
+
+/* 64 bit FNV-1a, wide enough that names of different paths do not collide
+ * in practice; the testbed detects it when they do */
+static uint64_t
+name_hash(const char *s)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *s; ++s) {
+	hash ^= (unsigned char) *s;
+	hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Set addr to the socket for rel, a path like "ioctl/dev/sda". With
+ * $UMOCKDEV_CHANNEL this is in the abstract namespace, where too long names
+ * get hashed, otherwise it is a file in the testbed. This must stay in sync
+ * with Testbed.register_handler() in umockdev.vala. */
+static void
+testbed_socket_addr(struct sockaddr_un *addr, const char *rel)
+{
+    const char *channel = getenv("UMOCKDEV_CHANNEL");
+    char norm[PATH_MAX];
+    size_t i, j;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    /* programs may open "/dev//sda", which only the kernel would resolve */
+    for (i = j = 0; rel[i] != '\0' && j < sizeof(norm) - 1; ++i)
+	if (rel[i] != '/' || j == 0 || norm[j - 1] != '/')
+	    norm[j++] = rel[i];
+    norm[j] = '\0';
+
+    if (channel == NULL) {
+	snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", getenv("UMOCKDEV_DIR"), norm);
+	return;
+    }
+
+    if (snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "umockdev.%s/%s", channel, norm) >=
+	(int) sizeof(addr->sun_path) - 1)
+	snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "umockdev.%s/#%016" PRIx64, channel, name_hash(norm));
+}
+
+/* The length of addr for bind() and connect(); abstract names are not padded */
+static socklen_t
+sockaddr_un_len(const struct sockaddr_un *addr)
+{
+    if (addr->sun_path[0] != '\0')
+	return sizeof(*addr);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+}
+
 /********************************
  *
  * Wrappers for accessing netlink socket
@@ -412,6 +838,7 @@ netlink_bind(int sockfd)
 
     struct sockaddr_un sa;
     const char *path = getenv("UMOCKDEV_DIR");
+    char rel[64];
 
     if (fd_map_get(&wrapped_netlink_sockets, sockfd, NULL) && path != NULL) {
 	DBG(DBG_NETLINK, "testbed wrapped bind: intercepting netlink socket fd %i\n", sockfd);
@@ -419,11 +846,18 @@ netlink_bind(int sockfd)
 	/* we create one socket per fd, and send emulated uevents to all of
 	 * them; poor man's multicast; this can become more elegant if/when
 	 * AF_UNIX multicast lands */
-	sa.sun_family = AF_UNIX;
-	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/event%i", path, sockfd);
-	/* clean up from previously closed fds, to avoid "already in use" error */
-	unlink(sa.sun_path);
-	return _bind(sockfd, (struct sockaddr *)&sa, sizeof(sa));
+	if (getenv("UMOCKDEV_CHANNEL") != NULL) {
+	    /* the uevent sender finds these in /proc/net/unix; with the pid,
+	     * processes sharing the testbed do not collide */
+	    snprintf(rel, sizeof(rel), "event/%i.%i", (int) getpid(), sockfd);
+	    testbed_socket_addr(&sa, rel);
+	} else {
+	    sa.sun_family = AF_UNIX;
+	    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/event%i", path, sockfd);
+	    /* clean up from previously closed fds, to avoid "already in use" error */
+	    unlink(sa.sun_path);
+	}
+	return _bind(sockfd, (struct sockaddr *)&sa, sockaddr_un_len(&sa));
     }
 
     return UNHANDLED;
@@ -464,48 +898,182 @@ netlink_recvmsg(int sockfd, struct msghdr * msg, ssize_t ret)
 
 static fd_map ioctl_wrapped_fds;
 
+#define IOCTL_REQ_IOCTL 1
+#define IOCTL_REQ_RES 2
+#define IOCTL_REQ_READ 7
+#define IOCTL_REQ_WRITE 8
+#define IOCTL_REQ_MMAP 12
+#define IOCTL_REQ_PREAD 13
+#define IOCTL_REQ_PWRITE 14
+/* or'ed into the request when the fd has O_NONBLOCK */
+#define IOCTL_REQ_NONBLOCK 0x100
+#define IOCTL_RES_DONE 3
+#define IOCTL_RES_RUN 4
+#define IOCTL_RES_READ_MEM 5
+#define IOCTL_RES_WRITE_MEM 6
+#define IOCTL_RES_SHM_MAP 9
+#define IOCTL_RES_READ_SHM 10
+#define IOCTL_RES_WRITE_SHM 11
+#define IOCTL_RES_MMAP_FD 12
+#define IOCTL_RES_READ_MEMV 13
+#define IOCTL_RES_WRITE_MEMV 14
+#define IOCTL_RES_DONE_CACHE 15
+#define IOCTL_RES_HELLO 16
+#define IOCTL_RES_ABORT 0xff
+
+/* Shared memory grows in these steps, so that it is rarely re-announced */
+#define IOCTL_SHM_ALIGN (1024 * 1024)
+
+/* Marshal everything as unsigned long */
+struct ioctl_request {
+    unsigned long cmd;
+    unsigned long arg1;
+    unsigned long arg2;
+};
+
 struct ioctl_fd_info {
     char *dev_path;
+    /* -1 in a forked child until it connects on its own */
     int ioctl_sock;
-    int is_default;
+    struct sockaddr_un addr;
+    /* only ioctls are passed on, for the default handler and for handlers
+     * which do not emulate read/write (their socket is not executable, or
+     * they say so in their HELLO) */
+    int ioctl_only;
+    /* mmap() is passed on; handlers on abstract sockets say whether they
+     * emulate it in their HELLO */
+    int emulate_mmap;
+    /* read() is passed on as pread() at the file position, for attributes */
+    int positional;
+    /* serializes these reads with the update of the file position; shared
+     * with forked children, as they share the position */
+    pthread_mutex_t *pos_lock;
+    /* the handler answered pread()/pwrite() with UNHANDLED, as it neither
+     * serves data by position nor lets the client do the I/O */
+    int stream;
+    /* mapped "<socket>.cache" of the handler, with the native uint32 that it
+     * counts up when it invalidates cached ioctl replies; NULL if they are
+     * never cached */
+    const uint32_t *cache_gen;
     pthread_mutex_t sock_lock;
+    /* memfd shared with the server for large buffer transfers */
+    int shm_fd;
+    void *shm_map;
+    size_t shm_size;
 };
 
-static void
-ioctl_emulate_open(int fd, const char *dev_path, int must_exist)
+/* Returns a connected socket, or -1 with errno set. Handlers on abstract
+ * sockets greet with a HELLO, which tells whether they are ioctl_only and
+ * whether they emulate mmap(); that is stored there if not NULL. */
+static int
+ioctl_sock_connect(const struct sockaddr_un *addr, int *ioctl_only, int *emulate_mmap)
 {
     libc_func(socket, int, int, int, int);
     libc_func(connect, int, int, const struct sockaddr *, socklen_t);
-    int is_default = 0;
-    int sock;
-    int ret;
-    struct ioctl_fd_info *fdinfo;
-    struct sockaddr_un addr;
+    libc_func(recv, ssize_t, int, void *, size_t, int);
+    libc_func(close, int, int);
+    struct ioctl_request hello;
+    int sock, orig_errno;
+
+    sock = _socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+	return -1;
+
+    if (_connect(sock, (const struct sockaddr *) addr, sockaddr_un_len(addr)) == -1)
+	goto error;
+
+    if (addr->sun_path[0] == '\0') {
+	if (_recv(sock, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello))
+	    goto error;
+	if (hello.cmd != IOCTL_RES_HELLO) {
+	    errno = EPROTO;
+	    goto error;
+	}
+	if (ioctl_only != NULL)
+	    *ioctl_only = hello.arg1 != 0;
+	if (emulate_mmap != NULL)
+	    *emulate_mmap = hello.arg2 != 0;
+    }
+    return sock;
 
-    if (strncmp(dev_path, "/dev/", 5) != 0)
-	return;
+error:
+    orig_errno = errno;
+    _close(sock);
+    errno = orig_errno;
+    return -1;
+}
 
-    addr.sun_family = AF_UNIX;
-    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/ioctl/%s", getenv("UMOCKDEV_DIR"), dev_path);
+/* A robust mutex in shared memory, which forked children inherit; NULL if
+ * that fails */
+static pthread_mutex_t *
+shared_mutex_new(void)
+{
+    libc_func(mmap, void *, void *, size_t, int, int, int, off_t);
+    pthread_mutexattr_t attr;
+    pthread_mutex_t *mutex;
 
-    if (path_exists (addr.sun_path) != 0) {
-	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/ioctl/_default", getenv("UMOCKDEV_DIR"));
-	is_default = 1;
-    }
+    mutex = _mmap(NULL, sizeof(pthread_mutex_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mutex == MAP_FAILED)
+	return NULL;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return mutex;
+}
 
-    sock = _socket(AF_UNIX, SOCK_STREAM, 0);
-    if (sock == -1) {
-	if (must_exist) {
-	    fprintf(stderr, "ERROR: libumockdev-preload: Failed to open ioctl socket for %s",
-		    dev_path);
-	    exit(1);
-	} else {
-	    return;
-	}
+static void
+shared_mutex_lock(pthread_mutex_t *mutex)
+{
+    /* the previous owner died, but the file position is consistent */
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+	pthread_mutex_consistent(mutex);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+static void io_uring_warn_foreign_rings(void);
+#endif
+
+/* Map the cache generation counter at path; NULL if there is none */
+static const uint32_t *
+ioctl_cache_map_generation(const char *path)
+{
+    libc_func(open, int, const char *, int, ...);
+    libc_func(close, int, int);
+    libc_func(mmap, void *, void *, size_t, int, int, int, off_t);
+    int orig_errno = errno;
+    struct stat st;
+    void *map = MAP_FAILED;
+    int fd;
+
+    fd = _open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(uint32_t))
+	    map = _mmap(NULL, sizeof(uint32_t), PROT_READ, MAP_SHARED, fd, 0);
+	_close(fd);
     }
+    errno = orig_errno;
+    if (map == MAP_FAILED) {
+	DBG(DBG_IOCTL, "ioctl_cache_map_generation: cannot map %s, not caching\n", path);
+	return NULL;
+    }
+    return map;
+}
+
+/* Set up emulation of fd through the handler at addr; sock is a connection
+ * to it, or -1 to connect now */
+static void
+ioctl_emulate_connect(int fd, const char *dev_path, const struct sockaddr_un *addr, int sock,
+		      int ioctl_only, int emulate_mmap, int must_exist)
+{
+    struct ioctl_fd_info *fdinfo;
+    const char *name;
+    char cache_path[PATH_MAX];
 
-    ret = _connect(sock, (const struct sockaddr *) &addr, sizeof(addr));
-    if (ret == -1) {
+    if (sock == -1)
+	sock = ioctl_sock_connect(addr, ioctl_only ? NULL : &ioctl_only, &emulate_mmap);
+    if (sock == -1) {
 	if (must_exist) {
 	    fprintf(stderr, "ERROR: libumockdev-preload: Failed to connect to ioctl socket for %s",
 		    dev_path);
@@ -517,12 +1085,67 @@ ioctl_emulate_open(int fd, const char *dev_path, int must_exist)
 
     fdinfo = mallocx(sizeof(struct ioctl_fd_info));
     fdinfo->ioctl_sock = sock;
+    fdinfo->addr = *addr;
     fdinfo->dev_path = strdupx(dev_path);
-    fdinfo->is_default = is_default;
+    fdinfo->ioctl_only = ioctl_only;
+    fdinfo->emulate_mmap = emulate_mmap;
+    fdinfo->positional = strncmp(dev_path, "/sys/", 5) == 0;
+    fdinfo->pos_lock = fdinfo->positional ? shared_mutex_new() : NULL;
+    fdinfo->stream = 0;
+    if (fdinfo->positional) {
+	fdinfo->cache_gen = NULL;
+    } else if (addr->sun_path[0] != '\0') {
+	snprintf(cache_path, sizeof(cache_path), "%s.cache", addr->sun_path);
+	fdinfo->cache_gen = ioctl_cache_map_generation(cache_path);
+    } else {
+	/* the abstract name without "umockdev.<channel>/", in the testbed */
+	name = strchr(addr->sun_path + 1, '/') + 1;
+	snprintf(cache_path, sizeof(cache_path), "%s/%s.cache", getenv("UMOCKDEV_DIR"), name);
+	fdinfo->cache_gen = ioctl_cache_map_generation(cache_path);
+    }
+    fdinfo->shm_fd = -1;
+    fdinfo->shm_map = NULL;
+    fdinfo->shm_size = 0;
     pthread_mutex_init(&fdinfo->sock_lock, NULL);
 
     fd_map_add(&ioctl_wrapped_fds, fd, fdinfo);
     DBG(DBG_IOCTL, "ioctl_emulate_open fd %i (%s): connected ioctl sockert\n", fd, dev_path);
+#ifdef HAVE_LINUX_IO_URING_H
+    io_uring_warn_foreign_rings();
+#endif
+}
+
+static void
+ioctl_emulate_open(int fd, const char *dev_path, int must_exist)
+{
+    int ioctl_only = 0;
+    /* file sockets cannot tell */
+    int emulate_mmap = 1;
+    int sock = -1;
+    struct sockaddr_un addr;
+    char rel[PATH_MAX];
+
+    if (strncmp(dev_path, "/dev/", 5) != 0)
+	return;
+
+    snprintf(rel, sizeof(rel), "ioctl/%s", dev_path);
+    testbed_socket_addr(&addr, rel);
+
+    if (addr.sun_path[0] == '\0') {
+	/* there is no file to check in the abstract namespace */
+	sock = ioctl_sock_connect(&addr, &ioctl_only, &emulate_mmap);
+	if (sock == -1) {
+	    testbed_socket_addr(&addr, "ioctl/_default");
+	    ioctl_only = 1;
+	}
+    } else if (path_exists (addr.sun_path) != 0) {
+	testbed_socket_addr(&addr, "ioctl/_default");
+	ioctl_only = 1;
+    } else if (path_executable(addr.sun_path) != 0) {
+	ioctl_only = 1;
+    }
+
+    ioctl_emulate_connect(fd, dev_path, &addr, sock, ioctl_only, emulate_mmap, must_exist);
 }
 
 static void
@@ -536,40 +1159,421 @@ ioctl_emulate_close(int fd)
 	fd_map_remove(&ioctl_wrapped_fds, fd);
 	if (fdinfo->ioctl_sock >= 0)
 	    _close(fdinfo->ioctl_sock);
+	if (fdinfo->shm_map != NULL)
+	    munmap(fdinfo->shm_map, fdinfo->shm_size);
+	if (fdinfo->shm_fd >= 0)
+	    _close(fdinfo->shm_fd);
 	free(fdinfo->dev_path);
+	if (fdinfo->cache_gen != NULL)
+	    munmap((void *) fdinfo->cache_gen, sizeof(uint32_t));
+	/* not destroyed, forked children may still use it */
+	if (fdinfo->pos_lock != NULL)
+	    munmap(fdinfo->pos_lock, sizeof(pthread_mutex_t));
 	pthread_mutex_destroy(&fdinfo->sock_lock);
 	free(fdinfo);
     }
 }
 
-#define IOCTL_REQ_IOCTL 1
-#define IOCTL_REQ_RES 2
-#define IOCTL_REQ_READ 7
-#define IOCTL_REQ_WRITE 8
-#define IOCTL_RES_DONE 3
-#define IOCTL_RES_RUN 4
-#define IOCTL_RES_READ_MEM 5
-#define IOCTL_RES_WRITE_MEM 6
-#define IOCTL_RES_ABORT 0xff
+/* Make the shared memfd at least size bytes large, returns 0 on success */
+static int
+ioctl_shm_resize(struct ioctl_fd_info *fdinfo, size_t size)
+{
+    libc_func(mmap, void *, void *, size_t, int, int, int, off_t);
+    void *map;
 
-/* Marshal everything as unsigned long */
-struct ioctl_request {
-    unsigned long cmd;
-    unsigned long arg1;
-    unsigned long arg2;
+    size = (size + IOCTL_SHM_ALIGN - 1) & ~((size_t) IOCTL_SHM_ALIGN - 1);
+    if (size <= fdinfo->shm_size)
+	return 0;
+
+    if (fdinfo->shm_fd < 0) {
+	fdinfo->shm_fd = memfd_create("umockdev-ioctl", MFD_CLOEXEC);
+	if (fdinfo->shm_fd < 0)
+	    return -1;
+    }
+
+    if (ftruncate(fdinfo->shm_fd, size) < 0)
+	return -1;
+
+    map = _mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fdinfo->shm_fd, 0);
+    if (map == MAP_FAILED)
+	return -1;
+
+    if (fdinfo->shm_map != NULL)
+	munmap(fdinfo->shm_map, fdinfo->shm_size);
+    fdinfo->shm_map = map;
+    fdinfo->shm_size = size;
+
+    DBG(DBG_IOCTL, "ioctl_shm_resize: %s: shared memory is now %zu bytes\n", fdinfo->dev_path, size);
+    return 0;
+}
+
+/* Pass fd to the other side, as a single byte with SCM_RIGHTS (like g_unix_connection_send_fd) */
+static int
+send_fd(int sock, int fd)
+{
+    libc_func(sendmsg, ssize_t, int, const struct msghdr *, int);
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    struct msghdr msg = {
+	.msg_iov = &iov,
+	.msg_iovlen = 1,
+	.msg_control = ctrl.buf,
+	.msg_controllen = sizeof(ctrl.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    memset(ctrl.buf, 0, sizeof(ctrl.buf));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return _sendmsg(sock, &msg, 0);
+}
+
+/* Counterpart of send_fd(), returns the received fd or -1 */
+static int
+recv_fd(int sock)
+{
+    libc_func(recvmsg, ssize_t, int, struct msghdr *, int);
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    struct msghdr msg = {
+	.msg_iov = &iov,
+	.msg_iovlen = 1,
+	.msg_control = ctrl.buf,
+	.msg_controllen = sizeof(ctrl.buf),
+    };
+    struct cmsghdr *cmsg;
+    int fd;
+
+    if (_recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+	return -1;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+	return -1;
+
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/* Send/receive exactly len bytes from/to client memory, returns 0 on success */
+static int
+ioctl_sock_send_mem(int sock, const void *addr, size_t len)
+{
+    libc_func(send, ssize_t, int, const void *, size_t, int);
+    size_t done = 0;
+    ssize_t res;
+
+    while (done < len) {
+	res = _send(sock, (const char *) addr + done, len - done, 0);
+	if (res < 0 && errno == EFAULT)
+	    fprintf(stderr, "ERROR: libumockdev-preload: emulation code requested invalid read from %p + %zx\n",
+		    addr, len);
+	if (res <= 0)
+	    return -1;
+	done += res;
+    }
+    return 0;
+}
+
+static int
+ioctl_sock_recv_mem(int sock, void *addr, size_t len)
+{
+    libc_func(recv, ssize_t, int, void *, size_t, int);
+    size_t done = 0;
+    ssize_t res;
+
+    while (done < len) {
+	res = _recv(sock, (char *) addr + done, len - done, MSG_WAITALL);
+	if (res < 0 && errno == EFAULT)
+	    fprintf(stderr, "ERROR: libumockdev-preload: emulation code requested invalid write to %p + %zx\n",
+		    addr, len);
+	if (res <= 0)
+	    return -1;
+	done += res;
+    }
+    return 0;
+}
+
+/* Receive the (address, length) list of a READ_MEMV/WRITE_MEMV request;
+ * returns a malloced array of 2 * count entries, or NULL on error */
+static unsigned long *
+ioctl_sock_recv_iov(int sock, unsigned long count)
+{
+    unsigned long *iov;
+
+    if (count == 0 || count > SIZE_MAX / (2 * sizeof(unsigned long)))
+	return NULL;
+    iov = malloc(2 * count * sizeof(unsigned long));
+    if (iov == NULL)
+	return NULL;
+    if (ioctl_sock_recv_mem(sock, iov, 2 * count * sizeof(unsigned long)) < 0) {
+	free(iov);
+	return NULL;
+    }
+    return iov;
+}
+
+/* The real pread()/pwrite(), with a 64 bit offset */
+static ssize_t
+real_pread(int fd, void *buf, size_t count, int64_t pos)
+{
+#ifdef __GLIBC__
+    libc_func(pread64, ssize_t, int, void *, size_t, off64_t);
+    return _pread64(fd, buf, count, pos);
+#else
+    libc_func(pread, ssize_t, int, void *, size_t, off_t);
+    return _pread(fd, buf, count, pos);
+#endif
+}
+
+static ssize_t
+real_pwrite(int fd, const void *buf, size_t count, int64_t pos)
+{
+#ifdef __GLIBC__
+    libc_func(pwrite64, ssize_t, int, const void *, size_t, off64_t);
+    return _pwrite64(fd, buf, count, pos);
+#else
+    libc_func(pwrite, ssize_t, int, const void *, size_t, off_t);
+    return _pwrite(fd, buf, count, pos);
+#endif
+}
+
+/********************************
+ *
+ * ioctl reply cache
+ *
+ ********************************/
+
+/* Replies to stateless ioctls (like EVIOCGNAME) which the handler marked as
+ * cacheable with IOCTL_RES_DONE_CACHE. Repeated requests with the same input
+ * are answered from here, without a round trip to the server. The handler
+ * invalidates them by counting up the generation in the "<socket>.cache" file
+ * of the device, which the clients keep mapped.
+ *
+ * Only replies which keep within the ioctl's argument struct are cached, as
+ * recorded copies relative to the argument: the input which the handler read
+ * is the key, the output which it wrote is replayed. */
+
+#define IOCTL_CACHE_MAX_ENTRIES 256
+#define IOCTL_CACHE_MAX_CHUNKS 8
+#define IOCTL_CACHE_MAX_BYTES 65536
+
+struct ioctl_cache_chunk {
+    size_t offset;		/* relative to the ioctl argument */
+    size_t len;
+    unsigned char *data;
+};
+
+struct ioctl_cache_entry {
+    struct ioctl_cache_entry *next;
+    const char *dev_path;
+    uint32_t generation;
+    unsigned long request;
+    unsigned long arg;		/* only compared if no memory was accessed */
+    long ret;
+    int err;
+    /* while recording: whether the reply can still be cached */
+    int valid;
+    size_t arg_size;
+    size_t n_bytes;
+    unsigned n_in, n_out;
+    struct ioctl_cache_chunk in[IOCTL_CACHE_MAX_CHUNKS];
+    struct ioctl_cache_chunk out[IOCTL_CACHE_MAX_CHUNKS];
 };
 
+static struct ioctl_cache_entry *ioctl_cache = NULL;
+static unsigned ioctl_cache_count = 0;
+pthread_mutex_t ioctl_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define IOCTL_CACHE_LOCK pthread_mutex_lock (&ioctl_cache_lock)
+#define IOCTL_CACHE_UNLOCK pthread_mutex_unlock (&ioctl_cache_lock)
+
+static uint32_t
+ioctl_cache_generation(const struct ioctl_fd_info *fdinfo)
+{
+    return __atomic_load_n(fdinfo->cache_gen, __ATOMIC_RELAXED);
+}
+
+static void
+ioctl_cache_free_chunks(struct ioctl_cache_entry *entry)
+{
+    unsigned i;
+
+    for (i = 0; i < entry->n_in; ++i)
+	free(entry->in[i].data);
+    for (i = 0; i < entry->n_out; ++i)
+	free(entry->out[i].data);
+    entry->n_in = entry->n_out = 0;
+}
+
+static void
+ioctl_cache_free(struct ioctl_cache_entry *entry)
+{
+    ioctl_cache_free_chunks(entry);
+    free((char *) entry->dev_path);
+    free(entry);
+}
+
+/* Answer an ioctl from the cache; returns 1 and sets *ret and errno on a hit */
 static int
-remote_emulate(int fd, int cmd, long arg1, long arg2)
+ioctl_cache_lookup(const struct ioctl_fd_info *fdinfo, uint32_t generation,
+		   unsigned long request, unsigned long arg, long *ret)
+{
+    struct ioctl_cache_entry **p, *entry;
+    unsigned i;
+    int hit = 0;
+
+    IOCTL_CACHE_LOCK;
+    for (p = &ioctl_cache; (entry = *p) != NULL; ) {
+	if (strcmp(entry->dev_path, fdinfo->dev_path) != 0) {
+	    p = &entry->next;
+	    continue;
+	}
+	if (entry->generation != generation) {
+	    *p = entry->next;
+	    ioctl_cache_free(entry);
+	    ioctl_cache_count--;
+	    continue;
+	}
+
+	if (entry->request == request &&
+	    (entry->n_in > 0 || entry->n_out > 0 || entry->arg == arg)) {
+	    for (i = 0; i < entry->n_in; ++i)
+		if (memcmp((void *) (arg + entry->in[i].offset), entry->in[i].data, entry->in[i].len) != 0)
+		    break;
+	    if (i == entry->n_in) {
+		for (i = 0; i < entry->n_out; ++i)
+		    memcpy((void *) (arg + entry->out[i].offset), entry->out[i].data, entry->out[i].len);
+		*ret = entry->ret;
+		errno = entry->err;
+		hit = 1;
+		break;
+	    }
+	}
+	p = &entry->next;
+    }
+    IOCTL_CACHE_UNLOCK;
+
+    return hit;
+}
+
+/* Start recording the reply to an ioctl into rec */
+static void
+ioctl_cache_begin(struct ioctl_cache_entry *rec, uint32_t generation, unsigned long request, unsigned long arg)
+{
+    int size = ioctl_data_size_by_id(request);
+
+    memset(rec, 0, sizeof(*rec));
+    rec->generation = generation;
+    rec->request = request;
+    rec->arg = arg;
+    rec->arg_size = size > 0 ? (size_t) size : 0;
+    rec->valid = 1;
+}
+
+/* Whether the argument of request carries input; some _IOR ioctls read it
+ * nevertheless, like the scancode of EVIOCGKEYCODE or the axis code of
+ * EVIOCGMTSLOTS */
+static int
+ioctl_has_input(unsigned long request)
+{
+    if (_IOC_DIR(request) != _IOC_READ)
+	return 1;
+    return request == EVIOCGKEYCODE || request == EVIOCGKEYCODE_V2 ||
+	   (_IOC_TYPE(request) == 'E' && _IOC_NR(request) == _IOC_NR(EVIOCGMTSLOTS(0)));
+}
+
+/* Record a transfer of the server from (is_write == 0) or to client memory */
+static void
+ioctl_cache_note(struct ioctl_cache_entry *rec, unsigned long addr, size_t len, int is_write)
+{
+    struct ioctl_cache_chunk *chunk;
+
+    if (!rec->valid || len == 0)
+	return;
+
+    /* only the output matters for read-only ioctls; their input is whatever
+     * happens to be in the buffer */
+    if (!is_write && !ioctl_has_input(rec->request))
+	return;
+
+    if (addr < rec->arg || addr - rec->arg > rec->arg_size || len > rec->arg_size - (addr - rec->arg) ||
+	(is_write ? rec->n_out : rec->n_in) >= IOCTL_CACHE_MAX_CHUNKS ||
+	rec->n_bytes + len > IOCTL_CACHE_MAX_BYTES) {
+	rec->valid = 0;
+	return;
+    }
+
+    chunk = is_write ? &rec->out[rec->n_out++] : &rec->in[rec->n_in++];
+    chunk->offset = addr - rec->arg;
+    chunk->len = len;
+    chunk->data = mallocx(len);
+    memcpy(chunk->data, (void *) addr, len);
+    rec->n_bytes += len;
+}
+
+/* Finish recording; keeps the reply if the server allowed it */
+static void
+ioctl_cache_end(struct ioctl_cache_entry *rec, const struct ioctl_fd_info *fdinfo, int cacheable, long ret, int err)
+{
+    struct ioctl_cache_entry *entry, **p;
+
+    if (!cacheable || !rec->valid) {
+	ioctl_cache_free_chunks(rec);
+	return;
+    }
+
+    entry = mallocx(sizeof(struct ioctl_cache_entry));
+    memcpy(entry, rec, sizeof(struct ioctl_cache_entry));
+    entry->dev_path = strdupx(fdinfo->dev_path);
+    entry->ret = ret;
+    entry->err = err;
+
+    IOCTL_CACHE_LOCK;
+    entry->next = ioctl_cache;
+    ioctl_cache = entry;
+    /* drop the oldest one */
+    if (++ioctl_cache_count > IOCTL_CACHE_MAX_ENTRIES) {
+	for (p = &ioctl_cache; (*p)->next != NULL; p = &(*p)->next);
+	ioctl_cache_free(*p);
+	*p = NULL;
+	ioctl_cache_count--;
+    }
+    IOCTL_CACHE_UNLOCK;
+
+    DBG(DBG_IOCTL, "ioctl_cache_end: %s: cached reply to ioctl %lX\n", fdinfo->dev_path, rec->request);
+}
+
+/* For IOCTL_REQ_MMAP, the backing fd of the region is returned in recv_fd_out;
+ * pos is the file offset for IOCTL_REQ_PREAD/PWRITE, which is sent after the
+ * request */
+static long
+remote_emulate_fd(int fd, int cmd, long arg1, long arg2, int64_t pos, int *recv_fd_out)
 {
     libc_func(send, ssize_t, int, const void *, size_t, int);
     libc_func(recv, ssize_t, int, const void *, size_t, int);
     libc_func(ioctl, int, int, IOCTL_REQUEST_TYPE, ...);
     libc_func(read, ssize_t, int, void *, size_t);
     libc_func(write, ssize_t, int, void *, size_t);
+    libc_func(fcntl, int, int, int, ...);
     struct ioctl_fd_info *fdinfo;
     struct ioctl_request req;
+    struct ioctl_cache_entry rec;
     sigset_t sig_set, sig_restore;
+    int positional = 0;
+    long cached;
     int res;
 
     /* Block all signals while we are talking with the remote process. */
@@ -586,23 +1590,74 @@ remote_emulate(int fd, int cmd, long arg1, long arg2)
     }
     IOCTL_UNLOCK;
 
-    /* Only pass on ioctl requests for the default handler. */
-    if (fdinfo->is_default && cmd != IOCTL_REQ_IOCTL) {
+    /* Only pass on ioctl requests for the default and ioctl-only handlers,
+     * and mmap() only to handlers which emulate it. */
+    if ((fdinfo->ioctl_only && cmd != IOCTL_REQ_IOCTL) ||
+	(!fdinfo->emulate_mmap && cmd == IOCTL_REQ_MMAP)) {
 	pthread_sigmask(SIG_SETMASK, &sig_restore, NULL);
 	return UNHANDLED;
     }
 
+    rec.valid = 0;
+    /* the handler only allows caching replies to stateless ioctls */
+    if (cmd == IOCTL_REQ_IOCTL && fdinfo->cache_gen != NULL && ioctl_type_is_stateless(arg1)) {
+	uint32_t generation = ioctl_cache_generation(fdinfo);
+
+	if (ioctl_cache_lookup(fdinfo, generation, arg1, arg2, &cached)) {
+	    DBG(DBG_IOCTL, "remote_emulate_fd: %s: answered ioctl %lX from cache\n", fdinfo->dev_path, arg1);
+	    pthread_sigmask(SIG_SETMASK, &sig_restore, NULL);
+	    return cached;
+	}
+	ioctl_cache_begin(&rec, generation, arg1, arg2);
+    }
+
     pthread_mutex_lock (&fdinfo->sock_lock);
 
+    /* forked children get their own connection on first use */
+    if (fdinfo->ioctl_sock < 0) {
+	fdinfo->ioctl_sock = ioctl_sock_connect(&fdinfo->addr, NULL, NULL);
+	if (fdinfo->ioctl_sock < 0) {
+	    DBG(DBG_IOCTL, "remote_emulate_fd: %s: cannot reconnect ioctl socket: %m\n", fdinfo->dev_path);
+	    pthread_mutex_unlock (&fdinfo->sock_lock);
+	    pthread_sigmask(SIG_SETMASK, &sig_restore, NULL);
+	    return UNHANDLED;
+	}
+	DBG(DBG_IOCTL, "remote_emulate_fd: %s: reconnected ioctl socket after fork\n", fdinfo->dev_path);
+    }
+
+    /* the emulation of attributes serves them by position, like kernfs;
+     * until the position is advanced, no other thread or forked child must
+     * read at it */
+    if (cmd == IOCTL_REQ_READ && fdinfo->positional) {
+	cmd = IOCTL_REQ_PREAD;
+	if (fdinfo->pos_lock != NULL)
+	    shared_mutex_lock(fdinfo->pos_lock);
+	pos = lseek(fd, 0, SEEK_CUR);
+	positional = 1;
+    }
+
     /* We force "unsigned int" here to prevent sign extension to long
      * which could confuse the receiving side. */
     req.cmd = cmd;
+    /* handlers answer reads and waiting ioctls with EAGAIN instead of
+     * blocking, like the kernel */
+    if (cmd == IOCTL_REQ_IOCTL || cmd == IOCTL_REQ_READ || cmd == IOCTL_REQ_PREAD) {
+	int fl = _fcntl(fd, F_GETFL);
+	if (fl >= 0 && (fl & O_NONBLOCK))
+	    req.cmd |= IOCTL_REQ_NONBLOCK;
+    }
     req.arg1 = arg1;
     req.arg2 = arg2;
 
     res = _send(fdinfo->ioctl_sock, &req, sizeof(req), 0);
     if (res < 0)
 	goto con_err;
+    /* positional I/O is followed by the offset */
+    if (cmd == IOCTL_REQ_PREAD || cmd == IOCTL_REQ_PWRITE) {
+	res = _send(fdinfo->ioctl_sock, &pos, sizeof(pos), 0);
+	if (res < 0)
+	    goto con_err;
+    }
 
     while (1) {
 	res = _recv(fdinfo->ioctl_sock, &req, sizeof(req), 0);
@@ -613,6 +1668,17 @@ remote_emulate(int fd, int cmd, long arg1, long arg2)
 
 	switch (req.cmd) {
 	    case IOCTL_RES_DONE:
+	    case IOCTL_RES_DONE_CACHE:
+		if (positional) {
+		    if ((long) req.arg1 > 0)
+			lseek(fd, pos + req.arg1, SEEK_SET);
+		    if (fdinfo->pos_lock != NULL)
+			pthread_mutex_unlock(fdinfo->pos_lock);
+		}
+		if (cmd == IOCTL_REQ_IOCTL)
+		    ioctl_cache_end(&rec, fdinfo, req.cmd == IOCTL_RES_DONE_CACHE, req.arg1, req.arg2);
+		if ((cmd == IOCTL_REQ_PREAD || cmd == IOCTL_REQ_PWRITE) && !positional && (long) req.arg1 == UNHANDLED)
+		    fdinfo->stream = 1;
 		errno = req.arg2;
 
 		pthread_mutex_unlock (&fdinfo->sock_lock);
@@ -622,12 +1688,17 @@ remote_emulate(int fd, int cmd, long arg1, long arg2)
 		return req.arg1;
 
 	    case IOCTL_RES_RUN:
+		rec.valid = 0;
 		if (cmd == IOCTL_REQ_IOCTL)
 		    res = _ioctl(fd, arg1, arg2);
 		else if (cmd == IOCTL_REQ_READ)
 		    res = _read(fd, (char*) arg1, arg2);
 		else if (cmd == IOCTL_REQ_WRITE)
 		    res = _write(fd, (char*) arg1, arg2);
+		else if (cmd == IOCTL_REQ_PREAD)
+		    res = real_pread(fd, (char*) arg1, arg2, pos);
+		else if (cmd == IOCTL_REQ_PWRITE)
+		    res = real_pwrite(fd, (char*) arg1, arg2, pos);
 		else
 		    goto con_err;
 
@@ -654,6 +1725,7 @@ remote_emulate(int fd, int cmd, long arg1, long arg2)
 		}
 		if (res < 0)
 		    goto con_err;
+		ioctl_cache_note(&rec, req.arg1, req.arg2, 0);
 
 		break;
 	    }
@@ -670,10 +1742,84 @@ remote_emulate(int fd, int cmd, long arg1, long arg2)
 			    (void*) req.arg1, (unsigned long) req.arg2);
 		}
 
+		if (res < 0)
+		    goto con_err;
+		ioctl_cache_note(&rec, req.arg1, req.arg2, 1);
+
+		break;
+	    }
+
+	    case IOCTL_RES_READ_MEMV:
+	    case IOCTL_RES_WRITE_MEMV: {
+		/* several blocks at once, concatenated in the order of the list */
+		unsigned long *iov = ioctl_sock_recv_iov(fdinfo->ioctl_sock, req.arg1);
+		unsigned long i;
+
+		if (iov == NULL)
+		    goto con_err;
+		for (i = 0, res = 0; i < req.arg1 && res == 0; i++) {
+		    if (req.cmd == IOCTL_RES_READ_MEMV)
+			res = ioctl_sock_send_mem(fdinfo->ioctl_sock, (void*) iov[2 * i], iov[2 * i + 1]);
+		    else
+			res = ioctl_sock_recv_mem(fdinfo->ioctl_sock, (void*) iov[2 * i], iov[2 * i + 1]);
+		    ioctl_cache_note(&rec, iov[2 * i], iov[2 * i + 1], req.cmd == IOCTL_RES_WRITE_MEMV);
+		}
+		free(iov);
+		if (res < 0)
+		    goto con_err;
+
+		break;
+	    }
+
+	    case IOCTL_RES_SHM_MAP:
+		/* Reply with the mapping size (0 if unavailable), followed by the memfd */
+		req.cmd = IOCTL_REQ_RES;
+		req.arg1 = ioctl_shm_resize(fdinfo, req.arg1) == 0 ? fdinfo->shm_size : 0;
+		req.arg2 = 0;
+
+		res = _send(fdinfo->ioctl_sock, &req, sizeof(req), 0);
+		if (res < 0)
+		    goto con_err;
+		if (req.arg1 > 0 && send_fd(fdinfo->ioctl_sock, fdinfo->shm_fd) < 0)
+		    goto con_err;
+
+		break;
+
+	    case IOCTL_RES_READ_SHM:
+	    case IOCTL_RES_WRITE_SHM:
+		if (req.arg2 > fdinfo->shm_size) {
+		    fprintf(stderr, "ERROR: libumockdev-preload: emulation code requested shared memory transfer of %lx bytes, but only %zx are mapped\n",
+			    (unsigned long) req.arg2, fdinfo->shm_size);
+		    goto con_err;
+		}
+		if (req.cmd == IOCTL_RES_READ_SHM)
+		    memcpy(fdinfo->shm_map, (void*) req.arg1, req.arg2);
+		else
+		    memcpy((void*) req.arg1, fdinfo->shm_map, req.arg2);
+		ioctl_cache_note(&rec, req.arg1, req.arg2, req.cmd == IOCTL_RES_WRITE_SHM);
+
+		/* acknowledge, so that the server may reuse the buffer */
+		req.cmd = IOCTL_REQ_RES;
+		req.arg1 = 0;
+		req.arg2 = 0;
+		res = _send(fdinfo->ioctl_sock, &req, sizeof(req), 0);
 		if (res < 0)
 		    goto con_err;
 
 		break;
+
+	    case IOCTL_RES_MMAP_FD: {
+		int region_fd = recv_fd(fdinfo->ioctl_sock);
+
+		if (region_fd < 0)
+		    goto con_err;
+		if (recv_fd_out == NULL || *recv_fd_out >= 0) {
+		    fprintf(stderr, "ERROR: libumockdev-preload: Unexpected mmap region from server for device %s\n",
+			    fdinfo->dev_path);
+		    abort();
+		}
+		*recv_fd_out = region_fd;
+		break;
 	    }
 
 	    case IOCTL_RES_ABORT:
@@ -700,991 +1846,3089 @@ con_err:
     abort();
 }
 
+static int
+remote_emulate(int fd, int cmd, long arg1, long arg2)
+{
+    return remote_emulate_fd(fd, cmd, arg1, arg2, 0, NULL);
+}
+
 /********************************
  *
- * device/socket script recording
+ * lazy device nodes
  *
  ********************************/
 
-#define MAX_SCRIPT_SOCKET_LOGFILE 50
+/* Char devices without contents get their PTY or socket pair only when they
+ * are first used; until then the node is an empty file, and
+ * $UMOCKDEV_DIR/dev/.lazy/<node name with / -> _> exists. Opening such a node
+ * asks the testbed's "_lazy" handler to create the backing: PTY nodes are
+ * opened by path as usual afterwards, for socket backed nodes the handler
+ * passes the client end of the socket pair instead. */
+
+/* The testbed keeps the number of its lazy nodes in $UMOCKDEV_DIR/lazy-count;
+ * while that is 0, opening nodes needs no marker lookup. The mapping is
+ * replaced when the testbed changes, and old ones stay, as other threads may
+ * still look at them. */
+struct lazy_node_count {
+    char *prefix;
+    const int *count;
+};
+static struct lazy_node_count *lazy_node_count;
 
-enum script_record_format {FMT_DEFAULT, FMT_EVEMU};
+/* Whether the testbed at prefix may have lazy nodes */
+static int
+lazy_nodes_exist(const char *prefix)
+{
+    libc_func(open, int, const char *, int, ...);
+    libc_func(close, int, int);
+    libc_func(mmap, void *, void *, size_t, int, int, int, off_t);
+    struct lazy_node_count *c = __atomic_load_n(&lazy_node_count, __ATOMIC_ACQUIRE);
+    char path[PATH_MAX];
+    struct stat st;
+    int orig_errno, fd, count;
+    void *map;
 
-static fd_map script_dev_logfile_map;	/* maps a st_rdev to a log file name */
-static fd_map script_dev_devpath_map;   /* maps a st_rdev to a device path */
-static fd_map script_dev_format_map;   /* maps a st_rdev to a script_record_format */
-static int script_dev_logfile_map_inited = 0;
-const char* script_socket_logfile[2*MAX_SCRIPT_SOCKET_LOGFILE]; /* list of socket name, log file name */
-size_t script_socket_logfile_len = 0;
-static fd_map script_recorded_fds;
+    if (c != NULL && strcmp(c->prefix, prefix) == 0) {
+	count = __atomic_load_n(c->count, __ATOMIC_RELAXED);
+	if (count >= 0)
+	    return count > 0;
+    }
 
-struct script_record_info {
-    FILE *log;			/* output file */
-    struct timespec time;	/* time of last operation */
-    char op;			/* last operation: 0: none, 'r': read, 'w': write */
-    enum script_record_format fmt;
-};
+    /* a new testbed; without the file, look for markers */
+    orig_errno = errno;
+    snprintf(path, sizeof(path), "%s/lazy-count", prefix);
+    fd = _open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+	errno = orig_errno;
+	return 1;
+    }
+    /* it is only ever written in place, but may just have been created */
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(int))
+	map = MAP_FAILED;
+    else
+	map = _mmap(NULL, sizeof(int), PROT_READ, MAP_SHARED, fd, 0);
+    _close(fd);
+    errno = orig_errno;
+    if (map == MAP_FAILED)
+	return 1;
+    count = __atomic_load_n((const int *) map, __ATOMIC_RELAXED);
+    if (count < 0) {
+	munmap(map, sizeof(int));
+	errno = orig_errno;
+	return 1;
+    }
 
-/* read UMOCKDEV_SCRIPT_* environment variables and set up dev_logfile_map
- * according to it */
-static void
-init_script_dev_logfile_map(void)
+    c = mallocx(sizeof(struct lazy_node_count));
+    c->prefix = strdupx(prefix);
+    c->count = map;
+    __atomic_store_n(&lazy_node_count, c, __ATOMIC_RELEASE);
+    DBG(DBG_PATH, "lazy_nodes_exist: mapped %s, %i nodes\n", path, count);
+    return count > 0;
+}
+
+/* Returns the fd for a socket backed node, or -1 with errno set on error, or
+ * UNHANDLED if path is to be opened as usual */
+static int
+lazy_node_open(const char *path, int flags)
 {
-    int i;
-    dev_t dev;
-    char varname[100];
-    const char *devname, *logname, *format;
+    libc_func(send, ssize_t, int, const void *, size_t, int);
+    libc_func(recv, ssize_t, int, void *, size_t, int);
+    libc_func(close, int, int);
+    const char *prefix = getenv("UMOCKDEV_DIR");
+    char marker[PATH_MAX];
+    struct sockaddr_un addr;
+    struct ioctl_request req;
+    sigset_t sig_set, sig_restore;
+    size_t name_offset, i;
+    int sock, fd = -1;
 
-    script_dev_logfile_map_inited = 1;
+    if (prefix == NULL || path == NULL || strncmp(path, "/dev/", 5) != 0 || !lazy_nodes_exist(prefix))
+	return UNHANDLED;
 
-    for (i = 0; 1; ++i) {
-	snprintf(varname, sizeof(varname), "UMOCKDEV_SCRIPT_RECORD_FILE_%i", i);
-	logname = getenv(varname);
-	if (logname == NULL)
-	    break;
-	snprintf(varname, sizeof(varname), "UMOCKDEV_SCRIPT_RECORD_DEV_%i", i);
-	devname = getenv(varname);
-	if (devname == NULL) {
-	    fprintf(stderr, "umockdev: $%s not set\n", varname);
-	    exit(1);
-	}
-	snprintf(varname, sizeof(varname), "UMOCKDEV_SCRIPT_RECORD_FORMAT_%i", i);
-	format = getenv(varname);
-	if (format == NULL) {
-	    fprintf(stderr, "umockdev: $%s not set\n", varname);
-	    exit(1);
-	}
-	dev = parse_dev_t(devname, NULL, 0);
-	if (dev != (dev_t) -1) {
-	    /* if it's a dev_t, we should record its path */
-	    const char *devpath;
-	    snprintf(varname, sizeof(varname), "UMOCKDEV_SCRIPT_RECORD_DEVICE_PATH_%i", i);
-	    devpath = getenv(varname);
-	    if (devpath == NULL) {
-		fprintf(stderr, "umockdev: $%s not set\n", varname);
-		exit(1);
-	    }
-	    DBG(DBG_SCRIPT, "init_script_dev_logfile_map: will record script of device %i:%i into %s\n", major(dev), minor(dev),
-	    logname);
-	    fd_map_add(&script_dev_logfile_map, dev, logname);
-	    fd_map_add(&script_dev_devpath_map, dev, devpath);
-
-	    if (strcmp(format, "default") == 0)
-		fd_map_add(&script_dev_format_map, dev, (void*) FMT_DEFAULT);
-	    else if (strcmp(format, "evemu") == 0)
-		fd_map_add(&script_dev_format_map, dev, (void*) FMT_EVEMU);
-	    else {
-		fprintf(stderr, "umockdev: unknown device script record format '%s'\n", format);
-		exit(1);
-	    }
-	} else {
-	    if (strcmp(format, "default") != 0) {
-		fprintf(stderr, "umockdev: unknown socket script record format '%s'\n", format);
-		exit(1);
-	    }
+    name_offset = snprintf(marker, sizeof(marker), "%s/dev/.lazy/", prefix);
+    if (name_offset + strlen(path + 5) >= sizeof(marker))
+	return UNHANDLED;
+    strcpy(marker + name_offset, path + 5);
+    for (i = name_offset; marker[i] != '\0'; ++i)
+	if (marker[i] == '/')
+	    marker[i] = '_';
+    if (path_exists(marker) != 0)
+	return UNHANDLED;
 
-	    /* if it's a path, then we record a socket */
-	    if (script_socket_logfile_len < MAX_SCRIPT_SOCKET_LOGFILE) {
-		DBG(DBG_SCRIPT, "init_script_dev_logfile_map: will record script of socket %s into %s\n", devname, logname);
-		script_socket_logfile[2*script_socket_logfile_len] = devname;
-		script_socket_logfile[2*script_socket_logfile_len+1] = logname;
-		script_socket_logfile_len++;
-	    } else {
-		fprintf(stderr, "too many script sockets to record\n");
-		abort();
-	    }
-	}
-    }
-}
+    testbed_socket_addr(&addr, "ioctl/_lazy");
+    sock = ioctl_sock_connect(&addr, NULL, NULL);
+    if (sock < 0)
+	return UNHANDLED;
 
-static void
-script_start_record(int fd, const char *logname, const char *recording_path, enum script_record_format fmt)
-{
-    FILE *log;
-    libc_func(fopen, FILE*, const char *, const char*);
-    struct script_record_info *srinfo;
+    sigfillset(&sig_set);
+    pthread_sigmask(SIG_SETMASK, &sig_set, &sig_restore);
 
-    if (fd_map_get(&script_recorded_fds, fd, NULL)) {
-	fprintf(stderr, "script_start_record: internal error: fd %i is already being recorded\n", fd);
-	abort();
-    }
+    req.cmd = IOCTL_REQ_IOCTL;
+    req.arg1 = strlen(path) + 1;
+    req.arg2 = (unsigned long) path;
+    if (_send(sock, &req, sizeof(req), 0) < 0)
+	goto con_err;
 
-    log = _fopen(logname, "a+");
-    if (log == NULL) {
-	perror("umockdev: failed to open script record file");
-	exit(1);
-    }
+    while (1) {
+	if (ioctl_sock_recv_mem(sock, &req, sizeof(req)) < 0)
+	    goto con_err;
 
-    /* if we have a previous record... */
-    fseek(log, 0, SEEK_END);
-    if (ftell(log) > 0) {
-	DBG(DBG_SCRIPT, "script_start_record: Appending to existing record of format %i for path %s\n", fmt, recording_path ?: "NULL");
-	/* ...and we're going to record the device name... */
-	if (recording_path) {
-	    /* ... ensure we're recording the same device... */
-	    char *existing_device_path;
-	    char line[1000];
-	    libc_func(fgets, char *, char *, int, FILE *);
+	switch (req.cmd) {
+	    case IOCTL_RES_READ_MEM:
+		if (ioctl_sock_send_mem(sock, (void*) req.arg1, req.arg2) < 0)
+		    goto con_err;
+		break;
 
-	    fseek(log, 0, SEEK_SET);
-	    while (_fgets(line, sizeof(line), log)) {
-		switch (fmt) {
-		    case FMT_DEFAULT:
-			/* Start by skipping any leading comments */
-			if (line[0] == '#')
-			    continue;
-			if (sscanf(line, "d 0 %ms\n", &existing_device_path) == 1)
-			{
-			    DBG(DBG_SCRIPT, "script_start_record: recording %s, existing device spec in record %s\n", recording_path, existing_device_path);
-			    /* We have an existing "d /dev/something" directive, check it matches */
-			    if (strcmp(recording_path, existing_device_path) != 0) {
-				fprintf(stderr, "umockdev: attempt to record two different devices to the same script recording\n");
-				exit(1);
-			    }
-			    free(existing_device_path);
-			}
-			// device specification must be on the first non-comment line
-			break;
+	    case IOCTL_RES_MMAP_FD:
+		if (fd >= 0 || (fd = recv_fd(sock)) < 0)
+		    goto con_err;
+		break;
 
-		    case FMT_EVEMU:
-			if (strncmp(line, "E: ", 3) == 0)
-			    break;
-			if (sscanf(line, "# device %ms\n", &existing_device_path) == 1) {
-			    DBG(DBG_SCRIPT, "script_start_record evemu format: recording %s, existing device spec in record %s\n", recording_path, existing_device_path);
-			    /* We have an existing "/dev/something" directive, check it matches */
-			    if (strcmp(recording_path, existing_device_path) != 0) {
-				fprintf(stderr, "umockdev: attempt to record two different devices to the same evemu recording\n");
-				exit(1);
-			    }
-			    free(existing_device_path);
-			}
-			break;
+	    case IOCTL_RES_DONE:
+		_close(sock);
+		pthread_sigmask(SIG_SETMASK, &sig_restore, NULL);
 
-		    default:
-			fprintf(stderr, "umockdev: unknown script format %i\n", fmt);
-			abort();
+		if ((long) req.arg1 < 0) {
+		    if (fd >= 0)
+			_close(fd);
+		    errno = req.arg2;
+		    return -1;
+		}
+		if (fd < 0) {
+		    DBG(DBG_PATH, "lazy_node_open: %s: created PTY\n", path);
+		    return UNHANDLED;
 		}
-	    }
-
-	    fseek(log, 0, SEEK_END);
-	}
-
-	/* ...finally, make sure that we start a new line */
-	putc('\n', log);
-    } else if (recording_path) { /* this is a new record, start by recording the device path */
-	DBG(DBG_SCRIPT, "script_start_record: Starting new record of format %i\n", fmt);
-	switch (fmt) {
-	    case FMT_DEFAULT:
-		fprintf(log, "d 0 %s\n", recording_path);
-		break;
 
-	    case FMT_EVEMU:
-		fprintf(log, "# EVEMU 1.2\n# device %s\n", recording_path);
-		break;
+		/* the fd arrives with FD_CLOEXEC */
+		if (!(flags & O_CLOEXEC))
+		    fcntl(fd, F_SETFD, 0);
+		if (flags & O_NONBLOCK)
+		    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		ioctl_emulate_open(fd, path, 1);
+		DBG(DBG_PATH, "lazy_node_open: %s: got socket fd %i\n", path, fd);
+		return fd;
 
 	    default:
-		fprintf(stderr, "umockdev: unknown script format %i\n", fmt);
-		abort();
+		goto con_err;
 	}
     }
 
-    srinfo = mallocx(sizeof(struct script_record_info));
-    srinfo->log = log;
-    if (clock_gettime(CLOCK_MONOTONIC, &srinfo->time) < 0) {
-	fprintf(stderr, "libumockdev-preload: failed to clock_gettime: %m\n");
-	abort();
-    }
-    srinfo->op = 0;
-    srinfo->fmt = fmt;
-    fd_map_add(&script_recorded_fds, fd, srinfo);
+con_err:
+    fprintf(stderr, "ERROR: libumockdev-preload: Error communicating with lazy node socket for %s, errno: %d\n",
+	    path, errno);
+    pthread_sigmask(SIG_SETMASK, &sig_restore, NULL);
+    abort();
 }
 
-static void
-script_record_open(int fd)
+/* lazy_node_open() for a path relative to dirfd */
+static int
+lazy_node_open_at(int dirfd, const char *path, int flags)
 {
-    dev_t fd_dev;
-    const char *logname, *recording_path = NULL;
-    const void* data = NULL;
-    enum script_record_format fmt;
-    int r;
+    char buf[PATH_MAX], dir_buf[PATH_MAX];
+    const char *base;
+    int ok = 0;
 
-    if (!script_dev_logfile_map_inited)
-	init_script_dev_logfile_map();
+    if (path == NULL || path[0] == '/' || dirfd == AT_FDCWD)
+	return lazy_node_open(path, flags);
+    if (getenv("UMOCKDEV_DIR") == NULL || !lazy_nodes_exist(getenv("UMOCKDEV_DIR")))
+	return UNHANDLED;
 
-    /* check if the opened device is one we want to record */
-    fd_dev = dev_of_fd(fd);
-    if (!fd_map_get(&script_dev_logfile_map, fd_dev, (const void **)&logname)) {
-	DBG(DBG_SCRIPT, "script_record_open: fd %i on device %i:%i is not recorded\n", fd, major(fd_dev), minor(fd_dev));
-	return;
-    }
-    r = fd_map_get(&script_dev_devpath_map, fd_dev, (const void **)&recording_path);
-    assert(r);
-    r = fd_map_get(&script_dev_format_map, fd_dev, &data);
-    assert(r);
-    fmt = (enum script_record_format) (long) data;
+    TRAP_PATH_LOCK;
+    base = dir_fd_path(dirfd, dir_buf, sizeof(dir_buf));
+    /* only directories in /dev can have device nodes */
+    if (base != NULL && strncmp(base, "/dev", 4) == 0 && (base[4] == '/' || base[4] == '\0'))
+	ok = join_path(base, 0, path, buf, sizeof(buf)) != NULL;
+    TRAP_PATH_UNLOCK;
 
-    DBG(DBG_SCRIPT, "script_record_open: start recording fd %i on device %i:%i into %s (format %i)\n",
-	fd, major(fd_dev), minor(fd_dev), logname, fmt);
-    script_start_record(fd, logname, recording_path, fmt);
+    return ok ? lazy_node_open(buf, flags) : UNHANDLED;
+}
+
+/********************************
+ *
+ * sysfs attribute notification
+ *
+ ********************************/
+
+/* Testbed attributes are plain files. umockdev_testbed_notify_attribute()
+ * appends a byte to $UMOCKDEV_DIR/notify/<attribute path>, which is the event
+ * counter that sysfs_notify() bumps in the kernel. Like for kernfs, an open
+ * attribute has a pending notification if the counter grew since it was
+ * opened or last read, and poll()/select()/epoll report POLLPRI|POLLERR for
+ * it. To wait for that, the attribute fd is replaced by an inotify fd on the
+ * counter file in the set of polled fds; for epoll, that watch is registered
+ * with its sysfs_attr_info as data, and the events are mapped back to the
+ * caller's data. */
+
+struct sysfs_attr_info {
+    char *path;			/* trapped attribute path */
+    size_t prefix_len;		/* of the testbed in path */
+    char *notify_path;
+    off_t seen;			/* counter at open or last read */
+    int inotify_fd;		/* -1 until the attribute is polled */
+    int backing_fd;		/* replaced file which reads go to, or -1 */
+    int epoll_fd;		/* epoll instance it is registered with, or -1 */
+    uint64_t epoll_data;	/* the caller's data */
+    uint32_t epoll_events;
+};
+
+static fd_map sysfs_attr_fds;
+static int sysfs_attr_count = 0;
+pthread_mutex_t sysfs_attr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define SYSFS_ATTR_LOCK pthread_mutex_lock (&sysfs_attr_lock)
+#define SYSFS_ATTR_UNLOCK pthread_mutex_unlock (&sysfs_attr_lock)
+
+static off_t
+sysfs_attr_notify_count(const struct sysfs_attr_info *info)
+{
+    struct stat st;
+
+    if (stat(info->notify_path, &st) < 0)
+	return 0;
+    return st.st_size;
 }
 
+/* Start tracking fd if it is a testbed attribute opened as path */
 static void
-script_record_connect(int sockfd, const struct sockaddr *addr, int res)
+sysfs_attr_open(int fd, const char *path)
 {
-    size_t i;
+    libc_func(realpath, char *, const char *, char *);
+    const char *prefix = getenv("UMOCKDEV_DIR");
+    char trapped[PATH_MAX], real[PATH_MAX], real_prefix[PATH_MAX];
+    struct sysfs_attr_info *info;
+    struct sockaddr_un addr;
+    char rel[PATH_MAX];
+    struct stat st;
+    size_t prefix_len;
+    int orig_errno;
 
-    if (addr->sa_family == AF_UNIX && res == 0) {
-	const char *sock_path = ((struct sockaddr_un *) addr)->sun_path;
+    if (fd < 0 || prefix == NULL || strncmp(path, "/sys/", 5) != 0)
+	return;
 
-	/* find out where we log it to */
-	if (!script_dev_logfile_map_inited)
-	    init_script_dev_logfile_map();
-	for (i = 0; i < script_socket_logfile_len; ++i) {
-	    if (strcmp(script_socket_logfile[2*i], sock_path) == 0) {
-		DBG(DBG_SCRIPT, "script_record_connect: starting recording of unix socket %s on fd %i\n", sock_path, sockfd);
-		script_start_record(sockfd, script_socket_logfile[2*i+1], NULL, FMT_DEFAULT);
-	    }
-	}
+    orig_errno = errno;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+	goto out;
+    snprintf(trapped, sizeof(trapped), "%s%s", prefix, path);
+    if (_realpath(trapped, real) == NULL || _realpath(prefix, real_prefix) == NULL)
+	goto out;
+    prefix_len = strlen(real_prefix);
+    if (strncmp(real, real_prefix, prefix_len) != 0 || strncmp(real + prefix_len, "/sys/", 5) != 0)
+	goto out;
+
+    /* computed attributes have a socket named by their canonical path */
+    snprintf(rel, sizeof(rel), "ioctl%s", real + prefix_len);
+    testbed_socket_addr(&addr, rel);
+    if (addr.sun_path[0] == '\0' || path_exists(addr.sun_path) == 0)
+	ioctl_emulate_connect(fd, real + prefix_len, &addr, -1, 0, 0, 0);
+
+    info = mallocx(sizeof(struct sysfs_attr_info));
+    info->path = strdupx(real);
+    info->prefix_len = prefix_len;
+    info->notify_path = mallocx(strlen(prefix) + strlen(real + prefix_len) + 8);
+    sprintf(info->notify_path, "%s/notify%s", prefix, real + prefix_len);
+    info->seen = sysfs_attr_notify_count(info);
+    info->inotify_fd = -1;
+    info->backing_fd = -1;
+    info->epoll_fd = -1;
+
+    SYSFS_ATTR_LOCK;
+    if (sysfs_attr_count < FD_MAP_MAX) {
+	fd_map_add(&sysfs_attr_fds, fd, info);
+	sysfs_attr_count++;
+	info = NULL;
+    }
+    SYSFS_ATTR_UNLOCK;
+
+    if (info != NULL) {
+	DBG(DBG_PATH, "sysfs_attr_open(%s): too many open attributes, not tracking notifications\n", path);
+	free(info->path);
+	free(info->notify_path);
+	free(info);
     }
-}
 
+out:
+    errno = orig_errno;
+}
 
 static void
-script_record_close(int fd)
+sysfs_attr_close(int fd)
 {
-    libc_func(fclose, int, FILE *);
-    struct script_record_info *srinfo;
+    libc_func(close, int, int);
+    struct sysfs_attr_info *info;
 
-    if (!fd_map_get(&script_recorded_fds, fd, (const void **)&srinfo))
+    if (sysfs_attr_count == 0)
 	return;
-    DBG(DBG_SCRIPT, "script_record_close: stop recording fd %i\n", fd);
-    _fclose(srinfo->log);
-    free(srinfo);
-    fd_map_remove(&script_recorded_fds, fd);
+
+    SYSFS_ATTR_LOCK;
+    if (fd_map_get(&sysfs_attr_fds, fd, (const void **) &info)) {
+	fd_map_remove(&sysfs_attr_fds, fd);
+	sysfs_attr_count--;
+	if (info->inotify_fd >= 0)
+	    _close(info->inotify_fd);
+	if (info->backing_fd >= 0)
+	    _close(info->backing_fd);
+	free(info->path);
+	free(info->notify_path);
+	free(info);
+    }
+    SYSFS_ATTR_UNLOCK;
 }
 
-static unsigned long
-update_msec(struct timespec *tm)
+/* Set up the inotify fd which gets readable on a notification; called with
+ * the lock held. If there is a pending notification, the counter file's
+ * timestamps are touched to wake up the watch right away. */
+static int
+sysfs_attr_watch(struct sysfs_attr_info *info)
 {
-    struct timespec now;
-    long delta;
-    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
-	fprintf(stderr, "libumockdev-preload: failed to clock_gettime: %m\n");
-	abort();
+    libc_func(open, int, const char *, int, ...);
+    libc_func(close, int, int);
+    libc_func(mkdir, int, const char *, mode_t);
+    libc_func(inotify_add_watch, int, int, const char *, uint32_t);
+    int orig_errno = errno;
+    char *dir, *cp;
+    int fd;
+
+    if (info->inotify_fd < 0) {
+	/* the counter needs to exist for watching it */
+	dir = strdupx(info->notify_path);
+	*strrchr(dir, '/') = '\0';
+	for (cp = strchr(dir + 1, '/'); cp != NULL; cp = strchr(cp + 1, '/')) {
+	    *cp = '\0';
+	    _mkdir(dir, 0755);
+	    *cp = '/';
+	}
+	_mkdir(dir, 0755);
+	free(dir);
+	fd = _open(info->notify_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd >= 0)
+	    _close(fd);
+
+	info->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (info->inotify_fd >= 0 &&
+	    _inotify_add_watch(info->inotify_fd, info->notify_path, IN_MODIFY | IN_ATTRIB) < 0) {
+	    DBG(DBG_PATH, "sysfs_attr_watch(%s): cannot watch %s: %m\n", info->path, info->notify_path);
+	}
     }
-    delta = (now.tv_sec - tm->tv_sec) * 1000 + now.tv_nsec / 1000000 - tm->tv_nsec / 1000000;
-    assert(delta >= 0);
-    *tm = now;
 
-    return (unsigned long)delta;
+    if (sysfs_attr_notify_count(info) > info->seen)
+	utimensat(AT_FDCWD, info->notify_path, NULL, 0);
+
+    errno = orig_errno;
+    return info->inotify_fd;
 }
 
-static void
-script_record_op(char op, int fd, const void *buf, ssize_t size)
+/* Reading an attribute consumes its notification. As the testbed replaces
+ * attribute files on changes, reading from the start (pos, or the current
+ * position if pos is -1) switches to the current file. The program's fd
+ * stays as it is; reads go to a private fd of the new file instead, at the
+ * position of the program's fd. Returns the result of such a read, or
+ * UNHANDLED if the read is to be done on fd. */
+static ssize_t
+sysfs_attr_read(int fd, void *buf, size_t count, int64_t pos)
 {
-    struct script_record_info *srinfo;
-    unsigned long delta;
-    libc_func(fwrite, size_t, const void *, size_t, size_t, FILE *);
-    static char header[100];
+    libc_func(open, int, const char *, int, ...);
+    libc_func(close, int, int);
+    libc_func(read, ssize_t, int, void *, size_t);
+    struct sysfs_attr_info *info;
+    struct inotify_event events[8];
+    struct stat st_fd, st_path;
+    int orig_errno, new_fd, fl;
+    int64_t cur;
+    ssize_t res = UNHANDLED;
+
+    if (sysfs_attr_count == 0)
+	return UNHANDLED;
 
-    if (!fd_map_get(&script_recorded_fds, fd, (const void **)&srinfo))
-	return;
-    if (size <= 0)
-	return;
-    DBG(DBG_SCRIPT, "script_record_op %c: got %zi bytes on fd %i (format %i)\n", op, size, fd, srinfo->fmt);
-
-    switch (srinfo->fmt) {
-	case FMT_DEFAULT:
-	    delta = update_msec(&srinfo->time);
-	    DBG(DBG_SCRIPT, "  %lu ms since last operation %c\n", delta, srinfo->op);
-
-	    /* for negligible time deltas, append to the previous stanza, otherwise
-	     * create a new record */
-	    if (delta >= 10 || srinfo->op != op) {
-		if (srinfo->op != 0)
-		    putc('\n', srinfo->log);
-		snprintf(header, sizeof(header), "%c %lu ", op, delta);
-		size_t r = _fwrite(header, strlen(header), 1, srinfo->log);
-		assert(r == 1);
-	    }
-
-	    /* escape ASCII control chars */
-	    const unsigned char *cur = buf;
-	    for (ssize_t i = 0; i < size; ++i, ++cur) {
-		if (*cur < 32) {
-		    putc('^', srinfo->log);
-		    putc(*cur + 64, srinfo->log);
-		    continue;
-		}
-		if (*cur == '^') {
-		    /* we cannot encode ^ as ^^, as we need that for 0x1E already; so
-		     * take the next free code which is 0x60 */
-		    putc('^', srinfo->log);
-		    putc('`', srinfo->log);
-		    continue;
-		}
-		putc(*cur, srinfo->log);
-	    }
-	    break;
-
-	case FMT_EVEMU:
-	    if (op != 'r') {
-		fprintf(stderr, "libumockdev-preload: evemu format only supports reads from the device\n");
-		abort();
-	    }
-	    if (size % sizeof(struct input_event) != 0) {
-		fprintf(stderr, "libumockdev-preload: evemu format only supports reading input_event structs\n");
-		abort();
-	    }
-	    const struct input_event *e = buf;
-	    while (size > 0) {
-		fprintf(srinfo->log, "E: %li.%06li %04"PRIX16" %04"PRIX16 " %"PRIi32"\n",
-			(long) e->input_event_sec, (long) e->input_event_usec, e->type, e->code, e->value);
-		size -= sizeof(struct input_event);
-		e++;
-	    }
-	    break;
+    SYSFS_ATTR_LOCK;
+    if (!fd_map_get(&sysfs_attr_fds, fd, (const void **) &info)) {
+	SYSFS_ATTR_UNLOCK;
+	return UNHANDLED;
+    }
 
-	default:
-	    fprintf(stderr, "libumockdev-preload script_record_op(): unsupported format %i\n", srinfo->fmt);
-	    abort();
+    orig_errno = errno;
+    /* drain first, so that a notification in between is not lost */
+    if (info->inotify_fd >= 0)
+	while (_read(info->inotify_fd, events, sizeof(events)) > 0);
+    info->seen = sysfs_attr_notify_count(info);
+
+    fl = fcntl(fd, F_GETFL);
+    cur = pos < 0 ? lseek(fd, 0, SEEK_CUR) : pos;
+    if (cur == 0 && fl >= 0 && (fl & O_ACCMODE) != O_WRONLY &&
+	fstat(info->backing_fd >= 0 ? info->backing_fd : fd, &st_fd) == 0 && stat(info->path, &st_path) == 0 &&
+	(st_fd.st_ino != st_path.st_ino || st_fd.st_dev != st_path.st_dev)) {
+	new_fd = _open(info->path, O_RDONLY | O_CLOEXEC);
+	if (new_fd >= 0) {
+	    DBG(DBG_PATH, "sysfs_attr_read(%i): reading changed %s\n", fd, info->path);
+	    if (info->backing_fd >= 0)
+		_close(info->backing_fd);
+	    info->backing_fd = new_fd;
+	}
     }
 
-    fflush(srinfo->log);
-    srinfo->op = op;
+    errno = orig_errno;
+    /* under the lock, so that threads sharing fd do not get the same data */
+    if (info->backing_fd >= 0 && cur >= 0) {
+	res = real_pread(info->backing_fd, buf, count, cur);
+	if (res > 0 && pos < 0) {
+	    orig_errno = errno;
+	    lseek(fd, cur + res, SEEK_SET);
+	    errno = orig_errno;
+	}
+    }
+    SYSFS_ATTR_UNLOCK;
+    return res;
 }
 
-
 /********************************
  *
- * Overridden libc wrappers for pretending that the $UMOCKDEV_DIR test bed is
- * the actual system.
+ * fork() and exec()
  *
  ********************************/
 
-/* wrapper template for a function with one "const char* path" argument */
-#define WRAP_1ARG(rettype, failret, name)   \
-rettype name(const char *path)		    \
-{ \
-    const char *p;			    \
-    libc_func(name, rettype, const char*);  \
-    rettype r;				    \
-    TRAP_PATH_LOCK;			    \
-    p = trap_path(path);		    \
-    if (p == NULL)			    \
-	r = failret;			    \
-    else {				    \
-	DBG(DBG_PATH, "testbed wrapped " #name "(%s) -> %s\n", path, p);	\
-	r = (*_ ## name)(p);		    \
-    };					    \
-    TRAP_PATH_UNLOCK;			    \
-    return r;				    \
+/* A forked child must not talk over its parent's ioctl sockets, as the
+ * messages of both would interleave. It drops its copies and connects again
+ * when it first uses an emulated fd; the handler then sees a new client.
+ * The locks are taken around fork(), so that the child does not inherit them
+ * locked by another thread. In-flight socket exchanges of other threads are
+ * not waited for, as these may block for a long time; their per-fd locks are
+ * reinitialized in the child instead.
+ *
+ * exec() loses all state. The wrappers below pass the inherited emulated fds
+ * in $UMOCKDEV_INHERITED_FDS as "fd:path;..." to the new program, which
+ * reattaches them at startup. */
+
+#define INHERITED_FDS_VAR "UMOCKDEV_INHERITED_FDS"
+
+static void
+fork_prepare(void)
+{
+    /* same order as nested in the wrappers: sysfs_attr_read() stat()s */
+    pthread_mutex_lock(&sysfs_attr_lock);
+    pthread_mutex_lock(&trap_path_lock);
+    pthread_mutex_lock(&ioctl_lock);
+    pthread_mutex_lock(&ioctl_cache_lock);
 }
 
-/* wrapper template for a function with one "const char* path" argument and path return */
-#define WRAP_1ARG_PATHRET(rettype, failret, name)   \
-rettype name(const char *path)		    \
-{ \
-    const char *p;			    \
-    libc_func(name, rettype, const char*);  \
-    rettype r;				    \
-    TRAP_PATH_LOCK;			    \
-    p = trap_path(path);		    \
-    if (p == NULL)			    \
-	r = failret;			    \
-    else {				    \
-	r = (*_ ## name)(p);		    \
-	if (p != path && r != NULL)	    \
-	    memmove(r, r + trap_path_prefix_len, strlen(r) - trap_path_prefix_len + 1); \
-    };					    \
-    TRAP_PATH_UNLOCK;			    \
-    return r;				    \
+static void
+fork_parent(void)
+{
+    pthread_mutex_unlock(&ioctl_cache_lock);
+    pthread_mutex_unlock(&ioctl_lock);
+    pthread_mutex_unlock(&trap_path_lock);
+    pthread_mutex_unlock(&sysfs_attr_lock);
 }
 
+static void
+fork_child(void)
+{
+    libc_func(close, int, int);
+    struct ioctl_fd_info *fdinfo;
+    size_t i;
 
-/* wrapper template for a function with "const char* path" and another argument */
-#define WRAP_2ARGS(rettype, failret, name, arg2t) \
-rettype name(const char *path, arg2t arg2) \
-{ \
-    const char *p;					\
-    libc_func(name, rettype, const char*, arg2t);	\
-    rettype r;						\
-    TRAP_PATH_LOCK;					\
-    p = trap_path(path);				\
-    if (p == NULL)					\
-	r = failret;					\
-    else						\
-	r = (*_ ## name)(p, arg2);			\
-    TRAP_PATH_UNLOCK;					\
-    return r;						\
+    for (i = 0; i < FD_MAP_MAX; ++i) {
+	if (!ioctl_wrapped_fds.set[i])
+	    continue;
+	fdinfo = (struct ioctl_fd_info *) ioctl_wrapped_fds.data[i];
+	if (fdinfo->ioctl_sock >= 0)
+	    _close(fdinfo->ioctl_sock);
+	fdinfo->ioctl_sock = -1;
+	/* the memfd is shared with the parent */
+	if (fdinfo->shm_map != NULL)
+	    munmap(fdinfo->shm_map, fdinfo->shm_size);
+	if (fdinfo->shm_fd >= 0)
+	    _close(fdinfo->shm_fd);
+	fdinfo->shm_fd = -1;
+	fdinfo->shm_map = NULL;
+	fdinfo->shm_size = 0;
+	pthread_mutex_init(&fdinfo->sock_lock, NULL);
+    }
+
+    fork_parent();
 }
 
-/* wrapper template for a function with "const char* path", another argument, and path return */
-#define WRAP_2ARGS_PATHRET(rettype, failret, name, arg2t) \
-rettype name(const char *path, arg2t arg2) \
-{ \
-    const char *p;					\
-    libc_func(name, rettype, const char*, arg2t);	\
-    rettype r;						\
-    TRAP_PATH_LOCK;					\
-    p = trap_path(path);				\
-    if (p == NULL)					\
-	r = failret;					\
-    else {						\
-	r = (*_ ## name)(p, arg2);			\
-	if (p != path && r != NULL)			\
-	    memmove(r, r + trap_path_prefix_len, strlen(r) - trap_path_prefix_len + 1); \
-    };					    \
-    TRAP_PATH_UNLOCK;					\
-    return r;						\
+/* Append "fd:path;" for fd unless it is close-on-exec; returns the new length */
+static size_t
+inherited_fds_add(char *buf, size_t len, size_t size, int fd, const char *path)
+{
+    int flags = fcntl(fd, F_GETFD);
+    int n;
+
+    if (flags < 0 || (flags & FD_CLOEXEC))
+	return len;
+    n = snprintf(buf + len, size - len, "%i:%s;", fd, path);
+    /* drop what does not fit */
+    if (n < 0 || (size_t) n >= size - len) {
+	buf[len] = '\0';
+	return len;
+    }
+    return len + n;
 }
 
+/* Build the environment for exec(): envp without a stale manifest, and the
+ * current one if there are emulated fds. new_env must have room for the
+ * entries of envp plus two. This runs in vfork() children, so it must not
+ * allocate. */
+static char * const *
+inherited_fds_env(char * const *envp, char **new_env, char *buf, size_t size)
+{
+    const struct sysfs_attr_info *info;
+    size_t len, i, n = 0;
+    int orig_errno = errno;
 
-/* wrapper template for a function with "const char* path" and two other arguments */
-#define WRAP_3ARGS(rettype, failret, name, arg2t, arg3t) \
-rettype name(const char *path, arg2t arg2, arg3t arg3) \
-{ \
-    const char *p;						\
-    libc_func(name, rettype, const char*, arg2t, arg3t);	\
-    rettype r;							\
-    TRAP_PATH_LOCK;						\
-    p = trap_path(path);					\
-    if (p == NULL)						\
-	r = failret;						\
-    else							\
-	r = (*_ ## name)(p, arg2, arg3);			\
-    TRAP_PATH_UNLOCK;						\
-    return r;							\
+    len = snprintf(buf, size, INHERITED_FDS_VAR "=");
+    IOCTL_LOCK;
+    for (i = 0; i < FD_MAP_MAX; ++i)
+	if (ioctl_wrapped_fds.set[i])
+	    len = inherited_fds_add(buf, len, size, ioctl_wrapped_fds.fd[i],
+				    ((const struct ioctl_fd_info *) ioctl_wrapped_fds.data[i])->dev_path);
+    IOCTL_UNLOCK;
+    SYSFS_ATTR_LOCK;
+    for (i = 0; i < FD_MAP_MAX; ++i) {
+	if (!sysfs_attr_fds.set[i] || fd_map_get(&ioctl_wrapped_fds, sysfs_attr_fds.fd[i], NULL))
+	    continue;
+	info = sysfs_attr_fds.data[i];
+	len = inherited_fds_add(buf, len, size, sysfs_attr_fds.fd[i], info->path + info->prefix_len);
+    }
+    SYSFS_ATTR_UNLOCK;
+    errno = orig_errno;
+
+    for (; envp != NULL && *envp != NULL; ++envp)
+	if (strncmp(*envp, INHERITED_FDS_VAR "=", sizeof(INHERITED_FDS_VAR)) != 0)
+	    new_env[n++] = *envp;
+    if (len > sizeof(INHERITED_FDS_VAR))
+	new_env[n++] = buf;
+    new_env[n] = NULL;
+    return new_env;
 }
 
-/* wrapper template for a function with "const char* path", two other arguments, and path return */
-#define WRAP_3ARGS_PATHRET(rettype, failret, name, arg2t, arg3t) \
-rettype name(const char *path, arg2t arg2, arg3t arg3) \
-{ \
-    const char *p;					\
-    libc_func(name, rettype, const char*, arg2t, arg3t); \
-    rettype r;						\
-    TRAP_PATH_LOCK;					\
-    p = trap_path(path);				\
-    if (p == NULL)					\
-	r = failret;					\
-    else {						\
-	r = (*_ ## name)(p, arg2, arg3);		\
-	if (p != path && r != NULL)			\
-	    memmove(r, r + trap_path_prefix_len, strlen(r) - trap_path_prefix_len + 1); \
-    };					    \
-    TRAP_PATH_UNLOCK;					\
-    return r;						\
+static size_t
+env_count(char * const *envp)
+{
+    size_t n = 0;
+
+    while (envp != NULL && envp[n] != NULL)
+	++n;
+    return n;
 }
 
+#define INHERITED_FDS_ENV(envp, name) \
+    char name ## _buf[4096];						\
+    char *name ## _array[env_count(envp) + 2];				\
+    char * const *name = inherited_fds_env(envp, name ## _array, name ## _buf, sizeof(name ## _buf))
 
-/* wrapper template for a function with "const char* path" and three other arguments */
-#define WRAP_4ARGS(rettype, failret, name, arg2t, arg3t, arg4t) \
-rettype name(const char *path, arg2t arg2, arg3t arg3, arg4t arg4) \
-{ \
-    const char *p;						\
-    libc_func(name, rettype, const char*, arg2t, arg3t, arg4t);	\
-    rettype r;							\
-    TRAP_PATH_LOCK;						\
-    p = trap_path(path);					\
-    if (p == NULL)						\
-	r = failret;						\
-    else							\
-	r = (*_ ## name)(p, arg2, arg3, arg4);			\
-    TRAP_PATH_UNLOCK;						\
-    return r;							\
+extern char **environ;
+
+int
+execve(const char *path, char *const argv[], char *const envp[])
+{
+    libc_func(execve, int, const char *, char *const[], char *const[]);
+    INHERITED_FDS_ENV(envp, env);
+
+    return _execve(path, argv, env);
 }
 
-#define STAT_ADJUST_MODE \
-    if (ret == 0 && p != path && strncmp(path, "/dev/", 5) == 0			\
-	&& is_emulated_device(p, st->st_mode)) {				\
-	st->st_mode &= ~S_IFREG;						\
-	if (st->st_mode & S_ISVTX) {						\
-            st->st_mode = S_IFBLK | (st->st_mode & ~S_IFMT);			\
-	    DBG(DBG_PATH, "  %s is an emulated block device\n", path);		\
-	} else {								\
-            st->st_mode = S_IFCHR | (st->st_mode & ~S_IFMT);			\
-	    DBG(DBG_PATH, "  %s is an emulated char device\n", path);		\
-	}									\
-	st->st_rdev = get_rdev(path + 5);					\
-    }										\
+int
+execv(const char *path, char *const argv[])
+{
+    return execve(path, argv, environ);
+}
 
-/* wrapper template for stat family; note that we abuse the sticky bit in
- * the emulated /dev to indicate a block device (the sticky bit has no
- * real functionality for device nodes) */
-#define WRAP_STAT(prefix, suffix) \
-int prefix ## stat ## suffix (const char *path, struct stat ## suffix *st) \
-{ \
-    const char *p;								\
-    libc_func(prefix ## stat ## suffix, int, const char*, struct stat ## suffix *); \
-    int ret;									\
-    TRAP_PATH_LOCK;								\
-    p = trap_path(path);							\
-    if (p == NULL) {								\
-	TRAP_PATH_UNLOCK;							\
-	return -1;								\
-    }										\
-    DBG(DBG_PATH, "testbed wrapped " #prefix "stat" #suffix "(%s) -> %s\n", path, p);	\
-    ret = _ ## prefix ## stat ## suffix(p, st);					\
-    TRAP_PATH_UNLOCK;								\
-    STAT_ADJUST_MODE;                                                           \
-    return ret;									\
+int
+execvpe(const char *file, char *const argv[], char *const envp[])
+{
+    libc_func(execvpe, int, const char *, char *const[], char *const[]);
+    INHERITED_FDS_ENV(envp, env);
+
+    return _execvpe(file, argv, env);
+}
+
+int
+execvp(const char *file, char *const argv[])
+{
+    return execvpe(file, argv, environ);
+}
+
+/* The execl*() family does not go through the exported execve() in glibc */
+#define EXECL_ARGV(arg, argv, ap, last) \
+    size_t argc = 1;							\
+    va_start(ap, arg);							\
+    while (va_arg(ap, char *) != NULL)					\
+	++argc;								\
+    va_end(ap);								\
+    char *argv[argc + 1];						\
+    va_start(ap, arg);							\
+    argv[0] = (char *) arg;						\
+    for (size_t i = 1; i <= argc; ++i)					\
+	argv[i] = va_arg(ap, char *);					\
+    last;								\
+    va_end(ap)
+
+int
+execl(const char *path, const char *arg, ...)
+{
+    va_list ap;
+    EXECL_ARGV(arg, argv, ap, );
+
+    return execve(path, argv, environ);
+}
+
+int
+execle(const char *path, const char *arg, ...)
+{
+    va_list ap;
+    char * const *envp;
+    EXECL_ARGV(arg, argv, ap, envp = va_arg(ap, char * const *));
+
+    return execve(path, argv, envp);
+}
+
+int
+execlp(const char *file, const char *arg, ...)
+{
+    va_list ap;
+    EXECL_ARGV(arg, argv, ap, );
+
+    return execvpe(file, argv, environ);
+}
+
+int
+fexecve(int fd, char *const argv[], char *const envp[])
+{
+    libc_func(fexecve, int, int, char *const[], char *const[]);
+    INHERITED_FDS_ENV(envp, env);
+
+    return _fexecve(fd, argv, env);
+}
+
+int
+posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
+	    const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+    libc_func(posix_spawn, int, pid_t *, const char *, const posix_spawn_file_actions_t *,
+	      const posix_spawnattr_t *, char *const[], char *const[]);
+    INHERITED_FDS_ENV(envp, env);
+
+    return _posix_spawn(pid, path, file_actions, attrp, argv, env);
+}
+
+int
+posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions,
+	     const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+    libc_func(posix_spawnp, int, pid_t *, const char *, const posix_spawn_file_actions_t *,
+	      const posix_spawnattr_t *, char *const[], char *const[]);
+    INHERITED_FDS_ENV(envp, env);
+
+    return _posix_spawnp(pid, file, file_actions, attrp, argv, env);
+}
+
+/* Reattach the emulated fds which the previous program passed over exec() */
+static void
+inherited_fds_restore(void)
+{
+    const char *manifest = getenv(INHERITED_FDS_VAR);
+    char path[PATH_MAX];
+    struct stat st_fd, st_path;
+    const char *p, *end;
+    size_t len;
+    char *endnum;
+    long fd;
+
+    if (manifest == NULL)
+	return;
+
+    for (p = manifest; *p != '\0'; p = end + 1) {
+	fd = strtol(p, &endnum, 10);
+	end = strchr(p, ';');
+	if (end == NULL || *endnum != ':' || endnum > end || fd < 0)
+	    break;
+	len = end - endnum - 1;
+	if (len >= sizeof(path))
+	    continue;
+	memcpy(path, endnum + 1, len);
+	path[len] = '\0';
+
+	/* the fd has to be the one the manifest talks about; stat() is
+	 * redirected to the testbed */
+	if (fstat(fd, &st_fd) < 0 || stat(path, &st_path) < 0 ||
+	    st_fd.st_dev != st_path.st_dev || st_fd.st_ino != st_path.st_ino) {
+	    DBG(DBG_PATH, "inherited_fds_restore: fd %li is not %s any more\n", fd, path);
+	    continue;
+	}
+
+	DBG(DBG_PATH, "inherited_fds_restore: fd %li is %s\n", fd, path);
+	if (strncmp(path, "/sys/", 5) == 0)
+	    sysfs_attr_open(fd, path);
+	else
+	    ioctl_emulate_open(fd, path, 0);
+    }
+
+    unsetenv(INHERITED_FDS_VAR);
+}
+
+static void __attribute__((constructor))
+umockdev_preload_init(void)
+{
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+    cwd_update();
+    if (getenv("UMOCKDEV_DIR") != NULL)
+	inherited_fds_restore();
+}
+
+/********************************
+ *
+ * device/socket script recording
+ *
+ ********************************/
+
+#define MAX_SCRIPT_SOCKET_LOGFILE 50
+
+enum script_record_format {FMT_DEFAULT, FMT_EVEMU};
+
+static fd_map script_dev_logfile_map;	/* maps a st_rdev to a log file name */
+static fd_map script_dev_devpath_map;   /* maps a st_rdev to a device path */
+static fd_map script_dev_format_map;   /* maps a st_rdev to a script_record_format */
+static int script_dev_logfile_map_inited = 0;
+const char* script_socket_logfile[2*MAX_SCRIPT_SOCKET_LOGFILE]; /* list of socket name, log file name */
+size_t script_socket_logfile_len = 0;
+static fd_map script_recorded_fds;
+
+struct script_record_info {
+    FILE *log;			/* output file */
+    struct timespec time;	/* time of last operation */
+    char op;			/* last operation: 0: none, 'r': read, 'w': write */
+    enum script_record_format fmt;
+};
+
+/* read UMOCKDEV_SCRIPT_* environment variables and set up dev_logfile_map
+ * according to it */
+static void
+init_script_dev_logfile_map(void)
+{
+    int i;
+    dev_t dev;
+    char varname[100];
+    const char *devname, *logname, *format;
+
+    script_dev_logfile_map_inited = 1;
+
+    for (i = 0; 1; ++i) {
+	snprintf(varname, sizeof(varname), "UMOCKDEV_SCRIPT_RECORD_FILE_%i", i);
+	logname = getenv(varname);
+	if (logname == NULL)
+	    break;
+	snprintf(varname, sizeof(varname), "UMOCKDEV_SCRIPT_RECORD_DEV_%i", i);
+	devname = getenv(varname);
+	if (devname == NULL) {
+	    fprintf(stderr, "umockdev: $%s not set\n", varname);
+	    exit(1);
+	}
+	snprintf(varname, sizeof(varname), "UMOCKDEV_SCRIPT_RECORD_FORMAT_%i", i);
+	format = getenv(varname);
+	if (format == NULL) {
+	    fprintf(stderr, "umockdev: $%s not set\n", varname);
+	    exit(1);
+	}
+	dev = parse_dev_t(devname, NULL, 0);
+	if (dev != (dev_t) -1) {
+	    /* if it's a dev_t, we should record its path */
+	    const char *devpath;
+	    snprintf(varname, sizeof(varname), "UMOCKDEV_SCRIPT_RECORD_DEVICE_PATH_%i", i);
+	    devpath = getenv(varname);
+	    if (devpath == NULL) {
+		fprintf(stderr, "umockdev: $%s not set\n", varname);
+		exit(1);
+	    }
+	    DBG(DBG_SCRIPT, "init_script_dev_logfile_map: will record script of device %i:%i into %s\n", major(dev), minor(dev),
+	    logname);
+	    fd_map_add(&script_dev_logfile_map, dev, logname);
+	    fd_map_add(&script_dev_devpath_map, dev, devpath);
+
+	    if (strcmp(format, "default") == 0)
+		fd_map_add(&script_dev_format_map, dev, (void*) FMT_DEFAULT);
+	    else if (strcmp(format, "evemu") == 0)
+		fd_map_add(&script_dev_format_map, dev, (void*) FMT_EVEMU);
+	    else {
+		fprintf(stderr, "umockdev: unknown device script record format '%s'\n", format);
+		exit(1);
+	    }
+	} else {
+	    if (strcmp(format, "default") != 0) {
+		fprintf(stderr, "umockdev: unknown socket script record format '%s'\n", format);
+		exit(1);
+	    }
+
+	    /* if it's a path, then we record a socket */
+	    if (script_socket_logfile_len < MAX_SCRIPT_SOCKET_LOGFILE) {
+		DBG(DBG_SCRIPT, "init_script_dev_logfile_map: will record script of socket %s into %s\n", devname, logname);
+		script_socket_logfile[2*script_socket_logfile_len] = devname;
+		script_socket_logfile[2*script_socket_logfile_len+1] = logname;
+		script_socket_logfile_len++;
+	    } else {
+		fprintf(stderr, "too many script sockets to record\n");
+		abort();
+	    }
+	}
+    }
+}
+
+static void
+script_start_record(int fd, const char *logname, const char *recording_path, enum script_record_format fmt)
+{
+    FILE *log;
+    libc_func(fopen, FILE*, const char *, const char*);
+    struct script_record_info *srinfo;
+
+    if (fd_map_get(&script_recorded_fds, fd, NULL)) {
+	fprintf(stderr, "script_start_record: internal error: fd %i is already being recorded\n", fd);
+	abort();
+    }
+
+    log = _fopen(logname, "a+");
+    if (log == NULL) {
+	perror("umockdev: failed to open script record file");
+	exit(1);
+    }
+
+    /* if we have a previous record... */
+    fseek(log, 0, SEEK_END);
+    if (ftell(log) > 0) {
+	DBG(DBG_SCRIPT, "script_start_record: Appending to existing record of format %i for path %s\n", fmt, recording_path ?: "NULL");
+	/* ...and we're going to record the device name... */
+	if (recording_path) {
+	    /* ... ensure we're recording the same device... */
+	    char *existing_device_path;
+	    char line[1000];
+	    libc_func(fgets, char *, char *, int, FILE *);
+
+	    fseek(log, 0, SEEK_SET);
+	    while (_fgets(line, sizeof(line), log)) {
+		switch (fmt) {
+		    case FMT_DEFAULT:
+			/* Start by skipping any leading comments */
+			if (line[0] == '#')
+			    continue;
+			if (sscanf(line, "d 0 %ms\n", &existing_device_path) == 1)
+			{
+			    DBG(DBG_SCRIPT, "script_start_record: recording %s, existing device spec in record %s\n", recording_path, existing_device_path);
+			    /* We have an existing "d /dev/something" directive, check it matches */
+			    if (strcmp(recording_path, existing_device_path) != 0) {
+				fprintf(stderr, "umockdev: attempt to record two different devices to the same script recording\n");
+				exit(1);
+			    }
+			    free(existing_device_path);
+			}
+			// device specification must be on the first non-comment line
+			break;
+
+		    case FMT_EVEMU:
+			if (strncmp(line, "E: ", 3) == 0)
+			    break;
+			if (sscanf(line, "# device %ms\n", &existing_device_path) == 1) {
+			    DBG(DBG_SCRIPT, "script_start_record evemu format: recording %s, existing device spec in record %s\n", recording_path, existing_device_path);
+			    /* We have an existing "/dev/something" directive, check it matches */
+			    if (strcmp(recording_path, existing_device_path) != 0) {
+				fprintf(stderr, "umockdev: attempt to record two different devices to the same evemu recording\n");
+				exit(1);
+			    }
+			    free(existing_device_path);
+			}
+			break;
+
+		    default:
+			fprintf(stderr, "umockdev: unknown script format %i\n", fmt);
+			abort();
+		}
+	    }
+
+	    fseek(log, 0, SEEK_END);
+	}
+
+	/* ...finally, make sure that we start a new line */
+	putc('\n', log);
+    } else if (recording_path) { /* this is a new record, start by recording the device path */
+	DBG(DBG_SCRIPT, "script_start_record: Starting new record of format %i\n", fmt);
+	switch (fmt) {
+	    case FMT_DEFAULT:
+		fprintf(log, "d 0 %s\n", recording_path);
+		break;
+
+	    case FMT_EVEMU:
+		fprintf(log, "# EVEMU 1.2\n# device %s\n", recording_path);
+		break;
+
+	    default:
+		fprintf(stderr, "umockdev: unknown script format %i\n", fmt);
+		abort();
+	}
+    }
+
+    srinfo = mallocx(sizeof(struct script_record_info));
+    srinfo->log = log;
+    if (clock_gettime(CLOCK_MONOTONIC, &srinfo->time) < 0) {
+	fprintf(stderr, "libumockdev-preload: failed to clock_gettime: %m\n");
+	abort();
+    }
+    srinfo->op = 0;
+    srinfo->fmt = fmt;
+    fd_map_add(&script_recorded_fds, fd, srinfo);
+}
+
+static void
+script_record_open(int fd)
+{
+    dev_t fd_dev;
+    const char *logname, *recording_path = NULL;
+    const void* data = NULL;
+    enum script_record_format fmt;
+    int r;
+
+    if (!script_dev_logfile_map_inited)
+	init_script_dev_logfile_map();
+
+    /* check if the opened device is one we want to record */
+    fd_dev = dev_of_fd(fd);
+    if (!fd_map_get(&script_dev_logfile_map, fd_dev, (const void **)&logname)) {
+	DBG(DBG_SCRIPT, "script_record_open: fd %i on device %i:%i is not recorded\n", fd, major(fd_dev), minor(fd_dev));
+	return;
+    }
+    r = fd_map_get(&script_dev_devpath_map, fd_dev, (const void **)&recording_path);
+    assert(r);
+    r = fd_map_get(&script_dev_format_map, fd_dev, &data);
+    assert(r);
+    fmt = (enum script_record_format) (long) data;
+
+    DBG(DBG_SCRIPT, "script_record_open: start recording fd %i on device %i:%i into %s (format %i)\n",
+	fd, major(fd_dev), minor(fd_dev), logname, fmt);
+    script_start_record(fd, logname, recording_path, fmt);
+}
+
+static void
+script_record_connect(int sockfd, const struct sockaddr *addr, int res)
+{
+    size_t i;
+
+    if (addr->sa_family == AF_UNIX && res == 0) {
+	const char *sock_path = ((struct sockaddr_un *) addr)->sun_path;
+
+	/* find out where we log it to */
+	if (!script_dev_logfile_map_inited)
+	    init_script_dev_logfile_map();
+	for (i = 0; i < script_socket_logfile_len; ++i) {
+	    if (strcmp(script_socket_logfile[2*i], sock_path) == 0) {
+		DBG(DBG_SCRIPT, "script_record_connect: starting recording of unix socket %s on fd %i\n", sock_path, sockfd);
+		script_start_record(sockfd, script_socket_logfile[2*i+1], NULL, FMT_DEFAULT);
+	    }
+	}
+    }
+}
+
+
+static void
+script_record_close(int fd)
+{
+    libc_func(fclose, int, FILE *);
+    struct script_record_info *srinfo;
+
+    if (!fd_map_get(&script_recorded_fds, fd, (const void **)&srinfo))
+	return;
+    DBG(DBG_SCRIPT, "script_record_close: stop recording fd %i\n", fd);
+    _fclose(srinfo->log);
+    free(srinfo);
+    fd_map_remove(&script_recorded_fds, fd);
+}
+
+static unsigned long
+update_msec(struct timespec *tm)
+{
+    struct timespec now;
+    long delta;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+	fprintf(stderr, "libumockdev-preload: failed to clock_gettime: %m\n");
+	abort();
+    }
+    delta = (now.tv_sec - tm->tv_sec) * 1000 + now.tv_nsec / 1000000 - tm->tv_nsec / 1000000;
+    assert(delta >= 0);
+    *tm = now;
+
+    return (unsigned long)delta;
+}
+
+static void
+script_record_op(char op, int fd, const void *buf, ssize_t size)
+{
+    struct script_record_info *srinfo;
+    unsigned long delta;
+    libc_func(fwrite, size_t, const void *, size_t, size_t, FILE *);
+    static char header[100];
+
+    if (!fd_map_get(&script_recorded_fds, fd, (const void **)&srinfo))
+	return;
+    if (size <= 0)
+	return;
+    DBG(DBG_SCRIPT, "script_record_op %c: got %zi bytes on fd %i (format %i)\n", op, size, fd, srinfo->fmt);
+
+    switch (srinfo->fmt) {
+	case FMT_DEFAULT:
+	    delta = update_msec(&srinfo->time);
+	    DBG(DBG_SCRIPT, "  %lu ms since last operation %c\n", delta, srinfo->op);
+
+	    /* for negligible time deltas, append to the previous stanza, otherwise
+	     * create a new record */
+	    if (delta >= 10 || srinfo->op != op) {
+		if (srinfo->op != 0)
+		    putc('\n', srinfo->log);
+		snprintf(header, sizeof(header), "%c %lu ", op, delta);
+		size_t r = _fwrite(header, strlen(header), 1, srinfo->log);
+		assert(r == 1);
+	    }
+
+	    /* escape ASCII control chars */
+	    const unsigned char *cur = buf;
+	    for (ssize_t i = 0; i < size; ++i, ++cur) {
+		if (*cur < 32) {
+		    putc('^', srinfo->log);
+		    putc(*cur + 64, srinfo->log);
+		    continue;
+		}
+		if (*cur == '^') {
+		    /* we cannot encode ^ as ^^, as we need that for 0x1E already; so
+		     * take the next free code which is 0x60 */
+		    putc('^', srinfo->log);
+		    putc('`', srinfo->log);
+		    continue;
+		}
+		putc(*cur, srinfo->log);
+	    }
+	    break;
+
+	case FMT_EVEMU:
+	    if (op != 'r') {
+		fprintf(stderr, "libumockdev-preload: evemu format only supports reads from the device\n");
+		abort();
+	    }
+	    if (size % sizeof(struct input_event) != 0) {
+		fprintf(stderr, "libumockdev-preload: evemu format only supports reading input_event structs\n");
+		abort();
+	    }
+	    const struct input_event *e = buf;
+	    while (size > 0) {
+		fprintf(srinfo->log, "E: %li.%06li %04"PRIX16" %04"PRIX16 " %"PRIi32"\n",
+			(long) e->input_event_sec, (long) e->input_event_usec, e->type, e->code, e->value);
+		size -= sizeof(struct input_event);
+		e++;
+	    }
+	    break;
+
+	default:
+	    fprintf(stderr, "libumockdev-preload script_record_op(): unsupported format %i\n", srinfo->fmt);
+	    abort();
+    }
+
+    fflush(srinfo->log);
+    srinfo->op = op;
+}
+
+
+/********************************
+ *
+ * isatty() classification
+ *
+ ********************************/
+
+/* isatty() succeeds for the PTYs of our emulated devices, but they should
+ * only appear as TTY if the emulated device has major 4. The testbed keeps a
+ * $UMOCKDEV_DIR/dev/.ptymap/_dev_pts_N -> major:minor link for each of them.
+ *
+ * Programs and logging libraries call isatty() on the same fds (like stdout)
+ * over and over, so remember the outcome for each fd which is a terminal;
+ * it is forgotten when the fd gets closed or replaced with dup2()/dup3().
+ * Fds can also be reused behind our back (close_range(), closefrom(), raw
+ * syscalls), so the outcome only applies to the inode it was found for. */
+
+#define ISATTY_CACHE_MAX 1024
+#define ISATTY_UNKNOWN 0
+#define ISATTY_TTY 1
+#define ISATTY_NO_TTY 2
+
+struct isatty_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    unsigned char kind;
+};
+
+static struct isatty_cache_entry isatty_cache[ISATTY_CACHE_MAX];
+
+static void
+isatty_cache_forget(int fd)
+{
+    if (fd >= 0 && fd < ISATTY_CACHE_MAX)
+	isatty_cache[fd].kind = ISATTY_UNKNOWN;
+}
+
+/* Name of the terminal fd with / -> _, as in the ptymap; returns 0 on success */
+static int
+isatty_pty_name(int fd, char *name, size_t size)
+{
+    struct stat st;
+    char *cp;
+
+    /* Unix98 PTY slaves are /dev/pts/<minor>; this avoids the more expensive
+     * ttyname_r() for the common case */
+    if (fstat(fd, &st) == 0 && S_ISCHR(st.st_mode) &&
+	major(st.st_rdev) >= 136 && major(st.st_rdev) <= 143) {
+	snprintf(name, size, "_dev_pts_%u", (major(st.st_rdev) - 136) * 256 + minor(st.st_rdev));
+	return 0;
+    }
+
+    if (ttyname_r(fd, name, size) != 0)
+	return -1;
+    for (cp = name; *cp; ++cp)
+	if (*cp == '/')
+	    *cp = '_';
+    return 0;
+}
+
+/* Classify fd, for which the real isatty() succeeded */
+static int
+isatty_classify(int fd)
+{
+    libc_func(readlink, ssize_t, const char*, char*, size_t);
+    char ttyname[1024];
+    char ptymap[PATH_MAX];
+    char majmin[20];
+    const char *prefix = getenv("UMOCKDEV_DIR");
+    ssize_t r;
+
+    if (prefix == NULL)
+	return ISATTY_TTY;
+
+    if (isatty_pty_name(fd, ttyname, sizeof(ttyname)) != 0) {
+	DBG(DBG_PATH, "isatty(%i): is a terminal, but ttyname() failed! %m\n", fd);
+	/* *shrug*, what can we do; return original result */
+	return ISATTY_TTY;
+    }
+
+    DBG(DBG_PATH, "isatty(%i): is a terminal, ttyname %s\n", fd, ttyname);
+    snprintf(ptymap, sizeof(ptymap), "%s/dev/.ptymap/%s", prefix, ttyname);
+    r = _readlink(ptymap, majmin, sizeof(majmin) - 1);
+    if (r < 0) {
+	/* failure here is normal for non-emulated devices */
+	DBG(DBG_PATH, "isatty(%i): readlink(%s) failed: %m\n", fd, ptymap);
+	return ISATTY_TTY;
+    }
+    majmin[r] = '\0';
+    if (majmin[0] != '4' || majmin[1] != ':') {
+	DBG(DBG_PATH, "isatty(%i): major/minor is %s which is not a tty; returning 0\n", fd, majmin);
+	return ISATTY_NO_TTY;
+    }
+    return ISATTY_TTY;
+}
+
+
+/********************************
+ *
+ * Overridden libc wrappers for pretending that the $UMOCKDEV_DIR test bed is
+ * the actual system.
+ *
+ ********************************/
+
+/* wrapper template for a function with one "const char* path" argument */
+#define WRAP_1ARG(rettype, failret, name)   \
+rettype name(const char *path)		    \
+{ \
+    const char *p;			    \
+    libc_func(name, rettype, const char*);  \
+    rettype r;				    \
+    TRAP_PATH_LOCK;			    \
+    p = trap_path(path);		    \
+    if (p == NULL)			    \
+	r = failret;			    \
+    else {				    \
+	DBG(DBG_PATH, "testbed wrapped " #name "(%s) -> %s\n", path, p);	\
+	r = (*_ ## name)(p);		    \
+    };					    \
+    TRAP_PATH_UNLOCK;			    \
+    return r;				    \
+}
+
+/* wrapper template for a function with one "const char* path" argument and path return */
+#define WRAP_1ARG_PATHRET(rettype, failret, name)   \
+rettype name(const char *path)		    \
+{ \
+    const char *p;			    \
+    libc_func(name, rettype, const char*);  \
+    rettype r;				    \
+    TRAP_PATH_LOCK;			    \
+    p = trap_path(path);		    \
+    if (p == NULL)			    \
+	r = failret;			    \
+    else {				    \
+	r = (*_ ## name)(p);		    \
+	if (p != path && r != NULL)	    \
+	    memmove(r, r + trap_path_prefix_len, strlen(r) - trap_path_prefix_len + 1); \
+    };					    \
+    TRAP_PATH_UNLOCK;			    \
+    return r;				    \
+}
+
+
+/* wrapper template for a function with "const char* path" and another argument */
+#define WRAP_2ARGS(rettype, failret, name, arg2t) \
+rettype name(const char *path, arg2t arg2) \
+{ \
+    const char *p;					\
+    libc_func(name, rettype, const char*, arg2t);	\
+    rettype r;						\
+    TRAP_PATH_LOCK;					\
+    p = trap_path(path);				\
+    if (p == NULL)					\
+	r = failret;					\
+    else						\
+	r = (*_ ## name)(p, arg2);			\
+    TRAP_PATH_UNLOCK;					\
+    return r;						\
+}
+
+/* wrapper template for a function with "const char* path", another argument, and path return */
+#define WRAP_2ARGS_PATHRET(rettype, failret, name, arg2t) \
+rettype name(const char *path, arg2t arg2) \
+{ \
+    const char *p;					\
+    libc_func(name, rettype, const char*, arg2t);	\
+    rettype r;						\
+    TRAP_PATH_LOCK;					\
+    p = trap_path(path);				\
+    if (p == NULL)					\
+	r = failret;					\
+    else {						\
+	r = (*_ ## name)(p, arg2);			\
+	if (p != path && r != NULL)			\
+	    memmove(r, r + trap_path_prefix_len, strlen(r) - trap_path_prefix_len + 1); \
+    };					    \
+    TRAP_PATH_UNLOCK;					\
+    return r;						\
+}
+
+
+/* wrapper template for a function with "const char* path" and two other arguments */
+#define WRAP_3ARGS(rettype, failret, name, arg2t, arg3t) \
+rettype name(const char *path, arg2t arg2, arg3t arg3) \
+{ \
+    const char *p;						\
+    libc_func(name, rettype, const char*, arg2t, arg3t);	\
+    rettype r;							\
+    TRAP_PATH_LOCK;						\
+    p = trap_path(path);					\
+    if (p == NULL)						\
+	r = failret;						\
+    else							\
+	r = (*_ ## name)(p, arg2, arg3);			\
+    TRAP_PATH_UNLOCK;						\
+    return r;							\
+}
+
+/* wrapper template for a function with "const char* path", two other arguments, and path return */
+#define WRAP_3ARGS_PATHRET(rettype, failret, name, arg2t, arg3t) \
+rettype name(const char *path, arg2t arg2, arg3t arg3) \
+{ \
+    const char *p;					\
+    libc_func(name, rettype, const char*, arg2t, arg3t); \
+    rettype r;						\
+    TRAP_PATH_LOCK;					\
+    p = trap_path(path);				\
+    if (p == NULL)					\
+	r = failret;					\
+    else {						\
+	r = (*_ ## name)(p, arg2, arg3);		\
+	if (p != path && r != NULL)			\
+	    memmove(r, r + trap_path_prefix_len, strlen(r) - trap_path_prefix_len + 1); \
+    };					    \
+    TRAP_PATH_UNLOCK;					\
+    return r;						\
+}
+
+
+/* wrapper template for a function with "const char* path" and three other arguments */
+#define WRAP_4ARGS(rettype, failret, name, arg2t, arg3t, arg4t) \
+rettype name(const char *path, arg2t arg2, arg3t arg3, arg4t arg4) \
+{ \
+    const char *p;						\
+    libc_func(name, rettype, const char*, arg2t, arg3t, arg4t);	\
+    rettype r;							\
+    TRAP_PATH_LOCK;						\
+    p = trap_path(path);					\
+    if (p == NULL)						\
+	r = failret;						\
+    else							\
+	r = (*_ ## name)(p, arg2, arg3, arg4);			\
+    TRAP_PATH_UNLOCK;						\
+    return r;							\
+}
+
+#define STAT_ADJUST_MODE \
+    if (ret == 0 && p != path && strncmp(path, "/dev/", 5) == 0			\
+	&& is_emulated_device(p, st->st_mode)) {				\
+	st->st_mode &= ~S_IFREG;						\
+	if (st->st_mode & S_ISVTX) {						\
+            st->st_mode = S_IFBLK | (st->st_mode & ~S_IFMT);			\
+	    DBG(DBG_PATH, "  %s is an emulated block device\n", path);		\
+	} else {								\
+            st->st_mode = S_IFCHR | (st->st_mode & ~S_IFMT);			\
+	    DBG(DBG_PATH, "  %s is an emulated char device\n", path);		\
+	}									\
+	st->st_rdev = get_rdev(path + 5);					\
+    }										\
+
+/* wrapper template for stat family; note that we abuse the sticky bit in
+ * the emulated /dev to indicate a block device (the sticky bit has no
+ * real functionality for device nodes) */
+#define WRAP_STAT(prefix, suffix) \
+int prefix ## stat ## suffix (const char *path, struct stat ## suffix *st) \
+{ \
+    const char *p;								\
+    libc_func(prefix ## stat ## suffix, int, const char*, struct stat ## suffix *); \
+    int ret;									\
+    TRAP_PATH_LOCK;								\
+    p = trap_path(path);							\
+    if (p == NULL) {								\
+	TRAP_PATH_UNLOCK;							\
+	return -1;								\
+    }										\
+    DBG(DBG_PATH, "testbed wrapped " #prefix "stat" #suffix "(%s) -> %s\n", path, p);	\
+    ret = _ ## prefix ## stat ## suffix(p, st);					\
+    TRAP_PATH_UNLOCK;								\
+    STAT_ADJUST_MODE;                                                           \
+    return ret;									\
 }
 
 /* wrapper template for fstatat family */
 #define WRAP_FSTATAT(prefix, suffix) \
 int prefix ## fstatat ## suffix (int dirfd, const char *path, struct stat ## suffix *st, int flags) \
 { \
-    const char *p;								\
-    libc_func(prefix ## fstatat ## suffix, int, int, const char*, struct stat ## suffix *, int); \
-    int ret;									\
-    TRAP_PATH_LOCK;								\
-    p = trap_path(path);							\
-    if (p == NULL) {								\
-	TRAP_PATH_UNLOCK;							\
-	return -1;								\
-    }										\
-    DBG(DBG_PATH, "testbed wrapped " #prefix "fstatat" #suffix "(%s) -> %s\n", path, p); \
-    ret = _ ## prefix ## fstatat ## suffix(dirfd, p, st, flags);		\
-    TRAP_PATH_UNLOCK;								\
-    STAT_ADJUST_MODE;                                                           \
-    return ret;									\
+    const char *p, *logical;							\
+    libc_func(prefix ## fstatat ## suffix, int, int, const char*, struct stat ## suffix *, int); \
+    int ret;									\
+    TRAP_PATH_LOCK;								\
+    p = trap_path_at(dirfd, path, &logical);					\
+    if (p == NULL) {								\
+	TRAP_PATH_UNLOCK;							\
+	return -1;								\
+    }										\
+    DBG(DBG_PATH, "testbed wrapped " #prefix "fstatat" #suffix "(%s) -> %s\n", path, p); \
+    ret = _ ## prefix ## fstatat ## suffix(dirfd, p, st, flags);		\
+    if (logical != NULL) {							\
+	/* the emulation goes by the path the program sees */			\
+	path = logical;								\
+	STAT_ADJUST_MODE;							\
+    }										\
+    TRAP_PATH_UNLOCK;								\
+    return ret;									\
+}
+
+/* wrapper template for __xstat family; note that we abuse the sticky bit in
+ * the emulated /dev to indicate a block device (the sticky bit has no
+ * real functionality for device nodes)
+ * This family got deprecated/dropped in glibc 2.32.9000, but we still need
+ * to keep it for a while for programs that were built against previous versions */
+#define WRAP_VERSTAT(prefix, suffix) \
+int prefix ## stat ## suffix (int ver, const char *path, struct stat ## suffix *st); \
+int prefix ## stat ## suffix (int ver, const char *path, struct stat ## suffix *st) \
+{ \
+    const char *p;								\
+    libc_func(prefix ## stat ## suffix, int, int, const char*, struct stat ## suffix *); \
+    int ret;									\
+    TRAP_PATH_LOCK;								\
+    p = trap_path(path);							\
+    if (p == NULL) {								\
+	TRAP_PATH_UNLOCK;							\
+	return -1;								\
+    }										\
+    DBG(DBG_PATH, "testbed wrapped " #prefix "stat" #suffix "(%s) -> %s\n", path, p);	\
+    ret = _ ## prefix ## stat ## suffix(ver, p, st);				\
+    TRAP_PATH_UNLOCK;								\
+    STAT_ADJUST_MODE;                                                           \
+    return ret;									\
+}
+
+/* wrapper template for __fxstatat family */
+#define WRAP_VERFSTATAT(prefix, suffix) \
+int prefix ## fxstatat ## suffix (int ver, int dirfd, const char *path, struct stat ## suffix *st, int flags) \
+{ \
+    const char *p, *logical;							\
+    libc_func(prefix ## fxstatat ## suffix, int, int, int, const char*, struct stat ## suffix *, int); \
+    int ret;									\
+    TRAP_PATH_LOCK;								\
+    p = trap_path_at(dirfd, path, &logical);					\
+    if (p == NULL) {								\
+	TRAP_PATH_UNLOCK;							\
+	return -1;								\
+    }										\
+    DBG(DBG_PATH, "testbed wrapped " #prefix "fxstatat" #suffix "(%s) -> %s\n", path, p); \
+    ret = _ ## prefix ## fxstatat ## suffix(ver, dirfd, p, st, flags);		\
+    if (logical != NULL) {							\
+	/* the emulation goes by the path the program sees */			\
+	path = logical;								\
+	STAT_ADJUST_MODE;							\
+    }										\
+    TRAP_PATH_UNLOCK;								\
+    return ret;									\
+}
+
+
+/* wrapper template for open family */
+#define WRAP_OPEN(prefix, suffix) \
+int prefix ## open ## suffix (const char *path, int flags, ...)	    \
+{ \
+    const char *p;						    \
+    libc_func(prefix ## open ## suffix, int, const char*, int, ...);\
+    int ret;							    \
+    ret = lazy_node_open(path, flags);				    \
+    if (ret != UNHANDLED)					    \
+	return ret;						    \
+    TRAP_PATH_LOCK;						    \
+    p = trap_path(path);					    \
+    if (p == NULL) {						    \
+	TRAP_PATH_UNLOCK;					    \
+	return -1;						    \
+    }								    \
+    DBG(DBG_PATH, "testbed wrapped " #prefix "open" #suffix "(%s) -> %s\n", path, p); \
+    if (flags & (O_CREAT | O_TMPFILE)) {			    \
+	mode_t mode;						    \
+	va_list ap;						    \
+	va_start(ap, flags);				    	    \
+	mode = va_arg(ap, mode_t);			    	    \
+	va_end(ap);					    	    \
+	ret = _ ## prefix ## open ## suffix(p, flags, mode);   	    \
+    } else							    \
+	ret =  _ ## prefix ## open ## suffix(p, flags);		    \
+    if (ret >= 0 && (flags & O_DIRECTORY))			    \
+	dir_fd_record(ret, AT_FDCWD, path);			    \
+    TRAP_PATH_UNLOCK;						    \
+    ioctl_emulate_open(ret, path, path != p);			    \
+    if (path == p)						    \
+	script_record_open(ret);				    \
+    else							    \
+	sysfs_attr_open(ret, path);				    \
+    return ret;							    \
+}
+
+#define WRAP_OPEN2(prefix, suffix) \
+int prefix ## open ## suffix (const char *path, int flags)	    \
+{ \
+    const char *p;						    \
+    libc_func(prefix ## open ## suffix, int, const char*, int);	    \
+    int ret;							    \
+    ret = lazy_node_open(path, flags);				    \
+    if (ret != UNHANDLED)					    \
+	return ret;						    \
+    TRAP_PATH_LOCK;						    \
+    p = trap_path(path);					    \
+    if (p == NULL) {						    \
+	TRAP_PATH_UNLOCK;					    \
+	return -1;						    \
+    }								    \
+    DBG(DBG_PATH, "testbed wrapped " #prefix "open" #suffix "(%s) -> %s\n", path, p); \
+    ret =  _ ## prefix ## open ## suffix(p, flags);		    \
+    if (ret >= 0 && (flags & O_DIRECTORY))			    \
+	dir_fd_record(ret, AT_FDCWD, path);			    \
+    TRAP_PATH_UNLOCK;						    \
+    ioctl_emulate_open(ret, path, path != p);			    \
+    if (path == p)						    \
+	script_record_open(ret);				    \
+    else							    \
+	sysfs_attr_open(ret, path);				    \
+    return ret;						    	    \
+}
+
+/* wrapper template for fopen family */
+#define WRAP_FOPEN(prefix, suffix) \
+FILE* prefix ## fopen ## suffix (const char *path, const char *mode)  \
+{ \
+    const char *p;						    \
+    libc_func(prefix ## fopen ## suffix, FILE*, const char*, const char*);\
+    FILE *ret;							    \
+    int lazy_fd = lazy_node_open(path, strchr(mode, 'e') ? O_CLOEXEC : 0); \
+    if (lazy_fd != UNHANDLED)					    \
+	return lazy_fd < 0 ? NULL : fdopen(lazy_fd, mode);	    \
+    TRAP_PATH_LOCK;						    \
+    p = trap_path(path);					    \
+    if (p == NULL) {						    \
+	TRAP_PATH_UNLOCK;					    \
+	return NULL;						    \
+    }								    \
+    DBG(DBG_PATH, "testbed wrapped " #prefix "fopen" #suffix "(%s) -> %s\n", path, p); \
+    ret =  _ ## prefix ## fopen ## suffix(p, mode);		    \
+    TRAP_PATH_UNLOCK;						    \
+    if (ret != NULL) {						    \
+	int fd = fileno(ret);					    \
+	ioctl_emulate_open(fd, path, path != p);		    \
+	if (path == p) {					    \
+	    script_record_open(fd);				    \
+	} else {						    \
+	    sysfs_attr_open(fd, path);				    \
+	}							    \
+    }								    \
+    return ret;							    \
+}
+
+DIR *
+opendir(const char *path)
+{
+    const char *p;
+    libc_func(opendir, DIR *, const char *);
+    DIR *d;
+
+    TRAP_PATH_LOCK;
+    p = trap_path(path);
+    if (p == NULL) {
+	TRAP_PATH_UNLOCK;
+	return NULL;
+    }
+    DBG(DBG_PATH, "testbed wrapped opendir(%s) -> %s\n", path, p);
+    d = _opendir(p);
+    if (d != NULL)
+	dir_fd_record(dirfd(d), AT_FDCWD, path);
+    TRAP_PATH_UNLOCK;
+    return d;
+}
+
+int
+closedir(DIR *d)
+{
+    libc_func(closedir, int, DIR *);
+
+    if (d != NULL)
+	dir_fd_forget(dirfd(d));
+    return _closedir(d);
+}
+
+int
+faccessat(int dirfd, const char *path, int mode, int flags)
+{
+    const char *p, *logical;
+    libc_func(faccessat, int, int, const char *, int, int);
+    int r;
+
+    TRAP_PATH_LOCK;
+    p = trap_path_at(dirfd, path, &logical);
+    if (p == NULL) {
+	r = -1;
+    } else {
+	DBG(DBG_PATH, "testbed wrapped faccessat(%i, %s) -> %s\n", dirfd, path, p);
+	r = _faccessat(dirfd, p, mode, flags);
+    }
+    TRAP_PATH_UNLOCK;
+    return r;
+}
+
+int
+chdir(const char *path)
+{
+    const char *p;
+    libc_func(chdir, int, const char*);
+    int r;
+
+    TRAP_PATH_LOCK;
+    p = trap_path(path);
+    if (p == NULL) {
+	r = -1;
+    } else {
+	DBG(DBG_PATH, "testbed wrapped chdir(%s) -> %s\n", path, p);
+	r = _chdir(p);
+	if (r == 0)
+	    cwd_update();
+    }
+    TRAP_PATH_UNLOCK;
+    return r;
+}
+
+int
+fchdir(int fd)
+{
+    libc_func(fchdir, int, int);
+    int r;
+
+    TRAP_PATH_LOCK;
+    r = _fchdir(fd);
+    if (r == 0)
+	cwd_update();
+    TRAP_PATH_UNLOCK;
+    return r;
+}
+
+WRAP_FOPEN(,);
+WRAP_2ARGS(int, -1, mkdir, mode_t);
+WRAP_2ARGS(int, -1, chmod, mode_t);
+WRAP_2ARGS(int, -1, access, int);
+WRAP_STAT(,);
+WRAP_STAT(l,);
+WRAP_FSTATAT(,);
+
+#ifdef __GLIBC__
+WRAP_STAT(,64);
+WRAP_STAT(l,64);
+WRAP_FSTATAT(,64);
+WRAP_FOPEN(,64);
+#endif
+
+WRAP_3ARGS(ssize_t, -1, readlink, char *, size_t);
+
+WRAP_4ARGS(ssize_t, -1, getxattr, const char*, void*, size_t);
+WRAP_4ARGS(ssize_t, -1, lgetxattr, const char*, void*, size_t);
+
+#ifdef __GLIBC__
+WRAP_VERSTAT(__x,);
+WRAP_VERSTAT(__x, 64);
+WRAP_VERSTAT(__lx,);
+WRAP_VERSTAT(__lx, 64);
+
+#ifdef HAVE_FXSTATAT
+WRAP_VERFSTATAT(__,);
+WRAP_VERFSTATAT(__,64);
+#endif
+
+int statx(int dirfd, const char *pathname, int flags, unsigned mask, struct statx * stx)
+{
+    const char *p, *logical;
+    libc_func(statx, int, int, const char *, int, unsigned, struct statx *);
+    int r;
+
+    TRAP_PATH_LOCK;
+    p = trap_path_at(dirfd, pathname, &logical);
+    DBG(DBG_PATH, "testbed wrapped statx (%s) -> %s\n", pathname, p ?: "NULL");
+    if (p == NULL)
+        r = -1;
+    else
+        r = _statx(dirfd, p, flags, mask, stx);
+
+    if (r == 0 && logical != NULL && p != logical && strncmp(logical, "/dev/", 5) == 0
+            && is_emulated_device(p, stx->stx_mode)) {
+        if (stx->stx_mode & S_ISVTX) {
+            stx->stx_mode = S_IFBLK | (stx->stx_mode & ~S_IFMT);
+            DBG(DBG_PATH, "  %s is an emulated block device (statx)\n", logical);
+        } else {
+            stx->stx_mode = S_IFCHR | (stx->stx_mode & ~S_IFMT);
+            DBG(DBG_PATH, "  %s is an emulated char device (statx)\n", logical);
+        }
+	unsigned maj, min;
+	if (get_rdev_maj_min(logical + 5, &maj, &min)) {
+	    stx->stx_rdev_major = maj;
+	    stx->stx_rdev_minor = min;
+	} else {
+	    stx->stx_rdev_major = stx->stx_rdev_minor = 0;
+	}
+
+    }
+    TRAP_PATH_UNLOCK;
+    return r;
+}
+
+static bool is_dir_or_contained(const char *path, const char *dir, const char *subdir)
+{
+    if (!path || !dir)
+	return false;
+
+    const ssize_t subdir_len = strlen(subdir);
+    const size_t dir_len = strlen(dir);
+
+    return (dir_len + subdir_len <= strlen(path) &&
+	    strncmp(path, dir, dir_len) == 0 &&
+	    strncmp(path + dir_len, subdir, subdir_len) == 0 &&
+	    (path[dir_len + subdir_len] == '\0' || path[dir_len + subdir_len] == '/'));
+}
+
+static bool is_fd_in_mock(int fd, const char *subdir)
+{
+    static char fdpath[PATH_MAX];
+    static char linkpath[PATH_MAX];
+    libc_func(readlink, ssize_t, const char*, char *, size_t);
+
+    snprintf(fdpath, sizeof fdpath, "/proc/self/fd/%i", fd);
+    int orig_errno = errno;
+    ssize_t linklen = _readlink(fdpath, linkpath, sizeof linkpath);
+    errno = orig_errno;
+    if (linklen < 0 || linklen >= sizeof linkpath) {
+	perror("umockdev: failed to map fd to a path");
+	return false;
+    }
+    linkpath[linklen] = '\0';
+
+    return is_dir_or_contained(linkpath, getenv("UMOCKDEV_DIR"), subdir);
+}
+
+#define WRAP_FSTATFS(suffix) \
+int fstatfs ## suffix(int fd, struct statfs ## suffix *buf)	\
+{ \
+    libc_func(fstatfs ## suffix, int, int, struct statfs ## suffix *buf); \
+    int r = _fstatfs ## suffix(fd, buf);			\
+    if (r == 0 && is_fd_in_mock (fd, "/sys")) {			\
+	DBG(DBG_PATH, "testbed wrapped fstatfs64 (%i) points into mocked /sys; adjusting f_type\n", fd); \
+	buf->f_type = SYSFS_MAGIC;				\
+    }								\
+    return r;							\
+}
+
+WRAP_FSTATFS();
+WRAP_FSTATFS(64);
+
+#define WRAP_STATFS(suffix) \
+int statfs ## suffix(const char *path, struct statfs ## suffix *buf) {	\
+    libc_func(statfs ## suffix, int, const char*, struct statfs ## suffix *buf); \
+    int r;								\
+    TRAP_PATH_LOCK;							\
+    const char *p = trap_path(path);					\
+    if (p == NULL || p == path) {					\
+	r = _statfs ## suffix(path, buf);				\
+	TRAP_PATH_UNLOCK;						\
+	return r;							\
+    } \
+    DBG(DBG_PATH, "testbed wrapped statfs" #suffix "(%s) -> %s\n", path, p); \
+    r = _statfs ## suffix(p, buf);					\
+    TRAP_PATH_UNLOCK;							\
+    if (r == 0 && is_dir_or_contained(path, "/sys", ""))		\
+	buf->f_type = SYSFS_MAGIC;					\
+    return r;								\
+}
+
+WRAP_STATFS();
+WRAP_STATFS(64);
+
+#endif
+
+int __open_2(const char *path, int flags);
+int __open64_2(const char *path, int flags);
+
+WRAP_OPEN(,);
+WRAP_OPEN2(__,_2);
+
+/* wrapper template for openat family; paths relative to a recorded directory
+ * fd are translated like absolute ones */
+#define WRAP_OPENAT(prefix, suffix) \
+int prefix ## openat ## suffix (int dirfd, const char *pathname, int flags, ...)		\
+{ \
+    const char *p, *logical;									\
+    char logical_buf[PATH_MAX];									\
+    libc_func(prefix ## openat ## suffix, int, int, const char *, int, ...);			\
+    int ret;											\
+    ret = lazy_node_open_at(dirfd, pathname, flags);						\
+    if (ret != UNHANDLED)									\
+	return ret;										\
+    TRAP_PATH_LOCK;										\
+    p = trap_path_at(dirfd, pathname, &logical);						\
+    if (p == NULL) { TRAP_PATH_UNLOCK; return -1; }						\
+    DBG(DBG_PATH, "testbed wrapped " #prefix "openat" #suffix "(%s) -> %s\n", pathname, p);	\
+    if (flags & (O_CREAT | O_TMPFILE)) {							\
+	mode_t mode;										\
+	va_list ap;										\
+	va_start(ap, flags);									\
+	mode = va_arg(ap, mode_t);								\
+	va_end(ap);										\
+	ret = _ ## prefix ## openat ## suffix(dirfd, p, flags, mode);				\
+    } else											\
+	ret =  _ ## prefix ## openat ## suffix(dirfd, p, flags);				\
+    if (ret >= 0 && (flags & O_DIRECTORY))							\
+	dir_fd_record(ret, dirfd, pathname);							\
+    /* the emulation runs without the lock */							\
+    if (logical != NULL && p != logical) {							\
+	snprintf(logical_buf, sizeof(logical_buf), "%s", logical);				\
+	logical = logical_buf;									\
+    } else											\
+	logical = NULL;										\
+    TRAP_PATH_UNLOCK;										\
+    if (logical != NULL) {									\
+	ioctl_emulate_open(ret, logical, 1);							\
+	sysfs_attr_open(ret, logical);								\
+    }												\
+    return ret;											\
+}
+
+WRAP_OPENAT(,);
+
+#ifdef __GLIBC__
+WRAP_OPEN(, 64);
+WRAP_OPEN2(__,64_2);
+WRAP_OPENAT(, 64);
+#endif
+
+int
+inotify_add_watch(int fd, const char *path, uint32_t mask)
+{
+    const char *p;
+    libc_func(inotify_add_watch, int, int, const char*, uint32_t);
+    int r;
+
+    TRAP_PATH_LOCK;
+    p = trap_path(path);
+    if (p == NULL)
+	r = -1;
+    else
+	r = _inotify_add_watch(fd, p, mask);
+    TRAP_PATH_UNLOCK;
+    return r;
 }
 
-/* wrapper template for __xstat family; note that we abuse the sticky bit in
- * the emulated /dev to indicate a block device (the sticky bit has no
- * real functionality for device nodes)
- * This family got deprecated/dropped in glibc 2.32.9000, but we still need
- * to keep it for a while for programs that were built against previous versions */
-#define WRAP_VERSTAT(prefix, suffix) \
-int prefix ## stat ## suffix (int ver, const char *path, struct stat ## suffix *st); \
-int prefix ## stat ## suffix (int ver, const char *path, struct stat ## suffix *st) \
-{ \
-    const char *p;								\
-    libc_func(prefix ## stat ## suffix, int, int, const char*, struct stat ## suffix *); \
-    int ret;									\
-    TRAP_PATH_LOCK;								\
-    p = trap_path(path);							\
-    if (p == NULL) {								\
-	TRAP_PATH_UNLOCK;							\
-	return -1;								\
-    }										\
-    DBG(DBG_PATH, "testbed wrapped " #prefix "stat" #suffix "(%s) -> %s\n", path, p);	\
-    ret = _ ## prefix ## stat ## suffix(ver, p, st);				\
-    TRAP_PATH_UNLOCK;								\
-    STAT_ADJUST_MODE;                                                           \
-    return ret;									\
+ssize_t readlinkat(int dirfd, const char *pathname, char *buf, size_t bufsiz)
+{
+    const char *p, *logical;
+    libc_func(readlinkat, size_t, int, const char*, char*, size_t);
+    size_t r;
+
+    TRAP_PATH_LOCK;
+    p = trap_path_at(dirfd, pathname, &logical);
+    DBG(DBG_PATH, "testbed wrapped readlinkat (%s) -> %s\n", pathname, p ?: "NULL");
+    if (p == NULL)
+	r = -1;
+    else
+	r = _readlinkat(dirfd, p, buf, bufsiz);
+    TRAP_PATH_UNLOCK;
+    return r;
 }
 
-/* wrapper template for __fxstatat family */
-#define WRAP_VERFSTATAT(prefix, suffix) \
-int prefix ## fxstatat ## suffix (int ver, int dirfd, const char *path, struct stat ## suffix *st, int flags) \
-{ \
-    const char *p;								\
-    libc_func(prefix ## fxstatat ## suffix, int, int, int, const char*, struct stat ## suffix *, int); \
-    int ret;									\
-    TRAP_PATH_LOCK;								\
-    p = trap_path(path);							\
-    if (p == NULL) {								\
-	TRAP_PATH_UNLOCK;							\
-	return -1;								\
-    }										\
-    DBG(DBG_PATH, "testbed wrapped " #prefix "fxstatat" #suffix "(%s) -> %s\n", path, p); \
-    ret = _ ## prefix ## fxstatat ## suffix(ver, dirfd, p, st, flags);		\
-    TRAP_PATH_UNLOCK;								\
-    STAT_ADJUST_MODE;                                                           \
-    return ret;									\
+/* A readlinkat fortify wrapper that is used when -D_FORTIFY_SOURCE is used. */
+ssize_t __readlinkat_chk(int dirfd, const char *pathname, char *buf, size_t bufsiz, size_t buflen);
+ssize_t __readlinkat_chk(int dirfd, const char *pathname, char *buf, size_t bufsiz, size_t buflen)
+{
+    return readlinkat(dirfd, pathname, buf, bufsiz);
+}
+
+WRAP_2ARGS_PATHRET(char *, NULL, realpath, char *);
+
+char *__realpath_chk(const char *path, char *resolved, size_t size);
+WRAP_3ARGS_PATHRET(char *, NULL, __realpath_chk, char *, size_t);
+
+#ifdef __GLIBC__
+WRAP_1ARG_PATHRET(char *, NULL, canonicalize_file_name);
+#endif
+
+char *
+getcwd(char *buf, size_t size)
+{
+    libc_func (getcwd, char*, char*, size_t);
+    const char *prefix = getenv("UMOCKDEV_DIR");
+    char *r = _getcwd (buf, size);
+
+    if (prefix != NULL && r != NULL) {
+	size_t prefix_len = strlen (prefix);
+	if (strncmp (r, prefix, prefix_len) == 0) {
+	    DBG(DBG_PATH, "testbed wrapped getcwd: %s -> %s\n", r, r + prefix_len);
+	    memmove(r, r + prefix_len, strlen(r) - prefix_len + 1); \
+	}
+    }
+    return r;
+}
+
+char * __getcwd_chk(char *buf, size_t size, size_t buflen);
+char *
+__getcwd_chk(char *buf, size_t size, size_t buflen)
+{
+    libc_func (__getcwd_chk, char*, char*, size_t, size_t);
+    const char *prefix = getenv("UMOCKDEV_DIR");
+    char *r = ___getcwd_chk (buf, size, buflen);
+
+    if (prefix != NULL && r != NULL) {
+	size_t prefix_len = strlen (prefix);
+	if (strncmp (r, prefix, prefix_len) == 0) {
+	    DBG(DBG_PATH, "testbed wrapped __getcwd_chk: %s -> %s\n", r, r + prefix_len);
+	    memmove(r, r + prefix_len, strlen(r) - prefix_len + 1); \
+	}
+    }
+    return r;
+}
+
+ssize_t
+read(int fd, void *buf, size_t count)
+{
+    libc_func(read, ssize_t, int, void *, size_t);
+    ssize_t res;
+
+    res = sysfs_attr_read(fd, buf, count, -1);
+    if (res != UNHANDLED)
+	return res;
+    res = remote_emulate(fd, IOCTL_REQ_READ, (long) buf, (long) count);
+    if (res != UNHANDLED) {
+	DBG(DBG_IOCTL, "ioctl fd %i read of %d bytes: emulated, result %i\n", fd, (int) count, (int) res);
+	return res;
+    }
+    res = _read(fd, buf, count);
+    script_record_op('r', fd, buf, res);
+    return res;
+}
+
+ssize_t
+write(int fd, const void *buf, size_t count)
+{
+    libc_func(write, ssize_t, int, const void *, size_t);
+    ssize_t res;
+
+    res = remote_emulate(fd, IOCTL_REQ_WRITE, (long) buf, (long) count);
+    if (res != UNHANDLED) {
+	DBG(DBG_IOCTL, "ioctl fd %i write of %d bytes: emulated, result %i\n", fd, (int) count, (int) res);
+	return res;
+    }
+    res = _write(fd, buf, count);
+    script_record_op('w', fd, buf, res);
+    return res;
+}
+
+/* Positional I/O is only passed on to handlers which throttle it, like for
+ * block devices, or which serve data by position, like computed sysfs
+ * attributes; otherwise the client runs it itself */
+static ssize_t
+emulate_pread(int fd, void *buf, size_t count, int64_t offset)
+{
+    ssize_t res;
+
+    res = sysfs_attr_read(fd, buf, count, offset);
+    if (res != UNHANDLED)
+	return res;
+    res = remote_emulate_fd(fd, IOCTL_REQ_PREAD, (long) buf, (long) count, offset, NULL);
+    if (res != UNHANDLED) {
+	DBG(DBG_IOCTL, "ioctl fd %i pread of %zu bytes: emulated, result %zi\n", fd, count, res);
+	return res;
+    }
+    return real_pread(fd, buf, count, offset);
+}
+
+static ssize_t
+emulate_pwrite(int fd, const void *buf, size_t count, int64_t offset)
+{
+    ssize_t res;
+
+    res = remote_emulate_fd(fd, IOCTL_REQ_PWRITE, (long) buf, (long) count, offset, NULL);
+    if (res != UNHANDLED) {
+	DBG(DBG_IOCTL, "ioctl fd %i pwrite of %zu bytes: emulated, result %zi\n", fd, count, res);
+	return res;
+    }
+    return real_pwrite(fd, buf, count, offset);
+}
+
+ssize_t
+pread(int fd, void *buf, size_t count, off_t offset)
+{
+    return emulate_pread(fd, buf, count, offset);
+}
+
+ssize_t
+pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    return emulate_pwrite(fd, buf, count, offset);
+}
+
+#ifdef __GLIBC__
+ssize_t
+pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+    return emulate_pread(fd, buf, count, offset);
+}
+
+ssize_t
+pwrite64(int fd, const void *buf, size_t count, off64_t offset)
+{
+    return emulate_pwrite(fd, buf, count, offset);
+}
+#endif
+
+/* how poll() handles an attribute */
+enum sysfs_attr_poll { ATTR_POLL_REAL = 0, ATTR_POLL_PENDING, ATTR_POLL_WATCH };
+
+/* Whether any of the nfds polled fds is an attribute */
+static int
+sysfs_attr_polled(const struct pollfd *fds, nfds_t nfds)
+{
+    nfds_t i;
+    int res = 0;
+
+    if (sysfs_attr_count == 0)
+	return 0;
+    SYSFS_ATTR_LOCK;
+    for (i = 0; i < nfds && !res; ++i)
+	res = fds[i].fd >= 0 && fd_map_get(&sysfs_attr_fds, fds[i].fd, NULL);
+    SYSFS_ATTR_UNLOCK;
+    return res;
+}
+
+/* ppoll() with attributes among fds */
+static int
+sysfs_attr_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout, const sigset_t *sigmask)
+{
+    libc_func(ppoll, int, struct pollfd *, nfds_t, const struct timespec *, const sigset_t *);
+    const short always = POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM;
+    static const struct timespec no_wait = { 0, 0 };
+    struct sysfs_attr_info *info;
+    struct pollfd *real_fds;
+    char *mode;
+    int res;
+    nfds_t i;
+
+    real_fds = mallocx(nfds * sizeof(struct pollfd));
+    memcpy(real_fds, fds, nfds * sizeof(struct pollfd));
+    mode = calloc(nfds, 1);
+
+    SYSFS_ATTR_LOCK;
+    for (i = 0; i < nfds; ++i) {
+	if (fds[i].fd < 0 || !fd_map_get(&sysfs_attr_fds, fds[i].fd, (const void **) &info))
+	    continue;
+	if (sysfs_attr_notify_count(info) > info->seen) {
+	    mode[i] = ATTR_POLL_PENDING;
+	    real_fds[i].fd = -1;
+	    timeout = &no_wait;
+	} else if (!(fds[i].events & always)) {
+	    /* regular reads are always possible, so only wait for POLLPRI */
+	    mode[i] = ATTR_POLL_WATCH;
+	    real_fds[i].fd = sysfs_attr_watch(info);
+	    real_fds[i].events = POLLIN;
+	}
+    }
+    SYSFS_ATTR_UNLOCK;
+
+    res = _ppoll(real_fds, nfds, timeout, sigmask);
+    if (res >= 0) {
+	res = 0;
+	for (i = 0; i < nfds; ++i) {
+	    if (mode[i] == ATTR_POLL_PENDING)
+		fds[i].revents = (fds[i].events & (always | POLLPRI)) | POLLERR;
+	    else if (mode[i] == ATTR_POLL_WATCH)
+		fds[i].revents = (real_fds[i].revents & POLLIN) ? (fds[i].events & POLLPRI) | POLLERR : 0;
+	    else
+		fds[i].revents = real_fds[i].revents;
+	    if (fds[i].revents != 0)
+		res++;
+	}
+    }
+
+    free(real_fds);
+    free(mode);
+    return res;
+}
+
+int
+poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    libc_func(poll, int, struct pollfd *, nfds_t, int);
+    struct timespec ts;
+
+    if (!sysfs_attr_polled(fds, nfds))
+	return _poll(fds, nfds, timeout);
+
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    return sysfs_attr_ppoll(fds, nfds, timeout < 0 ? NULL : &ts, NULL);
+}
+
+int
+ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout, const sigset_t *sigmask)
+{
+    libc_func(ppoll, int, struct pollfd *, nfds_t, const struct timespec *, const sigset_t *);
+
+    if (!sysfs_attr_polled(fds, nfds))
+	return _ppoll(fds, nfds, timeout, sigmask);
+    return sysfs_attr_ppoll(fds, nfds, timeout, sigmask);
+}
+
+/* pselect() with attributes among the fds: like the kernel, run it as
+ * ppoll() with POLLPRI for exceptfds; returns UNHANDLED without attributes */
+static int
+sysfs_attr_pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+		   const struct timespec *timeout, const sigset_t *sigmask)
+{
+    struct pollfd *fds;
+    int fd, n = 0, res, attrs = 0;
+
+    if (sysfs_attr_count == 0 || nfds <= 0)
+	return UNHANDLED;
+
+    fds = mallocx(nfds * sizeof(struct pollfd));
+    SYSFS_ATTR_LOCK;
+    for (fd = 0; fd < nfds && fd < FD_SETSIZE; ++fd) {
+	short events = 0;
+	if (readfds != NULL && FD_ISSET(fd, readfds))
+	    events |= POLLIN;
+	if (writefds != NULL && FD_ISSET(fd, writefds))
+	    events |= POLLOUT;
+	if (exceptfds != NULL && FD_ISSET(fd, exceptfds))
+	    events |= POLLPRI;
+	if (events == 0)
+	    continue;
+	fds[n].fd = fd;
+	fds[n].events = events;
+	fds[n].revents = 0;
+	n++;
+	if (fd_map_get(&sysfs_attr_fds, fd, NULL))
+	    attrs = 1;
+    }
+    SYSFS_ATTR_UNLOCK;
+
+    if (!attrs) {
+	free(fds);
+	return UNHANDLED;
+    }
+
+    res = sysfs_attr_ppoll(fds, n, timeout, sigmask);
+    if (res >= 0) {
+	res = 0;
+	for (fd = 0; fd < n; ++fd)
+	    if (fds[fd].revents & POLLNVAL) {
+		free(fds);
+		errno = EBADF;
+		return -1;
+	    }
+	if (readfds != NULL)
+	    FD_ZERO(readfds);
+	if (writefds != NULL)
+	    FD_ZERO(writefds);
+	if (exceptfds != NULL)
+	    FD_ZERO(exceptfds);
+	for (fd = 0; fd < n; ++fd) {
+	    if ((fds[fd].events & POLLIN) && (fds[fd].revents & (POLLIN | POLLHUP | POLLERR))) {
+		FD_SET(fds[fd].fd, readfds);
+		res++;
+	    }
+	    if ((fds[fd].events & POLLOUT) && (fds[fd].revents & (POLLOUT | POLLERR))) {
+		FD_SET(fds[fd].fd, writefds);
+		res++;
+	    }
+	    if ((fds[fd].events & POLLPRI) && (fds[fd].revents & POLLPRI)) {
+		FD_SET(fds[fd].fd, exceptfds);
+		res++;
+	    }
+	}
+    }
+    free(fds);
+    return res;
+}
+
+int
+select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout)
+{
+    libc_func(select, int, int, fd_set *, fd_set *, fd_set *, struct timeval *);
+    struct timespec ts;
+    int res;
+
+    if (timeout != NULL) {
+	ts.tv_sec = timeout->tv_sec;
+	ts.tv_nsec = timeout->tv_usec * 1000;
+    }
+    res = sysfs_attr_pselect(nfds, readfds, writefds, exceptfds, timeout != NULL ? &ts : NULL, NULL);
+    if (res == UNHANDLED)
+	return _select(nfds, readfds, writefds, exceptfds, timeout);
+    return res;
+}
+
+int
+pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+	const struct timespec *timeout, const sigset_t *sigmask)
+{
+    libc_func(pselect, int, int, fd_set *, fd_set *, fd_set *, const struct timespec *, const sigset_t *);
+    int res;
+
+    res = sysfs_attr_pselect(nfds, readfds, writefds, exceptfds, timeout, sigmask);
+    if (res == UNHANDLED)
+	return _pselect(nfds, readfds, writefds, exceptfds, timeout, sigmask);
+    return res;
+}
+
+int
+epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    libc_func(epoll_ctl, int, int, int, int, struct epoll_event *);
+    struct sysfs_attr_info *info;
+    struct epoll_event watch_event;
+    int res;
+
+    if (sysfs_attr_count == 0)
+	return _epoll_ctl(epfd, op, fd, event);
+
+    SYSFS_ATTR_LOCK;
+    if (!fd_map_get(&sysfs_attr_fds, fd, (const void **) &info)) {
+	SYSFS_ATTR_UNLOCK;
+	return _epoll_ctl(epfd, op, fd, event);
+    }
+
+    /* regular files cannot be added to epoll; register the watch instead.
+     * Its data is our info, which no other fd of the program can have as
+     * data, and the caller's data is put back by epoll_wait(). */
+    if (op == EPOLL_CTL_DEL) {
+	res = _epoll_ctl(epfd, op, info->inotify_fd, event);
+	if (res == 0)
+	    info->epoll_fd = -1;
+    } else {
+	watch_event.events = EPOLLIN | (event->events & (EPOLLET | EPOLLONESHOT));
+	watch_event.data.ptr = info;
+	res = _epoll_ctl(epfd, op, sysfs_attr_watch(info), &watch_event);
+	if (res == 0) {
+	    info->epoll_fd = epfd;
+	    info->epoll_data = event->data.u64;
+	    info->epoll_events = event->events;
+	}
+    }
+    SYSFS_ATTR_UNLOCK;
+    return res;
+}
+
+/* Turn the readable watches in events back into attribute notifications */
+static void
+sysfs_attr_epoll_events(int epfd, struct epoll_event *events, int n)
+{
+    struct sysfs_attr_info *info;
+    int i;
+    size_t j;
+
+    if (n <= 0 || sysfs_attr_count == 0)
+	return;
+
+    SYSFS_ATTR_LOCK;
+    for (i = 0; i < n; ++i) {
+	for (j = 0; j < FD_MAP_MAX; ++j) {
+	    if (!sysfs_attr_fds.set[j])
+		continue;
+	    info = (struct sysfs_attr_info *) sysfs_attr_fds.data[j];
+	    if (info->epoll_fd == epfd && events[i].data.ptr == info) {
+		events[i].events = (info->epoll_events & EPOLLPRI) | EPOLLERR;
+		events[i].data.u64 = info->epoll_data;
+		break;
+	    }
+	}
+    }
+    SYSFS_ATTR_UNLOCK;
 }
 
+int
+epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    libc_func(epoll_wait, int, int, struct epoll_event *, int, int);
+    int res = _epoll_wait(epfd, events, maxevents, timeout);
 
-/* wrapper template for open family */
-#define WRAP_OPEN(prefix, suffix) \
-int prefix ## open ## suffix (const char *path, int flags, ...)	    \
-{ \
-    const char *p;						    \
-    libc_func(prefix ## open ## suffix, int, const char*, int, ...);\
-    int ret;							    \
-    TRAP_PATH_LOCK;						    \
-    p = trap_path(path);					    \
-    if (p == NULL) {						    \
-	TRAP_PATH_UNLOCK;					    \
-	return -1;						    \
-    }								    \
-    DBG(DBG_PATH, "testbed wrapped " #prefix "open" #suffix "(%s) -> %s\n", path, p); \
-    if (flags & (O_CREAT | O_TMPFILE)) {			    \
-	mode_t mode;						    \
-	va_list ap;						    \
-	va_start(ap, flags);				    	    \
-	mode = va_arg(ap, mode_t);			    	    \
-	va_end(ap);					    	    \
-	ret = _ ## prefix ## open ## suffix(p, flags, mode);   	    \
-    } else							    \
-	ret =  _ ## prefix ## open ## suffix(p, flags);		    \
-    TRAP_PATH_UNLOCK;						    \
-    ioctl_emulate_open(ret, path, path != p);			    \
-    if (path == p)						    \
-	script_record_open(ret);				    \
-    return ret;							    \
+    sysfs_attr_epoll_events(epfd, events, res);
+    return res;
 }
 
-#define WRAP_OPEN2(prefix, suffix) \
-int prefix ## open ## suffix (const char *path, int flags)	    \
-{ \
-    const char *p;						    \
-    libc_func(prefix ## open ## suffix, int, const char*, int);	    \
-    int ret;							    \
-    TRAP_PATH_LOCK;						    \
-    p = trap_path(path);					    \
-    if (p == NULL) {						    \
-	TRAP_PATH_UNLOCK;					    \
-	return -1;						    \
-    }								    \
-    DBG(DBG_PATH, "testbed wrapped " #prefix "open" #suffix "(%s) -> %s\n", path, p); \
-    ret =  _ ## prefix ## open ## suffix(p, flags);		    \
-    TRAP_PATH_UNLOCK;						    \
-    ioctl_emulate_open(ret, path, path != p);			    \
-    if (path == p)						    \
-	script_record_open(ret);				    \
-    return ret;						    	    \
+int
+epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask)
+{
+    libc_func(epoll_pwait, int, int, struct epoll_event *, int, int, const sigset_t *);
+    int res = _epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+
+    sysfs_attr_epoll_events(epfd, events, res);
+    return res;
 }
 
-/* wrapper template for fopen family */
-#define WRAP_FOPEN(prefix, suffix) \
-FILE* prefix ## fopen ## suffix (const char *path, const char *mode)  \
-{ \
-    const char *p;						    \
-    libc_func(prefix ## fopen ## suffix, FILE*, const char*, const char*);\
-    FILE *ret;							    \
-    TRAP_PATH_LOCK;						    \
-    p = trap_path(path);					    \
-    if (p == NULL) {						    \
-	TRAP_PATH_UNLOCK;					    \
-	return NULL;						    \
-    }								    \
-    DBG(DBG_PATH, "testbed wrapped " #prefix "fopen" #suffix "(%s) -> %s\n", path, p); \
-    ret =  _ ## prefix ## fopen ## suffix(p, mode);		    \
-    TRAP_PATH_UNLOCK;						    \
-    if (ret != NULL) {						    \
-	int fd = fileno(ret);					    \
-	ioctl_emulate_open(fd, path, path != p);		    \
-	if (path == p) {					    \
-	    script_record_open(fd);				    \
-	}							    \
-    }								    \
-    return ret;							    \
+#ifdef HAVE_EPOLL_PWAIT2
+int
+epoll_pwait2(int epfd, struct epoll_event *events, int maxevents, const struct timespec *timeout,
+	     const sigset_t *sigmask)
+{
+    libc_func(epoll_pwait2, int, int, struct epoll_event *, int, const struct timespec *, const sigset_t *);
+    int res = _epoll_pwait2(epfd, events, maxevents, timeout, sigmask);
+
+    sysfs_attr_epoll_events(epfd, events, res);
+    return res;
 }
+#endif
+
+/* Emulated devices may hand out a memfd backed region for an mmap() offset;
+ * it is mapped directly, so that the emulation and the client share the
+ * pages. munmap() needs no special handling for that. */
+static void *
+emulate_mmap(void *addr, size_t length, int prot, int flags, int fd, int64_t offset, int *handled)
+{
+    libc_func(mmap, void *, void *, size_t, int, int, int, off_t);
+    libc_func(close, int, int);
+    int region_fd = -1;
+    long res;
+    void *map;
+
+    *handled = 0;
+    if (fd < 0 || (flags & MAP_ANONYMOUS))
+	return MAP_FAILED;
+
+    res = remote_emulate_fd(fd, IOCTL_REQ_MMAP, (long) offset, (long) length, 0, &region_fd);
+    if (res == UNHANDLED)
+	return MAP_FAILED;
+
+    *handled = 1;
+    if (res < 0) {
+	DBG(DBG_IOCTL, "ioctl fd %i mmap of %zu bytes at offset %" PRIi64 ": emulated, errno %i\n",
+	    fd, length, offset, errno);
+	if (region_fd >= 0)
+	    _close(region_fd);
+	return MAP_FAILED;
+    }
+    /* success comes with the region, see IOCTL_RES_MMAP_FD */
+    if (region_fd < 0) {
+	fprintf(stderr, "ERROR: libumockdev-preload: Server answered mmap() on fd %i without a region\n", fd);
+	abort();
+    }
 
-WRAP_1ARG(DIR *, NULL, opendir);
-WRAP_1ARG(int, -1, chdir);
+    map = _mmap(addr, length, prot, flags, region_fd, res);
+    DBG(DBG_IOCTL, "ioctl fd %i mmap of %zu bytes at offset %" PRIi64 ": emulated, region offset %li -> %p\n",
+	fd, length, offset, res, map);
+    _close(region_fd);
+    return map;
+}
 
-WRAP_FOPEN(,);
-WRAP_2ARGS(int, -1, mkdir, mode_t);
-WRAP_2ARGS(int, -1, chmod, mode_t);
-WRAP_2ARGS(int, -1, access, int);
-WRAP_STAT(,);
-WRAP_STAT(l,);
-WRAP_FSTATAT(,);
+void *
+mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    libc_func(mmap, void *, void *, size_t, int, int, int, off_t);
+    int handled;
+    void *map;
+
+    map = emulate_mmap(addr, length, prot, flags, fd, offset, &handled);
+    if (handled)
+	return map;
+    return _mmap(addr, length, prot, flags, fd, offset);
+}
 
 #ifdef __GLIBC__
-WRAP_STAT(,64);
-WRAP_STAT(l,64);
-WRAP_FSTATAT(,64);
-WRAP_FOPEN(,64);
+void *
+mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset)
+{
+    libc_func(mmap64, void *, void *, size_t, int, int, int, off64_t);
+    int handled;
+    void *map;
+
+    map = emulate_mmap(addr, length, prot, flags, fd, offset, &handled);
+    if (handled)
+	return map;
+    return _mmap64(addr, length, prot, flags, fd, offset);
+}
 #endif
 
-WRAP_3ARGS(ssize_t, -1, readlink, char *, size_t);
+/********************************
+ *
+ * io_uring
+ *
+ ********************************/
 
-WRAP_4ARGS(ssize_t, -1, getxattr, const char*, void*, size_t);
-WRAP_4ARGS(ssize_t, -1, lgetxattr, const char*, void*, size_t);
+#ifdef HAVE_LINUX_IO_URING_H
+
+/* Our own mapping of a ring's submission queue; SQEs for emulated devices
+ * are run through the ioctl socket before the kernel sees them. */
+struct io_uring_info {
+    char *sq_ring;
+    size_t sq_ring_size;
+    char *sqes;
+    size_t sqes_size;
+    size_t sqe_size;
+    struct io_sqring_offsets sq_off;
+    int has_sq_array;
+};
 
-#ifdef __GLIBC__
-WRAP_VERSTAT(__x,);
-WRAP_VERSTAT(__x, 64);
-WRAP_VERSTAT(__lx,);
-WRAP_VERSTAT(__lx, 64);
+static fd_map io_uring_fds;
 
-#ifdef HAVE_FXSTATAT
-WRAP_VERFSTATAT(__,);
-WRAP_VERFSTATAT(__,64);
+static long
+io_uring_emulate_setup(unsigned entries, struct io_uring_params *p)
+{
+    libc_func(syscall, long, long, ...);
+    libc_func(mmap, void *, void *, size_t, int, int, int, off_t);
+    libc_func(munmap, int, void *, size_t);
+    struct io_uring_info *info;
+    int orig_errno;
+    long fd;
+
+    fd = _syscall(__NR_io_uring_setup, entries, p);
+    if (fd < 0 || getenv("UMOCKDEV_DIR") == NULL)
+	return fd;
+
+    /* with these the kernel does not get the SQEs from io_uring_enter() */
+#ifdef IORING_SETUP_NO_MMAP
+    if (p->flags & IORING_SETUP_NO_MMAP) {
+	DBG(DBG_IOCTL, "io_uring fd %li: user provided rings are not intercepted\n", fd);
+	return fd;
+    }
 #endif
+    if (p->flags & IORING_SETUP_SQPOLL) {
+	DBG(DBG_IOCTL, "io_uring fd %li: SQPOLL rings are not intercepted\n", fd);
+	return fd;
+    }
 
-int statx(int dirfd, const char *pathname, int flags, unsigned mask, struct statx * stx)
-{
-    const char *p;
-    libc_func(statx, int, int, const char *, int, unsigned, struct statx *);
-    int r;
+    orig_errno = errno;
+    info = calloc(1, sizeof(struct io_uring_info));
+    info->sq_off = p->sq_off;
+    info->has_sq_array = 1;
+#ifdef IORING_SETUP_NO_SQARRAY
+    if (p->flags & IORING_SETUP_NO_SQARRAY)
+	info->has_sq_array = 0;
+#endif
+    info->sqe_size = (p->flags & IORING_SETUP_SQE128) ? 2 * sizeof(struct io_uring_sqe) : sizeof(struct io_uring_sqe);
+
+    /* same sizes as liburing maps */
+    info->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(__u32);
+    if ((p->features & IORING_FEAT_SINGLE_MMAP) && p->cq_off.cqes > info->sq_ring_size)
+	info->sq_ring_size = p->cq_off.cqes;
+    info->sqes_size = p->sq_entries * info->sqe_size;
+
+    info->sq_ring = _mmap(NULL, info->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  fd, IORING_OFF_SQ_RING);
+    info->sqes = _mmap(NULL, info->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       fd, IORING_OFF_SQES);
+    if (info->sq_ring == MAP_FAILED || info->sqes == MAP_FAILED) {
+	DBG(DBG_IOCTL, "io_uring fd %li: cannot map submission queue, not intercepting: %m\n", fd);
+	if (info->sq_ring != MAP_FAILED)
+	    _munmap(info->sq_ring, info->sq_ring_size);
+	if (info->sqes != MAP_FAILED)
+	    _munmap(info->sqes, info->sqes_size);
+	free(info);
+	errno = orig_errno;
+	return fd;
+    }
 
-    TRAP_PATH_LOCK;
-    p = trap_path(pathname);
-    DBG(DBG_PATH, "testbed wrapped statx (%s) -> %s\n", pathname, p ?: "NULL");
-    if (p == NULL)
-        r = -1;
-    else
-        r = _statx(dirfd, p, flags, mask, stx);
-    TRAP_PATH_UNLOCK;
+    IOCTL_LOCK;
+    fd_map_add(&io_uring_fds, fd, info);
+    IOCTL_UNLOCK;
+    DBG(DBG_IOCTL, "io_uring fd %li: intercepting %u SQ entries\n", fd, p->sq_entries);
+    errno = orig_errno;
+    return fd;
+}
 
-    if (r == 0 && p != pathname && strncmp(pathname, "/dev/", 5) == 0
-            && is_emulated_device(p, stx->stx_mode)) {
-        if (stx->stx_mode & S_ISVTX) {
-            stx->stx_mode = S_IFBLK | (stx->stx_mode & ~S_IFMT);
-            DBG(DBG_PATH, "  %s is an emulated block device (statx)\n", pathname);
-        } else {
-            stx->stx_mode = S_IFCHR | (stx->stx_mode & ~S_IFMT);
-            DBG(DBG_PATH, "  %s is an emulated char device (statx)\n", pathname);
-        }
-	unsigned maj, min;
-	if (get_rdev_maj_min(pathname + 5, &maj, &min)) {
-	    stx->stx_rdev_major = maj;
-	    stx->stx_rdev_minor = min;
-	} else {
-	    stx->stx_rdev_major = stx->stx_rdev_minor = 0;
-	}
+static void
+io_uring_close(int fd)
+{
+    libc_func(munmap, int, void *, size_t);
+    struct io_uring_info *info;
 
+    IOCTL_LOCK;
+    if (fd_map_get(&io_uring_fds, fd, (const void **) &info)) {
+	fd_map_remove(&io_uring_fds, fd);
+	IOCTL_UNLOCK;
+	_munmap(info->sq_ring, info->sq_ring_size);
+	_munmap(info->sqes, info->sqes_size);
+	free(info);
+	return;
     }
-    return r;
+    IOCTL_UNLOCK;
 }
 
-static bool is_dir_or_contained(const char *path, const char *dir, const char *subdir)
+/* Whether the handler of the emulated fd is known to ignore offsets */
+static int
+io_uring_fd_is_stream(int fd)
 {
-    if (!path || !dir)
-	return false;
+    struct ioctl_fd_info *fdinfo;
+    int res;
 
-    const ssize_t subdir_len = strlen(subdir);
-    const size_t dir_len = strlen(dir);
+    IOCTL_LOCK;
+    res = fd_map_get(&ioctl_wrapped_fds, fd, (const void **)&fdinfo) && fdinfo->stream;
+    IOCTL_UNLOCK;
+    return res;
+}
 
-    return (dir_len + subdir_len <= strlen(path) &&
-	    strncmp(path, dir, dir_len) == 0 &&
-	    strncmp(path + dir_len, subdir, subdir_len) == 0 &&
-	    (path[dir_len + subdir_len] == '\0' || path[dir_len + subdir_len] == '/'));
+/* Returns the result like read()/write() do, or UNHANDLED if fd is not an
+ * emulated device (or only its ioctls are) */
+static long
+io_uring_emulate_rw(int fd, int is_write, void *buf, size_t len, __u64 off)
+{
+    long res;
+
+    /* offset -1 means the current file position; like the kernel does for
+     * stream files, ignore the offset on devices whose handler does not
+     * serve data by position (it answers pread() with UNHANDLED) */
+    if (off != (__u64) -1 && !io_uring_fd_is_stream(fd)) {
+	res = remote_emulate_fd(fd, is_write ? IOCTL_REQ_PWRITE : IOCTL_REQ_PREAD,
+				(long) buf, (long) len, (int64_t) off, NULL);
+	if (res != UNHANDLED || !io_uring_fd_is_stream(fd))
+	    return res;
+    }
+    return remote_emulate_fd(fd, is_write ? IOCTL_REQ_WRITE : IOCTL_REQ_READ,
+			     (long) buf, (long) len, 0, NULL);
 }
 
-static bool is_fd_in_mock(int fd, const char *subdir)
+static long
+io_uring_emulate_rwv(int fd, int is_write, const struct iovec *iov, unsigned count, __u64 off)
 {
-    static char fdpath[PATH_MAX];
-    static char linkpath[PATH_MAX];
-    libc_func(readlink, ssize_t, const char*, char *, size_t);
+    long res = 0, total = 0;
+    unsigned i;
 
-    snprintf(fdpath, sizeof fdpath, "/proc/self/fd/%i", fd);
-    int orig_errno = errno;
-    ssize_t linklen = _readlink(fdpath, linkpath, sizeof linkpath);
-    errno = orig_errno;
-    if (linklen < 0 || linklen >= sizeof linkpath) {
-	perror("umockdev: failed to map fd to a path");
-	return false;
+    for (i = 0; i < count; ++i) {
+	res = io_uring_emulate_rw(fd, is_write, iov[i].iov_base, iov[i].iov_len, off);
+	if (res < 0)
+	    return total > 0 ? total : res;
+	total += res;
+	if ((size_t) res < iov[i].iov_len)
+	    break;
+	if (off != (__u64) -1)
+	    off += res;
     }
-    linkpath[linklen] = '\0';
-
-    return is_dir_or_contained(linkpath, getenv("UMOCKDEV_DIR"), subdir);
+    return total;
 }
 
-#define WRAP_FSTATFS(suffix) \
-int fstatfs ## suffix(int fd, struct statfs ## suffix *buf)	\
-{ \
-    libc_func(fstatfs ## suffix, int, int, struct statfs ## suffix *buf); \
-    int r = _fstatfs ## suffix(fd, buf);			\
-    if (r == 0 && is_fd_in_mock (fd, "/sys")) {			\
-	DBG(DBG_PATH, "testbed wrapped fstatfs64 (%i) points into mocked /sys; adjusting f_type\n", fd); \
-	buf->f_type = SYSFS_MAGIC;				\
-    }								\
-    return r;							\
-}
+/* Our own ring for posting CQEs to the programs' rings with
+ * IORING_OP_MSG_RING from other threads; forked children set up their own. */
+static struct {
+    pthread_mutex_t lock;
+    pid_t pid;
+    int fd;
+    char *sq_ring;
+    char *cq_ring;
+    struct io_uring_sqe *sqes;
+    struct io_sqring_offsets sq_off;
+    struct io_cqring_offsets cq_off;
+} io_uring_poster = { PTHREAD_MUTEX_INITIALIZER, 0, -1, NULL, NULL, NULL };
 
-WRAP_FSTATFS();
-WRAP_FSTATFS(64);
+static int
+io_uring_poster_init(void)
+{
+    libc_func(syscall, long, long, ...);
+    libc_func(mmap, void *, void *, size_t, int, int, int, off_t);
+    libc_func(munmap, int, void *, size_t);
+    libc_func(close, int, int);
+    struct io_uring_params p;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    int fd;
 
-#define WRAP_STATFS(suffix) \
-int statfs ## suffix(const char *path, struct statfs ## suffix *buf) {	\
-    libc_func(statfs ## suffix, int, const char*, struct statfs ## suffix *buf); \
-    int r;								\
-    TRAP_PATH_LOCK;							\
-    const char *p = trap_path(path);					\
-    if (p == NULL || p == path) {					\
-	r = _statfs ## suffix(path, buf);				\
-	TRAP_PATH_UNLOCK;						\
-	return r;							\
-    } \
-    DBG(DBG_PATH, "testbed wrapped statfs" #suffix "(%s) -> %s\n", path, p); \
-    r = _statfs ## suffix(p, buf);					\
-    TRAP_PATH_UNLOCK;							\
-    if (r == 0 && is_dir_or_contained(path, "/sys", ""))		\
-	buf->f_type = SYSFS_MAGIC;					\
-    return r;								\
+    memset(&p, 0, sizeof p);
+    fd = _syscall(__NR_io_uring_setup, 1, &p);
+    if (fd < 0)
+	return -1;
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(__u32);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    io_uring_poster.sq_ring = _mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				    fd, IORING_OFF_SQ_RING);
+    io_uring_poster.cq_ring = _mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				    fd, IORING_OFF_CQ_RING);
+    io_uring_poster.sqes = _mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				 fd, IORING_OFF_SQES);
+    if (io_uring_poster.sq_ring == MAP_FAILED || io_uring_poster.cq_ring == MAP_FAILED ||
+	io_uring_poster.sqes == MAP_FAILED) {
+	int orig_errno = errno;
+	if (io_uring_poster.sq_ring != MAP_FAILED)
+	    _munmap(io_uring_poster.sq_ring, sq_ring_size);
+	if (io_uring_poster.cq_ring != MAP_FAILED)
+	    _munmap(io_uring_poster.cq_ring, cq_ring_size);
+	if (io_uring_poster.sqes != MAP_FAILED)
+	    _munmap(io_uring_poster.sqes, sqes_size);
+	_close(fd);
+	errno = orig_errno;
+	return -1;
+    }
+
+    /* the parent's ring and mappings, if any, are the parent's business */
+    io_uring_poster.fd = fd;
+    io_uring_poster.pid = getpid();
+    io_uring_poster.sq_off = p.sq_off;
+    io_uring_poster.cq_off = p.cq_off;
+    return 0;
 }
 
-WRAP_STATFS();
-WRAP_STATFS(64);
+/* Post a CQE with res and user_data to ring; returns 0, or -1 with errno set */
+static int
+io_uring_post(int ring, __u64 user_data, long res)
+{
+    libc_func(syscall, long, long, ...);
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned tail, head, mask;
+    long ret;
+
+    pthread_mutex_lock(&io_uring_poster.lock);
+    if (io_uring_poster.pid != getpid() && io_uring_poster_init() < 0) {
+	pthread_mutex_unlock(&io_uring_poster.lock);
+	return -1;
+    }
 
-#endif
+    sqe = io_uring_poster.sqes;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_MSG_RING;
+    sqe->fd = ring;
+    sqe->addr = IORING_MSG_DATA;
+    sqe->len = (__u32) res;
+    sqe->off = user_data;
+
+    tail = *(unsigned *) (io_uring_poster.sq_ring + io_uring_poster.sq_off.tail);
+    mask = *(unsigned *) (io_uring_poster.sq_ring + io_uring_poster.sq_off.ring_mask);
+    ((unsigned *) (io_uring_poster.sq_ring + io_uring_poster.sq_off.array))[tail & mask] = 0;
+    __atomic_store_n((unsigned *) (io_uring_poster.sq_ring + io_uring_poster.sq_off.tail), tail + 1, __ATOMIC_RELEASE);
+
+    do
+	ret = _syscall(__NR_io_uring_enter, io_uring_poster.fd, 1, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    while (ret < 0 && errno == EINTR);
+
+    /* the CQE of the message itself */
+    head = *(unsigned *) (io_uring_poster.cq_ring + io_uring_poster.cq_off.head);
+    if (head != __atomic_load_n((unsigned *) (io_uring_poster.cq_ring + io_uring_poster.cq_off.tail), __ATOMIC_ACQUIRE)) {
+	mask = *(unsigned *) (io_uring_poster.cq_ring + io_uring_poster.cq_off.ring_mask);
+	cqe = (struct io_uring_cqe *) (io_uring_poster.cq_ring + io_uring_poster.cq_off.cqes) + (head & mask);
+	if (cqe->res < 0) {
+	    ret = -1;
+	    errno = -cqe->res;
+	}
+	__atomic_store_n((unsigned *) (io_uring_poster.cq_ring + io_uring_poster.cq_off.head), head + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&io_uring_poster.lock);
+    return ret < 0 ? -1 : 0;
+}
 
-int __open_2(const char *path, int flags);
-int __open64_2(const char *path, int flags);
+/* An emulated read or write which may wait for the device; it runs in a
+ * thread of its own, with dups of the ring and the eventfd which its SQE
+ * polls in the meantime */
+struct io_uring_async_op {
+    int ring;
+    int efd;
+    int fd;
+    int is_write;
+    void *buf;
+    struct iovec *iov;
+    unsigned len;
+    __u64 off;
+    __u64 user_data;
+};
 
-WRAP_OPEN(,);
-WRAP_OPEN2(__,_2);
+static void *
+io_uring_async_run(void *data)
+{
+    libc_func(write, ssize_t, int, const void *, size_t);
+    libc_func(close, int, int);
+    struct io_uring_async_op *op = data;
+    uint64_t one = 1;
+    long res;
 
-/* wrapper template for openat family; intercept opening /sys from the root dir */
-#define WRAP_OPENAT(prefix, suffix) \
-int prefix ## openat ## suffix (int dirfd, const char *pathname, int flags, ...)		\
-{ \
-    const char *p = NULL;									\
-    libc_func(prefix ## openat ## suffix, int, int, const char *, int, ...);			\
-    libc_func(readlink, ssize_t, const char*, char *, size_t);					\
-    int trapped = 0, ret;									\
-    TRAP_PATH_LOCK;										\
-  \
-    if (strncmp(pathname, "sys", 3) == 0 && (pathname[3] == '/' || pathname[3] == '\0')) {	\
-        static char buf[PATH_MAX],link[PATH_MAX];						\
-        snprintf(buf, sizeof(buf), "/proc/self/fd/%d", dirfd);					\
-        if (_readlink(buf, link, sizeof(link)) == 1 && link[0] == '/') {			\
-            trapped = 1;									\
-            strncpy(link + 1, pathname, sizeof(link) - 2);					\
-            buf[sizeof(link) - 1] = 0;								\
-            p = trap_path(link);								\
-        } \
-    } \
-  \
-    if (!trapped)										\
-        p = trap_path(pathname);								\
-    if (p == NULL) { TRAP_PATH_UNLOCK; return -1; }						\
-    DBG(DBG_PATH, "testbed wrapped " #prefix "openat" #suffix "(%s) -> %s\n", pathname, p);	\
-    if (flags & (O_CREAT | O_TMPFILE)) {							\
-	mode_t mode;										\
-	va_list ap;										\
-	va_start(ap, flags);									\
-	mode = va_arg(ap, mode_t);								\
-	va_end(ap);										\
-	ret = _ ## prefix ## openat ## suffix(dirfd, p, flags, mode);				\
-    } else											\
-	ret =  _ ## prefix ## openat ## suffix(dirfd, p, flags);				\
-    TRAP_PATH_UNLOCK;										\
-    return ret;											\
+    if (op->iov != NULL)
+	res = io_uring_emulate_rwv(op->fd, op->is_write, op->iov, op->len, op->off);
+    else
+	res = io_uring_emulate_rw(op->fd, op->is_write, op->buf, op->len, op->off);
+    /* the fd got closed in the meantime */
+    if (res == UNHANDLED)
+	res = -EBADF;
+    else if (res < 0)
+	res = -errno;
+    DBG(DBG_IOCTL, "io_uring fd %i: emulated I/O on fd %i in the background, result %li\n", op->ring, op->fd, res);
+
+    /* post the result first, then let SQEs which wait for this one go on */
+    if (io_uring_post(op->ring, op->user_data, res) < 0)
+	fprintf(stderr, "ERROR: libumockdev-preload: cannot post io_uring completion for fd %i: %m\n", op->fd);
+    if (_write(op->efd, &one, sizeof one) < 0)
+	fprintf(stderr, "ERROR: libumockdev-preload: cannot signal io_uring completion for fd %i: %m\n", op->fd);
+
+    _close(op->efd);
+    _close(op->ring);
+    free(op->iov);
+    free(op);
+    return NULL;
 }
 
-WRAP_OPENAT(,);
+/* Start the emulation of a read or write SQE in the background, and turn
+ * the SQE into a poll of an eventfd which gets signalled when it is done;
+ * SQEs linked after it thus still wait for it. Returns the eventfd, which
+ * must stay open until the SQE got submitted, or -1 if the emulation has to
+ * run right away. */
+static int
+io_uring_emulate_async(int ring, struct io_uring_sqe *sqe)
+{
+    libc_func(fcntl, int, int, int, ...);
+    libc_func(close, int, int);
+    struct io_uring_async_op *op;
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t sig_set, sig_restore;
+    __u64 user_data = sqe->user_data;
+    __u8 flags;
+    int efd, res;
+
+    efd = eventfd(0, EFD_CLOEXEC);
+    if (efd < 0)
+	return -1;
+
+    op = callocx(1, sizeof(struct io_uring_async_op));
+    op->fd = sqe->fd;
+    op->is_write = sqe->opcode == IORING_OP_WRITE || sqe->opcode == IORING_OP_WRITE_FIXED ||
+		   sqe->opcode == IORING_OP_WRITEV;
+    op->len = sqe->len;
+    op->off = sqe->off;
+    op->user_data = user_data;
+    /* the kernel copies the iovecs on submission, so must we */
+    if (sqe->opcode == IORING_OP_READV || sqe->opcode == IORING_OP_WRITEV) {
+	op->iov = mallocx(sqe->len * sizeof(struct iovec));
+	memcpy(op->iov, (const void *) (uintptr_t) sqe->addr, sqe->len * sizeof(struct iovec));
+    } else {
+	op->buf = (void *) (uintptr_t) sqe->addr;
+    }
+    op->efd = _fcntl(efd, F_DUPFD_CLOEXEC, 0);
+    op->ring = _fcntl(ring, F_DUPFD_CLOEXEC, 0);
 
-#ifdef __GLIBC__
-WRAP_OPEN(, 64);
-WRAP_OPEN2(__,64_2);
-WRAP_OPENAT(, 64);
+    /* the thread must not get the program's signals */
+    sigfillset(&sig_set);
+    pthread_sigmask(SIG_SETMASK, &sig_set, &sig_restore);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    res = (op->efd < 0 || op->ring < 0) ? -1 : pthread_create(&thread, &attr, io_uring_async_run, op);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &sig_restore, NULL);
+    if (res != 0) {
+	if (op->efd >= 0)
+	    _close(op->efd);
+	if (op->ring >= 0)
+	    _close(op->ring);
+	_close(efd);
+	free(op->iov);
+	free(op);
+	return -1;
+    }
+
+    /* the link flags stay, as for the messages of the other emulated SQEs;
+     * the CQE comes from the thread */
+    flags = (sqe->flags & (IOSQE_IO_LINK | IOSQE_IO_HARDLINK)) | IOSQE_CQE_SKIP_SUCCESS;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->flags = flags;
+    sqe->fd = efd;
+    /* the kernel swaps the halfwords back on big endian */
+#if __BYTE_ORDER == __BIG_ENDIAN
+    sqe->poll32_events = POLLIN << 16;
+#else
+    sqe->poll32_events = POLLIN;
 #endif
+    sqe->user_data = user_data;
+    return efd;
+}
 
-int
-inotify_add_watch(int fd, const char *path, uint32_t mask)
+/* Whether the op of an SQE on fd would be emulated */
+static int
+io_uring_fd_is_emulated(int fd, int is_ioctl)
 {
-    const char *p;
-    libc_func(inotify_add_watch, int, int, const char*, uint32_t);
-    int r;
+    struct ioctl_fd_info *fdinfo;
+    int res;
 
-    TRAP_PATH_LOCK;
-    p = trap_path(path);
-    if (p == NULL)
-	r = -1;
-    else
-	r = _inotify_add_watch(fd, p, mask);
-    TRAP_PATH_UNLOCK;
-    return r;
+    IOCTL_LOCK;
+    res = fd_map_get(&ioctl_wrapped_fds, fd, (const void **)&fdinfo) && (is_ioctl || !fdinfo->ioctl_only);
+    IOCTL_UNLOCK;
+    return res;
 }
 
-ssize_t readlinkat(int dirfd, const char *pathname, char *buf, size_t bufsiz)
+/* Whether I/O on the emulated fd may wait for the device */
+static int
+io_uring_fd_may_block(int fd)
 {
-    const char *p;
-    libc_func(readlinkat, size_t, int, const char*, char*, size_t);
-    size_t r;
+    libc_func(fcntl, int, int, int, ...);
+    int fl;
 
-    TRAP_PATH_LOCK;
-    p = trap_path(pathname);
-    DBG(DBG_PATH, "testbed wrapped readlinkat (%s) -> %s\n", pathname, p ?: "NULL");
-    if (p == NULL)
-	r = -1;
-    else
-	r = _readlinkat(dirfd, p, buf, bufsiz);
-    TRAP_PATH_UNLOCK;
-    return r;
+    if (!io_uring_fd_is_emulated(fd, 0))
+	return 0;
+    fl = _fcntl(fd, F_GETFL);
+    return fl >= 0 && !(fl & O_NONBLOCK);
 }
 
-/* A readlinkat fortify wrapper that is used when -D_FORTIFY_SOURCE is used. */
-ssize_t __readlinkat_chk(int dirfd, const char *pathname, char *buf, size_t bufsiz, size_t buflen);
-ssize_t __readlinkat_chk(int dirfd, const char *pathname, char *buf, size_t bufsiz, size_t buflen)
+/* Run an SQE on an emulated device and turn it into a message to our own
+ * ring, which posts a CQE with its result and user_data; other SQEs are left
+ * alone for the kernel. Reads and writes on blocking fds run in the
+ * background instead (see io_uring_emulate_async()); on non-blocking fds,
+ * handlers answer with EAGAIN instead of waiting.
+ * Only SQEs which have to wait for others (linked after one, or
+ * IOSQE_IO_DRAIN) are rejected, with EOPNOTSUPP; linked is set if the
+ * previous SQE links to this one. Returns an eventfd to close once the SQE
+ * got submitted, or -1. */
+static int
+io_uring_emulate_sqe(int ring, struct io_uring_sqe *sqe, int linked)
 {
-    return readlinkat(dirfd, pathname, buf, bufsiz);
-}
+    __u64 user_data;
+    __u8 flags;
+    long res;
+    int efd;
+
+    if (sqe->flags & IOSQE_FIXED_FILE)
+	return -1;
+
+    if (linked || (sqe->flags & IOSQE_IO_DRAIN)) {
+	switch (sqe->opcode) {
+	    case IORING_OP_READ:
+	    case IORING_OP_READ_FIXED:
+	    case IORING_OP_WRITE:
+	    case IORING_OP_WRITE_FIXED:
+	    case IORING_OP_READV:
+	    case IORING_OP_WRITEV:
+		if (!io_uring_fd_is_emulated(sqe->fd, 0))
+		    return -1;
+		break;
+	    case IORING_OP_URING_CMD:
+		if (!io_uring_fd_is_emulated(sqe->fd, 1))
+		    return -1;
+		break;
+	    default:
+		return -1;
+	}
+	DBG(DBG_IOCTL, "io_uring fd %i: cannot emulate linked or drained opcode %u on fd %i\n",
+	    ring, sqe->opcode, sqe->fd);
+	res = -EOPNOTSUPP;
+	goto post;
+    }
 
-WRAP_2ARGS_PATHRET(char *, NULL, realpath, char *);
+    switch (sqe->opcode) {
+	case IORING_OP_READ:
+	case IORING_OP_READ_FIXED:
+	case IORING_OP_WRITE:
+	case IORING_OP_WRITE_FIXED:
+	case IORING_OP_READV:
+	case IORING_OP_WRITEV:
+	    if (io_uring_fd_may_block(sqe->fd) && (efd = io_uring_emulate_async(ring, sqe)) >= 0) {
+		DBG(DBG_IOCTL, "io_uring fd %i: emulating opcode %u in the background\n", ring, sqe->opcode);
+		return efd;
+	    }
+	    break;
+	default:
+	    break;
+    }
 
-char *__realpath_chk(const char *path, char *resolved, size_t size);
-WRAP_3ARGS_PATHRET(char *, NULL, __realpath_chk, char *, size_t);
+    switch (sqe->opcode) {
+	case IORING_OP_READ:
+	case IORING_OP_READ_FIXED:
+	case IORING_OP_WRITE:
+	case IORING_OP_WRITE_FIXED:
+	    res = io_uring_emulate_rw(sqe->fd, sqe->opcode == IORING_OP_WRITE || sqe->opcode == IORING_OP_WRITE_FIXED,
+				      (void *) (uintptr_t) sqe->addr, sqe->len, sqe->off);
+	    break;
 
-#ifdef __GLIBC__
-WRAP_1ARG_PATHRET(char *, NULL, canonicalize_file_name);
-#endif
+	case IORING_OP_READV:
+	case IORING_OP_WRITEV:
+	    res = io_uring_emulate_rwv(sqe->fd, sqe->opcode == IORING_OP_WRITEV,
+				       (const struct iovec *) (uintptr_t) sqe->addr, sqe->len, sqe->off);
+	    break;
 
-char *
-getcwd(char *buf, size_t size)
-{
-    libc_func (getcwd, char*, char*, size_t);
-    const char *prefix = getenv("UMOCKDEV_DIR");
-    char *r = _getcwd (buf, size);
+	case IORING_OP_URING_CMD:
+	    /* passed on as ioctl with the inline command data as argument */
+	    res = remote_emulate(sqe->fd, IOCTL_REQ_IOCTL, sqe->cmd_op, (long) sqe->cmd);
+	    break;
 
-    if (prefix != NULL && r != NULL) {
-	size_t prefix_len = strlen (prefix);
-	if (strncmp (r, prefix, prefix_len) == 0) {
-	    DBG(DBG_PATH, "testbed wrapped getcwd: %s -> %s\n", r, r + prefix_len);
-	    memmove(r, r + prefix_len, strlen(r) - prefix_len + 1); \
-	}
+	default:
+	    return -1;
     }
-    return r;
+
+    if (res == UNHANDLED)
+	return -1;
+    if (res < 0)
+	res = -errno;
+    DBG(DBG_IOCTL, "io_uring fd %i: emulated opcode %u on fd %i, result %li\n", ring, sqe->opcode, sqe->fd, res);
+
+post:
+    /* the link flags stay, so that the rest of a chain behaves as usual */
+    user_data = sqe->user_data;
+    flags = sqe->flags & (IOSQE_IO_LINK | IOSQE_IO_HARDLINK | IOSQE_IO_DRAIN);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_MSG_RING;
+    sqe->flags = flags | IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd = ring;
+    sqe->addr = IORING_MSG_DATA;
+    sqe->len = (__u32) res;
+    sqe->off = user_data;
+    /* in case the message fails, that gets reported for the original SQE */
+    sqe->user_data = user_data;
+    return -1;
 }
 
-char * __getcwd_chk(char *buf, size_t size, size_t buflen);
-char *
-__getcwd_chk(char *buf, size_t size, size_t buflen)
+static long
+io_uring_emulate_enter(int ring, unsigned to_submit, unsigned min_complete, unsigned flags, long arg, long argsz)
 {
-    libc_func (__getcwd_chk, char*, char*, size_t, size_t);
-    const char *prefix = getenv("UMOCKDEV_DIR");
-    char *r = ___getcwd_chk (buf, size, buflen);
+    libc_func(syscall, long, long, ...);
+    libc_func(close, int, int);
+    struct io_uring_info *info = NULL;
+    /* eventfds polled by SQEs of background emulations, by batch position */
+    int *efds = NULL;
+    unsigned i;
+    long res;
+
+    if (to_submit > 0 && !(flags & IORING_ENTER_REGISTERED_RING)) {
+	IOCTL_LOCK;
+	fd_map_get(&io_uring_fds, ring, (const void **) &info);
+	IOCTL_UNLOCK;
+    }
 
-    if (prefix != NULL && r != NULL) {
-	size_t prefix_len = strlen (prefix);
-	if (strncmp (r, prefix, prefix_len) == 0) {
-	    DBG(DBG_PATH, "testbed wrapped __getcwd_chk: %s -> %s\n", r, r + prefix_len);
-	    memmove(r, r + prefix_len, strlen(r) - prefix_len + 1); \
+    if (info != NULL) {
+	int orig_errno = errno;
+	unsigned head = __atomic_load_n((unsigned *) (info->sq_ring + info->sq_off.head), __ATOMIC_ACQUIRE);
+	unsigned tail = __atomic_load_n((unsigned *) (info->sq_ring + info->sq_off.tail), __ATOMIC_ACQUIRE);
+	unsigned mask = *(unsigned *) (info->sq_ring + info->sq_off.ring_mask);
+	const unsigned *array = (const unsigned *) (info->sq_ring + info->sq_off.array);
+	unsigned idx;
+	struct io_uring_sqe *sqe;
+	__u8 sqe_flags;
+	int linked = 0;
+
+	efds = mallocx(to_submit * sizeof(int));
+	/* handle the whole batch before the kernel gets the rest of it */
+	for (i = 0; i < to_submit; ++i) {
+	    efds[i] = -1;
+	    if (head + i == tail)
+		continue;
+	    idx = (head + i) & mask;
+	    if (info->has_sq_array)
+		idx = array[idx];
+	    /* the kernel drops invalid indexes */
+	    if (idx > mask)
+		continue;
+	    sqe = (struct io_uring_sqe *) (info->sqes + idx * info->sqe_size);
+	    /* read the flags first, the SQE may get rewritten */
+	    sqe_flags = sqe->flags;
+	    efds[i] = io_uring_emulate_sqe(ring, sqe, linked);
+	    linked = (sqe_flags & (IOSQE_IO_LINK | IOSQE_IO_HARDLINK)) != 0;
+	}
+	errno = orig_errno;
+    }
+
+    res = _syscall(__NR_io_uring_enter, ring, to_submit, min_complete, flags, arg, argsz);
+
+    if (efds != NULL) {
+	int orig_errno = errno;
+	/* the kernel holds on to the eventfds of submitted polls; the ones of
+	 * SQEs which did not get submitted must stay for a later call */
+	for (i = 0; i < to_submit; ++i) {
+	    if (efds[i] >= 0 && res >= 0 && i < (unsigned long) res)
+		_close(efds[i]);
 	}
+	free(efds);
+	errno = orig_errno;
     }
-    return r;
+    return res;
 }
 
-ssize_t
-read(int fd, void *buf, size_t count)
+/* Rings which are not set up through syscall(), like the ones of liburing
+ * unless it was configured with --use-libc, are not intercepted, so their
+ * I/O on emulated devices goes to the device nodes. Tell about it once, when
+ * there is such a ring as well as an emulated device. */
+static void
+io_uring_warn_foreign_rings(void)
 {
-    libc_func(read, ssize_t, int, void *, size_t);
-    ssize_t res;
+    libc_func(opendir, DIR *, const char *);
+    libc_func(readlink, ssize_t, const char*, char*, size_t);
+    static int warned = 0;
+    struct dirent *entry;
+    char link[64], target[64];
+    int orig_errno, emulated = 0, fd, i;
+    ssize_t len;
+    DIR *dir;
+
+    if (__atomic_load_n(&warned, __ATOMIC_RELAXED))
+	return;
 
-    res = remote_emulate(fd, IOCTL_REQ_READ, (long) buf, (long) count);
-    if (res != UNHANDLED) {
-	DBG(DBG_IOCTL, "ioctl fd %i read of %d bytes: emulated, result %i\n", fd, (int) count, (int) res);
-	return res;
+    IOCTL_LOCK;
+    for (i = 0; i < FD_MAP_MAX; ++i)
+	emulated |= ioctl_wrapped_fds.set[i];
+    IOCTL_UNLOCK;
+    if (!emulated)
+	return;
+
+    orig_errno = errno;
+    dir = _opendir("/proc/self/fd");
+    if (dir == NULL) {
+	errno = orig_errno;
+	return;
     }
-    res = _read(fd, buf, count);
-    script_record_op('r', fd, buf, res);
+    while ((entry = readdir(dir)) != NULL) {
+	if (entry->d_name[0] == '.')
+	    continue;
+	snprintf(link, sizeof(link), "/proc/self/fd/%s", entry->d_name);
+	len = _readlink(link, target, sizeof(target) - 1);
+	if (len < 0)
+	    continue;
+	target[len] = '\0';
+	if (strcmp(target, "anon_inode:[io_uring]") != 0)
+	    continue;
+
+	fd = atoi(entry->d_name);
+	IOCTL_LOCK;
+	emulated = fd_map_get(&io_uring_fds, fd, NULL);
+	IOCTL_UNLOCK;
+	if (emulated || fd == __atomic_load_n(&io_uring_poster.fd, __ATOMIC_RELAXED))
+	    continue;
+
+	if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+	    fprintf(stderr, "WARNING: libumockdev-preload: io_uring fd %i was not set up through libc's syscall(), "
+		    "e. g. by liburing; I/O on emulated devices through it is not emulated\n", fd);
+	break;
+    }
+    closedir(dir);
+    errno = orig_errno;
+}
+
+/* liburing sets up rings with its own system calls, but these entry points
+ * are visible when it is a shared library */
+struct io_uring;
+int io_uring_queue_init_params(unsigned entries, struct io_uring *ring, struct io_uring_params *p);
+int io_uring_queue_init(unsigned entries, struct io_uring *ring, unsigned flags);
+
+int
+io_uring_queue_init_params(unsigned entries, struct io_uring *ring, struct io_uring_params *p)
+{
+    static int (*_io_uring_queue_init_params) (unsigned, struct io_uring *, struct io_uring_params *) = NULL;
+    int res;
+
+    if (_io_uring_queue_init_params == NULL)
+	_io_uring_queue_init_params = dlsym(RTLD_NEXT, "io_uring_queue_init_params");
+    if (_io_uring_queue_init_params == NULL)
+	return -ENOSYS;
+    res = _io_uring_queue_init_params(entries, ring, p);
+    if (res == 0)
+	io_uring_warn_foreign_rings();
     return res;
 }
 
-ssize_t
-write(int fd, const void *buf, size_t count)
+int
+io_uring_queue_init(unsigned entries, struct io_uring *ring, unsigned flags)
 {
-    libc_func(write, ssize_t, int, const void *, size_t);
-    ssize_t res;
+    static int (*_io_uring_queue_init) (unsigned, struct io_uring *, unsigned) = NULL;
+    int res;
 
-    res = remote_emulate(fd, IOCTL_REQ_WRITE, (long) buf, (long) count);
-    if (res != UNHANDLED) {
-	DBG(DBG_IOCTL, "ioctl fd %i write of %d bytes: emulated, result %i\n", fd, (int) count, (int) res);
-	return res;
-    }
-    res = _write(fd, buf, count);
-    script_record_op('w', fd, buf, res);
+    if (_io_uring_queue_init == NULL)
+	_io_uring_queue_init = dlsym(RTLD_NEXT, "io_uring_queue_init");
+    if (_io_uring_queue_init == NULL)
+	return -ENOSYS;
+    res = _io_uring_queue_init(entries, ring, flags);
+    if (res == 0)
+	io_uring_warn_foreign_rings();
     return res;
 }
 
+#else
+
+static void
+io_uring_close(int fd)
+{
+    (void) fd;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/* Only catches programs which go through libc for io_uring; liburing issues
+ * the system calls itself unless it was configured with --use-libc, see
+ * io_uring_warn_foreign_rings(). */
+long
+syscall(long number, ...)
+{
+    libc_func(syscall, long, long, ...);
+    va_list ap;
+    long args[6];
+    int i, nargs;
+
+    /* As with ioctl(), the varargs cannot be forwarded. Take only as many as
+     * the intercepted calls have; anything else passes on the six argument
+     * registers which the kernel may use, like libc's syscall() does. */
+    switch (number) {
+#ifdef HAVE_LINUX_IO_URING_H
+	case __NR_io_uring_setup:
+	    nargs = 2;
+	    break;
+	case __NR_io_uring_enter:
+	    nargs = 6;
+	    break;
+#endif
+	default:
+	    nargs = 6;
+	    break;
+    }
+    va_start(ap, number);
+    for (i = 0; i < nargs; ++i)
+	args[i] = va_arg(ap, long);
+    va_end(ap);
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (number == __NR_io_uring_setup)
+	return io_uring_emulate_setup(args[0], (struct io_uring_params *) args[1]);
+    if (number == __NR_io_uring_enter)
+	return io_uring_emulate_enter(args[0], args[1], args[2], args[3], args[4], args[5]);
+#endif
+
+    return _syscall(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
 size_t
 fread(void *ptr, size_t size, size_t nmemb, FILE * stream)
 {
@@ -1820,12 +5064,19 @@ int
 close(int fd)
 {
     libc_func(close, int, int);
+    int res;
 
     netlink_close(fd);
     ioctl_emulate_close(fd);
+    io_uring_close(fd);
+    sysfs_attr_close(fd);
     script_record_close(fd);
+    dir_fd_forget(fd);
 
-    return _close(fd);
+    res = _close(fd);
+    /* afterwards, so that a racing isatty() cannot cache the old fd */
+    isatty_cache_forget(fd);
+    return res;
 }
 
 int
@@ -1834,14 +5085,41 @@ fclose(FILE * stream)
     libc_func(fclose, int, FILE *);
     int fd = fileno(stream);
     if (fd >= 0) {
+	isatty_cache_forget(fd);
+	dir_fd_forget(fd);
 	netlink_close(fd);
 	ioctl_emulate_close(fd);
+	sysfs_attr_close(fd);
 	script_record_close(fd);
     }
 
     return _fclose(stream);
 }
 
+int
+dup2(int oldfd, int newfd)
+{
+    libc_func(dup2, int, int, int);
+    int res = _dup2(oldfd, newfd);
+
+    isatty_cache_forget(newfd);
+    if (res >= 0 && res != oldfd)
+	dir_fd_forget(newfd);
+    return res;
+}
+
+int
+dup3(int oldfd, int newfd, int flags)
+{
+    libc_func(dup3, int, int, int, int);
+    int res = _dup3(oldfd, newfd, flags);
+
+    isatty_cache_forget(newfd);
+    if (res >= 0 && res != oldfd)
+	dir_fd_forget(newfd);
+    return res;
+}
+
 int
 ioctl(int d, IOCTL_REQUEST_TYPE request, ...)
 {
@@ -1876,49 +5154,34 @@ int
 isatty(int fd)
 {
     libc_func(isatty, int, int);
-    libc_func(readlink, ssize_t, const char*, char*, size_t);
     int result = _isatty(fd);
-    char ttyname[1024];
-    char ptymap[PATH_MAX];
-    char majmin[20];
-    char *cp;
-    int orig_errno, r;
+    struct isatty_cache_entry *cache = NULL;
+    struct stat st;
+    int orig_errno, kind = ISATTY_UNKNOWN;
 
     if (result != 1) {
 	DBG(DBG_PATH, "isatty(%i): real function result: %i, returning that\n", fd, result);
 	return result;
     }
 
-    /* isatty() succeeds for our emulated devices, but they should not
-     * necessarily appear as TTY; so map the tty name to a major/minor, and
-     * only return 1 if it is major 4. */
     orig_errno = errno;
-    if (ttyname_r(fd, ttyname, sizeof(ttyname)) != 0) {
-	DBG(DBG_PATH, "isatty(%i): is a terminal, but ttyname() failed! %m\n", fd);
-	/* *shrug*, what can we do; return original result */
-	goto out;
-    }
-
-    DBG(DBG_PATH, "isatty(%i): is a terminal, ttyname %s\n", fd, ttyname);
-    for (cp = ttyname; *cp; ++cp)
-	if (*cp == '/')
-	    *cp = '_';
-    snprintf(ptymap, sizeof(ptymap), "%s/dev/.ptymap/%s", getenv("UMOCKDEV_DIR"), ttyname);
-    r = _readlink(ptymap, majmin, sizeof(majmin));
-    if (r < 0) {
-	/* failure here is normal for non-emulated devices */
-	DBG(DBG_PATH, "isatty(%i): readlink(%s) failed: %m\n", fd, ptymap);
-	goto out;
+    if (fd < ISATTY_CACHE_MAX && fstat(fd, &st) == 0) {
+	cache = &isatty_cache[fd];
+	if (cache->dev == st.st_dev && cache->ino == st.st_ino)
+	    kind = cache->kind;
     }
-    majmin[r] = '\0';
-    if (majmin[0] != '4' || majmin[1] != ':') {
-	DBG(DBG_PATH, "isatty(%i): major/minor is %s which is not a tty; returning 0\n", fd, majmin);
-	result = 0;
+    if (kind == ISATTY_UNKNOWN) {
+	kind = isatty_classify(fd);
+	if (cache != NULL) {
+	    cache->kind = ISATTY_UNKNOWN;
+	    cache->dev = st.st_dev;
+	    cache->ino = st.st_ino;
+	    cache->kind = kind;
+	}
     }
-
-out:
     errno = orig_errno;
-    return result;
+
+    return kind == ISATTY_TTY;
 }
 
 /* vim: set sw=4 noet: */
@@ -0,0 +1,132 @@
+/*
+ * Receive the uevents which udevd broadcasts after processing them; this is
+ * the counterpart of uevent_sender.c, for recording the real ones.
+ *
+ * umockdev is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * umockdev is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "uevent_monitor.h"
+
+#define UEVENT_BUFSIZE 16384
+/* the netlink multicast group of udevd; 1 is the kernel's */
+#define UDEV_MONITOR_GROUP 2
+#define UDEV_MONITOR_MAGIC 0xfeedcafe
+/* bursts like docking station connects produce hundreds of events at once */
+#define UEVENT_RCVBUF (16 * 1024 * 1024)
+
+struct _uevent_monitor {
+    int fd;
+};
+
+/* the fields of struct udev_monitor_netlink_header in uevent_sender.c which
+ * this needs */
+#define HEADER_MAGIC_OFFSET 8
+#define HEADER_PROPERTIES_OFFSET 16
+#define HEADER_MIN_SIZE 24
+
+/* Returns NULL and sets errno if the netlink socket cannot be set up */
+uevent_monitor *
+uevent_monitor_open(void)
+{
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = UDEV_MONITOR_GROUP };
+    int rcvbuf = UEVENT_RCVBUF;
+    uevent_monitor *m;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+	return NULL;
+
+    /* the forced size needs CAP_NET_ADMIN */
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	int orig_errno = errno;
+	close(fd);
+	errno = orig_errno;
+	return NULL;
+    }
+
+    m = callocx(1, sizeof(uevent_monitor));
+    m->fd = fd;
+    return m;
+}
+
+void
+uevent_monitor_close(uevent_monitor * monitor)
+{
+    close(monitor->fd);
+    free(monitor);
+}
+
+int
+uevent_monitor_get_fd(uevent_monitor * monitor)
+{
+    return monitor->fd;
+}
+
+/* Returns the properties of the next pending event as "KEY=VALUE" lines, or
+ * NULL if there is none. Messages which do not come from udevd are skipped. */
+char *
+uevent_monitor_receive(uevent_monitor * monitor)
+{
+    char buf[UEVENT_BUFSIZE];
+    uint32_t magic, props_off, props_len;
+    ssize_t len;
+    char *result;
+
+    for (;;) {
+	len = recv(monitor->fd, buf, sizeof(buf), 0);
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;
+	    /* ENOBUFS means that we were too slow and events got lost */
+	    if (errno == ENOBUFS) {
+		fprintf(stderr, "WARNING: uevent_monitor_receive: receive buffer overflow, events were lost\n");
+		continue;
+	    }
+	    return NULL;
+	}
+
+	if (len < HEADER_MIN_SIZE || memcmp(buf, "libudev", 8) != 0)
+	    continue;
+	memcpy(&magic, buf + HEADER_MAGIC_OFFSET, sizeof(magic));
+	memcpy(&props_off, buf + HEADER_PROPERTIES_OFFSET, sizeof(props_off));
+	memcpy(&props_len, buf + HEADER_PROPERTIES_OFFSET + sizeof(props_off), sizeof(props_len));
+	if (ntohl(magic) != UDEV_MONITOR_MAGIC || props_off > len || props_len > len - props_off)
+	    continue;
+	break;
+    }
+
+    /* NUL separated properties to lines */
+    result = mallocx(props_len + 1);
+    memcpy(result, buf + props_off, props_len);
+    for (uint32_t i = 0; i < props_len; ++i)
+	if (result[i] == '\0')
+	    result[i] = '\n';
+    result[props_len] = '\0';
+    return result;
+}
@@ -0,0 +1,26 @@
+/*
+ * umockdev is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * umockdev is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __UEVENT_MONITOR_H
+#    define __UEVENT_MONITOR_H
+
+typedef struct _uevent_monitor uevent_monitor;
+
+uevent_monitor *uevent_monitor_open(void);
+void uevent_monitor_close(uevent_monitor * monitor);
+int uevent_monitor_get_fd(uevent_monitor * monitor);
+char *uevent_monitor_receive(uevent_monitor * monitor);
+
+#endif				/* __UEVENT_MONITOR_H */
@@ -27,6 +27,7 @@
 #include <arpa/inet.h>
 #include <linux/un.h>
 #include <unistd.h>
+#include <stddef.h>
 
 #include <libudev.h>
 
@@ -38,7 +39,12 @@
 struct _uevent_sender {
     char *rootpath;
     char socket_glob[PATH_MAX];
+    /* listeners bind abstract sockets with this prefix if not NULL */
+    char *socket_prefix;
     struct udev *udev;
+    /* listeners found by uevent_sender_begin_batch(), NULL outside of a batch */
+    char **batch_listeners;
+    size_t n_batch_listeners;
 };
 
 uevent_sender *
@@ -55,6 +61,14 @@ uevent_sender_open(const char *rootpath)
     s->rootpath = strdupx(rootpath);
     s->udev = udev_new();
     snprintf(s->socket_glob, sizeof(s->socket_glob), "%s/event[0-9]*", rootpath);
+    if (getenv("UMOCKDEV_CHANNEL") != NULL) {
+	s->socket_prefix = malloc(strlen(getenv("UMOCKDEV_CHANNEL")) + 17);
+	if (!s->socket_prefix) {
+	    perror("uevent_sender_open: cannot allocate prefix");
+	    abort();
+	}
+	sprintf(s->socket_prefix, "umockdev.%s/event/", getenv("UMOCKDEV_CHANNEL"));
+    }
 
     return s;
 }
@@ -62,21 +76,31 @@ uevent_sender_open(const char *rootpath)
 void
 uevent_sender_close(uevent_sender * sender)
 {
+    uevent_sender_end_batch(sender);
     udev_unref(sender->udev);
+    free(sender->socket_prefix);
     free(sender->rootpath);
     free(sender);
 }
 
+/* path is a file, or a name in the abstract namespace if abstract is set */
 static void
-sendmsg_one(struct iovec *iov, size_t iov_len, const char *path)
+sendmsg_one(struct iovec *iov, size_t iov_len, const char *path, int abstract)
 {
     struct sockaddr_un event_addr;
+    socklen_t addr_len = sizeof(event_addr);
     int fd;
     int ret;
 
     /* create uevent socket address */
-    strncpy(event_addr.sun_path, path, sizeof(event_addr.sun_path) - 1);
+    memset(&event_addr, 0, sizeof(event_addr));
     event_addr.sun_family = AF_UNIX;
+    if (abstract) {
+	strncpy(event_addr.sun_path + 1, path, sizeof(event_addr.sun_path) - 2);
+	addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(event_addr.sun_path + 1);
+    } else {
+	strncpy(event_addr.sun_path, path, sizeof(event_addr.sun_path) - 1);
+    }
 
     /* create uevent socket */
     fd = socket(AF_UNIX, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
@@ -85,11 +109,12 @@ sendmsg_one(struct iovec *iov, size_t iov_len, const char *path)
 	abort();
     }
 
-    ret = connect(fd, (struct sockaddr *)&event_addr, sizeof(event_addr));
+    ret = connect(fd, (struct sockaddr *)&event_addr, addr_len);
     if (ret < 0) {
-	if (errno == ECONNREFUSED) {
+	if (errno == ECONNREFUSED || (abstract && errno == ENOENT)) {
 	    /* client side closed its monitor underneath us, so clean up and ignore */
-	    unlink(event_addr.sun_path);
+	    if (!abstract)
+		unlink(event_addr.sun_path);
 	    close(fd);
 	    return;
 	}
@@ -97,7 +122,7 @@ sendmsg_one(struct iovec *iov, size_t iov_len, const char *path)
 	abort();
     }
 
-    const struct msghdr msg = { .msg_name = &event_addr, .msg_iov = iov, .msg_iovlen = iov_len };
+    const struct msghdr msg = { .msg_name = &event_addr, .msg_namelen = addr_len, .msg_iov = iov, .msg_iovlen = iov_len };
     ssize_t count = sendmsg(fd, &msg, 0);
     if (count < 0) {
         perror("uevent_sender sendmsg_one: sendmsg failed");
@@ -108,21 +133,67 @@ sendmsg_one(struct iovec *iov, size_t iov_len, const char *path)
 }
 
 static void
-sendmsg_all(uevent_sender * sender, struct iovec *iov, size_t iov_len)
+add_listener(char ***listeners, size_t *n, const char *name)
+{
+    *listeners = realloc(*listeners, (*n + 1) * sizeof(char *));
+    if (*listeners == NULL) {
+	perror("uevent_sender: cannot allocate listener list");
+	abort();
+    }
+    (*listeners)[(*n)++] = strdupx(name);
+}
+
+/* Listeners in the abstract namespace cannot be globbed, but the kernel
+ * lists them (as "@name") */
+static void
+find_listeners_abstract(uevent_sender * sender, char ***listeners, size_t *n)
+{
+    char line[512];
+    char *name;
+    size_t prefix_len = strlen(sender->socket_prefix);
+    FILE *f;
+
+    f = fopen("/proc/net/unix", "re");
+    if (f == NULL) {
+	perror("uevent_sender find_listeners: cannot open /proc/net/unix");
+	abort();
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+	line[strcspn(line, "\n")] = '\0';
+	name = strrchr(line, ' ');
+	if (name == NULL || name[1] != '@' || strncmp(name + 2, sender->socket_prefix, prefix_len) != 0)
+	    continue;
+	add_listener(listeners, n, name + 2);
+    }
+
+    fclose(f);
+}
+
+static void
+find_listeners(uevent_sender * sender, char ***listeners, size_t *n)
 {
     glob_t gl;
     int res;
 
+    *listeners = NULL;
+    *n = 0;
+
+    if (sender->socket_prefix != NULL) {
+	find_listeners_abstract(sender, listeners, n);
+	return;
+    }
+
     /* find current listeners */
     res = glob(sender->socket_glob, GLOB_NOSORT, NULL, &gl);
     if (res == 0) {
 	size_t i;
 	for (i = 0; i < gl.gl_pathc; ++i)
-	    sendmsg_one(iov, iov_len, gl.gl_pathv[i]);
+	    add_listener(listeners, n, gl.gl_pathv[i]);
     } else {
 	/* ensure that we only fail due to that, not due to bad globs */
 	if (res != GLOB_NOMATCH) {
-            fprintf(stderr, "ERROR: sendmsg_all: %s glob failed with %i\n",
+            fprintf(stderr, "ERROR: find_listeners: %s glob failed with %i\n",
                     sender->socket_glob, res);
 	    abort();
 	}
@@ -131,6 +202,62 @@ sendmsg_all(uevent_sender * sender, struct iovec *iov, size_t iov_len)
     globfree(&gl);
 }
 
+static void
+free_listeners(char **listeners, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+	free(listeners[i]);
+    free(listeners);
+}
+
+static void
+sendmsg_all(uevent_sender * sender, struct iovec *iov, size_t iov_len)
+{
+    char **listeners;
+    size_t n;
+
+    if (sender->batch_listeners != NULL) {
+	listeners = sender->batch_listeners;
+	n = sender->n_batch_listeners;
+    } else {
+	find_listeners(sender, &listeners, &n);
+    }
+
+    for (size_t i = 0; i < n; ++i)
+	sendmsg_one(iov, iov_len, listeners[i], sender->socket_prefix != NULL);
+
+    if (listeners != sender->batch_listeners)
+	free_listeners(listeners, n);
+}
+
+/* Looking up the listeners is the expensive part of sending an event; in a
+ * batch, this is done only once. Listeners which get added during a batch do
+ * not see its events. */
+void
+uevent_sender_begin_batch(uevent_sender * sender)
+{
+    char **listeners;
+    size_t n;
+
+    uevent_sender_end_batch(sender);
+    find_listeners(sender, &listeners, &n);
+    /* keep a non-NULL list to mark the batch, even without listeners */
+    if (listeners == NULL)
+	listeners = callocx(1, sizeof(char *));
+    sender->batch_listeners = listeners;
+    sender->n_batch_listeners = n;
+}
+
+void
+uevent_sender_end_batch(uevent_sender * sender)
+{
+    if (sender->batch_listeners == NULL)
+	return;
+    free_listeners(sender->batch_listeners, sender->n_batch_listeners);
+    sender->batch_listeners = NULL;
+    sender->n_batch_listeners = 0;
+}
+
 #define UDEV_MONITOR_MAGIC                0xfeedcafe
 struct udev_monitor_netlink_header {
     /* "libudev" prefix to distinguish libudev and kernel messages */
@@ -230,32 +357,21 @@ append_property(char *array, size_t size, size_t offset, const char *name, const
 /* this mirrors the code from systemd/src/libsystemd/sd-device/device-monitor.c,
  * device_monitor_send_device() */
 void
-uevent_sender_send(uevent_sender * sender, const char *devpath, const char *action, const char *properties)
+uevent_sender_send_event(uevent_sender * sender, const char *devpath, const char *subsystem,
+			 const char *devtype, const char *action, const char *properties)
 {
     char buffer[UEVENT_BUFSIZE];
     size_t buffer_len = 0;
     struct iovec iov[2];
-    const char *subsystem;
-    const char *devtype;
     char seqnumstr[20];
-    struct udev_device *device;
     struct udev_monitor_netlink_header nlh;
     static unsigned long long seqnum = 1;
 
-    device = udev_device_new_from_syspath(sender->udev, devpath);
-    if (device == NULL) {
-	fprintf(stderr, "ERROR: uevent_sender_send: No such device %s\n", devpath);
-	return;
-    }
-
-    subsystem = udev_device_get_subsystem(device);
     assert(subsystem != NULL);
 
-    devtype = udev_device_get_devtype(device);
-
     /* build NUL-terminated property array */
     buffer_len += append_property(buffer, sizeof buffer, buffer_len, "ACTION=", action);
-    buffer_len += append_property(buffer, sizeof buffer, buffer_len, "DEVPATH=", udev_device_get_devpath(device));
+    buffer_len += append_property(buffer, sizeof buffer, buffer_len, "DEVPATH=", devpath);
     buffer_len += append_property(buffer, sizeof buffer, buffer_len, "SUBSYSTEM=", subsystem);
     snprintf(seqnumstr, sizeof(seqnumstr), "%llu", seqnum++);
     buffer_len += append_property(buffer, sizeof buffer, buffer_len, "SEQNUM=", seqnumstr);
@@ -286,8 +402,6 @@ uevent_sender_send(uevent_sender * sender, const char *devpath, const char *acti
     iov[0].iov_base = &nlh;
     iov[0].iov_len = sizeof(struct udev_monitor_netlink_header);
 
-    udev_device_unref(device);
-
     /* note, not setting nlh.filter_tag_bloom_{hi,lo} for now; if required, copy
      * from libudev */
 
@@ -300,3 +414,19 @@ uevent_sender_send(uevent_sender * sender, const char *devpath, const char *acti
     /* send message */
     sendmsg_all(sender, iov, 2);
 }
+
+void
+uevent_sender_send(uevent_sender * sender, const char *devpath, const char *action, const char *properties)
+{
+    struct udev_device *device;
+
+    device = udev_device_new_from_syspath(sender->udev, devpath);
+    if (device == NULL) {
+	fprintf(stderr, "ERROR: uevent_sender_send: No such device %s\n", devpath);
+	return;
+    }
+
+    uevent_sender_send_event(sender, udev_device_get_devpath(device), udev_device_get_subsystem(device),
+			     udev_device_get_devtype(device), action, properties);
+    udev_device_unref(device);
+}
@@ -24,5 +24,9 @@ typedef struct _uevent_sender uevent_sender;
 uevent_sender *uevent_sender_open(const char *rootpath);
 void uevent_sender_close(uevent_sender * sender);
 void uevent_sender_send(uevent_sender * sender, const char *devpath, const char *action, const char *properties);
+void uevent_sender_send_event(uevent_sender * sender, const char *devpath, const char *subsystem,
+			      const char *devtype, const char *action, const char *properties);
+void uevent_sender_begin_batch(uevent_sender * sender);
+void uevent_sender_end_batch(uevent_sender * sender);
 
 #endif				/* __UEVENT_SENDER_H */
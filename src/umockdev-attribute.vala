@@ -0,0 +1,63 @@
+/*
+ * Computed sysfs attributes
+ *
+ * umockdev is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * umockdev is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+namespace UMockdev {
+
+/* Serves reads of a sysfs attribute from an AttributeFunc.
+ *
+ * The preload passes on read() of attributes as pread() at the file position.
+ * Like kernfs, the value is computed when reading from the start; reads at
+ * other offsets continue in the value of that client. Writes go to the
+ * attribute file.
+ */
+internal class IoctlAttributeHandler : IoctlBase {
+    private string devpath;
+    private string name;
+    private AttributeFunc func;
+
+    public IoctlAttributeHandler(string devpath, string name, owned AttributeFunc func)
+    {
+        base ();
+
+        this.devpath = devpath;
+        this.name = name;
+        this.func = (owned) func;
+        positional_io = true;
+    }
+
+    public override bool handle_read(IoctlClient client)
+    {
+        unowned uint8[] buf = client.arg.data;
+        Bytes? value = client.get_data<Bytes>("attribute-value");
+
+        if (client.io_pos == 0 || value == null) {
+            value = new Bytes(func(devpath, name).data);
+            client.set_data<Bytes>("attribute-value", value);
+        }
+
+        size_t n = 0;
+        if (client.io_pos >= 0 && client.io_pos < value.length) {
+            n = size_t.min(buf.length, value.length - (size_t) client.io_pos);
+            Posix.memcpy(buf, (uint8*) value.get_data() + client.io_pos, n);
+        }
+
+        client.complete((long) n, 0);
+        return true;
+    }
+}
+
+}
@@ -0,0 +1,189 @@
+/*
+ * Block device emulation
+ *
+ * umockdev is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * umockdev is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+namespace UMockdev {
+
+using Ioctl;
+
+/* Emulation of a block device whose data lives in its (sparse) device node
+ * file. Clients read and write that file directly, so that positional I/O,
+ * lseek() and mmap() have the kernel's semantics; this only answers the
+ * block device ioctls and optionally throttles read/write.
+ */
+internal class IoctlBlockHandler : IoctlBase {
+    private int fd;
+    private uint64 size;
+    private uint block_size;
+    private uint latency;
+    private uint64 bandwidth;
+    /* end of the last transfer, for serializing them with a bandwidth */
+    private int64 busy_until = 0;
+
+    public IoctlBlockHandler(int fd, uint64 size, uint block_size, uint latency, uint64 bandwidth)
+    {
+        base ();
+
+        this.fd = fd;
+        this.size = size;
+        this.block_size = block_size;
+        this.latency = latency;
+        this.bandwidth = bandwidth;
+
+        ioctl_only = latency == 0 && bandwidth == 0;
+        io_passthrough = true;
+    }
+
+    ~IoctlBlockHandler()
+    {
+        Posix.close(fd);
+    }
+
+    private bool put_value(IoctlClient client, void* value, size_t len)
+    {
+        IoctlData? data = null;
+
+        try {
+            data = client.arg.resolve(0, len);
+        } catch (IOError e) {
+            warning("Error resolving IOCtl data: %s", e.message);
+            return false;
+        }
+
+        if (data == null) {
+            client.complete(-1, Posix.EFAULT);
+            return true;
+        }
+
+        Posix.memcpy(data.data, value, len);
+        client.complete(0, 0);
+        return true;
+    }
+
+    /* BLKDISCARD and BLKZEROOUT; both leave zeros behind */
+    private bool discard(IoctlClient client)
+    {
+        IoctlData? data = null;
+        uint64 range[2];
+
+        try {
+            data = client.arg.resolve(0, sizeof(uint64) * 2);
+        } catch (IOError e) {
+            warning("Error resolving IOCtl data: %s", e.message);
+            return false;
+        }
+
+        if (data == null) {
+            client.complete(-1, Posix.EFAULT);
+            return true;
+        }
+
+        Posix.memcpy(range, data.data, sizeof(uint64) * 2);
+        if (range[0] % block_size != 0 || range[1] % block_size != 0 ||
+            range[0] > size || range[1] > size - range[0]) {
+            client.complete(-1, Posix.EINVAL);
+            return true;
+        }
+
+        if (range[1] > 0 &&
+            LinuxFixes.fallocate(fd, LinuxFixes.FALLOC_FL_PUNCH_HOLE | LinuxFixes.FALLOC_FL_KEEP_SIZE,
+                                 (Posix.off_t) range[0], (Posix.off_t) range[1]) < 0) {
+            client.complete(-1, Posix.errno);
+            return true;
+        }
+
+        client.complete(0, 0);
+        return true;
+    }
+
+    public override bool handle_ioctl(IoctlClient client)
+    {
+        ulong request = client.request;
+
+        if (request == (ulong) BLKGETSIZE64) {
+            uint64 val = size;
+            return put_value(client, &val, sizeof(uint64));
+        } else if (request == (ulong) BLKGETSIZE) {
+            ulong val = (ulong) (size / 512);
+            return put_value(client, &val, sizeof(ulong));
+        } else if (request == (ulong) BLKSSZGET || request == (ulong) BLKBSZGET) {
+            int val = (int) block_size;
+            return put_value(client, &val, sizeof(int));
+        } else if (request == (ulong) BLKPBSZGET || request == (ulong) BLKIOMIN) {
+            uint val = block_size;
+            return put_value(client, &val, sizeof(uint));
+        } else if (request == (ulong) BLKIOOPT) {
+            uint val = 0;
+            return put_value(client, &val, sizeof(uint));
+        } else if (request == (ulong) BLKROGET) {
+            int val = 0;
+            return put_value(client, &val, sizeof(int));
+        } else if (request == (ulong) BLKDISCARD || request == (ulong) BLKZEROOUT) {
+            return discard(client);
+        } else if (request == (ulong) BLKFLSBUF) {
+            if (Posix.fdatasync(fd) < 0)
+                client.complete(-1, Posix.errno);
+            else
+                client.complete(0, 0);
+            return true;
+        } else if (request == (ulong) BLKRRPART) {
+            /* there is no kernel partition table to re-read */
+            client.complete(0, 0);
+            return true;
+        }
+
+        client.complete(-1, Posix.ENOTTY);
+        return true;
+    }
+
+    /* Let the client do the I/O once the device would be done with it */
+    private bool throttle(IoctlClient client)
+    {
+        int64 now = get_monotonic_time();
+        int64 start = busy_until > now ? busy_until : now;
+
+        if (bandwidth > 0)
+            busy_until = start + (int64) (client.io_length * 1000000 / bandwidth);
+        else
+            busy_until = start;
+
+        int64 delay = busy_until + latency - now;
+        if (delay <= 0) {
+            client.complete(-100, 0);
+            return true;
+        }
+
+        var source = new TimeoutSource((uint) ((delay + 999) / 1000));
+        source.set_callback(() => {
+            client.complete(-100, 0);
+            return Source.REMOVE;
+        });
+        source.attach(MainContext.get_thread_default());
+        return true;
+    }
+
+    public override bool handle_read(IoctlClient client)
+    {
+        return throttle(client);
+    }
+
+    public override bool handle_write(IoctlClient client)
+    {
+        return throttle(client);
+    }
+}
+
+}
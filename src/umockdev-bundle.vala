@@ -0,0 +1,188 @@
+/*
+ * Testbed bundles: device descriptions and recordings in one file
+ *
+ * umockdev is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * umockdev is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+namespace UMockdev {
+
+/* A bundle starts with an index of its members, followed by their data; all
+ * numbers are little endian:
+ *
+ *   "UMDBNDL\0", uint32 version (1), uint32 number of members
+ *   per member: uint8 kind, uint8 compression, uint16 target length,
+ *               uint64 offset, uint64 stored size, uint64 size, target
+ *   member data at the given offsets from the start of the file
+ *
+ * The target is what the member is for (device node, sysfs path, socket
+ * path); empty if the recording names it in its header. Members are stored
+ * with zlib compression if that makes them smaller.
+ */
+internal enum BundleKind {
+    /* umockdev-record device description */
+    DEVICES = 1,
+    IOCTL,
+    SCRIPT,
+    EVEMU_EVENTS,
+    PCAP,
+    UNIX_STREAM
+}
+
+internal enum BundleCompression {
+    NONE = 0,
+    ZLIB
+}
+
+internal class BundleMember {
+    public BundleKind kind;
+    public string target;
+    public BundleCompression compression;
+    /* as stored in the bundle */
+    public Bytes data;
+    public uint64 size;
+
+    public Bytes get_contents() throws IOError
+    {
+        if (compression == BundleCompression.NONE)
+            return data;
+
+        var input = new ConverterInputStream(new MemoryInputStream.from_bytes(data),
+                                             new ZlibDecompressor(ZlibCompressorFormat.ZLIB));
+        var contents = new uint8[size];
+        size_t n;
+        input.read_all(contents, out n, null);
+        if (n != size)
+            throw new IOError.INVALID_DATA("bundle member for '%s' is truncated", target);
+        return new Bytes.take((owned) contents);
+    }
+
+    /* for the text formats */
+    public string get_text() throws IOError
+    {
+        Bytes contents = get_contents();
+        return ((string) contents.get_data()).ndup(contents.get_size());
+    }
+}
+
+internal class Bundle {
+    const string MAGIC = "UMDBNDL";
+    const uint32 VERSION = 1;
+    const uint64 MAX_RATIO = 1100;
+
+    public GenericArray<BundleMember> members = new GenericArray<BundleMember>();
+
+    public Bundle()
+    {
+    }
+
+    /* Read the bundle at path; the members refer to its mapping */
+    public Bundle.load(string path) throws GLib.Error
+    {
+        Bytes file = new MappedFile(path, false).get_bytes();
+        var index = new DataInputStream(new MemoryInputStream.from_bytes(file));
+        index.byte_order = DataStreamByteOrder.LITTLE_ENDIAN;
+
+        var magic = new uint8[MAGIC.length + 1];
+        size_t n;
+        index.read_all(magic, out n, null);
+        if (n != magic.length || Memory.cmp(magic, MAGIC, magic.length) != 0)
+            throw new IOError.INVALID_DATA("%s is not an umockdev bundle", path);
+        if (index.read_uint32() != VERSION)
+            throw new IOError.NOT_SUPPORTED("%s has an unsupported bundle version", path);
+
+        uint32 count = index.read_uint32();
+        for (uint32 i = 0; i < count; ++i) {
+            var m = new BundleMember();
+            m.kind = (BundleKind) index.read_byte();
+            m.compression = (BundleCompression) index.read_byte();
+            var target = new uint8[index.read_uint16() + 1];
+            uint64 offset = index.read_uint64();
+            uint64 stored = index.read_uint64();
+            m.size = index.read_uint64();
+            index.read_all(target[0:target.length - 1], out n, null);
+            if (n != target.length - 1 || offset > file.get_size() || stored > file.get_size() - offset)
+                throw new IOError.INVALID_DATA("%s has a truncated bundle member", path);
+            if (m.kind < BundleKind.DEVICES || m.kind > BundleKind.UNIX_STREAM)
+                throw new IOError.NOT_SUPPORTED("%s has an unknown kind of bundle member %i", path, (int) m.kind);
+            /* the size gets allocated up front when decompressing, so it must
+             * be plausible; zlib does not compress better than about 1032:1 */
+            if (m.compression > BundleCompression.ZLIB ||
+                (m.compression == BundleCompression.NONE && m.size != stored) ||
+                (m.compression == BundleCompression.ZLIB && m.size / MAX_RATIO > stored))
+                throw new IOError.INVALID_DATA("%s has a bundle member with invalid size or compression", path);
+            target[target.length - 1] = 0;
+            m.target = (string) target;
+            m.data = new Bytes.from_bytes(file, (size_t) offset, (size_t) stored);
+            members.add(m);
+        }
+    }
+
+    public void add(BundleKind kind, string target, Bytes contents)
+    {
+        var m = new BundleMember();
+        m.kind = kind;
+        m.target = target;
+        m.size = contents.get_size();
+        m.compression = BundleCompression.NONE;
+        m.data = contents;
+
+        try {
+            var compressed = new MemoryOutputStream.resizable();
+            var output = new ConverterOutputStream(compressed, new ZlibCompressor(ZlibCompressorFormat.ZLIB, -1));
+            output.write_all(contents.get_data(), null);
+            output.close();
+            if (compressed.get_data_size() < contents.get_size()) {
+                m.compression = BundleCompression.ZLIB;
+                m.data = compressed.steal_as_bytes();
+            }
+        } catch (GLib.Error e) {
+            warning("Cannot compress bundle member for '%s': %s", target, e.message);
+        }
+
+        members.add(m);
+    }
+
+    public void save(string path) throws GLib.Error
+    {
+        var buffer = new MemoryOutputStream.resizable();
+        var output = new DataOutputStream(buffer);
+        output.byte_order = DataStreamByteOrder.LITTLE_ENDIAN;
+
+        uint64 offset = MAGIC.length + 1 + 2 * sizeof(uint32);
+        foreach (unowned BundleMember m in members.data)
+            offset += 28 + m.target.length;
+
+        output.write_all(MAGIC.data, null);
+        output.put_byte(0);
+        output.put_uint32(VERSION);
+        output.put_uint32(members.length);
+        foreach (unowned BundleMember m in members.data) {
+            output.put_byte((uint8) m.kind);
+            output.put_byte((uint8) m.compression);
+            output.put_uint16((uint16) m.target.length);
+            output.put_uint64(offset);
+            output.put_uint64(m.data.get_size());
+            output.put_uint64(m.size);
+            output.write_all(m.target.data, null);
+            offset += m.data.get_size();
+        }
+        foreach (unowned BundleMember m in members.data)
+            output.write_all(m.data.get_data(), null);
+        output.close();
+
+        FileUtils.set_data(path, buffer.steal_as_bytes().get_data());
+    }
+}
+
+}
@@ -0,0 +1,346 @@
+/*
+ * Stateful evdev emulation
+ *
+ * umockdev is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * umockdev is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+namespace UMockdev {
+
+using Ioctl;
+
+/* One of the kernel's per-device bitmaps (keys, LEDs, sounds, switches),
+ * with the bits that were set by a replayed event. Bits that no event
+ * touched yet are answered from the recording.
+ */
+private class EvdevBitmap {
+    public uint8[] bits;
+    public uint8[] touched;
+
+    public EvdevBitmap(int max)
+    {
+        /* same size as the kernel's unsigned long array */
+        size_t long_bits = 8 * sizeof(ulong);
+        size_t len = ((max + long_bits) / long_bits) * sizeof(ulong);
+        bits = new uint8[len];
+        touched = new uint8[len];
+    }
+
+    public void update(uint code, bool on)
+    {
+        if (code / 8 >= bits.length)
+            return;
+        uint8 mask = (uint8) (1 << (code % 8));
+        if (on)
+            bits[code / 8] = bits[code / 8] | mask;
+        else
+            bits[code / 8] = bits[code / 8] & (uint8) ~mask;
+        touched[code / 8] = touched[code / 8] | mask;
+    }
+
+    /* Returns the number of copied bytes, like the kernel's bits_to_user() */
+    public int copy(uint8[] buf, uint8[]? recorded)
+    {
+        int len = buf.length < bits.length ? buf.length : bits.length;
+        for (int i = 0; i < len; i++) {
+            uint8 rec = (recorded != null && i < recorded.length) ? recorded[i] : 0;
+            buf[i] = (uint8) ((rec & ~touched[i]) | (bits[i] & touched[i]));
+        }
+        return len;
+    }
+}
+
+/* Input state of an evdev device node, as the kernel keeps it.
+ *
+ * Events are fed in when a script or evemu replay writes them to the device
+ * node, which is when the kernel would update its state as well; the
+ * EVIOCG{KEY,LED,SND,SW,ABS,MTSLOTS} ioctls are then answered from it. This
+ * is shared between the script runner thread and the ioctl worker.
+ */
+internal class EvdevState {
+    const int MAX_SLOTS = 64;
+
+    private Mutex mutex = Mutex();
+    private ByteArray pending = new ByteArray();
+
+    private EvdevBitmap keys = new EvdevBitmap(KEY_MAX);
+    private EvdevBitmap leds = new EvdevBitmap(LED_MAX);
+    private EvdevBitmap snds = new EvdevBitmap(SND_MAX);
+    private EvdevBitmap sws = new EvdevBitmap(SW_MAX);
+
+    private int32[] abs_value = new int32[ABS_CNT];
+    private bool[] abs_touched = new bool[ABS_CNT];
+
+    private int mt_codes = ABS_MT_TOOL_Y - ABS_MT_TOUCH_MAJOR + 1;
+    private int32[] slot_value;
+    private bool[] slot_touched;
+    private int cur_slot = 0;
+    private bool slot_seen = false;
+    private int n_slots = 0;
+
+    public EvdevState()
+    {
+        slot_value = new int32[MAX_SLOTS * mt_codes];
+        slot_touched = new bool[MAX_SLOTS * mt_codes];
+    }
+
+    /* Set up the MT slots from the recorded ABS_MT_SLOT axis */
+    public void seed_slots(input_absinfo slot_info)
+    {
+        mutex.lock();
+        n_slots = (slot_info.maximum + 1).clamp(0, MAX_SLOTS);
+        if (!slot_seen)
+            cur_slot = slot_info.value;
+        mutex.unlock();
+    }
+
+    /* Feed data that is written to the device node; this does not need to
+     * be aligned to struct input_event. */
+    public void feed(uint8[] data)
+    {
+        size_t ev_size = sizeof(LinuxFixes.Input.Event);
+
+        mutex.lock();
+        pending.append(data);
+        uint done = 0;
+        while (pending.len - done >= ev_size) {
+            apply((LinuxFixes.Input.Event*) &pending.data[done]);
+            done += (uint) ev_size;
+        }
+        if (done > 0)
+            pending.remove_range(0, done);
+        mutex.unlock();
+    }
+
+    private void apply(LinuxFixes.Input.Event* ev)
+    {
+        switch (ev.type) {
+            case EV_KEY:
+                /* value 2 is autorepeat, which keeps the key down */
+                keys.update(ev.code, ev.value != 0);
+                break;
+            case EV_LED:
+                leds.update(ev.code, ev.value != 0);
+                break;
+            case EV_SND:
+                snds.update(ev.code, ev.value != 0);
+                break;
+            case EV_SW:
+                sws.update(ev.code, ev.value != 0);
+                break;
+            case EV_ABS:
+                if (ev.code > ABS_MAX)
+                    break;
+                if (ev.code >= ABS_MT_TOUCH_MAJOR && ev.code <= ABS_MT_TOOL_Y) {
+                    /* like the kernel, MT axes only update the current slot */
+                    if (cur_slot >= 0 && cur_slot < MAX_SLOTS) {
+                        int i = cur_slot * mt_codes + ev.code - ABS_MT_TOUCH_MAJOR;
+                        slot_value[i] = ev.value;
+                        slot_touched[i] = true;
+                    }
+                    break;
+                }
+                if (ev.code == ABS_MT_SLOT) {
+                    cur_slot = ev.value;
+                    slot_seen = true;
+                    if (cur_slot >= n_slots && cur_slot < MAX_SLOTS)
+                        n_slots = cur_slot + 1;
+                }
+                abs_value[ev.code] = ev.value;
+                abs_touched[ev.code] = true;
+                break;
+            default:
+                /* EV_SYN and everything else does not change state */
+                break;
+        }
+    }
+
+    public static bool is_state_request(ulong request)
+    {
+        ulong plain = request & ~(((ulong) (1 << _IOC_SIZEBITS) - 1) << _IOC_SIZESHIFT);
+        return plain == (ulong) EVIOCGKEY(0) || plain == (ulong) EVIOCGLED(0) ||
+               plain == (ulong) EVIOCGSND(0) || plain == (ulong) EVIOCGSW(0) ||
+               plain == (ulong) EVIOCGMTSLOTS(0) ||
+               (request >= (ulong) EVIOCGABS(0) && request <= (ulong) EVIOCGABS(ABS_MAX));
+    }
+
+    /* Answer a state ioctl into buf, with recorded being its answer from the
+     * ioctl record (if any). Returns false if there is no state for it, then
+     * the recording needs to answer it alone. */
+    public bool query(ulong request, uint8[] buf, uint8[]? recorded, out int ret, out int err)
+    {
+        mutex.lock();
+        bool res = query_locked(request, buf, recorded, out ret, out err);
+        mutex.unlock();
+        return res;
+    }
+
+    private bool query_locked(ulong request, uint8[] buf, uint8[]? recorded, out int ret, out int err)
+    {
+        ulong plain = request & ~(((ulong) (1 << _IOC_SIZEBITS) - 1) << _IOC_SIZESHIFT);
+        ret = 0;
+        err = 0;
+
+        if (plain == (ulong) EVIOCGKEY(0)) {
+            ret = keys.copy(buf, recorded);
+            return true;
+        }
+        if (plain == (ulong) EVIOCGLED(0)) {
+            ret = leds.copy(buf, recorded);
+            return true;
+        }
+        if (plain == (ulong) EVIOCGSND(0)) {
+            ret = snds.copy(buf, recorded);
+            return true;
+        }
+        if (plain == (ulong) EVIOCGSW(0)) {
+            ret = sws.copy(buf, recorded);
+            return true;
+        }
+
+        if (request >= (ulong) EVIOCGABS(0) && request <= (ulong) EVIOCGABS(ABS_MAX)) {
+            int code = (int) (request - (ulong) EVIOCGABS(0));
+            input_absinfo info = {};
+            if (recorded != null && recorded.length >= sizeof(input_absinfo))
+                Posix.memcpy(&info, recorded, sizeof(input_absinfo));
+            else if (!abs_touched[code])
+                return false;
+            if (abs_touched[code])
+                info.value = abs_value[code];
+            Posix.memcpy(buf, &info, buf.length < sizeof(input_absinfo) ? buf.length : sizeof(input_absinfo));
+            return true;
+        }
+
+        if (plain == (ulong) EVIOCGMTSLOTS(0)) {
+            if (n_slots == 0 || buf.length < sizeof(uint32))
+                return false;
+            uint32 code = *((uint32*) &buf[0]);
+            if (code < ABS_MT_TOUCH_MAJOR || code > ABS_MT_TOOL_Y) {
+                ret = -1;
+                err = Posix.EINVAL;
+                return true;
+            }
+            /* the recorded answer is only valid for the code it was recorded with */
+            int32* rec_values = null;
+            int n_rec = 0;
+            if (recorded != null && recorded.length >= sizeof(uint32) && *((uint32*) &recorded[0]) == code) {
+                rec_values = (int32*) &recorded[sizeof(uint32)];
+                n_rec = (int) ((recorded.length - sizeof(uint32)) / sizeof(int32));
+            }
+            int32* values = (int32*) &buf[sizeof(uint32)];
+            int max_slots = (int) ((buf.length - sizeof(uint32)) / sizeof(int32));
+            for (int s = 0; s < n_slots && s < max_slots; s++) {
+                int i = s * mt_codes + (int) code - ABS_MT_TOUCH_MAJOR;
+                if (slot_touched[i])
+                    values[s] = slot_value[i];
+                else if (s < n_rec)
+                    values[s] = rec_values[s];
+                else
+                    values[s] = code == ABS_MT_TRACKING_ID ? -1 : 0;
+            }
+            return true;
+        }
+
+        return false;
+    }
+}
+
+/* ioctl tree handler for evdev nodes that answers the state ioctls from
+ * an EvdevState, i. e. the recorded state updated with the replayed events.
+ */
+internal class IoctlEvdevHandler : IoctlTreeHandler {
+    private EvdevState state;
+    /* recorded answers of state ioctls by request and MTSLOTS code; null if
+     * not recorded */
+    private HashTable<string, Bytes?> recorded;
+
+    public IoctlEvdevHandler(string file, EvdevState state)
+    {
+        base (file);
+        this.state = state;
+        this.recorded = new HashTable<string, Bytes?> (str_hash, str_equal);
+
+        /* not a program's request, so neither counted as executed nor cached */
+        if (tree != null) {
+            input_absinfo info = {};
+            int ret = -1;
+            tree.lookup(EVIOCGABS(ABS_MT_SLOT), &info, ref ret);
+            if (ret != -1)
+                state.seed_slots(info);
+        }
+    }
+
+    private Bytes? lookup_recorded(ulong request, uint8[] arg)
+    {
+        /* EVIOCGMTSLOTS answers the ABS_MT_* code in the first field */
+        uint32 code = 0;
+        ulong plain = request & ~(((ulong) (1 << _IOC_SIZEBITS) - 1) << _IOC_SIZESHIFT);
+        if (plain == (ulong) EVIOCGMTSLOTS(0) && arg.length >= sizeof(uint32))
+            code = *((uint32*) &arg[0]);
+
+        string key = "%lx:%u".printf(request, code);
+        if (recorded.contains(key))
+            return recorded.lookup(key);
+
+        Bytes? res = null;
+        if (tree != null) {
+            uint8[] buf = new uint8[arg.length];
+            if (code != 0)
+                *((uint32*) &buf[0]) = code;
+            int ret = -1;
+            tree.execute(null, request, buf, ref ret);
+            if (ret != -1)
+                res = new Bytes(buf);
+        }
+        recorded.insert(key, res);
+        return res;
+    }
+
+    /* the evdev state follows the replayed events */
+    internal override bool may_cache(ulong request)
+    {
+        return base.may_cache(request) && !EvdevState.is_state_request(request);
+    }
+
+    public override bool handle_ioctl(IoctlClient client) {
+        ulong request = client.request;
+        ulong size = (request >> Ioctl._IOC_SIZESHIFT) & ((1 << Ioctl._IOC_SIZEBITS) - 1);
+        IoctlData? data = null;
+        int ret;
+        int my_errno;
+
+        if (!EvdevState.is_state_request(request) || size == 0)
+            return base.handle_ioctl(client);
+
+        try {
+            data = client.arg.resolve(0, size);
+        } catch (IOError e) {
+            warning("Error resolving IOCtl data: %s", e.message);
+            return false;
+        }
+
+        if (data == null) {
+            client.complete(-1, Posix.EFAULT);
+            return true;
+        }
+
+        Bytes? rec = lookup_recorded(request, data.data);
+        if (!state.query(request, data.data, rec != null ? rec.get_data() : null, out ret, out my_errno))
+            return base.handle_ioctl(client);
+
+        client.complete(ret, my_errno);
+        return true;
+    }
+}
+
+}
@@ -0,0 +1,411 @@
+/*
+ * Report based hidraw emulation
+ *
+ * umockdev is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * umockdev is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+namespace UMockdev {
+
+using Ioctl;
+
+private class HidrawRule {
+    public uint8[] prefix;
+    public Bytes[] responses;
+}
+
+/* Input reports of one open file, as the kernel queues them per reader */
+private class HidrawClient {
+    public Queue<Bytes> reports = new Queue<Bytes>();
+    public IoctlClient? waiting = null;
+}
+
+/* Emulates a hidraw device from its report descriptor and a set of rules.
+ *
+ * The static ioctls (descriptor, name, raw info) come from an ioctl record,
+ * from which the report descriptor is parsed to learn about report IDs and
+ * sizes. Output and feature reports that the client sends are matched
+ * against the rules by report ID and payload prefix, and the responses of
+ * the first matching rule are queued as input reports to all readers. Each
+ * read() returns one whole report.
+ */
+internal class IoctlHidrawHandler : IoctlTreeHandler {
+    /* the _IOC_NR of the HIDIOC{G,S}{FEATURE,INPUT,OUTPUT}(len) ioctls; the
+     * input/output ones are too new to rely on the headers */
+    const uint NR_SFEATURE = 0x06;
+    const uint NR_GFEATURE = 0x07;
+    const uint NR_SINPUT = 0x09;
+    const uint NR_GINPUT = 0x0A;
+    const uint NR_SOUTPUT = 0x0B;
+    const uint NR_GOUTPUT = 0x0C;
+
+    /* report sizes in bits by report ID, from the descriptor */
+    private uint[] input_bits = new uint[256];
+    private uint[] feature_bits = new uint[256];
+    private bool numbered = false;
+
+    private GenericArray<HidrawRule>?[] rules = new GenericArray<HidrawRule>?[256];
+    private GenericArray<Bytes> initial_input = new GenericArray<Bytes>();
+    private Bytes?[] features = new Bytes?[256];
+    private Bytes?[] last_input = new Bytes?[256];
+    private Bytes?[] last_output = new Bytes?[256];
+
+    private HashTable<IoctlClient, HidrawClient> clients;
+    /* the pty of the device node is readable while any reader has reports */
+    private int wake_fd;
+    private int drain_fd = -1;
+    private uint queued = 0;
+
+    /* wake_fd is the pty master of the device node and pty the path of its
+     * slave end, which this reads from again once all reports are consumed */
+    public IoctlHidrawHandler(string file, string? rulesfile, int wake_fd, string? pty) throws FileError
+    {
+        base (file);
+        this.wake_fd = wake_fd;
+        this.clients = new HashTable<IoctlClient, HidrawClient> (direct_hash, direct_equal);
+
+        if (wake_fd >= 0 && pty != null)
+            drain_fd = Posix.open(pty, Posix.O_RDONLY | Posix.O_NONBLOCK | Posix.O_NOCTTY | Posix.O_CLOEXEC);
+
+        if (tree != null) {
+            hidraw_report_descriptor desc = {};
+            int ret = -1;
+            tree.lookup(HIDIOCGRDESC, &desc, ref ret);
+            if (ret >= 0)
+                parse_descriptor(&desc.value[0], desc.size < HID_MAX_DESCRIPTOR_SIZE ? desc.size : HID_MAX_DESCRIPTOR_SIZE);
+        }
+
+        if (rulesfile != null)
+            load_rules(rulesfile);
+    }
+
+    ~IoctlHidrawHandler()
+    {
+        if (drain_fd >= 0)
+            Posix.close(drain_fd);
+        if (wake_fd >= 0)
+            Posix.close(wake_fd);
+    }
+
+    /* Sum up the report sizes of the Input and Feature main items per
+     * report ID; this follows the HID 1.11 short item encoding. */
+    private void parse_descriptor(uint8* d, uint len)
+    {
+        uint report_size = 0;
+        uint report_count = 0;
+        uint report_id = 0;
+        uint[] stack = {};
+        uint i = 0;
+
+        while (i < len) {
+            uint8 prefix = d[i];
+
+            if (prefix == 0xFE) {
+                /* long item */
+                if (i + 1 >= len)
+                    break;
+                i += 3 + d[i + 1];
+                continue;
+            }
+
+            uint size = prefix & 0x3;
+            if (size == 3)
+                size = 4;
+            uint type = (prefix >> 2) & 0x3;
+            uint tag = prefix >> 4;
+            if (i + 1 + size > len)
+                break;
+            uint32 value = 0;
+            for (uint b = 0; b < size; b++)
+                value |= (uint32) d[i + 1 + b] << (8 * b);
+            i += 1 + size;
+
+            if (type == 0) {
+                /* main item */
+                uint bits = report_size * report_count;
+                if (tag == 0x8)
+                    input_bits[report_id] += bits;
+                else if (tag == 0xB)
+                    feature_bits[report_id] += bits;
+            } else if (type == 1) {
+                /* global item */
+                if (tag == 0x7) {
+                    report_size = value;
+                } else if (tag == 0x8) {
+                    report_id = value & 0xff;
+                    numbered = true;
+                } else if (tag == 0x9) {
+                    report_count = value;
+                } else if (tag == 0xA) {
+                    stack += report_size;
+                    stack += report_count;
+                    stack += report_id;
+                } else if (tag == 0xB && stack.length >= 3) {
+                    report_id = stack[stack.length - 1];
+                    report_count = stack[stack.length - 2];
+                    report_size = stack[stack.length - 3];
+                    stack.resize(stack.length - 3);
+                }
+            }
+        }
+    }
+
+
+    private static uint8[] parse_hex(string hex, string rulesfile, int lineno) throws FileError
+    {
+        if (hex.length % 2 != 0)
+            throw new FileError.INVAL("%s:%i: odd number of hex digits".printf(rulesfile, lineno));
+        uint8[] res = new uint8[hex.length / 2];
+        for (int i = 0; i < res.length; i++) {
+            int hi = hex[2 * i].xdigit_value();
+            int lo = hex[2 * i + 1].xdigit_value();
+            if (hi < 0 || lo < 0)
+                throw new FileError.INVAL("%s:%i: invalid hex data '%s'".printf(rulesfile, lineno, hex));
+            res[i] = (uint8) (hi << 4 | lo);
+        }
+        return res;
+    }
+
+    /* Pad a report to the size the descriptor declares for it, so that
+     * rules can leave out trailing zeros. with_id says whether the report
+     * starts with the report number: feature reports always do, input reports
+     * only on devices with numbered reports. */
+    private Bytes pad_report(uint[] bits, uint8[] data, bool with_id)
+    {
+        uint id = with_id && data.length > 0 ? data[0] : 0;
+        uint len = bits[id] == 0 ? 0 : (bits[id] + 7) / 8 + (with_id ? 1 : 0);
+        if (len <= data.length)
+            return new Bytes(data);
+        uint8[] padded = new uint8[len];
+        Posix.memcpy(padded, data, data.length);
+        return new Bytes.take((owned) padded);
+    }
+
+    private void load_rules(string rulesfile) throws FileError
+    {
+        string contents;
+        FileUtils.get_contents(rulesfile, out contents);
+
+        int lineno = 0;
+        foreach (unowned string line in contents.split("\n")) {
+            lineno++;
+            string stripped = line.strip();
+            if (stripped.length == 0 || stripped.has_prefix("#"))
+                continue;
+
+            string[] fields = Regex.split_simple("\\s+", stripped);
+            if (fields[0] == "i" && fields.length == 2) {
+                initial_input.add(pad_report(input_bits, parse_hex(fields[1], rulesfile, lineno), numbered));
+            } else if (fields[0] == "f" && fields.length == 2) {
+                uint8[] report = parse_hex(fields[1], rulesfile, lineno);
+                if (report.length == 0)
+                    throw new FileError.INVAL("%s:%i: empty feature report".printf(rulesfile, lineno));
+                features[report[0]] = pad_report(feature_bits, report, true);
+            } else if (fields[0] == "w" && fields.length >= 2) {
+                var rule = new HidrawRule();
+                rule.prefix = parse_hex(fields[1], rulesfile, lineno);
+                if (rule.prefix.length == 0)
+                    throw new FileError.INVAL("%s:%i: empty report prefix".printf(rulesfile, lineno));
+                for (int i = 2; i < fields.length; i++)
+                    rule.responses += pad_report(input_bits, parse_hex(fields[i], rulesfile, lineno), numbered);
+                uint8 id = rule.prefix[0];
+                if (rules[id] == null)
+                    rules[id] = new GenericArray<HidrawRule>();
+                rules[id].add(rule);
+            } else {
+                throw new FileError.INVAL("%s:%i: invalid rule '%s'".printf(rulesfile, lineno, stripped));
+            }
+        }
+    }
+
+    private void wake(bool readable)
+    {
+        uint8 b = 0;
+        if (readable && wake_fd >= 0)
+            Posix.write(wake_fd, &b, 1);
+        else if (!readable && drain_fd >= 0)
+            Posix.read(drain_fd, &b, 1);
+    }
+
+    /* Hand a report to a waiting read(), or queue it */
+    private void deliver(HidrawClient c, Bytes report)
+    {
+        if (c.waiting != null) {
+            complete_read(c.waiting, report);
+            c.waiting = null;
+            return;
+        }
+
+        c.reports.push_tail(report);
+        if (queued++ == 0)
+            wake(true);
+    }
+
+    private void complete_read(IoctlClient client, Bytes report)
+    {
+        unowned uint8[] data = report.get_data();
+        unowned uint8[] buf = client.arg.data;
+        size_t len = buf.length < data.length ? buf.length : data.length;
+        /* like the kernel, the rest of a report that does not fit is lost */
+        Posix.memcpy(buf, data, len);
+        client.complete((long) len, 0);
+    }
+
+    private void send_input(Bytes report)
+    {
+        unowned uint8[] data = report.get_data();
+        last_input[numbered && data.length > 0 ? data[0] : 0] = report;
+
+        clients.foreach((key, c) => {
+            deliver(c, report);
+        });
+    }
+
+    /* A report from the client; answer it according to the rules */
+    private void received(uint8[] report)
+    {
+        if (report.length == 0 || rules[report[0]] == null)
+            return;
+
+        unowned GenericArray<HidrawRule> candidates = rules[report[0]];
+        for (uint i = 0; i < candidates.length; i++) {
+            HidrawRule rule = candidates[i];
+            if (rule.prefix.length <= report.length &&
+                Posix.memcmp(rule.prefix, report, rule.prefix.length) == 0) {
+                foreach (unowned Bytes response in rule.responses)
+                    send_input(response);
+                return;
+            }
+        }
+        debug("hidraw: no rule for report %u of %i bytes", report[0], report.length);
+    }
+
+    public override void client_connected(IoctlClient client) {
+        var c = new HidrawClient();
+        clients.insert(client, c);
+
+        ulong handler_id = 0;
+        handler_id = client.notify["connected"].connect(() => {
+            if (client.connected)
+                return;
+            SignalHandler.disconnect(client, handler_id);
+            if (c.reports.length > 0) {
+                queued -= c.reports.length;
+                if (queued == 0)
+                    wake(false);
+            }
+            clients.remove(client);
+        });
+
+        for (uint i = 0; i < initial_input.length; i++)
+            deliver(c, initial_input[i]);
+    }
+
+    public override bool handle_read(IoctlClient client) {
+        HidrawClient? c = clients.lookup(client);
+        if (c == null)
+            return false;
+
+        Bytes? report = c.reports.pop_head();
+        if (report == null) {
+            if (client.nonblock) {
+                client.complete(-1, Posix.EAGAIN);
+                return true;
+            }
+            /* block until the next report */
+            c.waiting = client;
+            return true;
+        }
+
+        if (--queued == 0)
+            wake(false);
+        complete_read(client, report);
+        return true;
+    }
+
+    public override bool handle_write(IoctlClient client) {
+        unowned uint8[] report = client.arg.data;
+        uint8 id = report.length > 0 ? report[0] : 0;
+
+        last_output[id] = new Bytes(report);
+        received(report);
+        client.complete(report.length, 0);
+        return true;
+    }
+
+    public override bool handle_ioctl(IoctlClient client) {
+        ulong request = client.request;
+        ulong type = (request >> Ioctl._IOC_TYPESHIFT) & ((1 << Ioctl._IOC_TYPEBITS) - 1);
+        ulong size = (request >> Ioctl._IOC_SIZESHIFT) & ((1 << Ioctl._IOC_SIZEBITS) - 1);
+        uint nr = (uint) (request & 0xff);
+        IoctlData? data = null;
+
+        if ((char) type != 'H' || size == 0 ||
+            (nr != NR_SFEATURE && nr != NR_GFEATURE && nr != NR_SINPUT &&
+             nr != NR_GINPUT && nr != NR_SOUTPUT && nr != NR_GOUTPUT))
+            return base.handle_ioctl(client);
+
+        try {
+            data = client.arg.resolve(0, size);
+        } catch (IOError e) {
+            warning("Error resolving IOCtl data: %s", e.message);
+            return false;
+        }
+
+        if (data == null) {
+            client.complete(-1, Posix.EFAULT);
+            return true;
+        }
+
+        uint8 id = data.data[0];
+        Bytes? report = null;
+
+        switch (nr) {
+            case NR_SFEATURE:
+                features[id] = new Bytes(data.data);
+                received(data.data);
+                client.complete((long) size, 0);
+                return true;
+            case NR_SOUTPUT:
+                last_output[id] = new Bytes(data.data);
+                received(data.data);
+                client.complete((long) size, 0);
+                return true;
+            case NR_SINPUT:
+                send_input(new Bytes(data.data));
+                client.complete((long) size, 0);
+                return true;
+            case NR_GFEATURE:
+                report = features[id];
+                break;
+            case NR_GINPUT:
+                report = last_input[id];
+                break;
+            case NR_GOUTPUT:
+                report = last_output[id];
+                break;
+        }
+
+        /* not known yet, maybe the recording has it */
+        if (report == null)
+            return base.handle_ioctl(client);
+
+        unowned uint8[] rdata = report.get_data();
+        size_t len = size < rdata.length ? size : rdata.length;
+        Posix.memcpy(data.data, rdata, len);
+        client.complete((long) len, 0);
+        return true;
+    }
+}
+
+}
@@ -31,6 +31,162 @@ internal bool signal_accumulator_true_handled(GLib.SignalInvocationHint ihint,
 }
 
 
+/* Shared memory for transferring large buffers from/to the client.
+ *
+ * Payloads of at least THRESHOLD bytes are copied through a memfd which the
+ * client creates on request and passes over the socket, instead of being
+ * streamed through the socket itself. Only the small request headers go over
+ * the socket then. Clients that cannot provide the memfd (or connections that
+ * cannot pass file descriptors) fall back to READ_MEM/WRITE_MEM.
+ */
+internal class IoctlSharedBuffer {
+    internal const size_t THRESHOLD = 64 * 1024;
+
+    private IOStream stream;
+    private int fd = -1;
+    private uint8* map = null;
+    private size_t size = 0;
+    private bool unavailable = false;
+
+    internal IoctlSharedBuffer(IOStream stream)
+    {
+        this.stream = stream;
+        unavailable = !(stream is UnixConnection);
+    }
+
+    ~IoctlSharedBuffer()
+    {
+        unmap();
+    }
+
+    private void unmap()
+    {
+        if (map != null)
+            Posix.munmap(map, size);
+        if (fd >= 0)
+            Posix.close(fd);
+        map = null;
+        fd = -1;
+        size = 0;
+    }
+
+    /* Ensure that len bytes can be transferred, returns false if the shared
+     * buffer should not or cannot be used. This is synchronous, but only
+     * happens when the buffer needs to grow. */
+    private bool ensure(size_t len) throws IOError
+    {
+        if (len < THRESHOLD || unavailable)
+            return false;
+        if (len <= size)
+            return true;
+
+        OutputStream output = stream.get_output_stream();
+        InputStream input = stream.get_input_stream();
+        ulong args[3];
+
+        args[0] = 9; /* SHM_MAP */
+        args[1] = len;
+        args[2] = 0;
+
+        output.write_all((uint8[])args, null, null);
+        input.read_all((uint8[])args, null, null);
+
+        assert(args[0] == 2); /* RES (new size) */
+
+        unmap();
+        if (args[1] < len) {
+            unavailable = true;
+            return false;
+        }
+
+        try {
+            fd = ((UnixConnection) stream).receive_fd(null);
+        } catch (GLib.Error e) {
+            throw new IOError.FAILED("Could not receive shared memory: %s", e.message);
+        }
+
+        map = Posix.mmap(null, args[1], Posix.PROT_READ | Posix.PROT_WRITE, Posix.MAP_SHARED, fd, 0);
+        if ((void*) map == Posix.MAP_FAILED) {
+            warning("Could not map shared memory: %s", Posix.strerror(Posix.errno));
+            map = null;
+            unmap();
+            unavailable = true;
+            return false;
+        }
+        size = args[1];
+
+        return true;
+    }
+
+    internal bool read_mem(ulong client_addr, uint8[] buf) throws IOError
+    {
+        if (!ensure(buf.length))
+            return false;
+
+        OutputStream output = stream.get_output_stream();
+        InputStream input = stream.get_input_stream();
+        ulong args[3];
+
+        args[0] = 10; /* READ_SHM */
+        args[1] = client_addr;
+        args[2] = buf.length;
+
+        output.write_all((uint8[])args, null, null);
+        input.read_all((uint8[])args, null, null);
+        assert(args[0] == 2); /* RES (ack) */
+
+        Posix.memcpy(buf, map, buf.length);
+
+        return true;
+    }
+
+    internal bool write_mem(ulong client_addr, uint8[] buf) throws IOError
+    {
+        if (!ensure(buf.length))
+            return false;
+
+        OutputStream output = stream.get_output_stream();
+        InputStream input = stream.get_input_stream();
+        ulong args[3];
+
+        Posix.memcpy(map, buf, buf.length);
+
+        args[0] = 11; /* WRITE_SHM */
+        args[1] = client_addr;
+        args[2] = buf.length;
+
+        output.write_all((uint8[])args, null, null);
+        /* wait for the ack, as the buffer may be reused right away */
+        input.read_all((uint8[])args, null, null);
+        assert(args[0] == 2); /* RES (ack) */
+
+        return true;
+    }
+
+    internal async bool write_mem_async(ulong client_addr, uint8[] buf) throws GLib.Error
+    {
+        if (!ensure(buf.length))
+            return false;
+
+        OutputStream output = stream.get_output_stream();
+        InputStream input = stream.get_input_stream();
+        ulong args[3];
+
+        Posix.memcpy(map, buf, buf.length);
+
+        args[0] = 11; /* WRITE_SHM */
+        args[1] = client_addr;
+        args[2] = buf.length;
+
+        yield output.write_all_async((uint8[])args, 0, null, null);
+        yield input.read_all_async((uint8[])args, 0, null, null);
+        assert(args[0] == 2); /* RES (ack) */
+
+        return true;
+    }
+}
+
+
 /**
  * UMockdevIoctlData:
  *
@@ -56,13 +212,15 @@ public class IoctlData : GLib.Object {
     public ulong client_addr;
 
     private IOStream stream;
+    private IoctlSharedBuffer? shm;
 
     private IoctlData[] children;
     private size_t[] children_offset;
 
-    internal IoctlData(IOStream stream)
+    internal IoctlData(IOStream stream, IoctlSharedBuffer? shm = null)
     {
         this.stream = stream;
+        this.shm = shm;
     }
 
     /**
@@ -99,7 +257,8 @@ public class IoctlData : GLib.Object {
      * Resolve an address inside the data. After this operation, the pointer
      * inside data points to a local copy of the memory. Any local modifications
      * will be synced back by umockdev_ioctl_client_complete() and
-     * umockdev_ioctl_client_execute().
+     * umockdev_ioctl_client_execute(). A @len of 0 gives an empty
+     * #UMockdevIoctlData, unless the pointer is %NULL.
      *
      * You may call this multiple times on the same pointer in order to fetch
      * the existing information.
@@ -108,8 +267,45 @@ public class IoctlData : GLib.Object {
      * Since: 0.16
      */
     public IoctlData? resolve(size_t offset, size_t len) throws IOError {
+        bool fresh;
+        IoctlData? res = resolve_child(offset, len, out fresh);
+
+        if (fresh)
+            res.load_data();
+
+        return res;
+    }
+
+    /*
+     * Same as calling resolve() for each of the given pointers, but the ones
+     * below the shared memory threshold are fetched from the client in a
+     * single round trip; larger ones still take one each.
+     */
+    internal IoctlData?[] resolve_many(size_t[] offsets, size_t[] lens) throws IOError {
+        assert(offsets.length == lens.length);
+
+        var res = new IoctlData?[offsets.length];
+        IoctlData[] fresh_children = {};
+
+        for (int i = 0; i < offsets.length; i++) {
+            bool fresh;
+            res[i] = resolve_child(offsets[i], lens[i], out fresh);
+            if (fresh)
+                fresh_children += res[i];
+        }
+
+        load_many(fresh_children);
+
+        return res;
+    }
+
+    /* Sets up the child for the pointer at offset; fresh is set if its data
+     * still needs to be loaded. */
+    private IoctlData? resolve_child(size_t offset, size_t len, out bool fresh) {
         IoctlData res;
 
+        fresh = false;
+
         for (int i = 0; i < children.length; i++) {
             if (children_offset[i] == offset)
                 return children[i];
@@ -118,7 +314,7 @@ public class IoctlData : GLib.Object {
         if (offset + sizeof(size_t) > data.length)
             return null;
 
-        res = new IoctlData(stream);
+        res = new IoctlData(stream, shm);
         res.data = new uint8[len];
         res.client_addr = *((size_t*) &data[offset]);
 
@@ -126,12 +322,15 @@ public class IoctlData : GLib.Object {
         children_offset += offset;
 
         /* Don't try to resolve null pointers. */
-        if (res.client_addr == 0 || len == 0)
+        if (res.client_addr == 0)
             return null;
 
         *((size_t*) &data[offset]) = (size_t) res.data;
-
-        res.load_data();
+        /* nothing to fetch for empty blocks */
+        if (len == 0)
+            res.client_data = new uint8[0];
+        else
+            fresh = true;
 
         return res;
     }
@@ -244,6 +443,11 @@ public class IoctlData : GLib.Object {
 
         client_data = new uint8[data.length];
 
+        if (shm != null && shm.read_mem(client_addr, client_data)) {
+            Posix.memcpy(data, client_data, data.length);
+            return;
+        }
+
         args[0] = 5; /* READ_MEM */
         args[1] = client_addr;
         args[2] = data.length;
@@ -255,56 +459,185 @@ public class IoctlData : GLib.Object {
     }
 
     /*
-     * Recursively flushes out all data elements, transparently ensuring that
-     * pointers are submitted in terms of the client.
+     * Loads the data of several blocks with a single READ_MEMV request, the
+     * client answers with all of them concatenated. Blocks that are large
+     * enough for the shared memory are loaded through it one by one.
      */
-    internal async void flush() throws GLib.Error {
+    private static void load_many(IoctlData[] blocks) throws IOError {
+        IoctlData[] batch = {};
+        size_t total = 0;
+
+        foreach (unowned IoctlData block in blocks) {
+            if (block.shm != null && block.data.length >= IoctlSharedBuffer.THRESHOLD)
+                block.load_data();
+            else
+                batch += block;
+        }
+
+        if (batch.length == 0)
+            return;
+        if (batch.length == 1) {
+            batch[0].load_data();
+            return;
+        }
+
+        OutputStream output = batch[0].stream.get_output_stream();
+        InputStream input = batch[0].stream.get_input_stream();
+        var msg = new uint8[(3 + 2 * batch.length) * sizeof(ulong)];
+        ulong* args = (ulong*) msg;
+
+        for (int i = 0; i < batch.length; i++) {
+            args[3 + 2 * i] = batch[i].client_addr;
+            args[4 + 2 * i] = batch[i].data.length;
+            total += batch[i].data.length;
+        }
+
+        args[0] = 13; /* READ_MEMV */
+        args[1] = (ulong) batch.length;
+        args[2] = total;
+
+        output.write_all(msg, null, null);
+
+        foreach (unowned IoctlData block in batch) {
+            block.client_data = new uint8[block.data.length];
+            input.read_all(block.client_data, null, null);
+            Posix.memcpy(block.data, block.client_data, block.data.length);
+        }
+    }
+
+    /*
+     * Recursively collects the modified data elements, transparently ensuring
+     * that pointers are submitted in terms of the client. Children come
+     * before their parents.
+     */
+    private void collect_dirty(IoctlFlushBatch batch) {
         uint8[] submit_data = data;
 
         for (int i = 0; i < children.length; i++) {
-            yield children[i].flush();
+            children[i].collect_dirty(batch);
 
             *((size_t*) &submit_data[children_offset[i]]) = children[i].client_addr;
         }
 
         if (client_addr != 0 &&
             submit_data.length == client_data.length &&
-            Posix.memcmp(submit_data, client_data, submit_data.length) != 0) {
+            Posix.memcmp(submit_data, client_data, submit_data.length) != 0)
+            batch.add(client_addr, (owned) submit_data);
+    }
+
+    /*
+     * Flushes out all modified data elements; they are written with a single
+     * request (apart from the ones going through shared memory).
+     */
+    internal async void flush() throws GLib.Error {
+        var batch = new IoctlFlushBatch();
+
+        collect_dirty(batch);
+        yield batch.submit_async(stream, shm);
+    }
+
+    internal void flush_sync() throws IOError {
+        var batch = new IoctlFlushBatch();
 
-            OutputStream output = stream.get_output_stream();
-            ulong args[3];
+        collect_dirty(batch);
+        batch.submit(stream, shm);
+    }
+}
 
+/* Modified client memory blocks that are written back together.
+ *
+ * A single block is sent as WRITE_MEM; several ones as one WRITE_MEMV
+ * request with the list of addresses and lengths, followed by the
+ * concatenated data. Large blocks go through the shared memory, in order.
+ */
+private class IoctlFlushBatch {
+    private ulong[] addrs = {};
+    private Bytes[] blocks = {};
+
+    public void add(ulong client_addr, owned uint8[] data) {
+        addrs += client_addr;
+        blocks += new Bytes.take((owned) data);
+    }
+
+    private bool is_large(int i, IoctlSharedBuffer? shm) {
+        return shm != null && blocks[i].length >= IoctlSharedBuffer.THRESHOLD;
+    }
+
+    /* Message for the blocks from start to end (exclusive) */
+    private ByteArray message(int start, int end) {
+        var msg = new ByteArray();
+        ulong args[3];
+
+        if (end - start == 1) {
             args[0] = 6; /* WRITE_MEM */
-            args[1] = client_addr;
-            args[2] = submit_data.length;
+            args[1] = addrs[start];
+            args[2] = blocks[start].length;
+            msg.append((uint8[]) args);
+        } else {
+            ulong iov[2];
+            size_t total = 0;
 
-            yield output.write_all_async((uint8[])args, 0, null, null);
-            yield output.write_all_async(submit_data, 0, null, null);
+            for (int i = start; i < end; i++)
+                total += blocks[i].length;
+
+            args[0] = 14; /* WRITE_MEMV */
+            args[1] = (ulong) (end - start);
+            args[2] = total;
+            msg.append((uint8[]) args);
+
+            for (int i = start; i < end; i++) {
+                iov[0] = addrs[i];
+                iov[1] = blocks[i].length;
+                msg.append((uint8[]) iov);
+            }
         }
+
+        for (int i = start; i < end; i++)
+            msg.append(blocks[i].get_data());
+
+        return msg;
     }
 
-    internal void flush_sync() throws IOError {
-        uint8[] submit_data = data;
+    public void submit(IOStream stream, IoctlSharedBuffer? shm) throws IOError {
+        OutputStream output = stream.get_output_stream();
+        int start = 0;
 
-        for (int i = 0; i < children.length; i++) {
-            children[i].flush_sync();
+        for (int i = 0; i < blocks.length; i++) {
+            if (!is_large(i, shm))
+                continue;
 
-            *((ulong*) &submit_data[children_offset[i]]) = children[i].client_addr;
+            if (start < i)
+                output.write_all(message(start, i).data, null, null);
+            start = i;
+            if (shm.write_mem(addrs[i], blocks[i].get_data()))
+                start = i + 1;
         }
 
-        if (client_addr != 0 &&
-            submit_data.length == client_data.length &&
-            Posix.memcmp(submit_data, client_data, submit_data.length) != 0) {
+        if (start < blocks.length)
+            output.write_all(message(start, blocks.length).data, null, null);
+    }
 
-            OutputStream output = stream.get_output_stream();
-            ulong args[3];
+    public async void submit_async(IOStream stream, IoctlSharedBuffer? shm) throws GLib.Error {
+        OutputStream output = stream.get_output_stream();
+        int start = 0;
 
-            args[0] = 6; /* WRITE_MEM */
-            args[1] = client_addr;
-            args[2] = submit_data.length;
+        for (int i = 0; i < blocks.length; i++) {
+            if (!is_large(i, shm))
+                continue;
 
-            output.write_all((uint8[])args, null, null);
-            output.write_all(submit_data, null, null);
+            if (start < i) {
+                var msg = message(start, i);
+                yield output.write_all_async(msg.data, 0, null, null);
+            }
+            start = i;
+            bool done = yield shm.write_mem_async(addrs[i], blocks[i].get_data());
+            if (done)
+                start = i + 1;
+        }
+
+        if (start < blocks.length) {
+            var msg = message(start, blocks.length);
+            yield output.write_all_async(msg.data, 0, null, null);
         }
     }
 }
@@ -351,6 +684,7 @@ public class IoctlData : GLib.Object {
 public class IoctlClient : GLib.Object {
     private IoctlBase handler;
     private IOStream stream;
+    private IoctlSharedBuffer shm;
     private GLib.MainContext _ctx;
 
     [Description(nick = "device node", blurb = "The device node the client opened")]
@@ -367,8 +701,17 @@ public class IoctlClient : GLib.Object {
       }
     }
 
+    /* Byte count of the current read/write */
+    internal size_t io_length;
+    /* File offset of the current pread/pwrite */
+    internal int64 io_pos;
+    /* Whether the client's fd has O_NONBLOCK, for read and ioctl */
+    internal bool nonblock;
+
     private ulong _cmd;
     private bool _abort;
+    private bool cache_result;
+    private int mmap_fd = -1;
     private long result;
     private int result_errno;
 
@@ -445,6 +788,8 @@ public class IoctlClient : GLib.Object {
     public void complete(long res, int errno_) {
         /* Nullify some of the request information */
         assert(_cmd != 0);
+        /* replies to stateless ioctls are the same for the same input */
+        cache_result = _cmd == 1 && res != -100 && handler.may_cache(_request);
         _cmd = 0;
         _request = 0;
 
@@ -455,6 +800,13 @@ public class IoctlClient : GLib.Object {
         _ctx.invoke(complete_idle);
     }
 
+    /* Like complete(), but first pass fd to the client, like the backing
+     * fd of a mapped region; this takes ownership of fd */
+    internal void complete_with_fd(long res, int fd) {
+        mmap_fd = fd;
+        complete(res, 0);
+    }
+
     /**
      * umockdev_ioctl_client_abort:
      * @self: A #UMockdevIoctlClient
@@ -477,8 +829,22 @@ public class IoctlClient : GLib.Object {
 
         yield _arg.flush();
 
+        /* The backing fd of a mapped region is passed right before DONE */
+        if (!_abort && mmap_fd >= 0 && result >= 0) {
+            args[0] = 12; /* MMAP_FD */
+            args[1] = 0;
+            args[2] = 0;
+
+            yield output.write_all_async((uint8[])args, 0, null, null);
+            ((UnixConnection) stream).send_fd(mmap_fd, null);
+        }
+        if (mmap_fd >= 0) {
+            Posix.close(mmap_fd);
+            mmap_fd = -1;
+        }
+
         if (!_abort) {
-            args[0] = 3; /* DONE */
+            args[0] = cache_result ? 15 : 3; /* DONE_CACHE or DONE */
             args[1] = result;
             args[2] = result_errno;
         } else {
@@ -526,19 +892,61 @@ public class IoctlClient : GLib.Object {
             return;
         }
 
-        assert(args[0] == 1 || args[0] == 7 || args[0] == 8);
+        /* 0x100 flags O_NONBLOCK */
+        nonblock = (args[0] & 0x100) != 0;
+        args[0] &= ~0x100UL;
+        assert(args[0] == 1 || args[0] == 7 || args[0] == 8 || args[0] == 12 ||
+               args[0] == 13 || args[0] == 14);
         _cmd = args[0];
 
+        if (args[0] == 12) {
+            handle_mmap((uint64) args[1], (size_t) args[2]);
+            return;
+        }
+
+        /* pread()/pwrite() are only meaningful for handlers that let the
+         * client do the I/O or which serve data by position; for everything
+         * else run them on the node */
+        if (args[0] == 13 || args[0] == 14) {
+            int64 pos[1];
+            try {
+                yield input.read_all_async((uint8[]) pos, 0, null, out bytes);
+            } catch (GLib.Error e) {
+                try {
+                    yield stream.close_async();
+                } catch (IOError e) {};
+                return;
+            }
+            io_pos = pos[0];
+
+            if (!handler.io_passthrough && !handler.positional_io) {
+                _request = 0;
+                _arg = new IoctlData(stream, shm);
+                _arg.data = new uint8[0];
+                complete(-100, 0);
+                return;
+            }
+            args[0] = args[0] == 13 ? 7 : 8;
+        }
+
         if (args[0] == 1) {
             _request = args[1];
-            _arg = new IoctlData(stream);
+            _arg = new IoctlData(stream, shm);
             _arg.data = new uint8[sizeof(ulong)];
             *(ulong*) _arg.data = args[2];
         } else {
             _request = 0;
-            _arg = new IoctlData(stream);
-            _arg.data = new uint8[args[2]];
+            _arg = new IoctlData(stream, shm);
             _arg.client_addr = args[1];
+            io_length = (size_t) args[2];
+
+            /* the buffer is not needed when the client does the I/O */
+            if (handler.io_passthrough) {
+                _arg.data = new uint8[0];
+                _arg.client_addr = 0;
+            } else {
+                _arg.data = new uint8[args[2]];
+            }
 
             try {
                 _arg.load_data();
@@ -604,6 +1012,28 @@ public class IoctlClient : GLib.Object {
         }
     }
 
+    private void handle_mmap(uint64 offset, size_t length)
+    {
+        uint64 region_offset;
+
+        _request = 0;
+        _arg = new IoctlData(stream, shm);
+        _arg.data = new uint8[0];
+
+        if (!(stream is UnixConnection)) {
+            complete(-100, 0);
+            return;
+        }
+
+        int res = handler.lookup_mmap_region(offset, length, out mmap_fd, out region_offset);
+        if (res < 0)
+            complete(-100, 0); /* not emulated, map the backing file */
+        else if (res == 0)
+            complete((long) region_offset, 0);
+        else
+            complete(-1, res);
+    }
+
     private bool complete_idle()
     {
         /* Set completed early, so that an IO error will not trigger the
@@ -630,6 +1060,7 @@ public class IoctlClient : GLib.Object {
     {
         this.handler = handler;
         this.stream = stream;
+        this.shm = new IoctlSharedBuffer(stream);
         this._devnode = devnode;
         this._ctx = GLib.MainContext.get_thread_default();
 
@@ -730,6 +1161,36 @@ public class IoctlClient : GLib.Object {
  * Returns: #TRUE if the request is being handled, #FALSE otherwise.
  * Since: 0.16
  */
+/**
+ * UMockdevIoctlBase:cache-stateless:
+ *
+ * Whether clients may keep the replies to stateless ioctls like
+ * EVIOCGNAME or HIDIOCGRDESC, and answer repeated identical requests without
+ * asking the handler again. This is on for recorded ioctl trees; handlers
+ * which compute these replies can turn it on if the answers never change, or
+ * call umockdev_ioctl_base_invalidate_cache() when they do. The input state
+ * of evdev devices (EVIOCGKEY, EVIOCGABS, ...) is never cached, as replayed
+ * events change it.
+ *
+ * Since: 0.19
+ */
+/**
+ * UMockdevIoctlBase:emulate-mmap:
+ *
+ * Whether clients pass mmap() of the device on to the handler. Otherwise they
+ * map the device node directly, without asking. umockdev_ioctl_base_add_mmap_region()
+ * turns this on; handlers which only add regions once a program asks for
+ * them (like V4L2 buffers) have to turn it on before programs open the
+ * device.
+ *
+ * Since: 0.19
+ */
+
+private struct IoctlMmapRegion {
+    uint64 offset;
+    size_t size;
+    int fd;
+}
 
 private class StartListenClosure {
     public IoctlBase handler;
@@ -758,6 +1219,24 @@ extern const int IOCTL_BASE_HANDLE_WRITE_OFFSET;
 
 public class IoctlBase: GLib.Object {
     private HashTable<string,Cancellable> listeners;
+    private Array<IoctlMmapRegion?> mmap_regions;
+
+    /* Only ioctls need emulation, read()/write() go straight to the device
+     * node. The preload recognizes this by the socket not being executable,
+     * or by the HELLO on abstract sockets. */
+    internal bool ioctl_only = false;
+    /* read()/write() and their positional variants are only delayed, then
+     * they are run by the client itself; their data is never loaded */
+    internal bool io_passthrough = false;
+    /* pread()/pwrite() are handled like read()/write() with their offset in
+     * the client's io_pos; read() of sysfs attributes always comes as pread() */
+    internal bool positional_io = false;
+
+    [Description(nick = "cache stateless", blurb = "Whether clients may cache replies to stateless ioctls")]
+    public bool cache_stateless { get; set; default = false; }
+
+    [Description(nick = "emulate mmap", blurb = "Whether clients pass mmap() on to the handler")]
+    public bool emulate_mmap { get; set; default = false; }
 
     static construct {
         GLib.Signal.@new("handle-ioctl", typeof(IoctlBase), GLib.SignalFlags.RUN_LAST, IOCTL_BASE_HANDLE_IOCTL_OFFSET, signal_accumulator_true_handled, null, null, typeof(bool), 1, typeof(IoctlClient));
@@ -767,18 +1246,146 @@ public class IoctlBase: GLib.Object {
 
     construct {
         listeners = new HashTable<string,Cancellable>(str_hash, str_equal);
+        mmap_regions = new Array<IoctlMmapRegion?>();
     }
 
     ~IoctlBase()
     {
+        for (uint i = 0; i < mmap_regions.length; i++)
+            Posix.close(mmap_regions.index(i).fd);
+    }
+
+    /**
+     * umockdev_ioctl_base_add_mmap_region:
+     * @self: A #UMockdevIoctlBase
+     * @offset: mmap() offset at which clients find the region
+     * @fd: File descriptor backing the region, usually a memfd
+     * @size: Size of the region in bytes
+     *
+     * Make a region available for mmap() on the emulated device. A client
+     * mapping (part of) the range @offset to @offset + @size maps @fd
+     * directly, so that the handler and the client share the memory. This is
+     * what e.g. V4L2 or DRM buffers need.
+     *
+     * The file descriptor is duplicated, the caller keeps ownership of @fd.
+     * This turns on #UMockdevIoctlBase:emulate-mmap, which only affects
+     * programs that open the device afterwards.
+     *
+     * Since: 0.19
+     */
+    public void add_mmap_region(uint64 offset, int fd, size_t size)
+    {
+        IoctlMmapRegion region = { offset, size, Posix.dup(fd) };
+
+        emulate_mmap = true;
+
+        assert(region.fd >= 0);
+        Posix.fcntl(region.fd, Posix.F_SETFD, Posix.FD_CLOEXEC);
+
+        lock (mmap_regions) {
+            remove_mmap_region_locked(offset);
+            mmap_regions.append_val(region);
+        }
+    }
+
+    /**
+     * umockdev_ioctl_base_remove_mmap_region:
+     * @self: A #UMockdevIoctlBase
+     * @offset: mmap() offset of the region, as passed to umockdev_ioctl_base_add_mmap_region()
+     *
+     * Remove a region again. Existing client mappings stay valid.
+     *
+     * Since: 0.19
+     */
+    public void remove_mmap_region(uint64 offset)
+    {
+        lock (mmap_regions)
+            remove_mmap_region_locked(offset);
+    }
+
+    private void remove_mmap_region_locked(uint64 offset)
+    {
+        for (uint i = 0; i < mmap_regions.length; i++) {
+            if (mmap_regions.index(i).offset == offset) {
+                Posix.close(mmap_regions.index(i).fd);
+                mmap_regions.remove_index(i);
+                return;
+            }
+        }
+    }
+
+    /**
+     * umockdev_ioctl_base_invalidate_cache:
+     * @self: A #UMockdevIoctlBase
+     *
+     * Drop the replies to stateless ioctls that clients have cached, see
+     * #UMockdevIoctlBase:cache-stateless. Requests which are already being
+     * answered from the cache when this is called may still see the old reply.
+     *
+     * Since: 0.19
+     */
+    public void invalidate_cache()
+    {
+        lock (listeners) {
+            listeners.foreach((devnode, cancellable) => {
+                /* the preload keeps the generation mapped and compares it to
+                 * the one it saw when filling the cache */
+                string path = cancellable.get_data("cachepath");
+                uint32 generation = 0;
+                int fd = Posix.open(path, Posix.O_RDWR | Posix.O_CLOEXEC);
+                bool ok = fd >= 0 && Posix.pread(fd, &generation, sizeof(uint32), 0) == sizeof(uint32);
+                if (ok) {
+                    generation++;
+                    ok = Posix.pwrite(fd, &generation, sizeof(uint32), 0) == sizeof(uint32);
+                }
+                if (!ok)
+                    warning("Cannot invalidate ioctl cache of %s: %s", devnode, Posix.strerror(Posix.errno));
+                if (fd >= 0)
+                    Posix.close(fd);
+            });
+        }
+    }
+
+    /* Whether clients may cache the reply to request */
+    internal virtual bool may_cache(ulong request)
+    {
+        return cache_stateless && IoctlTree.type_is_stateless(request);
+    }
+
+    /* Returns 0 and a new fd for the region with the offset inside of it, or
+     * an errno. Without any regions, mmap() is not emulated at all. */
+    internal int lookup_mmap_region(uint64 offset, size_t length, out int fd, out uint64 fd_offset)
+    {
+        fd = -1;
+        fd_offset = 0;
+
+        lock (mmap_regions) {
+            if (mmap_regions.length == 0)
+                return -1;
+
+            for (uint i = 0; i < mmap_regions.length; i++) {
+                unowned IoctlMmapRegion? region = mmap_regions.index(i);
+
+                if (offset >= region.offset && offset + length <= region.offset + region.size) {
+                    fd = Posix.dup(region.fd);
+                    fd_offset = offset - region.offset;
+                    return fd >= 0 ? 0 : Posix.errno;
+                }
+            }
+        }
+
+        return Posix.EINVAL;
     }
 
     internal async void socket_listen(SocketListener listener, string devnode)
     {
         Cancellable cancellable;
+        bool hello;
 
         lock (listeners)
           cancellable = listeners[devnode];
+        /* abstract sockets have no file whose mode tells about ioctl_only */
+        hello = cancellable.get_data<string>("sockpath") == null;
 
         try {
             while (true) {
@@ -787,6 +1394,19 @@ public class IoctlBase: GLib.Object {
 
                 connection = yield listener.accept_async(cancellable);
 
+                if (hello) {
+                    ulong args[3];
+                    args[0] = 16; /* HELLO */
+                    args[1] = ioctl_only ? 1 : 0;
+                    args[2] = emulate_mmap ? 1 : 0;
+                    try {
+                        connection.get_output_stream().write_all((uint8[])args, null, null);
+                    } catch (IOError e) {
+                        /* the client went away already */
+                        continue;
+                    }
+                }
+
                 client = new IoctlClient(this, connection, devnode);
 
                 client_connected(client);
@@ -805,22 +1425,47 @@ public class IoctlBase: GLib.Object {
     {
         assert(DirUtils.create_with_parents(Path.get_dirname(sockpath), 0755) == 0);
 
+        if (listen(ctx, devnode, new UnixSocketAddress(sockpath), sockpath, sockpath + ".cache"))
+            Posix.chmod(sockpath, ioctl_only ? 0644 : 0755);
+    }
+
+    /* Like register_path(), but on a socket in the abstract namespace, which
+     * needs no file; as clients cannot check for an executable socket, they
+     * are told about ioctl_only with a HELLO after connecting. cachepath is
+     * the file for invalidate_cache(). */
+    internal void register_abstract(GLib.MainContext? ctx, string devnode, string name, string cachepath)
+    {
+        listen(ctx, devnode, new UnixSocketAddress.with_type(name, -1, UnixSocketAddressType.ABSTRACT),
+               null, cachepath);
+    }
+
+    private bool listen(GLib.MainContext? ctx, string devnode, SocketAddress addr, string? sockpath, string cachepath)
+    {
         Cancellable cancellable = new Cancellable();
 
         cancellable.set_data("sockpath", sockpath);
+        cancellable.set_data("cachepath", cachepath);
+
+        /* the cache generation is a native uint32, only ever written in place
+         * by invalidate_cache(); clients which still map an old file keep it */
+        uint32 generation = 0;
+        Posix.unlink(cachepath);
+        int fd = Posix.open(cachepath, Posix.O_RDWR | Posix.O_CREAT | Posix.O_CLOEXEC, 0644);
+        if (fd < 0 || Posix.pwrite(fd, &generation, sizeof(uint32), 0) != sizeof(uint32))
+            warning("Cannot create ioctl cache generation for %s: %s", devnode, Posix.strerror(Posix.errno));
+        if (fd >= 0)
+            Posix.close(fd);
 
         /* We create new listener for each file; purely because we may not
          * have the correct main context in construct yet. */
         SocketListener listener;
-        SocketAddress addr;
 
         listener = new SocketListener();
-        addr = new UnixSocketAddress(sockpath);
         try {
             listener.add_address(addr, SocketType.STREAM, SocketProtocol.DEFAULT, this, null);
         } catch (GLib.Error e) {
             warning("Error listening on ioctl socket for %s", devnode);
-            return;
+            return false;
         }
 
         lock (listeners)
@@ -828,6 +1473,16 @@ public class IoctlBase: GLib.Object {
 
         StartListenClosure tmp = new StartListenClosure(this, listener, devnode);
         ctx.invoke(tmp.cb);
+        return true;
+    }
+
+    private static void unlink_paths(Cancellable cancellable)
+    {
+        string? sockpath = cancellable.get_data("sockpath");
+
+        if (sockpath != null)
+            Posix.unlink(sockpath);
+        Posix.unlink(cancellable.get_data("cachepath"));
     }
 
 #if INTERNAL_UNREGISTER_PATH_API
@@ -835,7 +1490,7 @@ public class IoctlBase: GLib.Object {
     {
         lock (listeners) {
             listeners[devnode].cancel();
-            Posix.unlink(listeners[devnode].get_data("sockpath"));
+            unlink_paths(listeners[devnode]);
             listeners.remove(devnode);
         }
     }
@@ -847,7 +1502,7 @@ public class IoctlBase: GLib.Object {
         lock (listeners) {
             listeners.foreach_remove((key, val) => {
                 val.cancel();
-                Posix.unlink(val.get_data("sockpath"));
+                unlink_paths(val);
                 return true;
             });
         }
@@ -881,16 +1536,35 @@ private IoctlData? last_submit_urb = null;
 
 internal class IoctlTreeHandler : IoctlBase {
 
-    private IoctlTree.Tree tree;
+    protected IoctlTree.Tree tree;
 
     public IoctlTreeHandler(string file)
     {
         base ();
 
+        cache_stateless = true;
+
         Posix.FILE f = Posix.FILE.open(file, "r");
         tree = new IoctlTree.Tree(f);
     }
 
+    /* Write the nodes which answered ioctls so far into file, with a @DEV
+     * header for device; as the tree is used by the worker thread, this
+     * should be called when the clients are done. */
+    public bool write_executed(string file, string device, out IoctlTree.Stats stats)
+    {
+        stats = {};
+        Posix.FILE? f = Posix.FILE.open(file, "w");
+        if (f == null)
+            return false;
+        f.printf("@DEV %s\n", device);
+        if (tree != null) {
+            tree.write_executed(f);
+            tree.get_stats(out stats);
+        }
+        return f.flush() == 0;
+    }
+
     public override bool handle_ioctl(IoctlClient client) {
         void* last = null;
         IoctlData? data = null;
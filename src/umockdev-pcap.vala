@@ -47,6 +47,264 @@ private struct UrbInfo {
     uint64 pcap_id;
 }
 
+private struct PcapPacket {
+    uint64 offset;
+    uint32 caplen;
+    bool swapped;
+}
+
+/* Random access reader for pcap and pcapng files.
+ *
+ * The file is mapped read-only and only an offset index of the packets is kept
+ * in memory. Pages further than WINDOW behind the cursor are released again
+ * and the window in front of it is prefetched, so the resident set stays
+ * bounded even for multi-GB captures.
+ */
+internal class PcapMmapReader {
+    /* Keep madvise() ranges aligned to any page size we might run on */
+    const size_t ALIGN = 64 * 1024;
+    const size_t WINDOW = 4 * 1024 * 1024;
+
+    const uint32 PCAP_MAGIC_USEC = 0xa1b2c3d4;
+    const uint32 PCAP_MAGIC_NSEC = 0xa1b23c4d;
+    const uint32 PCAPNG_SHB = 0x0a0d0d0a;
+    const uint32 PCAPNG_BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+    const uint32 PCAPNG_IDB = 1;
+    const uint32 PCAPNG_PB = 2;
+    const uint32 PCAPNG_SPB = 3;
+    const uint32 PCAPNG_EPB = 6;
+
+    private uint8* map = null;
+    private size_t map_size;
+    private Array<PcapPacket?> index;
+    private size_t released = 0;
+    private size_t prefetch_start = 0;
+    private size_t prefetched = 0;
+
+    public uint length { get { return index.length; } }
+    public uint cursor { get; private set; default = 0; }
+
+    public PcapMmapReader(string file, int linktype) throws FileError
+    {
+        int fd = Posix.open(file, Posix.O_RDONLY | Posix.O_CLOEXEC);
+        if (fd < 0)
+            throw new FileError.FAILED("Cannot open pcap file %s: %m".printf(file));
+        load(fd, file, linktype);
+    }
+
+    /* Read the recording from an fd (e. g. a memfd), which gets closed; file
+     * is only used for error messages */
+    public PcapMmapReader.from_fd(int fd, string file, int linktype) throws FileError
+    {
+        load(fd, file, linktype);
+    }
+
+    private void load(int fd, string file, int linktype) throws FileError
+    {
+        Posix.Stat st;
+        if (Posix.fstat(fd, out st) < 0 || st.st_size < 4) {
+            Posix.close(fd);
+            throw new FileError.INVAL("%s is not a pcap file".printf(file));
+        }
+
+        map_size = (size_t) st.st_size;
+        map = Posix.mmap(null, map_size, Posix.PROT_READ, Posix.MAP_PRIVATE, fd, 0);
+        Posix.close(fd);
+        if ((void*) map == Posix.MAP_FAILED) {
+            map = null;
+            throw new FileError.FAILED("Cannot map pcap file %s: %m".printf(file));
+        }
+        LinuxFixes.madvise(map, map_size, LinuxFixes.MADV_SEQUENTIAL);
+
+        index = new Array<PcapPacket?>();
+        if (read_u32(0, false) == PCAPNG_SHB)
+            index_pcapng(file, linktype);
+        else
+            index_pcap(file, linktype);
+
+        /* indexing touched the whole file, start out with a clean slate */
+        LinuxFixes.madvise(map, map_size, LinuxFixes.MADV_DONTNEED);
+        released = 0;
+        seek(0);
+    }
+
+    ~PcapMmapReader()
+    {
+        if (map != null)
+            Posix.munmap(map, map_size);
+    }
+
+    /* Start of the packet data (not copied, may be unaligned) */
+    public uint8* packet(uint idx)
+    {
+        return map + index.index(idx).offset;
+    }
+
+    public uint32 caplen(uint idx)
+    {
+        return index.index(idx).caplen;
+    }
+
+    /* Whether the packet was written on a host with different byte order */
+    public bool swapped(uint idx)
+    {
+        return index.index(idx).swapped;
+    }
+
+    /* Packet at the cursor, or null at the end of the recording */
+    public uint8* current()
+    {
+        return cursor < length ? packet(cursor) : null;
+    }
+
+    public void advance()
+    {
+        if (cursor < length)
+            seek(cursor + 1);
+    }
+
+    public void seek(uint idx)
+    {
+        cursor = idx;
+        if (idx >= length)
+            return;
+
+        size_t pos = (size_t) index.index(idx).offset;
+
+        /* We went backwards; pages before pos may be resident again */
+        if (pos < released)
+            released = pos & ~(ALIGN - 1);
+
+        if (pos > WINDOW) {
+            size_t end = (pos - WINDOW) & ~(ALIGN - 1);
+            if (end > released) {
+                LinuxFixes.madvise(map + released, end - released, LinuxFixes.MADV_DONTNEED);
+                released = end;
+            }
+        }
+
+        /* Prefetch the lookahead window once half of it has been consumed */
+        if (pos >= prefetch_start && pos + WINDOW / 2 < prefetched)
+            return;
+        prefetch_start = pos & ~(ALIGN - 1);
+        prefetched = prefetch_start + WINDOW;
+        if (prefetched > map_size)
+            prefetched = map_size;
+        LinuxFixes.madvise(map + prefetch_start, prefetched - prefetch_start, LinuxFixes.MADV_WILLNEED);
+    }
+
+    private uint16 read_u16(size_t offset, bool swap)
+    {
+        uint16 v = 0;
+        Posix.memcpy(&v, map + offset, sizeof(uint16));
+        return swap ? v.swap_little_endian_big_endian() : v;
+    }
+
+    private uint32 read_u32(size_t offset, bool swap)
+    {
+        uint32 v = 0;
+        Posix.memcpy(&v, map + offset, sizeof(uint32));
+        return swap ? v.swap_little_endian_big_endian() : v;
+    }
+
+    private void add_packet(size_t offset, uint32 caplen, bool swap, string file) throws FileError
+    {
+        if (offset + caplen > map_size)
+            throw new FileError.INVAL("%s: truncated packet at offset %lu".printf(file, (ulong) offset));
+
+        PcapPacket pkt = { offset, caplen, swap };
+        index.append_val(pkt);
+
+        /* Don't let indexing pull the whole file into memory */
+        if (offset > released + 2 * WINDOW) {
+            size_t end = (offset - WINDOW) & ~(ALIGN - 1);
+            LinuxFixes.madvise(map + released, end - released, LinuxFixes.MADV_DONTNEED);
+            released = end;
+        }
+    }
+
+    private void index_pcap(string file, int linktype) throws FileError
+    {
+        bool swap;
+        uint32 magic = read_u32(0, false);
+
+        if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC)
+            swap = false;
+        else if (magic.swap_little_endian_big_endian() == PCAP_MAGIC_USEC ||
+                 magic.swap_little_endian_big_endian() == PCAP_MAGIC_NSEC)
+            swap = true;
+        else
+            throw new FileError.INVAL("%s is not a pcap or pcapng file".printf(file));
+
+        if (map_size < 24)
+            throw new FileError.INVAL("%s: truncated pcap header".printf(file));
+        if ((read_u32(20, swap) & 0xffff) != linktype)
+            throw new FileError.INVAL("%s: unsupported link type %u".printf(file, read_u32(20, swap) & 0xffff));
+
+        for (size_t pos = 24; pos + 16 <= map_size; ) {
+            uint32 caplen = read_u32(pos + 8, swap);
+            add_packet(pos + 16, caplen, swap, file);
+            pos += 16 + caplen;
+        }
+    }
+
+    private void index_pcapng(string file, int linktype) throws FileError
+    {
+        bool swap = false;
+        var if_linktypes = new Array<uint16>();
+
+        for (size_t pos = 0; pos + 12 <= map_size; ) {
+            uint32 type = read_u32(pos, swap);
+
+            if (type == PCAPNG_SHB) {
+                /* Each section may have a different byte order */
+                uint32 bom = read_u32(pos + 8, false);
+                if (bom == PCAPNG_BYTE_ORDER_MAGIC)
+                    swap = false;
+                else if (bom.swap_little_endian_big_endian() == PCAPNG_BYTE_ORDER_MAGIC)
+                    swap = true;
+                else
+                    throw new FileError.INVAL("%s: invalid pcapng section header".printf(file));
+                if_linktypes.set_size(0);
+            }
+
+            uint32 block_len = read_u32(pos + 4, swap);
+            if (block_len < 12 || block_len % 4 != 0 || pos + block_len > map_size)
+                throw new FileError.INVAL("%s: invalid pcapng block at offset %lu".printf(file, (ulong) pos));
+
+            switch (type) {
+                case PCAPNG_IDB:
+                    if_linktypes.append_val(read_u16(pos + 8, swap));
+                    break;
+
+                case PCAPNG_EPB:
+                case PCAPNG_PB:
+                    uint32 iface = type == PCAPNG_EPB ? read_u32(pos + 8, swap) : read_u16(pos + 8, swap);
+                    if (iface >= if_linktypes.length || if_linktypes.index(iface) != linktype)
+                        throw new FileError.INVAL("%s: packet on unknown or unsupported interface %u".printf(file, iface));
+                    add_packet(pos + 28, read_u32(pos + 20, swap), swap, file);
+                    break;
+
+                case PCAPNG_SPB:
+                    if (if_linktypes.length == 0 || if_linktypes.index(0) != linktype)
+                        throw new FileError.INVAL("%s: packet on unknown or unsupported interface 0".printf(file));
+                    /* The simple packet block has no captured length field */
+                    uint32 caplen = read_u32(pos + 8, swap);
+                    if (caplen > block_len - 16)
+                        caplen = block_len - 16;
+                    add_packet(pos + 12, caplen, swap, file);
+                    break;
+
+                default:
+                    /* Name resolution, statistics, custom blocks, ... */
+                    break;
+            }
+
+            pos += block_len;
+        }
+    }
+}
+
 
 internal class IoctlUsbPcapHandler : IoctlBase {
 
@@ -56,24 +314,20 @@ internal class IoctlUsbPcapHandler : IoctlBase {
                                 USBDEVFS_CAP_NO_PACKET_SIZE_LIM |
                                 USBDEVFS_CAP_REAP_AFTER_DISCONNECT |
                                 USBDEVFS_CAP_ZERO_PACKET;
-    private pcap.pcap rec;
+    private PcapMmapReader rec;
     private Array<UrbInfo?> urbs;
     private Array<UrbInfo?> discarded;
     private int bus;
     private int device;
 
-    public IoctlUsbPcapHandler(string file, int bus, int device)
+    /* Only DLT_USB_LINUX_MMAPPED recordings are supported */
+    public IoctlUsbPcapHandler(PcapMmapReader rec, int bus, int device)
     {
-        char errbuf[pcap.ERRBUF_SIZE];
         base ();
 
         this.bus = bus;
         this.device = device;
-
-        rec = new pcap.pcap.open_offline(file, errbuf);
-
-        if (rec.datalink() != dlt.USB_LINUX_MMAPPED)
-            error("Only DLT_USB_LINUX_MMAPPED recordings are supported!");
+        this.rec = rec;
 
         urbs = new Array<UrbInfo?>();
         discarded = new Array<UrbInfo?>();
@@ -180,11 +434,45 @@ internal class IoctlUsbPcapHandler : IoctlBase {
     /* If we are stuck, we need to be able to look at the already fetched
      * packet. As such, keep it in a global state.
      */
-    private pcap.pkthdr cur_hdr;
+    private usb_header_mmapped cur_hdr;
     private uint64 start_time_ms;
     private uint64 last_pkt_time_ms;
     private uint64 cur_waiting_since;
-    private unowned uint8[]? cur_buf = null;
+    private uint8* cur_buf = null;
+
+    /* Copy out the (possibly unaligned) header and fix up its byte order */
+    private void read_header(uint idx, out usb_header_mmapped hdr) {
+        assert(rec.caplen(idx) >= 64);
+
+        hdr = {};
+        Posix.memcpy(&hdr, rec.packet(idx), sizeof(usb_header_mmapped));
+        if (!rec.swapped(idx))
+            return;
+
+        hdr.id = hdr.id.swap_little_endian_big_endian();
+        hdr.bus_id = hdr.bus_id.swap_little_endian_big_endian();
+        hdr.ts_sec = hdr.ts_sec.swap_little_endian_big_endian();
+        hdr.ts_usec = hdr.ts_usec.swap_little_endian_big_endian();
+        hdr.status = hdr.status.swap_little_endian_big_endian();
+        hdr.urb_len = hdr.urb_len.swap_little_endian_big_endian();
+        hdr.data_len = hdr.data_len.swap_little_endian_big_endian();
+        hdr.interval = hdr.interval.swap_little_endian_big_endian();
+        hdr.start_frame = hdr.start_frame.swap_little_endian_big_endian();
+        hdr.transfer_flags = hdr.transfer_flags.swap_little_endian_big_endian();
+        hdr.iso_numdesc = hdr.iso_numdesc.swap_little_endian_big_endian();
+    }
+
+    /* Load the packet at the reader's cursor into cur_buf/cur_hdr */
+    private void fetch_packet() {
+        cur_buf = rec.current();
+        if (cur_buf != null)
+            read_header(rec.cursor, out cur_hdr);
+    }
+
+    private void next_packet() {
+        rec.advance();
+        fetch_packet();
+    }
 
     private UrbInfo? next_reapable_urb() {
         bool debug = false;
@@ -199,22 +487,20 @@ internal class IoctlUsbPcapHandler : IoctlBase {
 
         /* Fetch the first packet if we do not have one. */
         if (cur_buf == null) {
-            cur_buf = rec.next(ref cur_hdr);
+            fetch_packet();
 
             if (cur_buf == null)
                 return null;
 
-            usb_header_mmapped *urb_hdr = (void*) cur_buf;
+            usb_header_mmapped *urb_hdr = &cur_hdr;
 
             cur_waiting_since = now;
             last_pkt_time_ms = urb_hdr.ts_sec * 1000 + urb_hdr.ts_usec / 1000;
             start_time_ms = last_pkt_time_ms;
         }
 
-        for (; cur_buf != null; cur_buf = rec.next(ref cur_hdr), cur_waiting_since = now) {
-            assert(cur_hdr.caplen >= 64);
-
-            usb_header_mmapped *urb_hdr = (void*) cur_buf;
+        for (; cur_buf != null; next_packet(), cur_waiting_since = now) {
+            usb_header_mmapped *urb_hdr = &cur_hdr;
 
             uint64 cur_pkt_time_ms = urb_hdr.ts_sec * 1000 + urb_hdr.ts_usec / 1000;
 
@@ -241,6 +527,21 @@ internal class IoctlUsbPcapHandler : IoctlBase {
                             urb_type_to_string(urb.type), urb.endpoint, urb.buffer_length,
                             urb_data.pcap_id == 0 ? "NOT " : "");
                 }
+
+                /* Peek ahead without consuming, to show what the recording expects next */
+                message("Next packets for this device in the recording:");
+                uint shown = 0;
+                for (uint i = rec.cursor + 1; i < rec.length && shown < 5; i++) {
+                    usb_header_mmapped next_hdr;
+                    read_header(i, out next_hdr);
+                    if (next_hdr.bus_id != bus || next_hdr.device_address != device)
+                        continue;
+                    message("   %c %s packet, for endpoint 0x%02x with length %u (time: %.3f)",
+                            next_hdr.event_type, urb_type_to_string(next_hdr.transfer_type),
+                            next_hdr.endpoint_number, next_hdr.urb_len,
+                            (next_hdr.ts_sec * 1000 + next_hdr.ts_usec / 1000 - start_time_ms) / 1000.0);
+                    shown++;
+                }
                 cur_waiting_since = now;
                 debug = true;
             }
@@ -121,16 +121,19 @@ format_hex(uint8[] bytes, int len=-1)
     return result.str;
 }
 
+// the device description
+static StringBuilder dump;
+
 static void
 write_attr(string name, uint8[] val)
 {
     // check if it's text or binary
     string strval = (string) val;
     if (val.length == strval.length && strval.validate())
-        stdout.printf("A: %s=%s", name, strval.escape(""));
+        dump.append_printf("A: %s=%s", name, strval.escape(""));
     else
-        stdout.printf("H: %s=%s", name, format_hex(val));
-    stdout.putc('\n');
+        dump.append_printf("H: %s=%s", name, format_hex(val));
+    dump.append_c('\n');
 }
 
 // Return contents of device node, if applicable.
@@ -197,7 +200,7 @@ print_device_attributes(string devpath, string subdir)
         string attr_name = Path.build_filename(subdir, attr);
         if (FileUtils.test(attr_path, FileTest.IS_SYMLINK)) {
             try {
-                stdout.printf("L: %s=%s\n", attr_name, FileUtils.read_link(attr_path));
+                dump.append_printf("L: %s=%s\n", attr_name, FileUtils.read_link(attr_path));
             } catch (Error e) {
                 error("Cannot read link %s: %s", attr_path, e.message);
             }
@@ -265,26 +268,26 @@ record_device(string dev)
                 properties.append("E: __DEVCONTEXT=" + context);
 #endif
         }
-        stdout.puts(line);
-        stdout.putc('\n');
+        dump.append(line);
+        dump.append_c('\n');
     }
 
     // print sorted properties
     properties.sort(strcmp);
     foreach (var prop in properties) {
-        stdout.puts(prop);
-        stdout.putc('\n');
+        dump.append(prop);
+        dump.append_c('\n');
     }
 
     // work around kernel crash, skip reading attributes for Tegra stuff (LP #1190225)
     if (dev.contains("tegra")) {
-        stdout.putc('\n');
+        dump.append_c('\n');
         return;
     }
 
     // now append all attributes
     print_device_attributes(dev, "");
-    stdout.putc('\n');
+    dump.append_c('\n');
 }
 
 static void
@@ -308,8 +311,12 @@ static void
 split_devfile_arg(string arg, out string dev, out string devnum, out bool is_block, out string fname)
 {
     string[] parts = arg.split ("=", 2); // devname, ioctlfilename
-    if (parts.length != 2)
+    if (parts.length == 1 && bundle_dir != null) {
+        // only goes into the bundle
+        parts += Path.build_filename(bundle_dir, "%u".printf(bundle_files.length));
+    } else if (parts.length != 2) {
         error("--ioctl argument must be devname=filename");
+    }
     dev = parts[0];
     fname = parts[1];
 
@@ -318,6 +325,9 @@ split_devfile_arg(string arg, out string dev, out string devnum, out bool is_blo
     if (Posix.stat(dev, out st) != 0)
         error("Cannot access device %s: %m", dev);
 
+    if (bundle_dir != null)
+        bundle_files += "%s=%s".printf(dev, fname);
+
     is_block = Posix.S_ISBLK(st.st_mode);
     if (Posix.S_ISCHR(st.st_mode) || Posix.S_ISBLK(st.st_mode)) {
         // if we have a device node, get devnum from stat
@@ -335,6 +345,48 @@ split_devfile_arg(string arg, out string dev, out string devnum, out bool is_blo
     }
 }
 
+/* --bundle: the recording files (as devname=filename) and their kind,
+ * and the directory for the ones which are not kept */
+static UMockdev.Bundle? bundle = null;
+static string? bundle_dir = null;
+static string[] bundle_files;
+static UMockdev.BundleKind[] bundle_kinds;
+
+static UMockdev.Bundle
+open_bundle(string path)
+{
+    if (!FileUtils.test(path, FileTest.EXISTS))
+        return new UMockdev.Bundle();
+    try {
+        return new UMockdev.Bundle.load(path);
+    } catch (Error e) {
+        error("Cannot load bundle %s: %s", path, e.message);
+    }
+}
+
+// Add a member to the bundle, replacing a previous recording of the same target
+static void
+bundle_add(UMockdev.BundleKind kind, string target, Bytes contents)
+{
+    for (uint i = 0; i < bundle.members.length; ++i) {
+        if (bundle.members[i].kind == kind && bundle.members[i].target == target) {
+            bundle.members.remove_index(i);
+            break;
+        }
+    }
+    bundle.add(kind, target, contents);
+}
+
+static void
+save_bundle(string path)
+{
+    try {
+        bundle.save(path);
+    } catch (Error e) {
+        error("Cannot write bundle %s: %s", path, e.message);
+    }
+}
+
 // Record ioctls for given device into outfile
 static UMockdev.IoctlBase
 record_ioctl(string root_dir, string arg)
@@ -343,10 +395,24 @@ record_ioctl(string root_dir, string arg)
     string dev, devnum, outfile;
     bool is_block;
     split_devfile_arg(arg, out dev, out devnum, out is_block, out outfile);
+    bundle_kinds += UMockdev.BundleKind.IOCTL;
+
+    // continue a bundled recording, like with an existing file
+    if (bundle != null && outfile.has_prefix(bundle_dir)) {
+        foreach (unowned UMockdev.BundleMember m in bundle.members.data) {
+            if (m.kind == UMockdev.BundleKind.IOCTL && m.target == dev) {
+                try {
+                    FileUtils.set_data(outfile, m.get_contents().get_data());
+                } catch (Error e) {
+                    error("Cannot extract %s from bundle: %s", dev, e.message);
+                }
+            }
+        }
+    }
 
     /* SPI: major 153, character device */
     if (!is_block && devnum.has_prefix("153:"))
-        handler = new UMockdev.IoctlSpiRecorder(dev, outfile);
+        handler = new UMockdev.IoctlSpiRecorder(dev, outfile, outfile.has_suffix(".bin"));
     else
         handler = new UMockdev.IoctlTreeRecorder(dev, outfile);
 
@@ -365,6 +431,12 @@ record_script(string arg, string format)
     bool is_block;
     split_devfile_arg(arg, out dev, out devnum, out is_block, out outfile);
     string c = record_script_counter.to_string();
+    if (format == "evemu")
+        bundle_kinds += UMockdev.BundleKind.EVEMU_EVENTS;
+    else if (devnum == dev)
+        bundle_kinds += UMockdev.BundleKind.UNIX_STREAM;
+    else
+        bundle_kinds += UMockdev.BundleKind.SCRIPT;
 
     checked_setenv("UMOCKDEV_SCRIPT_RECORD_FILE_" + c, outfile);
     checked_setenv("UMOCKDEV_SCRIPT_RECORD_DEV_" + c, devnum);
@@ -374,6 +446,46 @@ record_script(string arg, string format)
     record_script_counter++;
 }
 
+static UeventMonitor.monitor? uevent_monitor = null;
+static FileStream? uevent_file = null;
+static int64 uevent_time = 0;
+
+static void
+write_uevents ()
+{
+    string? props;
+
+    while ((props = uevent_monitor.receive()) != null) {
+        // keep the rounding to ms from accumulating over the recording
+        int64 now = get_monotonic_time();
+        if (uevent_time == 0)
+            uevent_time = now;
+        int64 delta = (now - uevent_time) / 1000;
+        uevent_time += delta * 1000;
+
+        uevent_file.puts(format_uevent(delta, props));
+    }
+    uevent_file.flush();
+}
+
+// Record the uevents which udevd sends, with the ms since the previous one;
+// see umockdev_testbed_load_uevents() for the format.
+static void
+record_uevents (string path)
+{
+    uevent_monitor = new UeventMonitor.monitor();
+    if (uevent_monitor == null)
+        error("Cannot listen to udev events: %m");
+    uevent_file = FileStream.open(path, "w");
+    if (uevent_file == null)
+        error("Cannot create %s: %m", path);
+
+    new IOChannel.unix_new(uevent_monitor.get_fd()).add_watch(IOCondition.IN, (source, condition) => {
+        write_uevents();
+        return true;
+    });
+}
+
 [CCode (array_length=false, array_null_terminated=true)]
 static string[] opt_devices;
 static bool opt_all = false;
@@ -382,6 +494,8 @@ static string? opt_ioctl = null;
 static string[] opt_script;
 [CCode (array_length=false, array_null_terminated=true)]
 static string[] opt_evemu_events;
+static string? opt_bundle = null;
+static string? opt_uevents = null;
 static bool opt_version = false;
 
 const GLib.OptionEntry[] options = {
@@ -392,7 +506,11 @@ const GLib.OptionEntry[] options = {
      "Trace reads and writes on the device, record into given file. In this case, all positional arguments are a command (and its arguments) to run that gets traced. Can be specified multiple times.", "devname=FILE"},
     {"evemu-events", 'e', 0, OptionArg.FILENAME_ARRAY, ref opt_evemu_events,
      "Trace evdev event reads on the device, record into given file in EVEMU event format. In this case, all positional arguments are a command (and its arguments) to run that gets traced. Can be specified multiple times.", "devname=FILE"},
-    {"", 0, 0, OptionArg.STRING_ARRAY, ref opt_devices, "Path of a device in /dev or /sys, or command and arguments with --ioctl.", "DEVICE [...]"},
+    {"bundle", 'b', 0, OptionArg.FILENAME, ref opt_bundle,
+     "Add the device description or recordings to the given bundle file instead of writing them to stdout or separate files; with a bundle, the =FILE part of --ioctl, --script, and --evemu-events is optional. Recordings of the same device replace the previous ones.", "FILE"},
+    {"uevents", 0, 0, OptionArg.FILENAME, ref opt_uevents,
+     "Record the uevents which udev sends, with their timing, into the given file. This records while the command given as positional arguments runs, or until interrupted without one.", "FILE"},
+    {"", 0, 0, OptionArg.STRING_ARRAY, ref opt_devices, "Path of a device in /dev or /sys, or command and arguments with --ioctl or --uevents.", "DEVICE [...]"},
     {"version", 0, 0, OptionArg.NONE, ref opt_version, "Output version information and exit"},
     { null }
 };
@@ -430,11 +548,41 @@ main (string[] args)
 
     if (opt_all && opt_devices.length > 0)
         error("Specifying a device list together with --all is invalid.");
-    if (!opt_all && opt_devices.length == 0)
+    if (!opt_all && opt_devices.length == 0 && opt_uevents == null)
         error("Need to specify at least one device or --all.");
     if ((opt_ioctl != null || opt_script.length > 0 || opt_evemu_events.length > 0) &&
         (opt_all || opt_devices.length < 1))
         error("For recording ioctls or scripts you have to specify a command to run");
+    if (opt_uevents != null && opt_all)
+        error("--uevents cannot be used together with --all");
+
+    if (opt_uevents != null)
+        record_uevents(opt_uevents);
+
+    // uevent recording mode, while running the command or until interrupted
+    if (opt_uevents != null && opt_ioctl == null && opt_script.length == 0 && opt_evemu_events.length == 0) {
+        loop = new GLib.MainLoop(null);
+        if (opt_devices.length > 0) {
+            try {
+                child_pid = spawn_process_under_test (opt_devices, child_watch_cb);
+            } catch (Error e) {
+                error ("Cannot run %s: %s", opt_devices[0], e.message);
+            }
+        } else {
+            Unix.signal_add(ProcessSignal.INT, () => { loop.quit(); return false; });
+            Unix.signal_add(ProcessSignal.TERM, () => { loop.quit(); return false; });
+        }
+
+        loop.run();
+        write_uevents();
+        uevent_file = null;
+
+        if (Process.if_exited (child_status))
+            return Process.exit_status (child_status);
+        if (Process.if_signaled (child_status))
+            Process.raise (Process.term_sig (child_status));
+        return child_status;
+    }
 
     // device dump mode
     if (opt_ioctl == null && opt_script.length == 0 && opt_evemu_events.length == 0) {
@@ -445,7 +593,15 @@ main (string[] args)
             for (int i = 0; i < opt_devices.length; ++i)
                 opt_devices[i] = resolve(opt_devices[i]);
         }
+        dump = new StringBuilder();
         dump_devices(opt_devices);
+        if (opt_bundle != null) {
+            bundle = open_bundle(opt_bundle);
+            bundle_add(UMockdev.BundleKind.DEVICES, string.joinv(" ", opt_devices), new Bytes(dump.data));
+            save_bundle(opt_bundle);
+        } else {
+            stdout.puts(dump.str);
+        }
         return 0;
     }
 
@@ -461,6 +617,12 @@ main (string[] args)
     try {
         root_dir = DirUtils.make_tmp("umockdev.XXXXXX");
         checked_setenv("UMOCKDEV_DIR", root_dir);
+        // the sockets are in root_dir, not the ones of a surrounding testbed
+        Environment.unset_variable("UMOCKDEV_CHANNEL");
+        if (opt_bundle != null) {
+            bundle = open_bundle(opt_bundle);
+            bundle_dir = DirUtils.make_tmp("umockdev-bundle.XXXXXX");
+        }
     } catch (FileError e) {
         error("Cannot create temporary directory: %s", e.message);
     }
@@ -487,6 +649,10 @@ main (string[] args)
     }
 
     loop.run();
+    if (uevent_file != null) {
+        write_uevents();
+        uevent_file = null;
+    }
 
     debug ("Removing recording directory %s", root_dir);
     remove_dir (root_dir);
@@ -499,6 +665,25 @@ main (string[] args)
         handler.unregister_all();
     while (GLib.MainContext.default().iteration(false)) { };
 
+    if (opt_bundle != null) {
+        // the ioctl recorder writes its file when it goes away
+        handler = null;
+
+        for (int i = 0; i < bundle_files.length; ++i) {
+            string[] parts = bundle_files[i].split("=", 2);
+            try {
+                uint8[] contents;
+                FileUtils.get_data(parts[1], out contents);
+                bundle_add(bundle_kinds[i], parts[0], new Bytes.take((owned) contents));
+            } catch (FileError e) {
+                // the program did not use the device
+                debug("Not adding %s to bundle: %s", parts[1], e.message);
+            }
+        }
+        save_bundle(opt_bundle);
+        remove_dir(bundle_dir);
+    }
+
     if (Process.if_exited (child_status))
         return Process.exit_status (child_status);
     if (Process.if_signaled (child_status))
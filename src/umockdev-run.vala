@@ -33,7 +33,16 @@ static string[] opt_unix_stream;
 [CCode (array_length=false, array_null_terminated=true)]
 static string[] opt_evemu_events;
 [CCode (array_length=false, array_null_terminated=true)]
+static string[] opt_bundle;
+[CCode (array_length=false, array_null_terminated=true)]
 static string[] opt_program;
+[CCode (array_length=false, array_null_terminated=true)]
+static string[] opt_prune_ioctl;
+[CCode (array_length=false, array_null_terminated=true)]
+static string[] opt_uevents;
+static double opt_uevents_time_scale = 1.0;
+static string? opt_trace = null;
+static string? opt_minimize = null;
 static bool opt_version = false;
 
 const GLib.OptionEntry[] options = {
@@ -55,6 +64,24 @@ const GLib.OptionEntry[] options = {
     {"evemu-events", 'e', 0, OptionArg.FILENAME_ARRAY, ref opt_evemu_events,
      "Load an evemu .events file into the testbed. Can be specified multiple times.",
      "devname=eventsfilename"},
+    {"bundle", 'b', 0, OptionArg.FILENAME_ARRAY, ref opt_bundle,
+     "Load an umockdev-record bundle with device descriptions and recordings into the testbed. Can be specified multiple times.",
+     "filename"},
+    {"uevents", 0, 0, OptionArg.FILENAME_ARRAY, ref opt_uevents,
+     "Replay an umockdev-record uevent recording once the program started; devices which it adds or removes get added to or removed from the testbed. Can be specified multiple times.",
+     "filename"},
+    {"uevents-time-scale", 0, 0, OptionArg.DOUBLE, ref opt_uevents_time_scale,
+     "Factor for the time between replayed uevents, e. g. 0.5 for twice as fast, or 0 for sending all events at once (default: 1).",
+     "factor"},
+    {"prune-ioctl", 0, 0, OptionArg.FILENAME_ARRAY, ref opt_prune_ioctl,
+     "After the program finished, write the device's ioctl record with only the parts that the program used into the given file, and show statistics. Can be specified multiple times.",
+     "devname=ioctlfilename"},
+    {"trace", 't', 0, OptionArg.FILENAME, ref opt_trace,
+     "Log the paths in /sys and /dev which the program accesses into the given file.",
+     "filename"},
+    {"minimize", 'm', 0, OptionArg.FILENAME, ref opt_minimize,
+     "Write the devices from --device files into the given file, with only the devices and attributes which the program accessed.",
+     "filename"},
     {"", 0, 0, OptionArg.STRING_ARRAY, ref opt_program, "", ""},
     {"version", 0, 0, OptionArg.NONE, ref opt_version, "Output version information and exit"},
     { null }
@@ -72,6 +99,109 @@ child_watch_cb (Pid pid, int status)
     loop.quit();
 }
 
+/* Paths from the trace log, as in the testbed without its root. Symlinks get
+ * resolved, as devices and attributes are often reached through /sys/class or
+ * /dev symlinks; the path with just the parent directory resolved is added as
+ * well, for symlink attributes like "driver". */
+static GenericSet<string>
+read_trace (string trace, string root)
+{
+    var used = new GenericSet<string> (str_hash, str_equal);
+    string contents;
+
+    try {
+        FileUtils.get_contents (trace, out contents);
+    } catch (FileError e) {
+        // the program did not access anything
+        return used;
+    }
+
+    string real_root = Posix.realpath (root) ?? root;
+    foreach (unowned string path in contents.split ("\n")) {
+        if (path == "")
+            continue;
+        used.add (path);
+        string? real = Posix.realpath (root + path);
+        if (real != null && real.has_prefix (real_root + "/"))
+            used.add (real.substring (real_root.length));
+        string? dir = Posix.realpath (root + Path.get_dirname (path));
+        if (dir != null && dir.has_prefix (real_root + "/"))
+            used.add (Path.build_filename (dir.substring (real_root.length), Path.get_basename (path)));
+    }
+    return used;
+}
+
+static bool
+is_used_below (GenericSet<string> used, string dir)
+{
+    if (used.contains (dir))
+        return true;
+    foreach (unowned string path in used.get_values ())
+        if (path.has_prefix (dir + "/"))
+            return true;
+    return false;
+}
+
+/* Reduce device descriptions to the devices which the program used (i. e.
+ * accessed their sysfs directory or device node), and their parents. Of
+ * these, only the accessed attributes are kept, and "dev" for creating the
+ * device node; properties are read as a whole from the udev database. */
+static string
+minimize_devices (string[] records, GenericSet<string> used)
+{
+    string[] blocks = {};
+    foreach (var record in records)
+        foreach (var block in record.split ("\n\n"))
+            if (block.strip () != "")
+                blocks += block.strip ();
+
+    // find the devices which the program used
+    var keep = new GenericSet<string> (str_hash, str_equal);
+    foreach (var block in blocks) {
+        string devpath = "/sys" + block.split ("\n", 2)[0].substring (3);
+        bool is_used = is_used_below (used, devpath);
+        foreach (var line in block.split ("\n")) {
+            if (is_used)
+                break;
+            if (line.has_prefix ("N: "))
+                is_used = used.contains ("/dev/" + line.substring (3).split ("=", 2)[0]);
+            else if (line.has_prefix ("S: "))
+                is_used = used.contains ("/dev/" + line.substring (3));
+        }
+        if (is_used)
+            keep.add (devpath);
+    }
+
+    var result = new StringBuilder ();
+    foreach (var block in blocks) {
+        string devpath = "/sys" + block.split ("\n", 2)[0].substring (3);
+
+        // parents of used devices are needed as well
+        bool is_kept = false;
+        foreach (unowned string k in keep.get_values ()) {
+            if (k == devpath || k.has_prefix (devpath + "/")) {
+                is_kept = true;
+                break;
+            }
+        }
+        if (!is_kept)
+            continue;
+
+        foreach (var line in block.split ("\n")) {
+            if (line.has_prefix ("A: ") || line.has_prefix ("H: ") || line.has_prefix ("L: ")) {
+                string name = line.substring (3).split ("=", 2)[0];
+                if (name != "dev" && !used.contains (devpath + "/" + name))
+                    continue;
+            }
+            result.append (line);
+            result.append_c ('\n');
+        }
+        result.append_c ('\n');
+    }
+
+    return result.str;
+}
+
 static int
 main (string[] args)
 {
@@ -98,6 +228,7 @@ main (string[] args)
     checked_setenv ("LD_PRELOAD", preload + "libumockdev-preload.so.0");
 
     var testbed = new UMockdev.Testbed ();
+    string[] records = {};
 
     foreach (var path in opt_device) {
         string record;
@@ -113,6 +244,19 @@ main (string[] args)
             stderr.printf ("Error: Invalid record file %s: %s\n", path, e.message);
             return 1;
         }
+        records += record;
+    }
+
+    foreach (var path in opt_bundle) {
+        try {
+            if (!testbed.load_bundle (path)) {
+                stderr.printf ("Error: Cannot load bundle %s\n", path);
+                return 1;
+            }
+        } catch (Error e) {
+            stderr.printf ("Error: Cannot load bundle %s: %s\n", path, e.message);
+            return 1;
+        }
     }
 
     foreach (var i in opt_ioctl) {
@@ -185,11 +329,32 @@ main (string[] args)
         }
     }
 
+    foreach (var i in opt_prune_ioctl) {
+        if (i.split ("=", 2).length != 2) {
+            stderr.printf ("Error: --prune-ioctl argument must be devname=filename\n");
+            return 1;
+        }
+    }
+
+    if (opt_uevents_time_scale < 0) {
+        stderr.printf ("Error: --uevents-time-scale must not be negative\n");
+        return 1;
+    }
+
     if (opt_program.length == 0) {
         stderr.printf ("No program specified. See --help for how to use umockdev-run\n");
         return 1;
     }
 
+    string? trace = opt_trace;
+    if (trace == null && opt_minimize != null)
+        trace = Path.build_filename (testbed.get_root_dir (), "trace");
+    if (trace != null) {
+        trace = File.new_for_path (trace).get_path ();
+        FileUtils.remove (trace);
+        checked_setenv ("UMOCKDEV_TRACE_FILE", trace);
+    }
+
     // we want to run opt_program as a subprocess instead of execve()ing, so
     // that we can run device script threads in the background
     loop = new GLib.MainLoop(null);
@@ -199,8 +364,44 @@ main (string[] args)
         error("Cannot run %s: %s", opt_program[0], e.message);
     }
 
+    foreach (var path in opt_uevents) {
+        try {
+            testbed.load_uevents (path, opt_uevents_time_scale);
+        } catch (Error e) {
+            stderr.printf ("Error: Cannot load uevents %s: %s\n", path, e.message);
+            Posix.kill (child_pid, ProcessSignal.TERM);
+            return 1;
+        }
+    }
+
     loop.run();
 
+    foreach (var i in opt_prune_ioctl) {
+        string[] parts = i.split ("=", 2); // devname, ioctlfilename
+        uint nodes, kept, duplicates;
+        try {
+            if (!testbed.prune_ioctl (parts[0], parts[1], out nodes, out kept, out duplicates)) {
+                stderr.printf ("Error: No ioctl record loaded for %s\n", parts[0]);
+                return 1;
+            }
+        } catch (Error e) {
+            stderr.printf ("Error: Cannot prune ioctl record of %s: %s\n", parts[0], e.message);
+            return 1;
+        }
+        stderr.printf ("%s: kept %u of %u ioctl tree nodes, %u recorded more than once\n",
+                       parts[0], kept, nodes, duplicates);
+    }
+
+    if (opt_minimize != null) {
+        var used = read_trace (trace, testbed.get_root_dir ());
+        try {
+            FileUtils.set_contents (opt_minimize, minimize_devices (records, used));
+        } catch (FileError e) {
+            stderr.printf ("Error: Cannot write %s: %s\n", opt_minimize, e.message);
+            return 1;
+        }
+    }
+
     // free the testbed here already, so that it gets cleaned up before raise()
     testbed = null;
 
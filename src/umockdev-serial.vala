@@ -0,0 +1,393 @@
+/*
+ * Serial port emulation
+ *
+ * umockdev is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * umockdev is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+namespace UMockdev {
+
+using Ioctl;
+
+/* A TIOCMIWAIT call, waiting for one of the lines in mask to change */
+private class SerialLineWaiter {
+    public IoctlClient client;
+    public uint mask;
+}
+
+/* Emulation of a serial port on top of the pty of its device node.
+ *
+ * The pty itself keeps the termios settings; this follows the ones that the
+ * client sets to pace the data at the configured baud rate and frame format.
+ * Data that the test writes into the pty master is read from the pty by
+ * this handler and handed to the client no faster than the line could
+ * transfer it; the client's writes complete once they would have been sent.
+ * With CRTSCTS, writes are held while CTS is off.
+ *
+ * The modem lines DTR and RTS are set by the client, the other ones by the
+ * test through set_lines(). This is shared between the ioctl worker and the
+ * test's thread.
+ */
+internal class IoctlSerialHandler : IoctlBase {
+    /* standard and CBAUDEX speeds, in the order of their cflag values */
+    const uint[] SPEEDS = { 0, 50, 75, 110, 134, 150, 200, 300, 600, 1200, 1800, 2400,
+                            4800, 9600, 19200, 38400 };
+    const uint[] SPEEDS_EX = { 0, 57600, 115200, 230400, 460800, 500000, 576000, 921600,
+                               1000000, 1152000, 1500000, 2000000, 2500000, 3000000,
+                               3500000, 4000000 };
+    /* reads return what arrives in this many microseconds, like a FIFO
+     * interrupt does */
+    const int64 CHUNK_TIME = 10000;
+
+    private Mutex mutex = Mutex();
+    private MainContext ctx;
+    private int pty_fd;
+    private uint cflag;
+    private uint lines;
+    private serial_icounter_struct icount;
+
+    /* when the line is done with what was already transferred */
+    private int64 rx_free = 0;
+    private int64 tx_free = 0;
+
+    private Queue<IoctlClient> readers = new Queue<IoctlClient>();
+    private GenericArray<IoctlClient> held_writers = new GenericArray<IoctlClient>();
+    private GenericArray<SerialLineWaiter> waiters = new GenericArray<SerialLineWaiter>();
+    private Source? read_watch = null;
+
+    /* pty_fd is the slave end of the device node's pty, which this reads
+     * the incoming data from; cflag are its initial settings */
+    public IoctlSerialHandler(MainContext ctx, int pty_fd, uint cflag)
+    {
+        base ();
+
+        this.ctx = ctx;
+        this.pty_fd = pty_fd;
+        this.cflag = cflag;
+        this.lines = speed() > 0 ? TIOCM_DTR | TIOCM_RTS : 0;
+        this.icount = {};
+    }
+
+    ~IoctlSerialHandler()
+    {
+        if (read_watch != null)
+            read_watch.destroy();
+        Posix.close(pty_fd);
+    }
+
+    private uint speed()
+    {
+        uint index = cflag & CBAUD & ~CBAUDEX;
+
+        if ((cflag & CBAUDEX) != 0)
+            return index < SPEEDS_EX.length ? SPEEDS_EX[index] : 0;
+        return SPEEDS[index];
+    }
+
+    /* Line time of n characters in microseconds, 0 without pacing */
+    private int64 transfer_time(size_t n)
+    {
+        uint baud = speed();
+        if (baud == 0)
+            return 0;
+
+        uint size = cflag & (uint) Posix.CSIZE;
+        uint bits = 1; /* start bit */
+        if (size == (uint) Posix.CS5)
+            bits += 5;
+        else if (size == (uint) Posix.CS6)
+            bits += 6;
+        else if (size == (uint) Posix.CS7)
+            bits += 7;
+        else
+            bits += 8;
+        if ((cflag & (uint) Posix.PARENB) != 0)
+            bits += 1;
+        bits += (cflag & (uint) Posix.CSTOPB) != 0 ? 2 : 1;
+
+        return (int64) n * bits * 1000000 / baud;
+    }
+
+    private void complete_at(IoctlClient client, long res, int64 due)
+    {
+        int64 delay = due - get_monotonic_time();
+
+        if (delay <= 0) {
+            client.complete(res, 0);
+            return;
+        }
+
+        var source = new TimeoutSource((uint) ((delay + 999) / 1000));
+        source.set_callback(() => {
+            client.complete(res, 0);
+            return Source.REMOVE;
+        });
+        source.attach(ctx);
+    }
+
+    /* Modem lines as the client sees them */
+    public uint get_lines()
+    {
+        mutex.lock();
+        uint res = lines;
+        mutex.unlock();
+        return res;
+    }
+
+    /* Set the lines which the other end controls (CTS, DSR, CAR, RNG) */
+    public void set_lines(uint new_lines)
+    {
+        const uint INPUT_LINES = (uint) (TIOCM_CTS | TIOCM_DSR | TIOCM_CAR | TIOCM_RNG);
+
+        mutex.lock();
+        uint changed = (lines ^ new_lines) & INPUT_LINES;
+        lines = (lines & ~INPUT_LINES) | (new_lines & INPUT_LINES);
+
+        if ((changed & TIOCM_CTS) != 0)
+            icount.cts++;
+        if ((changed & TIOCM_DSR) != 0)
+            icount.dsr++;
+        if ((changed & TIOCM_CAR) != 0)
+            icount.dcd++;
+        /* like the kernel, count the trailing edge of RI */
+        if ((changed & TIOCM_RNG) != 0 && (lines & TIOCM_RNG) == 0)
+            icount.rng++;
+
+        for (uint i = 0; i < waiters.length;) {
+            if (!waiters[i].client.connected) {
+                waiters.remove_index(i);
+            } else if ((waiters[i].mask & changed) != 0) {
+                waiters[i].client.complete(0, 0);
+                waiters.remove_index(i);
+            } else {
+                i++;
+            }
+        }
+
+        if ((lines & TIOCM_CTS) != 0) {
+            for (uint i = 0; i < held_writers.length; i++)
+                start_write(held_writers[i]);
+            held_writers.remove_range(0, held_writers.length);
+        }
+        mutex.unlock();
+    }
+
+    private bool get_int(IoctlClient client, out uint val)
+    {
+        IoctlData? data = null;
+
+        val = 0;
+        try {
+            data = client.arg.resolve(0, sizeof(int));
+        } catch (IOError e) {
+            warning("Error resolving IOCtl data: %s", e.message);
+            return false;
+        }
+
+        if (data == null)
+            return false;
+        val = *((uint*) data.data);
+        return true;
+    }
+
+    private void put_data(IoctlClient client, void* value, size_t len)
+    {
+        IoctlData? data = null;
+
+        try {
+            data = client.arg.resolve(0, len);
+        } catch (IOError e) {
+            warning("Error resolving IOCtl data: %s", e.message);
+        }
+
+        if (data == null) {
+            client.complete(-1, Posix.EFAULT);
+            return;
+        }
+
+        Posix.memcpy(data.data, value, len);
+        client.complete(0, 0);
+    }
+
+    private void set_termios(IoctlClient client)
+    {
+        IoctlData? data = null;
+
+        /* c_cflag is the third field of the kernel's struct termios */
+        try {
+            data = client.arg.resolve(0, 3 * sizeof(uint32));
+        } catch (IOError e) {
+            warning("Error resolving IOCtl data: %s", e.message);
+        }
+
+        if (data != null) {
+            bool was_hup = speed() == 0;
+            cflag = *((uint32*) &data.data[2 * sizeof(uint32)]);
+
+            /* dropping to B0 hangs up, leaving it raises DTR/RTS again */
+            if (speed() == 0)
+                lines &= ~(TIOCM_DTR | TIOCM_RTS);
+            else if (was_hup)
+                lines |= TIOCM_DTR | TIOCM_RTS;
+        }
+
+        /* the pty keeps the actual settings */
+        client.complete(-100, 0);
+    }
+
+    public override bool handle_ioctl(IoctlClient client)
+    {
+        ulong request = client.request;
+        uint val;
+
+        mutex.lock();
+
+        if (request == (ulong) TCSETS || request == (ulong) TCSETSW || request == (ulong) TCSETSF) {
+            set_termios(client);
+        } else if (request == (ulong) TIOCMGET) {
+            put_data(client, &lines, sizeof(uint));
+        } else if (request == (ulong) TIOCMSET || request == (ulong) TIOCMBIS || request == (ulong) TIOCMBIC) {
+            if (!get_int(client, out val)) {
+                client.complete(-1, Posix.EFAULT);
+            } else {
+                /* only the outputs can be set */
+                val &= TIOCM_DTR | TIOCM_RTS;
+                if (request == (ulong) TIOCMSET)
+                    lines = (lines & ~(TIOCM_DTR | TIOCM_RTS)) | val;
+                else if (request == (ulong) TIOCMBIS)
+                    lines |= val;
+                else
+                    lines &= ~val;
+                client.complete(0, 0);
+            }
+        } else if (request == (ulong) TIOCMIWAIT) {
+            uint mask = (uint) (*(ulong*) client.arg.data) & (TIOCM_CTS | TIOCM_DSR | TIOCM_CAR | TIOCM_RNG);
+            if (mask == 0) {
+                client.complete(-1, Posix.EINVAL);
+            } else {
+                var waiter = new SerialLineWaiter();
+                waiter.client = client;
+                waiter.mask = mask;
+                waiters.add(waiter);
+            }
+        } else if (request == (ulong) TIOCGICOUNT) {
+            put_data(client, &icount, sizeof(serial_icounter_struct));
+        } else {
+            /* everything else (TCGETS, TCFLSH, ...) is done by the pty */
+            client.complete(-100, 0);
+        }
+
+        mutex.unlock();
+        return true;
+    }
+
+    /* Hand out incoming data to the waiting readers, at line speed; called
+     * with the mutex held */
+    private void process_reads()
+    {
+        while (!readers.is_empty()) {
+            IoctlClient client = readers.peek_head();
+            if (!client.connected) {
+                readers.pop_head();
+                continue;
+            }
+
+            unowned uint8[] buf = client.arg.data;
+            size_t max = buf.length;
+            int64 char_time = transfer_time(1);
+            if (char_time > 0) {
+                size_t chunk = char_time < CHUNK_TIME ? (size_t) (CHUNK_TIME / char_time) : 1;
+                if (max > chunk)
+                    max = chunk;
+            }
+
+            ssize_t n = Posix.read(pty_fd, buf, max);
+            if (n < 0 && Posix.errno == Posix.EAGAIN) {
+                if (client.nonblock) {
+                    readers.pop_head();
+                    client.complete(-1, Posix.EAGAIN);
+                    continue;
+                }
+                watch_pty();
+                return;
+            }
+
+            readers.pop_head();
+            if (n < 0) {
+                client.complete(-1, Posix.errno);
+                continue;
+            }
+
+            icount.rx += (int) n;
+            int64 now = get_monotonic_time();
+            rx_free = (rx_free > now ? rx_free : now) + transfer_time(n);
+            complete_at(client, (long) n, rx_free);
+        }
+    }
+
+    private void watch_pty()
+    {
+        if (read_watch != null)
+            return;
+
+        read_watch = new IOChannel.unix_new(pty_fd).create_watch(IOCondition.IN | IOCondition.HUP);
+        read_watch.set_callback((source, condition) => {
+            mutex.lock();
+            read_watch = null;
+            process_reads();
+            mutex.unlock();
+            return Source.REMOVE;
+        });
+        read_watch.attach(ctx);
+    }
+
+    private void start_write(IoctlClient client)
+    {
+        size_t n = client.arg.data.length;
+        int64 now = get_monotonic_time();
+
+        icount.tx += (int) n;
+        tx_free = (tx_free > now ? tx_free : now) + transfer_time(n);
+        /* the client writes into the pty once it would be sent */
+        complete_at(client, -100, tx_free);
+    }
+
+    public override bool handle_read(IoctlClient client)
+    {
+        mutex.lock();
+        /* earlier readers get the pending data first */
+        if (client.nonblock && !readers.is_empty()) {
+            mutex.unlock();
+            client.complete(-1, Posix.EAGAIN);
+            return true;
+        }
+        readers.push_tail(client);
+        if (readers.length == 1)
+            process_reads();
+        mutex.unlock();
+        return true;
+    }
+
+    public override bool handle_write(IoctlClient client)
+    {
+        mutex.lock();
+        if ((cflag & CRTSCTS) != 0 && (lines & TIOCM_CTS) == 0)
+            held_writers.add(client);
+        else
+            start_write(client);
+        mutex.unlock();
+        return true;
+    }
+}
+
+}
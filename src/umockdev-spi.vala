@@ -20,27 +20,30 @@ namespace UMockdev {
 
 using Ioctl;
 
-private static uint8
-spi_hexdigit (char c)
+private static int
+spi_hexdigit (uint8 c)
 {
-    return (c >= 'a') ? (c - 'a' + 10) :
-           (c >= 'A') ? (c - 'A' + 10) :
-           (c - '0');
+    return (c >= '0' && c <= '9') ? (c - '0') :
+           (c >= 'a' && c <= 'f') ? (c - 'a' + 10) :
+           (c >= 'A' && c <= 'F') ? (c - 'A' + 10) :
+           -1;
 }
 
-private static uint8[]
-spi_decode_hex (string data) throws IOError
+/* Decode len hex digits from src into dest */
+private static void
+spi_decode_hex (uint8* src, size_t len, uint8* dest) throws IOError
 {
     /* hex digits must come in pairs */
-    if (data.length % 2 != 0)
-        throw new IOError.PARTIAL_INPUT("malformed hexadecimal value: %s", data);
-    var len = data.length;
-    uint8[] bin = new uint8[len / 2];
-
-    for (uint i = 0; i < bin.length; ++i)
-        bin[i] = (spi_hexdigit (data[i*2]) << 4) | spi_hexdigit (data[i*2+1]);
-
-    return bin;
+    if (len % 2 != 0)
+        throw new IOError.PARTIAL_INPUT("malformed hexadecimal value: %s", ((string) src).ndup(len));
+
+    for (size_t i = 0; i < len / 2; ++i) {
+        int hi = spi_hexdigit (src[i*2]);
+        int lo = spi_hexdigit (src[i*2+1]);
+        if (hi < 0 || lo < 0)
+            throw new IOError.INVALID_DATA("malformed hexadecimal value: %s", ((string) src).ndup(len));
+        dest[i] = (uint8) (hi << 4 | lo);
+    }
 }
 
 
@@ -61,11 +64,26 @@ spi_decode_hex (string data) throws IOError
  *    R HEX
  * where HEX may not contain spaces. If W/R us "don't care", then the lines will
  * not be included. It is assumed that we never do a pure don't care transfer.
+ *
+ * For large recordings there is also a binary variant, marked with "(SPI-BIN)"
+ * instead of "(SPI)" in the @DEV header line. The header line is directly
+ * followed by one record per transfer:
+ *   uint8 flags (SPI_BIN_TX, SPI_BIN_RX, SPI_BIN_CONT as above)
+ *   uint32 length (little endian)
+ *   length bytes tx data, if SPI_BIN_TX
+ *   length bytes rx data, if SPI_BIN_RX
+ * Binary recordings are mapped and replayed without copying the data.
  */
 
+private const uint8 SPI_BIN_TX = 1;
+private const uint8 SPI_BIN_RX = 2;
+private const uint8 SPI_BIN_CONT = 4;
+
+/* tx/rx point into the mapped recording or the decoded data; null is don't care */
 private struct TransferChunk {
-    uint8[]? tx;
-    uint8[]? rx;
+    uint8* tx;
+    uint8* rx;
+    size_t len;
     bool cont;
 }
 
@@ -73,10 +91,12 @@ internal abstract class IoctlSpiBase : IoctlBase {
 
     internal long iter_ioctl_vector(ulong count, IoctlData data, bool for_recording) {
         long transferred = 0;
+        size_t[] offsets = new size_t[2 * count];
+        size_t[] lens = new size_t[2 * count];
+        IoctlData?[] bufs;
 
         // This only works on 64bit machines
         for (long i = 0; i < count; i++) {
-            unowned IoctlData tx = null, rx = null;
             Ioctl.spi_ioc_transfer *transfer = &((Ioctl.spi_ioc_transfer[]) data.data)[i];
 
             // Double check we don't have anything unexpected
@@ -89,16 +109,26 @@ internal abstract class IoctlSpiBase : IoctlBase {
             // Requires linux headers 5.1
             //assert(transfer.word_delay_usecs == 0);
 
-            // Resolves buffers. Mark RX buf as dirty as we will need to write it back (and don't load it).
-            try {
-                if (transfer.tx_buf != 0)
-                    tx = data.resolve((ulong) &transfer.tx_buf - (ulong) data.data, transfer.len);
-                if (transfer.rx_buf != 0)
-                    rx = data.resolve((ulong) &transfer.rx_buf - (ulong) data.data, transfer.len);
-            } catch (IOError e) {
-                warning("Error resolving IOCtl data: %s", e.message);
-                return -100;
-            }
+            // Unused (NULL) buffers resolve to null
+            offsets[2 * i] = (size_t) ((ulong) &transfer.tx_buf - (ulong) data.data);
+            lens[2 * i] = transfer.len;
+            offsets[2 * i + 1] = (size_t) ((ulong) &transfer.rx_buf - (ulong) data.data);
+            lens[2 * i + 1] = transfer.len;
+        }
+
+        // Resolve all buffers in one go, RX buffers are written back
+        // together when the client gets completed.
+        try {
+            bufs = data.resolve_many(offsets, lens);
+        } catch (IOError e) {
+            warning("Error resolving IOCtl data: %s", e.message);
+            return -100;
+        }
+
+        for (long i = 0; i < count; i++) {
+            unowned IoctlData? tx = bufs[2 * i];
+            unowned IoctlData? rx = bufs[2 * i + 1];
+            Ioctl.spi_ioc_transfer *transfer = &((Ioctl.spi_ioc_transfer[]) data.data)[i];
 
             // We are good to go, now emulate the read/write or both.
             long res;
@@ -123,70 +153,166 @@ internal abstract class IoctlSpiBase : IoctlBase {
 
 internal class IoctlSpiHandler : IoctlSpiBase {
 
+    MappedFile mapped;
+    /* decoded data of a text recording; binary ones are used in place */
+    uint8[] decoded;
     TransferChunk[] recording;
     long replay_chunk;
     long replay_byte;
 
     public IoctlSpiHandler(string file)
     {
-        string val;
         base ();
 
         // Open SPI file
         try {
-            FileUtils.get_contents(file, out val);
+            mapped = new MappedFile(file, false);
         } catch (GLib.Error e) {
             error("Could not read %s: %s", file, e.message);
         }
 
-        string[] lines = val.split("\n");
-        unowned TransferChunk* chunk = null;
-        foreach (unowned string line in lines) {
-            if (line.length == 0)
+        uint8* d = (uint8*) mapped.get_contents();
+        size_t len = mapped.get_length();
+        size_t pos = 0;
+        bool binary = false;
+
+        // Skip comments and the header; that is also all text in binary files
+        while (pos < len && (d[pos] == '#' || d[pos] == '@')) {
+            size_t eol = pos;
+            while (eol < len && d[eol] != '\n')
+                eol++;
+            if (d[pos] == '@' && ((string) (d + pos)).ndup(eol - pos).contains("(SPI-BIN)"))
+                binary = true;
+            pos = eol + 1;
+        }
+
+        if (binary)
+            load_binary(d, len, pos);
+        else
+            load_text(d, len, pos);
+
+        replay_chunk = 0;
+        replay_byte = 0;
+    }
+
+    private void load_binary(uint8* d, size_t len, size_t start)
+    {
+        // Count first, so that the chunks are allocated once
+        size_t count = 0;
+        for (size_t pos = start; pos < len; count++) {
+            uint32 chunk_len;
+
+            if (pos + 5 > len)
+                error("Invalid SPI transfer description, truncated record at offset %lu", (ulong) pos);
+            uint8 flags = d[pos];
+            Posix.memcpy(&chunk_len, &d[pos + 1], sizeof(uint32));
+            chunk_len = uint32.from_little_endian(chunk_len);
+            if ((flags & (SPI_BIN_TX | SPI_BIN_RX)) == 0 || flags > (SPI_BIN_TX | SPI_BIN_RX | SPI_BIN_CONT))
+                error("Invalid SPI transfer description, bad record flags at offset %lu", (ulong) pos);
+
+            pos += 5;
+            if ((flags & SPI_BIN_TX) != 0)
+                pos += chunk_len;
+            if ((flags & SPI_BIN_RX) != 0)
+                pos += chunk_len;
+            if (pos > len)
+                error("Invalid SPI transfer description, truncated record data");
+        }
+
+        recording = new TransferChunk[count];
+        size_t pos = start;
+        for (size_t i = 0; i < count; i++) {
+            uint8 flags = d[pos];
+            uint32 chunk_len;
+            Posix.memcpy(&chunk_len, &d[pos + 1], sizeof(uint32));
+            pos += 5;
+
+            if ((flags & SPI_BIN_CONT) != 0) {
+                if (i == 0)
+                    error("Invalid SPI transfer description, continuation without previous transfer");
+                recording[i - 1].cont = true;
+            }
+
+            recording[i].len = uint32.from_little_endian(chunk_len);
+            if ((flags & SPI_BIN_TX) != 0) {
+                recording[i].tx = &d[pos];
+                pos += recording[i].len;
+            }
+            if ((flags & SPI_BIN_RX) != 0) {
+                recording[i].rx = &d[pos];
+                pos += recording[i].len;
+            }
+        }
+    }
+
+    private void load_text(uint8* d, size_t len, size_t start)
+    {
+        // Count the transfers first, so that the chunks are allocated once;
+        // the decoded data is at most half the file size
+        size_t count = 0;
+        bool line_start = true;
+        for (size_t pos = start; pos < len; pos++) {
+            if (line_start && (d[pos] == 'T' || d[pos] == 'C'))
+                count++;
+            line_start = d[pos] == '\n';
+        }
+
+        recording = new TransferChunk[count];
+        decoded = new uint8[(len - start) / 2 + 1];
+
+        long chunk = -1;
+        size_t out_pos = 0;
+        size_t pos = start;
+        while (pos < len) {
+            size_t line = pos;
+            while (pos < len && d[pos] != '\n')
+                pos++;
+            size_t line_len = pos - line;
+            pos++;
+
+            if (line_len == 0)
                 continue;
 
-            if (line[0] == '#' || line[0] == '@')
+            if (d[line] == '#' || d[line] == '@')
                 continue;
 
-            if (line.length < 3)
+            if (line_len < 3)
                 error("Invalid SPI transfer description");
 
-            if (line[0] == 'C') {
-                if (chunk != null)
-                    chunk.cont = true;
+            if (d[line] == 'C') {
+                if (chunk >= 0)
+                    recording[chunk].cont = true;
                 else
                     error("Invalid SPI transfer description, continuation without previous transfer");
 
-                recording += TransferChunk();
-                chunk = &recording[recording.length - 1];
-            } else if (line[0] == 'T') {
-                if (chunk != null)
-                    chunk.cont = false;
-
-                recording += TransferChunk();
-                chunk = &recording[recording.length - 1];
-            } else if (line[0] != ' ') {
+                chunk++;
+            } else if (d[line] == 'T') {
+                chunk++;
+            } else if (d[line] != ' ' || chunk < 0) {
                 error("Invalid SPI transfer description");
             }
 
+            uint8* data = &decoded[out_pos];
+            size_t data_len = (line_len - 3) / 2;
             try {
-                if (line[1] == 'W') {
-                    chunk.tx = spi_decode_hex(line.substring(3));
-                } else if (line[1] == 'R') {
-                    chunk.rx = spi_decode_hex(line.substring(3));
-                } else {
-                    error("Invalid transfer type, expected R or W got %c", line[1]);
-                }
+                spi_decode_hex(&d[line + 3], line_len - 3, data);
             } catch (IOError e) {
                 error("Invalid SPI transfer description, could not decode HEX string");
             }
+            out_pos += data_len;
 
-            if (chunk.tx != null && chunk.rx != null && chunk.tx.length != chunk.rx.length)
+            if (d[line + 1] == 'W') {
+                recording[chunk].tx = data;
+            } else if (d[line + 1] == 'R') {
+                recording[chunk].rx = data;
+            } else {
+                error("Invalid transfer type, expected R or W got %c", d[line + 1]);
+            }
+
+            if (recording[chunk].tx != null && recording[chunk].rx != null && recording[chunk].len != data_len)
                 error("Invalid SPI transfer description, read/write length need to be identical");
+            recording[chunk].len = data_len;
         }
-
-        replay_chunk = 0;
-        replay_byte = 0;
     }
 
     public override bool handle_ioctl(IoctlClient client) {
@@ -275,18 +401,17 @@ internal class IoctlSpiHandler : IoctlSpiBase {
                 return -Posix.ENOENT;
 
             chunk = &recording[replay_chunk];
-            left = -1;
             trans = len;
 
+            if (trans > (long) chunk.len - replay_byte)
+                trans = (long) chunk.len - replay_byte;
+            left = (long) chunk.len - replay_byte - trans;
+
             if (chunk.tx != null) {
                 if (tx == null)
                     return -Posix.ENOMSG;
 
-                if (trans > chunk.tx.length - replay_byte)
-                    trans = chunk.tx.length - replay_byte;
-                left = chunk.tx.length - replay_byte - trans;
-
-                if (Posix.memcmp(&tx.data[offset], &chunk.tx[replay_byte], trans) != 0)
+                if (Posix.memcmp(&tx.data[offset], chunk.tx + replay_byte, trans) != 0)
                     return -Posix.ENOMSG;
 
                 /* We are happy. */
@@ -296,11 +421,7 @@ internal class IoctlSpiHandler : IoctlSpiBase {
                 if (rx == null)
                     return -Posix.ENOMSG;
 
-                if (trans > chunk.rx.length - replay_byte)
-                    trans = chunk.rx.length - replay_byte;
-                left = chunk.rx.length - replay_byte - trans;
-
-                Posix.memcpy(&rx.data[offset], &chunk.rx[replay_byte], trans);
+                Posix.memcpy(&rx.data[offset], chunk.rx + replay_byte, trans);
                 /* We are happy. */
             }
             assert(left >= 0);
@@ -324,17 +445,20 @@ internal class IoctlSpiHandler : IoctlSpiBase {
 internal class IoctlSpiRecorder : IoctlSpiBase {
 
     bool cs_is_high;
-    Posix.FILE log;
+    bool binary;
+    FileStream log;
+    uint8[] line_buf;
 
-    public IoctlSpiRecorder(string device, string file)
+    public IoctlSpiRecorder(string device, string file, bool binary = false)
     {
         base ();
 
         // Open SPI log file
         cs_is_high = false;
-        log = Posix.FILE.open(file, "w");
+        this.binary = binary;
+        log = FileStream.open(file, "w");
 
-        log.printf("@DEV %s (SPI)\n", device);
+        log.printf("@DEV %s (%s)\n", device, binary ? "SPI-BIN" : "SPI");
     }
 
     public override bool handle_ioctl(IoctlClient client) {
@@ -426,33 +550,50 @@ internal class IoctlSpiRecorder : IoctlSpiBase {
         return true;
     }
 
-    void write_hex(uint8[] buf) {
-        foreach (uint8 c in buf) {
-            log.printf("%02x", c);
+    /* Format "XW HEX" lines in one buffer, so that each one is a single
+     * buffered write */
+    void write_line(char c1, char c2, uint8[] buf) {
+        const string HEX = "0123456789abcdef";
+        size_t len = 4 + 2 * buf.length;
+
+        if (line_buf.length < len)
+            line_buf = new uint8[len];
+
+        line_buf[0] = (uint8) c1;
+        line_buf[1] = (uint8) c2;
+        line_buf[2] = (uint8) ' ';
+        for (int i = 0; i < buf.length; i++) {
+            line_buf[3 + 2 * i] = (uint8) HEX[buf[i] >> 4];
+            line_buf[4 + 2 * i] = (uint8) HEX[buf[i] & 0xf];
         }
+        line_buf[len - 1] = (uint8) '\n';
+        log.write(line_buf[0:(int) len]);
     }
 
-    internal override long handle_read_write(IoctlData? tx, IoctlData? rx, bool keep_cs_high) {
-        bool indent = false;
+    void write_record(IoctlData? tx, IoctlData? rx) {
+        uint8 header[5];
+        uint32 len = tx != null ? tx.data.length : rx.data.length;
 
-        if (cs_is_high)
-            log.printf("C");
-        else
-            log.printf("T");
+        header[0] = (uint8) ((tx != null ? SPI_BIN_TX : 0) | (rx != null ? SPI_BIN_RX : 0) | (cs_is_high ? SPI_BIN_CONT : 0));
+        len = len.to_little_endian();
+        Posix.memcpy(&header[1], &len, sizeof(uint32));
+        log.write(header);
+        if (tx != null)
+            log.write(tx.data);
+        if (rx != null)
+            log.write(rx.data);
+    }
 
-        if (tx != null) {
-            log.printf("W ");
-            write_hex(tx.data);
-            log.printf("\n");
+    internal override long handle_read_write(IoctlData? tx, IoctlData? rx, bool keep_cs_high) {
+        if (binary) {
+            write_record(tx, rx);
+        } else {
+            char start = cs_is_high ? 'C' : 'T';
 
-            indent = true;
-        }
-        if (rx != null) {
-            if (indent)
-                log.printf(" ");
-            log.printf("R ");
-            write_hex(rx.data);
-            log.printf("\n");
+            if (tx != null)
+                write_line(start, 'W', tx.data);
+            if (rx != null)
+                write_line(tx != null ? ' ' : start, 'R', rx.data);
         }
 
         cs_is_high = keep_cs_high;
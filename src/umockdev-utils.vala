@@ -38,6 +38,28 @@ remove_dir (string path, bool remove_toplevel=true)
         checked_remove(path);
 }
 
+// Format a uevent with its udev properties (KEY=VALUE lines) as one line of a
+// umockdev-record --uevents recording; see umockdev_testbed_load_uevents().
+public string
+format_uevent(int64 delta, string props)
+{
+    string action = "";
+    string devpath = "";
+    var properties = new StringBuilder();
+    foreach (unowned string prop in props.split("\n")) {
+        string[] kv = prop.split("=", 2);
+        if (kv.length != 2)
+            continue;
+        if (kv[0] == "ACTION")
+            action = kv[1];
+        else if (kv[0] == "DEVPATH")
+            devpath = kv[1].escape("").replace(" ", "\\040");
+        else if (kv[0] != "SEQNUM")
+            properties.append_printf(" %s=%s", kv[0], kv[1].escape("").replace(" ", "\\040"));
+    }
+    return "%s %s %s%s\n".printf(delta.to_string(), action, devpath, properties.str);
+}
+
 private static Pid process_under_test;
 private static ChildWatchFunc process_under_test_watch_cb;
 
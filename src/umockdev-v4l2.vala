@@ -0,0 +1,505 @@
+/*
+ * V4L2 video capture emulation
+ *
+ * umockdev is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * umockdev is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+namespace UMockdev {
+
+using Ioctl;
+
+/* Emulates a single-format V4L2 capture device with MMAP streaming.
+ *
+ * Buffers live in one memfd that is shared with the client through
+ * IoctlBase.add_mmap_region(), buffer i being at offset i * buf_stride.
+ * Frames are produced at a fixed rate while streaming, either from a file
+ * with raw frames (looping at its end) or from a generated pattern. Frames
+ * for which the client has no buffer queued are dropped, as on hardware.
+ */
+internal class IoctlV4l2Handler : IoctlBase {
+    const uint MAX_BUFFERS = 32;
+    /* mmap() offsets must be page aligned, whatever the page size */
+    const size_t BUF_ALIGN = 64 * 1024;
+
+    private uint width;
+    private uint height;
+    private uint32 pixelformat;
+    private uint bytesperline;
+    private uint sizeimage;
+    private uint fps;
+
+    private int frame_fd = -1;
+    private uint64 frame_index = 0;
+    /* pty master of the device node, to make poll() report readability
+     * while a frame is ready, and its slave end for taking that back */
+    private int wake_fd;
+    private int drain_fd = -1;
+
+    private int mem_fd = -1;
+    private uint8* mem = null;
+    private size_t mem_size = 0;
+    private size_t buf_stride = 0;
+    private uint n_buffers = 0;
+    private uint32[] buf_flags;
+    private uint32[] buf_bytesused;
+    private uint32[] buf_sequence;
+    private int64[] buf_timestamp;
+    private Queue<uint> queued;
+    private Queue<uint> done;
+
+    private bool streaming = false;
+    private uint32 sequence;
+    private int64 stream_start;
+    private Source? frame_source = null;
+
+    /* A DQBUF waiting for the next frame */
+    private IoctlClient? waiting_client = null;
+    private IoctlData? waiting_data = null;
+
+    public IoctlV4l2Handler(string? framefile, uint width, uint height, uint32 pixelformat, uint fps,
+                            int wake_fd, string? pty)
+        throws FileError
+    {
+        base ();
+
+        this.width = width;
+        this.height = height;
+        this.pixelformat = pixelformat;
+        this.fps = fps > 0 ? fps : 30;
+        this.wake_fd = wake_fd;
+        if (wake_fd >= 0 && pty != null)
+            drain_fd = Posix.open(pty, Posix.O_RDONLY | Posix.O_NONBLOCK | Posix.O_NOCTTY | Posix.O_CLOEXEC);
+        /* the buffers only get their region with VIDIOC_REQBUFS */
+        this.emulate_mmap = true;
+
+        if (width == 0 || height == 0 || width > uint.MAX / 4)
+            throw new FileError.INVAL("unsupported V4L2 frame size %ux%u".printf(width, height));
+        if (pixelformat == V4L2_PIX_FMT_YUYV)
+            bytesperline = width * 2;
+        else if (pixelformat == V4L2_PIX_FMT_RGB24)
+            bytesperline = width * 3;
+        else if (pixelformat == V4L2_PIX_FMT_GREY)
+            bytesperline = width;
+        else
+            throw new FileError.INVAL("unsupported V4L2 pixel format %08x".printf(pixelformat));
+        if (height > uint.MAX / bytesperline)
+            throw new FileError.INVAL("unsupported V4L2 frame size %ux%u".printf(width, height));
+        sizeimage = bytesperline * height;
+
+        queued = new Queue<uint>();
+        done = new Queue<uint>();
+
+        if (framefile != null) {
+            frame_fd = Posix.open(framefile, Posix.O_RDONLY | Posix.O_CLOEXEC);
+            if (frame_fd < 0)
+                throw new FileError.FAILED("Cannot open frame file %s: %m".printf(framefile));
+
+            Posix.Stat st;
+            if (Posix.fstat(frame_fd, out st) < 0 || st.st_size < sizeimage) {
+                Posix.close(frame_fd);
+                throw new FileError.INVAL("%s does not contain a complete %ux%u frame".printf(framefile, width, height));
+            }
+        }
+    }
+
+    ~IoctlV4l2Handler()
+    {
+        if (frame_source != null)
+            frame_source.destroy();
+        free_buffers();
+        if (frame_fd >= 0)
+            Posix.close(frame_fd);
+        if (drain_fd >= 0)
+            Posix.close(drain_fd);
+        if (wake_fd >= 0)
+            Posix.close(wake_fd);
+    }
+
+    public override bool handle_ioctl(IoctlClient client) {
+        IoctlData? data = null;
+        ulong request = client.request;
+        ulong size = (request >> Ioctl._IOC_SIZESHIFT) & ((1 << Ioctl._IOC_SIZEBITS) - 1);
+
+        try {
+            data = client.arg.resolve(0, size);
+        } catch (IOError e) {
+            warning("Error resolving IOCtl data: %s", e.message);
+            return false;
+        }
+
+        if (data == null) {
+            client.complete(-1, Posix.EFAULT);
+            return true;
+        }
+
+        switch (request) {
+            case VIDIOC_QUERYCAP:
+                v4l2_capability *cap = (v4l2_capability*) data.data;
+                Posix.memset(cap, 0, sizeof(v4l2_capability));
+                Posix.memcpy(cap.driver, "umockdev", "umockdev".length);
+                Posix.memcpy(cap.card, "umockdev V4L2 capture", "umockdev V4L2 capture".length);
+                Posix.memcpy(cap.bus_info, "platform:umockdev", "platform:umockdev".length);
+                cap.version = 6 << 16;
+                cap.device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+                cap.capabilities = cap.device_caps | V4L2_CAP_DEVICE_CAPS;
+                client.complete(0, 0);
+                return true;
+
+            case VIDIOC_ENUM_FMT:
+                v4l2_fmtdesc *desc = (v4l2_fmtdesc*) data.data;
+                if (desc.index != 0 || desc.type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+                    client.complete(-1, Posix.EINVAL);
+                    return true;
+                }
+                desc.flags = 0;
+                Posix.memset(desc.description, 0, 32);
+                Posix.memcpy(desc.description, &pixelformat, 4);
+                desc.pixelformat = pixelformat;
+                client.complete(0, 0);
+                return true;
+
+            case VIDIOC_G_FMT:
+            case VIDIOC_S_FMT:
+            case VIDIOC_TRY_FMT:
+                v4l2_format *fmt = (v4l2_format*) data.data;
+                if (fmt.type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+                    client.complete(-1, Posix.EINVAL);
+                    return true;
+                }
+                if (request == VIDIOC_S_FMT && n_buffers > 0) {
+                    client.complete(-1, Posix.EBUSY);
+                    return true;
+                }
+                /* There is only one mode, so any requested format is adjusted to it */
+                fmt.pix.width = width;
+                fmt.pix.height = height;
+                fmt.pix.pixelformat = pixelformat;
+                fmt.pix.field = V4L2_FIELD_NONE;
+                fmt.pix.bytesperline = bytesperline;
+                fmt.pix.sizeimage = sizeimage;
+                fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+                client.complete(0, 0);
+                return true;
+
+            case VIDIOC_G_PARM:
+            case VIDIOC_S_PARM:
+                v4l2_streamparm *parm = (v4l2_streamparm*) data.data;
+                if (parm.type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+                    client.complete(-1, Posix.EINVAL);
+                    return true;
+                }
+                if (request == VIDIOC_S_PARM && streaming) {
+                    client.complete(-1, Posix.EBUSY);
+                    return true;
+                }
+                if (request == VIDIOC_S_PARM && parm.timeperframe.numerator > 0 &&
+                    parm.timeperframe.denominator >= parm.timeperframe.numerator)
+                    fps = parm.timeperframe.denominator / parm.timeperframe.numerator;
+                parm.capability = V4L2_CAP_TIMEPERFRAME;
+                parm.timeperframe.numerator = 1;
+                parm.timeperframe.denominator = fps;
+                client.complete(0, 0);
+                return true;
+
+            case VIDIOC_REQBUFS:
+                v4l2_requestbuffers *req = (v4l2_requestbuffers*) data.data;
+                if (req.type != V4L2_BUF_TYPE_VIDEO_CAPTURE || req.memory != V4L2_MEMORY_MMAP) {
+                    client.complete(-1, Posix.EINVAL);
+                    return true;
+                }
+                if (streaming) {
+                    client.complete(-1, Posix.EBUSY);
+                    return true;
+                }
+                int err = alloc_buffers(uint.min(req.count, MAX_BUFFERS));
+                req.count = n_buffers;
+                req.capabilities = V4L2_BUF_CAP_SUPPORTS_MMAP;
+                client.complete(err == 0 ? 0 : -1, err);
+                return true;
+
+            case VIDIOC_QUERYBUF:
+            case VIDIOC_QBUF:
+                v4l2_buffer *buf = (v4l2_buffer*) data.data;
+                if (buf.type != V4L2_BUF_TYPE_VIDEO_CAPTURE || buf.index >= n_buffers ||
+                    (request == VIDIOC_QBUF && (buf.memory != V4L2_MEMORY_MMAP ||
+                                                (buf_flags[buf.index] & (V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE)) != 0))) {
+                    client.complete(-1, Posix.EINVAL);
+                    return true;
+                }
+                if (request == VIDIOC_QBUF) {
+                    buf_flags[buf.index] |= V4L2_BUF_FLAG_QUEUED;
+                    queued.push_tail(buf.index);
+                }
+                fill_buffer(buf, buf.index);
+                client.complete(0, 0);
+                return true;
+
+            case VIDIOC_DQBUF:
+                v4l2_buffer *dqbuf = (v4l2_buffer*) data.data;
+                if (dqbuf.type != V4L2_BUF_TYPE_VIDEO_CAPTURE || dqbuf.memory != V4L2_MEMORY_MMAP) {
+                    client.complete(-1, Posix.EINVAL);
+                    return true;
+                }
+                if (!done.is_empty()) {
+                    dequeue(dqbuf);
+                    client.complete(0, 0);
+                } else if (!streaming || waiting_client != null) {
+                    client.complete(-1, streaming ? Posix.EBUSY : Posix.EINVAL);
+                } else if (client.nonblock) {
+                    client.complete(-1, Posix.EAGAIN);
+                } else {
+                    /* block until the next frame */
+                    waiting_client = client;
+                    waiting_data = data;
+                }
+                return true;
+
+            case VIDIOC_STREAMON:
+                if (*(uint32*) data.data != V4L2_BUF_TYPE_VIDEO_CAPTURE || n_buffers == 0) {
+                    client.complete(-1, Posix.EINVAL);
+                    return true;
+                }
+                if (!streaming) {
+                    streaming = true;
+                    sequence = 0;
+                    stream_start = get_monotonic_time();
+                    schedule_frame();
+                }
+                client.complete(0, 0);
+                return true;
+
+            case VIDIOC_STREAMOFF:
+                if (*(uint32*) data.data != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+                    client.complete(-1, Posix.EINVAL);
+                    return true;
+                }
+                stop_streaming();
+                client.complete(0, 0);
+                return true;
+
+            default:
+                client.complete(-1, Posix.ENOTTY);
+                return true;
+        }
+    }
+
+    public override bool handle_read(IoctlClient client) {
+        /* only streaming I/O is supported */
+        client.complete(-1, Posix.EINVAL);
+        return true;
+    }
+
+    public override bool handle_write(IoctlClient client) {
+        client.complete(-1, Posix.EINVAL);
+        return true;
+    }
+
+    private void free_buffers()
+    {
+        if (mem_fd < 0)
+            return;
+
+        remove_mmap_region(0);
+        Posix.munmap(mem, mem_size);
+        Posix.close(mem_fd);
+        mem = null;
+        mem_fd = -1;
+        mem_size = 0;
+        n_buffers = 0;
+    }
+
+    /* Returns 0 or an errno */
+    private int alloc_buffers(uint count)
+    {
+        free_buffers();
+        queued.clear();
+        done.clear();
+
+        if (count == 0)
+            return 0;
+
+        buf_stride = (sizeimage + BUF_ALIGN - 1) & ~(BUF_ALIGN - 1);
+        mem_size = buf_stride * count;
+
+        mem_fd = LinuxFixes.memfd_create("umockdev-v4l2", LinuxFixes.MFD_CLOEXEC);
+        if (mem_fd < 0)
+            return Posix.errno;
+
+        if (Posix.ftruncate(mem_fd, (Posix.off_t) mem_size) < 0) {
+            int err = Posix.errno;
+            Posix.close(mem_fd);
+            mem_fd = -1;
+            return err;
+        }
+
+        mem = Posix.mmap(null, mem_size, Posix.PROT_READ | Posix.PROT_WRITE, Posix.MAP_SHARED, mem_fd, 0);
+        if ((void*) mem == Posix.MAP_FAILED) {
+            int err = Posix.errno;
+            mem = null;
+            Posix.close(mem_fd);
+            mem_fd = -1;
+            return err;
+        }
+
+        add_mmap_region(0, mem_fd, mem_size);
+
+        n_buffers = count;
+        buf_flags = new uint32[count];
+        buf_bytesused = new uint32[count];
+        buf_sequence = new uint32[count];
+        buf_timestamp = new int64[count];
+
+        return 0;
+    }
+
+    private void fill_buffer(v4l2_buffer *buf, uint index)
+    {
+        buf.index = index;
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.field = V4L2_FIELD_NONE;
+        buf.flags = buf_flags[index] | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+        buf.offset = (uint32) (index * buf_stride);
+        buf.length = sizeimage;
+        buf.bytesused = buf_bytesused[index];
+        buf.sequence = buf_sequence[index];
+        buf.timestamp.tv_sec = (time_t) (buf_timestamp[index] / 1000000);
+        buf.timestamp.tv_usec = (long) (buf_timestamp[index] % 1000000);
+    }
+
+    private void dequeue(v4l2_buffer *buf)
+    {
+        uint index = done.pop_head();
+
+        buf_flags[index] &= ~V4L2_BUF_FLAG_DONE;
+        fill_buffer(buf, index);
+        /* a waiting DQBUF gets the frame without it ever being ready */
+        if (done.is_empty() && waiting_client == null)
+            wake(false);
+    }
+
+    private void wake(bool readable)
+    {
+        uint8 b = 0;
+        if (readable && wake_fd >= 0)
+            Posix.write(wake_fd, &b, 1);
+        else if (!readable && drain_fd >= 0)
+            Posix.read(drain_fd, &b, 1);
+    }
+
+    private void stop_streaming()
+    {
+        streaming = false;
+        if (frame_source != null) {
+            frame_source.destroy();
+            frame_source = null;
+        }
+
+        if (!done.is_empty())
+            wake(false);
+        queued.clear();
+        done.clear();
+        for (uint i = 0; i < n_buffers; i++)
+            buf_flags[i] &= ~(V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE);
+
+        if (waiting_client != null) {
+            waiting_client.complete(-1, Posix.EINVAL);
+            waiting_client = null;
+            waiting_data = null;
+        }
+    }
+
+    /* Frames are due at fixed times after STREAMON, so that timer latency
+     * does not accumulate */
+    private void schedule_frame()
+    {
+        if (frame_source != null)
+            frame_source.destroy();
+
+        int64 due = stream_start + (int64) sequence * 1000000 / fps;
+        int64 delay = due - get_monotonic_time();
+
+        frame_source = new TimeoutSource(delay > 0 ? (uint) ((delay + 999) / 1000) : 0);
+        frame_source.set_callback(produce_frame);
+        frame_source.attach(MainContext.get_thread_default());
+    }
+
+    private bool produce_frame()
+    {
+        frame_source = null;
+
+        if (!queued.is_empty()) {
+            uint index = queued.pop_head();
+
+            fill_frame(mem + index * buf_stride);
+            buf_flags[index] = (buf_flags[index] & ~V4L2_BUF_FLAG_QUEUED) | V4L2_BUF_FLAG_DONE;
+            buf_bytesused[index] = sizeimage;
+            buf_sequence[index] = sequence;
+            buf_timestamp[index] = get_monotonic_time();
+            done.push_tail(index);
+            if (done.length == 1 && waiting_client == null)
+                wake(true);
+
+            if (waiting_client != null) {
+                dequeue((v4l2_buffer*) waiting_data.data);
+                waiting_client.complete(0, 0);
+                waiting_client = null;
+                waiting_data = null;
+            }
+        }
+
+        sequence++;
+        schedule_frame();
+
+        return false;
+    }
+
+    private void fill_frame(uint8* dest)
+    {
+        if (frame_fd >= 0) {
+            if (Posix.pread(frame_fd, dest, sizeimage, (Posix.off_t) (frame_index * sizeimage)) < sizeimage) {
+                /* loop around at the end of the file */
+                frame_index = 0;
+                if (Posix.pread(frame_fd, dest, sizeimage, 0) < sizeimage)
+                    warning("Cannot read frame: %s", Posix.strerror(Posix.errno));
+            }
+            frame_index++;
+            return;
+        }
+
+        /* Diagonal gradient moving with each frame */
+        for (uint y = 0; y < height; y++) {
+            uint8* line = dest + y * bytesperline;
+            uint8 base_value = (uint8) ((y + sequence * 4) & 0xff);
+
+            if (pixelformat == V4L2_PIX_FMT_YUYV) {
+                for (uint x = 0; x < width; x++) {
+                    line[2 * x] = (uint8) (base_value + x);
+                    line[2 * x + 1] = 128;
+                }
+            } else if (pixelformat == V4L2_PIX_FMT_RGB24) {
+                for (uint x = 0; x < width; x++) {
+                    line[3 * x] = (uint8) (base_value + x);
+                    line[3 * x + 1] = (uint8) y;
+                    line[3 * x + 2] = (uint8) sequence;
+                }
+            } else {
+                for (uint x = 0; x < width; x++)
+                    line[x] = (uint8) (base_value + x);
+            }
+        }
+    }
+}
+
+}
@@ -70,6 +70,35 @@ static void checked_mkdir_with_parents (string path, int mode)
  * instead of the system's real sysfs.
  */
 
+/**
+ * UMockdevAttributeFunc:
+ * @devpath: The device path of the attribute
+ * @name: The attribute name
+ * @user_data: The data passed to umockdev_testbed_set_attribute_func()
+ *
+ * Computes the current value of an attribute, see
+ * umockdev_testbed_set_attribute_func().
+ *
+ * Returns: The attribute value.
+ * Since: 0.19
+ */
+public delegate string AttributeFunc(string devpath, string name);
+
+/**
+ * UMockdevNodeBacking:
+ * @UMOCKDEV_NODE_BACKING_PTY: A pseudo terminal, with TTY semantics
+ * @UMOCKDEV_NODE_BACKING_SOCKET: A Unix stream socket pair
+ *
+ * How device nodes without pre-defined contents are backed, see
+ * umockdev_testbed_set_node_backing().
+ *
+ * Since: 0.19
+ */
+public enum NodeBacking {
+    PTY,
+    SOCKET
+}
+
 /* This avoids taking a reference on the Testbed */
 private static Thread<void>
 create_worker_thread(MainLoop loop)
@@ -112,8 +141,20 @@ public class Testbed: GLib.Object {
         this.dev_fd = new HashTable<string, int> (str_hash, str_equal);
         this.dev_script_runner = new HashTable<string, ScriptRunner> (str_hash, str_equal);
         this.custom_handlers = new HashTable<string, IoctlBase> (str_hash, str_equal);
+        this.evdev_state = new HashTable<string, EvdevState> (str_hash, str_equal);
+        this.serial_handlers = new HashTable<string, IoctlSerialHandler> (str_hash, str_equal);
+        this.ioctl_trees = new HashTable<string, IoctlTreeHandler> (str_hash, str_equal);
+        this.lazy_nodes = new HashTable<string, LazyNode> (str_hash, str_equal);
+        this.hashed_socket_names = new HashTable<string, string> (str_hash, str_equal);
+        this.open_lazy_node_count ();
+        this.node_backing = new HashTable<string, int> (str_hash, str_equal);
+        this.uevent_replays = new GenericArray<UeventReplay> ();
 
         checked_setenv ("UMOCKDEV_DIR", this.root_dir);
+        /* sockets live in the abstract namespace, under a name which is
+         * unique to this testbed */
+        this.channel = "%08x%08x".printf(Random.next_int(), Random.next_int());
+        checked_setenv ("UMOCKDEV_CHANNEL", this.channel);
 
         this.worker_ctx = new MainContext();
         this.worker_loop = new MainLoop(this.worker_ctx);
@@ -121,8 +162,12 @@ public class Testbed: GLib.Object {
 
         /* Create fallback ioctl handler */
         IoctlBase handler = new IoctlBase();
-        string sockpath = Path.build_filename(this.root_dir, "ioctl", "_default");
-        handler.register_path(this.worker_ctx, "_default", sockpath);
+        register_handler(handler, "_default", "ioctl/_default");
+
+        /* Create handler for creating the backing of lazy device nodes */
+        handler = new LazyNodeHandler(this);
+        register_handler(handler, "_lazy", "ioctl/_lazy");
+        this.custom_handlers.insert("_lazy", handler);
 
         debug("Created udev test bed %s", this.root_dir);
     }
@@ -145,16 +190,23 @@ public class Testbed: GLib.Object {
             Posix.close (fd);
         } */
 
+        foreach (unowned UeventReplay r in this.uevent_replays.data)
+            r.stop ();
+
         if (this.socket_server != null) {
             debug ("shutting down socket server thread");
             this.socket_server.stop ();
             this.socket_server = null;
         }
 
+        lock (this.lazy_nodes)
+            this.close_lazy_node_count ();
+
         debug ("Removing test bed %s", this.root_dir);
         remove_dir (this.root_dir);
         this.worker_loop.quit();
         Environment.unset_variable("UMOCKDEV_DIR");
+        Environment.unset_variable("UMOCKDEV_CHANNEL");
     }
 
     /**
@@ -257,6 +309,85 @@ public class Testbed: GLib.Object {
         this.set_attribute(devpath, name, "%x".printf(value));
     }
 
+    /**
+     * umockdev_testbed_set_attribute_func:
+     * @self: A #UMockdevTestbed.
+     * @devpath: The full device path, as returned by #umockdev_testbed_add_device()
+     * @name: Attribute name
+     * @func: (nullable): Function which computes the attribute value, or %NULL
+     *        to stop computing it
+     * @func_target: User data for @func
+     * @func_target_destroy_notify: Function to free @func_target
+     *
+     * Compute the value of a sysfs attribute whenever a program reads it from
+     * the start, instead of rewriting the attribute file with
+     * umockdev_testbed_set_attribute() for every change. This is meant for
+     * attributes which change all the time, like counters or sensor values.
+     *
+     * @func gets called in a separate thread. The attribute file keeps the
+     * value of its first call, which is what programs see that do not go
+     * through the preload library. Writes go to the attribute file.
+     *
+     * Since: 0.19
+     */
+    public void set_attribute_func(string devpath, string name, owned AttributeFunc? func)
+    {
+        if (func != null)
+            this.set_attribute(devpath, name, func(devpath, name));
+
+        string? attr_path = this.resolve_attribute(devpath, name);
+        if (attr_path == null) {
+            critical("umockdev_testbed_set_attribute_func(): %s has no attribute %s", devpath, name);
+            return;
+        }
+
+        IoctlBase? old = this.custom_handlers.lookup(attr_path);
+        if (old != null) {
+            old.unregister_path(attr_path);
+            this.custom_handlers.remove(attr_path);
+        }
+        if (func == null)
+            return;
+
+        var handler = new IoctlAttributeHandler(devpath, name, (owned) func);
+        register_handler(handler, attr_path, Path.build_filename("ioctl", attr_path));
+        this.custom_handlers.insert(attr_path, handler);
+    }
+
+    /**
+     * umockdev_testbed_notify_attribute:
+     * @self: A #UMockdevTestbed.
+     * @devpath: The full device path, as returned by #umockdev_testbed_add_device()
+     * @name: Attribute name
+     *
+     * Notify programs which wait for changes of a sysfs attribute, like the
+     * kernel's sysfs_notify(). poll() and epoll on an open file descriptor of
+     * the attribute then report POLLPRI and POLLERR, until the program reads
+     * the attribute again.
+     *
+     * Change the value with e. g. umockdev_testbed_set_attribute() before;
+     * reading an open attribute from the start again gets the new value.
+     *
+     * Since: 0.19
+     */
+    public void notify_attribute(string devpath, string name)
+    {
+        string? attr_path = this.resolve_attribute(devpath, name);
+        if (attr_path == null) {
+            critical("umockdev_testbed_notify_attribute(): %s has no attribute %s", devpath, name);
+            return;
+        }
+
+        /* the preload library watches this as the attribute's event counter */
+        string counter = Path.build_filename(this.root_dir, "notify", attr_path);
+        checked_mkdir_with_parents(Path.get_dirname(counter), 0755);
+
+        int fd = Posix.open(counter, Posix.O_WRONLY | Posix.O_CREAT | Posix.O_APPEND | Posix.O_CLOEXEC, 0644);
+        if (fd < 0 || Posix.write(fd, "!", 1) != 1)
+            error("Cannot write attribute notification %s: %m", counter);
+        Posix.close(fd);
+    }
+
     /**
      * umockdev_testbed_set_attribute_link:
      * @self: A #UMockdevTestbed.
@@ -277,6 +408,17 @@ public class Testbed: GLib.Object {
         }
     }
 
+    /* Path of an attribute in /sys with all symlinks resolved, which is how
+     * the preload library identifies it; null if it does not exist */
+    private string? resolve_attribute(string devpath, string name)
+    {
+        string? attr_path = Posix.realpath(Path.build_filename(this.root_dir, devpath, name));
+        string? root = Posix.realpath(this.root_dir);
+        if (attr_path == null || root == null || !attr_path.has_prefix(root + "/sys/"))
+            return null;
+        return attr_path.substring(root.length);
+    }
+
     private string get_attribute(string devpath, string name)
     {
         string read = null;
@@ -668,6 +810,11 @@ public class Testbed: GLib.Object {
                 FileUtils.unlink(real_node);
                 DirUtils.remove(Path.get_dirname(real_node));
                 FileUtils.unlink(Path.build_filename(this.root_dir, "dev", ".node", dev_node.substring(5).replace("/", "_")));
+                FileUtils.unlink(this.lazy_marker_path(dev_node));
+                lock (this.lazy_nodes) {
+                    this.lazy_nodes.remove(dev_node);
+                    this.update_lazy_node_count ();
+                }
             }
         } catch (FileError e) {}
 
@@ -715,7 +862,8 @@ public class Testbed: GLib.Object {
      *             continuous hex string), it creates a
      *             <filename>/dev/devname</filename> in the mock environment with
      *             the given contents, otherwise the created dev file will be a
-     *             pty; see #umockdev_testbed_get_dev_fd for details.</listitem>
+     *             pty or socket; see #umockdev_testbed_get_dev_fd and
+     *             #umockdev_testbed_set_node_backing for details.</listitem>
      *   <listitem><type>S:</type> <emphasis>linkname</emphasis>: device node
      *             symlink (without the <filename>/dev/</filename> prefix); ignored right
      *             now.</listitem>
@@ -777,11 +925,7 @@ public class Testbed: GLib.Object {
      */
     public void uevent (string devpath, string action)
     {
-        if (this.ev_sender == null) {
-            debug("umockdev_testbed_uevent: lazily initializing uevent_sender");
-            this.ev_sender = new UeventSender.sender(this.root_dir);
-            assert(this.ev_sender != null);
-        }
+        unowned UeventSender.sender sender = this.get_uevent_sender();
         debug("umockdev_testbed_uevent: sending uevent %s for device %s", action, devpath);
 
         var uevent_path = Path.build_filename(this.root_dir, devpath, "uevent");
@@ -791,7 +935,131 @@ public class Testbed: GLib.Object {
         } catch (FileError e) {
             debug("uevent: devpath %s has no uevent file: %s",  devpath, e.message);
         }
-        this.ev_sender.send(devpath, action, properties);
+        sender.send(devpath, action, properties);
+    }
+
+    internal unowned UeventSender.sender get_uevent_sender ()
+    {
+        if (this.ev_sender == null) {
+            debug("umockdev_testbed_uevent: lazily initializing uevent_sender");
+            this.ev_sender = new UeventSender.sender(this.root_dir);
+            assert(this.ev_sender != null);
+        }
+        return this.ev_sender;
+    }
+
+    /**
+     * umockdev_testbed_load_uevents:
+     * @self: A #UMockdevTestbed.
+     * @recordfile: Path of the uevent recording.
+     * @time_scale: Factor for the time between the events; 1 replays them
+     *              with the recorded timing, 0.5 twice as fast, and 0 sends
+     *              all of them at once.
+     * @error: return location for a GError, or %NULL
+     *
+     * Replay a uevent recording, as written by umockdev-record --uevents.
+     * Each line of it is one event:
+     *
+     *  delay action devpath KEY=VALUE ...
+     *
+     * with the delay in milliseconds since the previous event, the device path
+     * in sysfs starting with /devices/, and the udev properties of the event.
+     * The device path and values use C style backslash escapes, with spaces
+     * written as \040. Lines starting with '#' are comments.
+     *
+     * The events get sent from the thread-default main context, starting when
+     * it runs next; events which are due within the same millisecond are sent
+     * as one batch. Devices which do not exist in the testbed yet get added
+     * on their "add" event, with the properties of the event and a device
+     * node if it has one; devices get removed after their "remove" event.
+     *
+     * Returns: %TRUE on success, %FALSE if the recording cannot be read or is
+     *          invalid and an error occurred.
+     * Since: 0.19
+     */
+    public bool load_uevents (string recordfile, double time_scale = 1.0) throws GLib.Error
+    {
+        string contents;
+
+        if (time_scale < 0)
+            throw new UMockdev.Error.VALUE("invalid time scale %f", time_scale);
+        FileUtils.get_contents (recordfile, out contents);
+
+        var events = new GenericArray<RecordedUevent> ();
+        int64 due = 0;
+        uint lineno = 0;
+        foreach (unowned string line in contents.split ("\n")) {
+            ++lineno;
+            if (line == "" || line.has_prefix ("#"))
+                continue;
+
+            string[] fields = line.split (" ");
+            int64 delay;
+            if (fields.length < 3 || !int64.try_parse (fields[0], out delay) || delay < 0 ||
+                !fields[2].has_prefix ("/devices/"))
+                throw new UMockdev.Error.PARSE ("%s:%u: malformed uevent", recordfile, lineno);
+
+            var ev = new RecordedUevent ();
+            due += (int64) (delay * 1000 * time_scale);
+            ev.due = due;
+            ev.action = fields[1];
+            ev.devpath = fields[2].compress ();
+            var properties = new StringBuilder ();
+            for (int i = 3; i < fields.length; ++i) {
+                string[] kv = fields[i].split ("=", 2);
+                if (kv.length != 2)
+                    throw new UMockdev.Error.PARSE ("%s:%u: malformed uevent property '%s'", recordfile, lineno, fields[i]);
+                string val = kv[1].compress ();
+                // properties are sent as lines
+                if ("\n" in val)
+                    continue;
+                // the sender adds SUBSYSTEM itself
+                if (kv[0] == "SUBSYSTEM") {
+                    ev.subsystem = val;
+                    continue;
+                }
+                if (kv[0] == "DEVTYPE")
+                    ev.devtype = val;
+                properties.append_printf ("%s=%s\n", kv[0], val);
+            }
+            if (ev.subsystem == null)
+                throw new UMockdev.Error.PARSE ("%s:%u: uevent without SUBSYSTEM", recordfile, lineno);
+            ev.properties = properties.str;
+            events.add (ev);
+        }
+
+        if (events.length > 0) {
+            var replay = new UeventReplay (this, events);
+            this.uevent_replays.add (replay);
+            replay.start ();
+        }
+        return true;
+    }
+
+    /* Forget a replay once it sent its last event */
+    internal void remove_uevent_replay (UeventReplay replay)
+    {
+        this.uevent_replays.remove (replay);
+    }
+
+    /* Send a recorded uevent, adding or removing the device as it happened */
+    internal void send_recorded_uevent (RecordedUevent ev)
+    {
+        string syspath = "/sys" + ev.devpath;
+        bool exists = FileUtils.test (Path.build_filename (this.root_dir, syspath), FileTest.IS_DIR);
+
+        if (ev.action == "add" && !exists) {
+            try {
+                this.add_from_string (ev.get_description ());
+            } catch (UMockdev.Error e) {
+                warning ("Cannot add device %s from uevent: %s", ev.devpath, e.message);
+            }
+        }
+
+        this.get_uevent_sender ().send_event (ev.devpath, ev.subsystem, ev.devtype, ev.action, ev.properties);
+
+        if (ev.action == "remove" && exists)
+            this.remove_device (syspath);
     }
 
     /**
@@ -813,8 +1081,7 @@ public class Testbed: GLib.Object {
     {
         assert (!this.custom_handlers.contains (dev));
 
-        string sockpath = Path.build_filename(this.root_dir, "ioctl", dev);
-        handler.register_path(this.worker_ctx, dev, sockpath);
+        register_handler(handler, dev, Path.build_filename("ioctl", dev));
 
         this.custom_handlers.insert(dev, handler);
 
@@ -866,29 +1133,104 @@ public class Testbed: GLib.Object {
      */
     public bool load_ioctl (string? dev, string recordfile) throws GLib.Error, FileError, IOError, RegexError
     {
-        string format = "";
-        DataInputStream recording;
-        // Apparently valac isn't smart enough to turn a parameter into an owned
-        // variable when we assign to it, so we need an explicit copy here.
-        string? owned_dev = dev;
+        return this.load_ioctl_contents (dev, read_ioctl_record (recordfile), recordfile);
+    }
+
+    /* load_ioctl() for a record which is already in memory; name is for
+     * error messages */
+    private bool load_ioctl_contents (string? dev, Bytes contents, string name) throws GLib.Error, FileError, IOError, RegexError
+    {
+        string owned_dev;
+        string format;
+        string? dest = this.install_ioctl_record (dev, contents, name, out owned_dev, out format);
+        if (dest == null)
+            return false;
+
+        IoctlBase handler;
+        EvdevState? evdev = this.get_evdev_state (owned_dev);
+        if (format == "SPI" || format == "SPI-BIN")
+            handler = new IoctlSpiHandler(dest);
+        else if (evdev != null)
+            handler = new IoctlEvdevHandler(dest, evdev);
+        else
+            handler = new IoctlTreeHandler(dest);
+
+        register_handler(handler, owned_dev, Path.build_filename("ioctl", owned_dev));
+        if (handler is IoctlTreeHandler)
+            this.ioctl_trees.insert(owned_dev, (IoctlTreeHandler) handler);
+
+        return true;
+    }
+
+    /**
+     * umockdev_testbed_prune_ioctl:
+     * @self: A #UMockdevTestbed.
+     * @dev: Device path (/dev/...) for which an ioctl record was loaded
+     * @recordfile: Path of the ioctl record file to write
+     * @nodes: (out) (optional): Number of nodes in the loaded tree
+     * @kept: (out) (optional): Number of nodes written, i. e. the executed
+     *        ones and their parents
+     * @duplicates: (out) (optional): Number of nodes which are equal to an
+     *              earlier one, i. e. are recorded more than once
+     * @error: return location for a GError, or %NULL
+     *
+     * Write the ioctl tree which was loaded for @dev with
+     * umockdev_testbed_load_ioctl() or umockdev_testbed_load_hidraw(), but
+     * only with the nodes which the programs in the testbed executed so far,
+     * the ones which the device emulation itself needs (like the report
+     * descriptor of hidraw devices), and their parents. Unused parts of a recording, like init sequences
+     * that replays never reach, get dropped this way. Run all programs which
+     * the recording should serve before calling this.
+     *
+     * Returns: %TRUE on success, %FALSE if no ioctl tree was loaded for @dev.
+     * Since: 0.19
+     */
+    public bool prune_ioctl (string dev, string recordfile, out uint nodes, out uint kept,
+                             out uint duplicates) throws FileError
+    {
+        nodes = kept = duplicates = 0;
+        IoctlTreeHandler? handler = this.ioctl_trees.lookup (dev);
+        if (handler == null)
+            return false;
+
+        IoctlTree.Stats stats;
+        if (!handler.write_executed (recordfile, dev, out stats))
+            throw new FileError.FAILED ("Cannot write %s: %s", recordfile, strerror (errno));
+        nodes = stats.nodes;
+        kept = stats.kept;
+        duplicates = stats.duplicates;
+        return true;
+    }
+
+    /* Read an ioctl record (possibly xz compressed). Records are handled as
+     * bytes, as some formats are binary. */
+    private static Bytes read_ioctl_record (string recordfile) throws GLib.Error
+    {
+        Bytes contents;
 
         if (recordfile.has_suffix(".xz")) {
             try {
-                string contents;
-                int exit;
-                Process.spawn_sync(null, {"xz", "-cd", recordfile}, null,
-                                   SpawnFlags.SEARCH_PATH,
-                                   null,
-                                   out contents,
-                                   null,
-                                   out exit);
-                assert(exit == 0);
-                recording = new DataInputStream(new MemoryInputStream.from_data(contents.data, null));
-            } catch (SpawnError e) {
+                var xz = new Subprocess.newv({"xz", "-cd", recordfile}, SubprocessFlags.STDOUT_PIPE);
+                xz.communicate(null, null, out contents, null);
+                assert(xz.get_successful());
+            } catch (GLib.Error e) {
                 error("Cannot call xz to decompress %s: %s", recordfile, e.message);
             }
         } else
-            recording = new DataInputStream(File.new_for_path(recordfile).read());
+            contents = File.new_for_path(recordfile).load_bytes();
+
+        return contents;
+    }
+
+    /* Copy an ioctl record into the testbed, and return its path there; null
+     * on failure. */
+    private string? install_ioctl_record (string? dev, Bytes contents, string recordfile, out string owned_dev, out string format)
+        throws GLib.Error, FileError, IOError, RegexError
+    {
+        format = "";
+        owned_dev = dev;
+
+        var recording = new DataInputStream(new MemoryInputStream.from_bytes(contents));
 
         // Grab information from header file
 
@@ -908,27 +1250,13 @@ public class Testbed: GLib.Object {
             error("null passed for device node, but recording %s has no @DEV header", recordfile);
         }
 
-        recording.seek(0, SeekType.SET);
-
         string dest = Path.build_filename(this.root_dir, "ioctl", owned_dev + ".tree");
         checked_mkdir_with_parents(Path.get_dirname(dest), 0755);
 
-        string? contents = recording.read_upto("", 0, null);
-        if (contents == null)
-            contents = "";
-        if (!FileUtils.set_contents(dest, contents))
-            return false;
-
-        IoctlBase handler;
-        if (format == "SPI")
-            handler = new IoctlSpiHandler(dest);
-        else
-            handler = new IoctlTreeHandler(dest);
-
-        string sockpath = Path.build_filename(this.root_dir, "ioctl", owned_dev);
-        handler.register_path(this.worker_ctx, owned_dev, sockpath);
+        if (!FileUtils.set_data(dest, contents.get_data()))
+            return null;
 
-        return true;
+        return dest;
     }
 
     /**
@@ -947,9 +1275,13 @@ public class Testbed: GLib.Object {
      * Since: 0.16
      */
     public bool load_pcap (string sysfs, string recordfile) throws GLib.Error, FileError, IOError, RegexError
+    {
+        return this.load_pcap_recording (sysfs, new PcapMmapReader (recordfile, dlt.USB_LINUX_MMAPPED));
+    }
+
+    private bool load_pcap_recording (string sysfs, PcapMmapReader rec) throws GLib.Error
     {
         string owned_dev;
-        string sockpath;
         int busnum;
         int devnum;
 
@@ -959,16 +1291,326 @@ public class Testbed: GLib.Object {
         owned_dev = Path.build_filename("/dev", "bus", "usb",
                                         busnum.to_string("%03d"), devnum.to_string("%03d"));
 
-        sockpath = Path.build_filename(this.root_dir, "ioctl", owned_dev);
+        IoctlUsbPcapHandler handler = new IoctlUsbPcapHandler(rec, busnum, devnum);
+        register_handler(handler, owned_dev, Path.build_filename("ioctl", owned_dev));
+
+        return true;
+    }
+
+    /**
+     * umockdev_testbed_load_v4l2:
+     * @self: A #UMockdevTestbed.
+     * @dev: Device path (/dev/videoN) of a previously added video4linux device
+     * @framefile: (nullable): File with raw frames in the given format, or
+     *             %NULL to generate a moving test pattern
+     * @width: Frame width
+     * @height: Frame height
+     * @fourcc: Pixel format, one of "YUYV", "GREY" or "RGB3"
+     * @fps: Frame rate while streaming
+     * @error: return location for a GError, or %NULL
+     *
+     * Emulate a V4L2 video capture device with a single format. Clients can
+     * query it and stream with mmap()ed buffers (VIDIOC_REQBUFS, QBUF, DQBUF,
+     * STREAMON); the buffers are shared with the emulation, so frames are
+     * not copied. @framefile is played in a loop.
+     *
+     * poll() on the device reports it as readable while a frame is ready.
+     * Without one, VIDIOC_DQBUF blocks until the next frame is due, or fails
+     * with EAGAIN on non-blocking fds.
+     *
+     * Returns: %TRUE on success, %FALSE on error.
+     * Since: 0.19
+     */
+    public bool load_v4l2 (string dev, string? framefile, uint width, uint height, string fourcc, uint fps)
+        throws GLib.Error
+    {
+        uint32 pixelformat;
+
+        if ((fourcc != "YUYV" && fourcc != "GREY" && fourcc != "RGB3") || width == 0 || height == 0)
+            throw new UMockdev.Error.VALUE("unsupported V4L2 format %s %ux%u", fourcc, width, height);
+        pixelformat = (uint32) fourcc[0] | (uint32) fourcc[1] << 8 | (uint32) fourcc[2] << 16 | (uint32) fourcc[3] << 24;
+
+        int fd = this.get_dev_fd (dev);
+        string? pty = null;
+        string node = Path.build_filename (this.root_dir, dev);
+        /* socket backed nodes have no pty */
+        if (fd >= 0 && FileUtils.test (node, FileTest.IS_SYMLINK))
+            pty = FileUtils.read_link (node);
+        var handler = new IoctlV4l2Handler(framefile, width, height, pixelformat, fps,
+                                           fd >= 0 ? Posix.dup (fd) : -1, pty);
+
+        register_handler(handler, dev, Path.build_filename("ioctl", dev));
+
+        return true;
+    }
+
+    /**
+     * umockdev_testbed_load_hidraw:
+     * @self: A #UMockdevTestbed.
+     * @dev: Device path (/dev/hidrawN) of a previously added hidraw device.
+     *       %NULL is valid; in this case the device node is taken from the
+     *       ioctl record.
+     * @recordfile: Path of an ioctl record of the device, as created with
+     *              umockdev-record --ioctl; it must contain HIDIOCGRDESC.
+     * @rulesfile: (nullable): Path of a rules file, or %NULL
+     * @error: return location for a GError, or %NULL
+     *
+     * Emulate a hidraw device by its reports. The report descriptor from
+     * @recordfile tells which report IDs exist and how long the reports are;
+     * other ioctls are answered from the record like with
+     * umockdev_testbed_load_ioctl().
+     *
+     * @rulesfile has one rule per line, with reports in hex:
+     *
+     *  i REPORT: input report that every reader gets when opening the device
+     *
+     *  f REPORT: feature report for HIDIOCGFEATURE; it starts with the report ID
+     *
+     *  w PREFIX [REPORT ...]: when the client sends an output or feature
+     *  report (write(), HIDIOCSOUTPUT, HIDIOCSFEATURE) that starts with PREFIX,
+     *  send the given input reports. PREFIX starts with the report ID (0 on
+     *  devices without numbered reports, like in write()). The first matching
+     *  rule wins.
+     *
+     * Input reports are written as read() returns them, i. e. only starting
+     * with the report ID on devices with numbered reports; they are padded
+     * with zeros to the size from the descriptor. Every read() returns one
+     * whole report and blocks until there is one; poll() reports the device
+     * as readable while reports are queued.
+     *
+     * Returns: %TRUE on success, %FALSE if the data is invalid and an error
+     *          occurred.
+     * Since: 0.19
+     */
+    public bool load_hidraw (string? dev, string recordfile, string? rulesfile)
+        throws GLib.Error
+    {
+        string owned_dev;
+        string format;
+        string? dest = this.install_ioctl_record (dev, read_ioctl_record (recordfile), recordfile,
+                                                  out owned_dev, out format);
+        if (dest == null)
+            return false;
+
+        int fd = this.get_dev_fd (owned_dev);
+        string? pty = null;
+        string node = Path.build_filename (this.root_dir, owned_dev);
+        /* socket backed nodes have no pty */
+        if (fd >= 0 && FileUtils.test (node, FileTest.IS_SYMLINK))
+            pty = FileUtils.read_link (node);
+        var handler = new IoctlHidrawHandler(dest, rulesfile, fd >= 0 ? Posix.dup (fd) : -1, pty);
+
+        register_handler(handler, owned_dev, Path.build_filename("ioctl", owned_dev));
+        this.ioctl_trees.insert(owned_dev, handler);
+
+        return true;
+    }
+
+    /**
+     * umockdev_testbed_load_block:
+     * @self: A #UMockdevTestbed.
+     * @dev: Device path (/dev/...) of a previously added block device
+     * @image: (nullable): Path of a disk image with the initial contents, or
+     *         %NULL for an empty disk
+     * @size: Disk size in bytes; 0 means the size of @image
+     * @block_size: Logical and physical block size in bytes, e. g. 512 or 4096
+     * @latency: Delay of every read() and write() in microseconds, or 0
+     * @bandwidth: Throughput of read() and write() in bytes per second, or 0
+     *             for no limit
+     * @error: return location for a GError, or %NULL
+     *
+     * Emulate the data of a block device. The device node becomes a sparse
+     * file of @size bytes, which clients read and write directly; so
+     * read()/write(), pread()/pwrite(), lseek() and mmap() behave like on a
+     * real disk. BLKGETSIZE64, BLKGETSIZE, BLKSSZGET, BLKPBSZGET,
+     * BLKDISCARD, BLKZEROOUT, BLKFLSBUF and BLKRRPART are emulated.
+     *
+     * @image is never modified: the disk starts as a copy-on-write clone of
+     * it where the file system supports that (like btrfs or XFS), otherwise
+     * as a sparse copy.
+     *
+     * With @latency or @bandwidth, all read/write calls get delayed
+     * accordingly; transfers are serialized like on a single disk queue.
+     * Delays are rounded up to full milliseconds.
+     *
+     * The "size" and queue attributes in sysfs are not changed, they should
+     * be part of the device description.
+     *
+     * Returns: %TRUE on success, %FALSE on error.
+     * Since: 0.19
+     */
+    public bool load_block (string dev, string? image, uint64 size, uint block_size, uint latency, uint64 bandwidth)
+        throws GLib.Error
+    {
+        string node = Path.build_filename (this.root_dir, dev);
+        Posix.Stat st;
+
+        if (Posix.lstat (node, out st) != 0 || !Posix.S_ISREG (st.st_mode) || (st.st_mode & Posix.S_ISVTX) == 0)
+            throw new UMockdev.Error.VALUE ("%s is not an emulated block device", dev);
+        if (block_size < 512 || (block_size & (block_size - 1)) != 0)
+            throw new UMockdev.Error.VALUE ("invalid block size %u", block_size);
+
+        int fd = Posix.open (node, Posix.O_RDWR | Posix.O_TRUNC | Posix.O_CLOEXEC);
+        if (fd < 0)
+            throw new FileError.FAILED ("Cannot open %s: %m".printf (node));
+
+        try {
+            if (image != null) {
+                uint64 image_size = clone_block_image (image, fd);
+                if (size == 0)
+                    size = image_size;
+            }
+
+            if (size == 0 || size % block_size != 0)
+                throw new UMockdev.Error.VALUE ("invalid size %" + uint64.FORMAT + " for block device %s", size, dev);
+            if (Posix.ftruncate (fd, (Posix.off_t) size) < 0)
+                throw new FileError.FAILED ("Cannot resize %s: %m".printf (node));
+        } catch (GLib.Error e) {
+            Posix.close (fd);
+            throw e;
+        }
+
+        var handler = new IoctlBlockHandler (fd, size, block_size, latency, bandwidth);
+
+        register_handler (handler, dev, Path.build_filename ("ioctl", dev));
+
+        return true;
+    }
+
+    /* Copy image into dest, without modifying it; this is a reflink where the
+     * file system can do that, otherwise only the data (not the holes) get
+     * copied. Returns the image size. */
+    private static uint64 clone_block_image (string image, int dest) throws FileError
+    {
+        int src = Posix.open (image, Posix.O_RDONLY | Posix.O_CLOEXEC);
+        if (src < 0)
+            throw new FileError.FAILED ("Cannot open %s: %m".printf (image));
+
+        Posix.off_t end = Posix.lseek (src, 0, Posix.SEEK_END);
+        if (end < 0 || Posix.ioctl (dest, Ioctl.FICLONE, src) == 0) {
+            Posix.close (src);
+            return end < 0 ? 0 : (uint64) end;
+        }
+
+        var buf = new uint8[1024 * 1024];
+        Posix.off_t pos = 0;
+        while (pos < end) {
+            Posix.off_t data = Posix.lseek (src, pos, LinuxFixes.SEEK_DATA);
+            if (data < 0 && Posix.errno == Posix.ENXIO)
+                break; /* only a hole left */
+            Posix.off_t hole = data < 0 ? end : Posix.lseek (src, data, LinuxFixes.SEEK_HOLE);
+            /* no SEEK_DATA support: everything is data */
+            if (data < 0)
+                data = pos;
+            if (hole < 0)
+                hole = end;
+
+            for (pos = data; pos < hole;) {
+                size_t len = (size_t) (hole - pos < buf.length ? hole - pos : buf.length);
+                ssize_t r = Posix.pread (src, buf, len, pos);
+                if (r <= 0 || Posix.pwrite (dest, buf, r, pos) != r) {
+                    Posix.close (src);
+                    throw new FileError.FAILED ("Cannot copy %s: %m".printf (image));
+                }
+                pos += r;
+            }
+        }
+
+        Posix.close (src);
+        return (uint64) end;
+    }
+
+    /**
+     * umockdev_testbed_load_serial:
+     * @self: A #UMockdevTestbed.
+     * @dev: Device path (/dev/...) of a previously added PTY backed device,
+     *       like /dev/ttyUSB0
+     * @error: return location for a GError, or %NULL
+     *
+     * Emulate a serial port on the device. Data still goes through the
+     * master end from umockdev_testbed_get_dev_fd() (or a script), but it
+     * is paced according to the baud rate and frame format that the client
+     * configures with tcsetattr(); the client's writes return once the data
+     * would have been sent. With CRTSCTS, writes wait for CTS.
+     *
+     * The modem lines are emulated with TIOCMGET, TIOCMSET, TIOCMBIS,
+     * TIOCMBIC, TIOCMIWAIT and TIOCGICOUNT; the client controls DTR and RTS,
+     * and the test sets the other lines with
+     * umockdev_testbed_set_serial_lines().
+     *
+     * read() always blocks until there is data, so clients with O_NONBLOCK
+     * need to poll() first.
+     *
+     * Returns: %TRUE on success, %FALSE on error.
+     * Since: 0.19
+     */
+    public bool load_serial (string dev) throws GLib.Error
+    {
+        int fd = this.get_dev_fd (dev);
+        if (fd < 0)
+            throw new UMockdev.Error.VALUE ("%s is not a PTY backed device", dev);
+
+        Posix.termios ios;
+        if (Posix.tcgetattr (fd, out ios) < 0)
+            throw new FileError.FAILED ("Cannot get terminal settings of %s: %m".printf (dev));
+
+        string pty = FileUtils.read_link (Path.build_filename (this.root_dir, dev));
+        int pty_fd = Posix.open (pty, Posix.O_RDONLY | Posix.O_NONBLOCK | Posix.O_NOCTTY | Posix.O_CLOEXEC);
+        if (pty_fd < 0)
+            throw new FileError.FAILED ("Cannot open %s: %m".printf (pty));
 
-        checked_mkdir_with_parents(Path.get_dirname(sockpath), 0755);
+        var handler = new IoctlSerialHandler (this.worker_ctx, pty_fd, (uint) ios.c_cflag);
+        this.serial_handlers.insert (dev, handler);
 
-        IoctlUsbPcapHandler handler = new IoctlUsbPcapHandler(recordfile, busnum, devnum);
-        handler.register_path(this.worker_ctx, owned_dev, sockpath);
+        register_handler (handler, dev, Path.build_filename ("ioctl", dev));
 
         return true;
     }
 
+    /**
+     * umockdev_testbed_set_serial_lines:
+     * @self: A #UMockdevTestbed.
+     * @dev: Device path (/dev/...) of a device set up with
+     *       umockdev_testbed_load_serial()
+     * @lines: TIOCM_CTS, TIOCM_DSR, TIOCM_CAR and TIOCM_RNG flags
+     *
+     * Set the modem lines which the other end of the serial line controls.
+     * This wakes up TIOCMIWAIT calls and counts the changes for TIOCGICOUNT
+     * like the kernel does. Other flags in @lines are ignored.
+     *
+     * Since: 0.19
+     */
+    public void set_serial_lines (string dev, uint lines)
+    {
+        IoctlSerialHandler? handler = this.serial_handlers.lookup (dev);
+        if (handler == null)
+            critical ("umockdev_testbed_set_serial_lines(): %s is not an emulated serial port", dev);
+        else
+            handler.set_lines (lines);
+    }
+
+    /**
+     * umockdev_testbed_get_serial_lines:
+     * @self: A #UMockdevTestbed.
+     * @dev: Device path (/dev/...) of a device set up with
+     *       umockdev_testbed_load_serial()
+     *
+     * Get the modem lines as the client sees them, i. e. including DTR and
+     * RTS as set by the client.
+     *
+     * Returns: TIOCM_* flags
+     * Since: 0.19
+     */
+    public uint get_serial_lines (string dev)
+    {
+        IoctlSerialHandler? handler = this.serial_handlers.lookup (dev);
+        if (handler == null) {
+            critical ("umockdev_testbed_get_serial_lines(): %s is not an emulated serial port", dev);
+            return 0;
+        }
+        return handler.get_lines ();
+    }
+
     /**
      * umockdev_testbed_load_script:
      * @self: A #UMockdevTestbed.
@@ -986,15 +1628,22 @@ public class Testbed: GLib.Object {
      */
     public bool load_script (string? dev, string recordfile)
         throws GLib.Error, FileError, IOError, RegexError
+    {
+        FileStream? script = FileStream.open (recordfile, "r");
+        if (script == null)
+            throw new FileError.FAILED ("Cannot open script record file " + recordfile);
+        return this.load_script_stream (dev, (owned) script, recordfile);
+    }
+
+    private bool load_script_stream (string? dev, owned FileStream script, string recordfile)
+        throws GLib.Error, FileError, IOError, RegexError
     {
         string? owned_dev = dev;
         if (owned_dev == null) {
-            var recording = new DataInputStream(File.new_for_path(recordfile).read());
-
             // Ignore any leading comments
-            string line = recording.read_line();
+            string? line = script.read_line();
             while (line != null && line.has_prefix("#"))
-                line = recording.read_line();
+                line = script.read_line();
 
             // Next must be our d 0 <devicenode> header
             if (line == null)
@@ -1004,6 +1653,7 @@ public class Testbed: GLib.Object {
             if (!(new Regex("^d 0 (.*)(\n|$)")).match(line, 0, out header_matcher))
                 error("null passed for device node, but recording %s has no d 0 header", recordfile);
             owned_dev = header_matcher.fetch(1);
+            script.seek (0, FileSeek.SET);
         }
 
         assert (!this.dev_script_runner.contains (owned_dev));
@@ -1012,7 +1662,8 @@ public class Testbed: GLib.Object {
         if (fd < 0)
             throw new FileError.INVAL (owned_dev + " is not a device suitable for scripts");
 
-        this.dev_script_runner.insert (owned_dev, new ScriptRunner (owned_dev, recordfile, fd));
+        this.dev_script_runner.insert (owned_dev, new ScriptRunner (owned_dev, (owned) script, recordfile, fd,
+                                                                    this.get_evdev_state (owned_dev)));
         return true;
     }
 
@@ -1032,6 +1683,13 @@ public class Testbed: GLib.Object {
      *          invalid and an error occurred.
      */
     public bool load_socket_script (string path, int type, string recordfile) throws FileError
+    {
+        uint8[] contents;
+        FileUtils.get_data (recordfile, out contents);
+        return this.load_socket_script_contents (path, type, new Bytes.take ((owned) contents), recordfile);
+    }
+
+    private bool load_socket_script_contents (string path, int type, Bytes script, string recordfile) throws FileError
     {
         int fd = Posix.socket (Posix.AF_UNIX, type, 0);
         if (fd < 0)
@@ -1044,7 +1702,7 @@ public class Testbed: GLib.Object {
         if (this.socket_server == null)
             this.socket_server = new SocketServer ();
 
-        this.socket_server.add (real_path, fd, recordfile);
+        this.socket_server.add (real_path, fd, script, recordfile);
         return true;
     }
 
@@ -1075,8 +1733,12 @@ public class Testbed: GLib.Object {
     public bool load_evemu_events (string? dev, string eventsfile)
         throws GLib.Error, FileError, IOError, RegexError
     {
-        File f_ev = File.new_for_path(eventsfile);
-        var s_ev = new DataInputStream(f_ev.read());
+        return this.load_evemu_stream (dev, new DataInputStream (File.new_for_path (eventsfile).read ()), eventsfile);
+    }
+
+    private bool load_evemu_stream (string? dev, DataInputStream s_ev, string eventsfile)
+        throws GLib.Error, FileError, IOError, RegexError
+    {
         string line;
         string? recorded_dev = null;
         size_t len;
@@ -1085,8 +1747,8 @@ public class Testbed: GLib.Object {
         var default_dev_re = new Regex("^# device (.*)$");
         var event_re = new Regex("^E: ([0-9]+)\\.([0-9]+) +([0-9a-fA-F]+) +([0-9a-fA-F]+) +(-?[0-9]+) *#?");
 
-        string script_file;
-        int script_fd = FileUtils.open_tmp ("evemu.XXXXXX.script", out script_file);
+        // the converted script only lives in memory
+        int script_fd = create_memfd (eventsfile);
         int delay = 0;
         bool first = true;
 
@@ -1123,8 +1785,6 @@ public class Testbed: GLib.Object {
             assert (Posix.write(script_fd, script_line, script_line.length) == script_line.length);
         }
 
-        Posix.close (script_fd);
-
         string? owned_dev = dev;
         if (owned_dev == null) {
             if (recorded_dev == null)
@@ -1132,9 +1792,79 @@ public class Testbed: GLib.Object {
             owned_dev = recorded_dev;
         }
 
-        bool ret = load_script(owned_dev, script_file);
-        FileUtils.unlink(script_file);
-        return ret;
+        Posix.lseek (script_fd, 0, Posix.SEEK_SET);
+        return load_script_stream (owned_dev, memfd_stream (script_fd, eventsfile), eventsfile);
+    }
+
+    /**
+     * umockdev_testbed_load_bundle:
+     * @self: A #UMockdevTestbed.
+     * @path: Path of the bundle file.
+     * @error: return location for a GError, or %NULL
+     *
+     * Load a bundle of device descriptions and recordings, as written by
+     * umockdev-record --bundle. The devices get added first; every ioctl
+     * record, script, evemu events file, pcap recording, and Unix stream
+     * script in the bundle then gets loaded like with
+     * umockdev_testbed_load_ioctl(), umockdev_testbed_load_script(), and so
+     * on, for the device that it was recorded or bundled for.
+     *
+     * The bundle is mapped into memory and read in one go; it has an index of
+     * its members, which are compressed individually.
+     *
+     * Returns: %TRUE on success, %FALSE if the bundle or one of its members
+     *          is invalid.
+     * Since: 0.19
+     */
+    public bool load_bundle (string path) throws GLib.Error
+    {
+        var bundle = new Bundle.load (path);
+
+        // devices first, as everything else refers to them
+        foreach (unowned BundleMember m in bundle.members.data)
+            if (m.kind == BundleKind.DEVICES && !this.add_from_string (m.get_text ()))
+                return false;
+
+        // the members are loaded from memory; the script runners and the
+        // pcap reader get them as memfd
+        for (uint i = 0; i < bundle.members.length; ++i) {
+            unowned BundleMember m = bundle.members[i];
+            string? target = m.target != "" ? m.target : null;
+            string name = "%s[%u]".printf (path, i);
+            bool ret = true;
+
+            switch (m.kind) {
+                case BundleKind.DEVICES:
+                    continue;
+                case BundleKind.IOCTL:
+                    ret = this.load_ioctl_contents (target, m.get_contents (), name);
+                    break;
+                case BundleKind.SCRIPT:
+                    ret = this.load_script_stream (target, memfd_stream (memfd_from_bytes (m.get_contents (), name), name), name);
+                    break;
+                case BundleKind.EVEMU_EVENTS:
+                    ret = this.load_evemu_stream (target, new DataInputStream (new MemoryInputStream.from_bytes (m.get_contents ())), name);
+                    break;
+                case BundleKind.PCAP:
+                    if (target == null)
+                        throw new IOError.INVALID_DATA ("%s: pcap recording without sysfs path", name);
+                    ret = this.load_pcap_recording (target, new PcapMmapReader.from_fd (memfd_from_bytes (m.get_contents (), name),
+                                                                                       name, dlt.USB_LINUX_MMAPPED));
+                    break;
+                case BundleKind.UNIX_STREAM:
+                    if (target == null)
+                        throw new IOError.INVALID_DATA ("%s: Unix stream script without socket path", name);
+                    ret = this.load_socket_script_contents (target, Posix.SOCK_STREAM, m.get_contents (), name);
+                    break;
+                default:
+                    throw new IOError.NOT_SUPPORTED ("%s: unknown kind of bundle member %i", name, (int) m.kind);
+            }
+
+            if (!ret)
+                return false;
+        }
+
+        return true;
     }
 
     private static HashTable<string, string> bus_lookup_table;
@@ -1442,13 +2172,113 @@ public class Testbed: GLib.Object {
             return;
         }
 
-        // otherwise we create a PTY
+        // otherwise the node gets a PTY or socket pair on first use; until
+        // then it is an empty file, which the preload shows as char device
+        try {
+            FileUtils.set_contents(node_path, "");
+        } catch (FileError e) {
+            error("Cannot create dev node file: %s", e.message);
+        }
+        set_selinux_context (node_path, selinux_context);
+
+        string devname = node_path.substring (this.root_dir.length);
+        var node = new LazyNode ();
+        node.majmin = majmin;
+        node.selinux_context = selinux_context;
+        lock (this.lazy_nodes) {
+            node.backing = this.node_backing.contains (subsystem) ?
+                (NodeBacking) this.node_backing.get (subsystem) : NodeBacking.PTY;
+            assert (!this.dev_fd.contains (devname));
+            this.lazy_nodes.insert (devname, node);
+            this.update_lazy_node_count ();
+        }
+
+        string marker = this.lazy_marker_path (devname);
+        checked_mkdir_with_parents (Path.get_dirname (marker), 0755);
+        try {
+            FileUtils.set_contents (marker, "");
+        } catch (FileError e) {
+            error("Cannot create lazy node marker: %s", e.message);
+        }
+    }
+
+    /* The preload asks the _lazy handler to create the backing of nodes for
+     * which this exists */
+    private string lazy_marker_path (string devname)
+    {
+        return Path.build_filename (this.root_dir, "dev", ".lazy", devname.substring (5).replace ("/", "_"));
+    }
+
+    /* Create the backing of a lazy node, if it does not have one yet, and
+     * return its master fd; -1 if devnode is not a stream device. This is
+     * called from the ioctl worker thread as well. */
+    internal int realize_node (string devnode)
+    {
+        lock (this.lazy_nodes) {
+            if (!this.dev_fd.contains (devnode)) {
+                LazyNode? node = this.lazy_nodes.lookup (devnode);
+                if (node == null)
+                    return -1;
+                if (node.backing == NodeBacking.SOCKET)
+                    this.create_socket_backing (devnode, node);
+                else
+                    this.create_pty_backing (devnode, node);
+            }
+            return this.dev_fd.get (devnode);
+        }
+    }
+
+    /* A new fd of the client end of a socket backed node, or -1 for other
+     * nodes; the node may go away once the lock is released */
+    internal int dup_node_peer_fd (string devnode)
+    {
+        lock (this.lazy_nodes) {
+            LazyNode? node = this.lazy_nodes.lookup (devnode);
+            return node != null && node.peer_fd >= 0 ? Posix.dup (node.peer_fd) : -1;
+        }
+    }
+
+    /* The number of lazy nodes is kept as native int in lazy-count, which
+     * the preload maps to skip looking for markers while there are none. -1
+     * tells it that the file is going away. */
+    private void open_lazy_node_count ()
+    {
+        string path = Path.build_filename (this.root_dir, "lazy-count");
+        this.lazy_count_fd = Posix.open (path, Posix.O_RDWR | Posix.O_CREAT | Posix.O_CLOEXEC, 0644);
+        if (this.lazy_count_fd < 0)
+            error ("Cannot create %s: %m", path);
+        this.update_lazy_node_count ();
+    }
+
+    /* called with lazy_nodes locked */
+    private void close_lazy_node_count ()
+    {
+        int gone = -1;
+        if (this.lazy_count_fd < 0)
+            return;
+        Posix.pwrite (this.lazy_count_fd, &gone, sizeof (int), 0);
+        Posix.close (this.lazy_count_fd);
+        this.lazy_count_fd = -1;
+    }
+
+    /* called with lazy_nodes locked */
+    private void update_lazy_node_count ()
+    {
+        int count = (int) this.lazy_nodes.size ();
+        if (Posix.pwrite (this.lazy_count_fd, &count, sizeof (int), 0) != sizeof (int))
+            error ("Cannot update the lazy node count: %m");
+    }
+
+    /* called with lazy_nodes locked */
+    private void create_pty_backing (string devname, LazyNode node)
+    {
+        string node_path = Path.build_filename (this.root_dir, devname);
         int ptym, ptys;
         char[] ptyname_array = new char[8192];
         if (Linux.openpty (out ptym, out ptys, ptyname_array, null, null) < 0)
-            error ("umockdev Testbed.create_node_for_device: openpty() failed: %m");
+            error ("umockdev Testbed.create_pty_backing: openpty() failed: %m");
         string ptyname = (string) ptyname_array;
-        debug ("create_node_for_device: creating pty device %s: got pty %s", node_path, ptyname);
+        debug ("create_pty_backing: creating pty device %s: got pty %s", node_path, ptyname);
         Posix.close (ptys);
 
         // disable echo, canonical mode, and line ending translation by
@@ -1461,24 +2291,44 @@ public class Testbed: GLib.Object {
         Posix.cfmakeraw(ref ios);
         assert (Posix.tcsetattr (ptym, Posix.TCSANOW, ios) == 0);
 
+        FileUtils.unlink (node_path);
         assert (FileUtils.symlink (ptyname, node_path) == 0);
 
         // store link from pty name to emulated device major/minor, so that
         // we can map from an fd -> ttyname -> device we emulate
-        if (majmin != null) {
+        if (node.majmin != null) {
             string mapdir = Path.build_filename (this.root_dir, "dev", ".ptymap");
             checked_mkdir_with_parents (mapdir, 0755);
             string dest = Path.build_filename (mapdir, ptyname.replace("/", "_"));
-            debug ("create_node_for_device: creating ptymap symlink %s", dest);
-            assert (FileUtils.symlink(majmin, dest) == 0);
+            debug ("create_pty_backing: creating ptymap symlink %s", dest);
+            assert (FileUtils.symlink(node.majmin, dest) == 0);
         }
 
         // store ptym for controlling the master end
-        string devname = node_path.substring (this.root_dir.length);
-        assert (!this.dev_fd.contains (devname));
         this.dev_fd.insert (devname, ptym);
 
-        set_selinux_context (node_path, selinux_context);
+        set_selinux_context (node_path, node.selinux_context);
+
+        // from now on the node gets opened as usual
+        FileUtils.unlink (this.lazy_marker_path (devname));
+        this.lazy_nodes.remove (devname);
+        this.update_lazy_node_count ();
+    }
+
+    /* called with lazy_nodes locked */
+    private void create_socket_backing (string devname, LazyNode node)
+    {
+        int sv[2];
+        if (Posix.socketpair (Posix.AF_UNIX, Posix.SOCK_STREAM, 0, sv) < 0)
+            error ("umockdev Testbed.create_socket_backing: socketpair() failed: %m");
+        Posix.fcntl (sv[0], Posix.F_SETFD, Posix.FD_CLOEXEC);
+        Posix.fcntl (sv[1], Posix.F_SETFD, Posix.FD_CLOEXEC);
+        debug ("create_socket_backing: creating socket device %s", devname);
+
+        // the preload hands out sv[1] to every client that opens the node,
+        // so that the marker stays
+        this.dev_fd.insert (devname, sv[0]);
+        node.peer_fd = sv[1];
     }
 
     private void set_selinux_context (string path, string? context)
@@ -1575,7 +2425,12 @@ public class Testbed: GLib.Object {
      */
     public void clear()
     {
-        remove_dir (this.root_dir, false);
+        lock (this.lazy_nodes) {
+            this.close_lazy_node_count ();
+            remove_dir (this.root_dir, false);
+            this.lazy_nodes.remove_all ();
+            this.open_lazy_node_count ();
+        }
         // /sys should always exist
         checked_mkdir_with_parents(this.sys_dir, 0755);
     }
@@ -1586,38 +2441,127 @@ public class Testbed: GLib.Object {
      * @devnode: Device node name ("/dev/...")
      *
      * Simulated devices without a pre-defined contents are backed by a
-     * stream-like device node (PTY). Return the file descriptor
+     * stream-like device node (PTY, or a socket pair, see
+     * umockdev_testbed_set_node_backing()). Return the file descriptor
      * for accessing their "master" side, i. e. the end that gets
      * controlled by test suites. The tested program opens the "slave" side,
      * which is just openening the device specified by @devnode, e. g.
      * /dev/ttyUSB2. Once that happened, your test can directly communicate
      * with the tested program over that descriptor.
      *
+     * The backing is only created when it is first needed, i. e. on the
+     * first call of this function, when loading a script for the device,
+     * or when a program opens it.
+     *
      * Returns: File descriptor for communicating with clients that connect to
      *           @devnode, or -1 if @devnode does not exist or is not a
      *           simulated stream device. This must not be closed!
      */
     public int get_dev_fd(string devnode)
     {
-        // Note: the more efficient comparison of get() against null doesn't
-        // yet work with vala 0.16
-        if (this.dev_fd.contains (devnode))
-            return this.dev_fd.get (devnode);
-        else
-            return -1;
+        return this.realize_node (devnode);
+    }
+
+    /**
+     * umockdev_testbed_set_node_backing:
+     * @self: A #UMockdevTestbed.
+     * @subsystem: Subsystem name (e. g. "tty")
+     * @backing: How to back the device nodes of @subsystem
+     *
+     * Set how the device nodes without pre-defined contents of subsequently
+     * added devices in @subsystem are backed. By default these are PTYs, which
+     * have TTY semantics (termios, isatty()). Devices which do not need that
+     * can use a Unix stream socket pair instead, which is cheaper and not
+     * limited by the number of available PTYs. Clients then see a socket in
+     * fstat(); all clients of a device share the same end of the pair.
+     *
+     * Since: 0.19
+     */
+    public void set_node_backing (string subsystem, NodeBacking backing)
+    {
+        lock (this.lazy_nodes)
+            this.node_backing.insert (subsystem, (int) backing);
+    }
+
+    /* 64 bit FNV-1a of a socket path; same as name_hash() in
+     * libumockdev-preload.c */
+    private static string socket_name_hash (string rel)
+    {
+        uint64 hash = 0xcbf29ce484222325ULL;
+
+        for (int i = 0; i < rel.length; i++) {
+            hash ^= (uchar) rel[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return "#" + hash.to_string ("%016" + uint64.FORMAT_MODIFIER + "x");
+    }
+
+    /* Let handler serve the socket for rel, a path like "ioctl/dev/sda" which
+     * is the same for the preload; too long names get hashed. This must stay
+     * in sync with testbed_socket_addr() in libumockdev-preload.c. */
+    private void register_handler (IoctlBase handler, string devnode, string rel)
+    {
+        /* sizeof(sun_path) without the leading zero and the terminator that
+         * the preload's snprintf() needs */
+        const int MAX_NAME = 106;
+        string suffix = rel;
+
+        if ("umockdev.%s/%s".printf (this.channel, rel).length > MAX_NAME) {
+            suffix = socket_name_hash (rel);
+            string? other = this.hashed_socket_names.lookup (suffix);
+            if (other != null && other != rel)
+                error ("socket names of %s and %s collide, cannot emulate both", other, rel);
+            this.hashed_socket_names.insert (suffix, rel);
+        }
+
+        /* the file for invalidating cached ioctl replies */
+        string cachepath = Path.build_filename (this.root_dir, suffix) + ".cache";
+        checked_mkdir_with_parents (Path.get_dirname (cachepath), 0755);
+
+        handler.register_abstract (this.worker_ctx, devnode, "umockdev.%s/%s".printf (this.channel, suffix), cachepath);
+    }
+
+    /* Input state of an evdev node, shared between its script runner and
+     * ioctl handler; null for other devices */
+    private EvdevState? get_evdev_state (string devnode)
+    {
+        if (!devnode.has_prefix ("/dev/input/event"))
+            return null;
+
+        EvdevState? state = this.evdev_state.lookup (devnode);
+        if (state == null) {
+            state = new EvdevState ();
+            this.evdev_state.insert (devnode, state);
+        }
+        return state;
     }
 
     private string root_dir;
     private string sys_dir;
+    /* ID of the testbed's sockets in the abstract namespace */
+    private string channel;
+    /* hashed socket name → socket path, to detect collisions */
+    private HashTable<string,string> hashed_socket_names;
     private Regex re_record_val;
     private Regex re_record_keyval;
     private Regex re_record_optval;
     private UeventSender.sender? ev_sender = null;
+    private GenericArray<UeventReplay> uevent_replays;
     private HashTable<string,int> dev_fd;
     private HashTable<string,ScriptRunner> dev_script_runner;
     private SocketServer socket_server = null;
 
     private HashTable<string,IoctlBase> custom_handlers;
+    private HashTable<string,EvdevState> evdev_state;
+    private HashTable<string,IoctlSerialHandler> serial_handlers;
+    /* devnode -> handler of its ioctl tree, for pruning */
+    private HashTable<string,IoctlTreeHandler> ioctl_trees;
+    /* char device nodes whose backing is created on first use; protects
+     * dev_fd as well */
+    private HashTable<string,LazyNode> lazy_nodes;
+    private int lazy_count_fd = -1;
+    /* subsystem -> NodeBacking */
+    private HashTable<string,int> node_backing;
 
     private Thread<void> worker_thread;
     private MainContext worker_ctx;
@@ -1695,17 +2639,216 @@ find_devnode (string devpath)
     return devname;
 }
 
-private class ScriptRunner {
+/* Char device node whose backing is created on first use */
+private class LazyNode {
+    public string? majmin;
+    public string? selinux_context;
+    public NodeBacking backing;
+    /* client end of a socket backed node */
+    public int peer_fd = -1;
+
+    ~LazyNode ()
+    {
+        if (peer_fd >= 0)
+            Posix.close (peer_fd);
+    }
+}
+
+/* Creates the backing of lazy device nodes for the preload. It sends an
+ * ioctl with the size of the node name (including the NUL) as request and
+ * the name as argument; then the PTY of the node exists, or the client gets the client
+ * end of the socket pair, with result 1. */
+internal class LazyNodeHandler : IoctlBase {
+    private unowned Testbed testbed;
+
+    public LazyNodeHandler(Testbed testbed)
+    {
+        base ();
+
+        this.testbed = testbed;
+    }
 
-    public ScriptRunner (string device, string script_file, int fd) throws FileError
+    public override bool handle_ioctl(IoctlClient client)
     {
-        this.script = FileStream.open (script_file, "r");
-        if (this.script == null)
-            throw new FileError.FAILED ("Cannot open script record file " + script_file);
+        IoctlData? data = null;
 
+        try {
+            data = client.arg.resolve(0, client.request);
+        } catch (IOError e) {
+            warning("Error resolving IOCtl data: %s", e.message);
+        }
+
+        if (data == null || data.data.length == 0 || data.data[data.data.length - 1] != 0) {
+            client.complete(-1, Posix.EFAULT);
+            return true;
+        }
+
+        unowned string devnode = (string) data.data;
+        if (testbed.realize_node(devnode) < 0) {
+            client.complete(-1, Posix.ENOENT);
+            return true;
+        }
+
+        int peer = testbed.dup_node_peer_fd(devnode);
+        if (peer >= 0)
+            client.complete_with_fd(1, peer);
+        else
+            client.complete(0, 0);
+        return true;
+    }
+}
+
+/* An event from a uevent recording */
+internal class RecordedUevent {
+    /* in µs from the start of the replay */
+    public int64 due;
+    public string action;
+    public string devpath;
+    public string? subsystem = null;
+    public string? devtype = null;
+    /* "KEY=VALUE" lines */
+    public string properties;
+
+    /* Device description for creating the device of an "add" event */
+    public string get_description ()
+    {
+        var desc = new StringBuilder ();
+        string? major = null;
+        string? minor = null;
+
+        desc.append_printf ("P: %s\nE: SUBSYSTEM=%s\n", devpath, subsystem);
+        foreach (unowned string prop in properties.split ("\n")) {
+            string[] kv = prop.split ("=", 2);
+            if (kv.length != 2)
+                continue;
+            if (kv[0] == "DEVNAME")
+                desc.append_printf ("N: %s\n", kv[1].has_prefix ("/dev/") ? kv[1].substring (5) : kv[1]);
+            else if (kv[0] == "MAJOR")
+                major = kv[1];
+            else if (kv[0] == "MINOR")
+                minor = kv[1];
+            desc.append_printf ("E: %s\n", prop);
+        }
+        if (major != null && minor != null)
+            desc.append_printf ("A: dev=%s:%s\n", major, minor);
+        return desc.str;
+    }
+}
+
+/* Sends the events of a recording at their due time from the thread-default
+ * main context; the ones which are due together go out as a batch, so that
+ * the sender looks up the listeners only once for them. */
+internal class UeventReplay {
+    private unowned Testbed testbed;
+    private GenericArray<RecordedUevent> events;
+    private MainContext ctx;
+    private Source? timer = null;
+    private int64 start_time;
+    private uint next = 0;
+
+    public UeventReplay (Testbed testbed, GenericArray<RecordedUevent> events)
+    {
+        this.testbed = testbed;
+        this.events = events;
+        this.ctx = MainContext.ref_thread_default ();
+    }
+
+    public void start ()
+    {
+        this.start_time = get_monotonic_time ();
+        this.schedule ();
+    }
+
+    public void stop ()
+    {
+        if (this.timer != null) {
+            this.timer.destroy ();
+            this.timer = null;
+        }
+    }
+
+    private void schedule ()
+    {
+        if (this.next >= this.events.length) {
+            /* the running timer's closure may hold the last reference now */
+            this.timer = null;
+            this.testbed.remove_uevent_replay (this);
+            return;
+        }
+
+        int64 delay = this.start_time + this.events[this.next].due - get_monotonic_time ();
+        this.timer = new TimeoutSource (delay > 0 ? (uint) ((delay + 999) / 1000) : 0);
+        this.timer.set_callback (() => {
+            this.send_due ();
+            return Source.REMOVE;
+        });
+        this.timer.attach (this.ctx);
+    }
+
+    private void send_due ()
+    {
+        unowned UeventSender.sender sender = this.testbed.get_uevent_sender ();
+        int64 now = get_monotonic_time () - this.start_time;
+
+        sender.begin_batch ();
+        while (this.next < this.events.length && this.events[this.next].due <= now + 1000)
+            this.testbed.send_recorded_uevent (this.events[this.next++]);
+        sender.end_batch ();
+
+        this.schedule ();
+    }
+}
+
+
+/* In-memory files for recordings which do not come from a file, for the
+ * readers which need one; name is only used for error messages */
+private int create_memfd (string name) throws FileError
+{
+    int fd = LinuxFixes.memfd_create ("umockdev", LinuxFixes.MFD_CLOEXEC);
+    if (fd < 0)
+        throw new FileError.FAILED ("Cannot create memfd for %s: %s", name, strerror (errno));
+    return fd;
+}
+
+private int memfd_from_bytes (Bytes contents, string name) throws FileError
+{
+    int fd = create_memfd (name);
+    unowned uint8[] data = contents.get_data ();
+    for (size_t done = 0; done < contents.get_size (); ) {
+        ssize_t r = Posix.write (fd, &data[done], contents.get_size () - done);
+        if (r < 0) {
+            int err = errno;
+            Posix.close (fd);
+            throw new FileError.FAILED ("Cannot write memfd for %s: %s", name, strerror (err));
+        }
+        done += r;
+    }
+    Posix.lseek (fd, 0, Posix.SEEK_SET);
+    return fd;
+}
+
+/* Takes over fd */
+private FileStream memfd_stream (int fd, string name) throws FileError
+{
+    FileStream? stream = FileStream.fdopen (fd, "r");
+    if (stream == null) {
+        int err = errno;
+        Posix.close (fd);
+        throw new FileError.FAILED ("Cannot open memfd for %s: %s", name, strerror (err));
+    }
+    return (owned) stream;
+}
+
+private class ScriptRunner {
+
+    /* script_file is only used for messages */
+    public ScriptRunner (string device, owned FileStream script, string script_file, int fd, EvdevState? evdev = null)
+    {
+        this.script = (owned) script;
         this.device = device;
         this.script_file = script_file;
         this.fd = fd;
+        this.evdev = evdev;
         this.running = true;
 
         this.thread = new Thread<void*> (device, this.run);
@@ -1743,6 +2886,9 @@ private class ScriptRunner {
                            this.device, delta);
                     Thread.usleep (delta * 1000);
                     debug ("ScriptRunner[%s]: read op after sleep; writing data '%s'", this.device, encode(data));
+                    // update the device state before the client can see the events
+                    if (this.evdev != null)
+                        this.evdev.feed (data);
                     ssize_t l = Posix.write (this.fd, data, data.length);
                     if (l < 0)
                         error ("ScriptRunner[%s]: write failed: %m", this.device);
@@ -1933,6 +3079,7 @@ private class ScriptRunner {
     private Thread<void*> thread;
     private FileStream script;
     private int fd;
+    private EvdevState? evdev;
     private bool running;
     private uint fuzz = 0;
 }
@@ -1943,7 +3090,7 @@ private class SocketServer {
     public SocketServer ()
     {
         this.running = true;
-        this.socket_scriptfile = new HashTable<string, string> (str_hash, str_equal);
+        this.socket_scripts = new HashTable<string, Bytes> (str_hash, str_equal);
         this.script_runners = new HashTable<string, ScriptRunner> (str_hash, str_equal);
 
         // we use a control pipe which we trigger when adding or stopping, to
@@ -1979,7 +3126,8 @@ private class SocketServer {
         this.thread.join ();
     }
 
-    public void add (string sock_path, int fd, string record_file)
+    /* record_file is only used for messages */
+    public void add (string sock_path, int fd, Bytes script, string record_file)
     {
         try {
             var s = new Socket.from_fd (fd);
@@ -1991,9 +3139,9 @@ private class SocketServer {
             error ("load_socket_script(): cannot create Socket: %s", e.message);
         }
 
-        debug ("SocketServer.add: Created socket path %s, fd %i", sock_path, fd);
+        debug ("SocketServer.add: Created socket path %s, fd %i, script %s", sock_path, fd, record_file);
 
-        this.socket_scriptfile.insert (sock_path, record_file);
+        this.socket_scripts.insert (sock_path, script);
 
         // wake up the select() in our thread
         char b = '1';
@@ -2052,11 +3200,12 @@ private class SocketServer {
                     string sock_path = null;
                     try {
                         sock_path = ((UnixSocketAddress) s.get_local_address()).path;
-                        string script = this.socket_scriptfile.get (sock_path);
-                        debug ("socket server thread: accepted request on server socket fd %i, path %s, script %s",
-                               s.fd, sock_path, script);
+                        Bytes script = this.socket_scripts.get (sock_path);
+                        debug ("socket server thread: accepted request on server socket fd %i, path %s",
+                               s.fd, sock_path);
                         string key = "%s%i".printf (sock_path, fd);
-                        this.script_runners.insert (key, new ScriptRunner (key, script, fd));
+                        this.script_runners.insert (key, new ScriptRunner (
+                            key, memfd_stream (memfd_from_bytes (script, sock_path), sock_path), sock_path, fd));
                     } catch (GLib.Error e) {
                         error ("socket server thread: cannot launch ScriptRunner: %s", e.message);
                     }
@@ -2069,7 +3218,7 @@ private class SocketServer {
     }
 
     private Socket[] listen_sockets = {};
-    private HashTable<string,string> socket_scriptfile;
+    private HashTable<string,Bytes> socket_scripts;
     private HashTable<string,ScriptRunner> script_runners;
     private Thread<void*> thread;
     private bool running;
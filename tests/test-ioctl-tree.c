@@ -338,6 +338,42 @@ t_iteration(void)
     ioctl_tree_free(tree);
 }
 
+static void
+t_payload_interning(void)
+{
+    ioctl_tree *tree1 = get_test_tree();
+    ioctl_tree *tree2 = get_test_tree();
+    ioctl_tree *n_ci, *n_in1a;
+
+    /* equal payloads are shared across trees */
+    g_assert(tree1->data == tree2->data);
+    g_assert(((struct usbdevfs_urb *) tree1->next->data)->buffer ==
+	     ((struct usbdevfs_urb *) tree2->next->data)->buffer);
+    g_assert(ioctl_tree_find_equal(tree1, tree2->next) == tree1->next);
+
+    /* and with recorded ones; the undefined tail of input URBs is ignored */
+    n_ci = ioctl_tree_new_from_bin(USBDEVFS_CONNECTINFO, &ci, 0);
+    g_assert(n_ci->data == tree1->data);
+    ioctl_tree_free(n_ci);
+    n_ci = ioctl_tree_new_from_bin(USBDEVFS_CONNECTINFO, &ci2, 0);
+    g_assert(n_ci->data != tree1->data);
+    ioctl_tree_free(n_ci);
+
+    struct usbdevfs_urb s_in1a_junk = s_in1a;
+    s_in1a_junk.buffer = "this\xFF\xFF\xFF\xFF\xFF\xFF";
+    const struct usbdevfs_urb *in1a_junk = &s_in1a_junk;
+    n_in1a = ioctl_tree_new_from_bin(USBDEVFS_REAPURB, &in1a_junk, 0);
+    g_assert(((struct usbdevfs_urb *) n_in1a->data)->buffer ==
+	     ((struct usbdevfs_urb *) tree1->next->child->data)->buffer);
+    ioctl_tree_free(n_in1a);
+
+    /* payloads stay valid as long as any node uses them */
+    ioctl_tree_free(tree1);
+    assert_ci(tree2, &ci);
+    assert_urb(tree2->next, &s_out1);
+    ioctl_tree_free(tree2);
+}
+
 static void
 init_urb(struct usbdevfs_urb *urb, const struct usbdevfs_urb *orig)
 {
@@ -453,6 +489,93 @@ t_execute(void)
     ioctl_tree_free(tree);
 }
 
+static void
+t_coverage(void)
+{
+    ioctl_tree *tree = get_test_tree();
+    ioctl_tree *last = NULL;
+    ioctl_tree_stats stats;
+    struct usbdevfs_connectinfo ci;
+    char contents[1000];
+    FILE *f;
+    int ret;
+
+    ioctl_tree_get_stats(tree, &stats);
+    g_assert_cmpuint(stats.nodes, ==, 10);
+    g_assert_cmpuint(stats.executed, ==, 0);
+    g_assert_cmpuint(stats.kept, ==, 0);
+    g_assert_cmpuint(stats.duplicates, ==, 0);
+
+    /* CI, then the first input URB, which keeps its parent */
+    last = ioctl_tree_execute(tree, last, USBDEVFS_CONNECTINFO, &ci, &ret);
+    g_assert(last == tree);
+    last = tree->next;
+    t_execute_check_inurb(&s_in1a, tree, &last);
+    g_assert(last == tree->next->child);
+
+    ioctl_tree_get_stats(tree, &stats);
+    g_assert_cmpuint(stats.nodes, ==, 10);
+    g_assert_cmpuint(stats.executed, ==, 2);
+    g_assert_cmpuint(stats.kept, ==, 3);
+
+    f = tmpfile();
+    ioctl_tree_write_executed(f, tree);
+    rewind(f);
+    memset(contents, 0, sizeof(contents));
+    g_assert_cmpint(fread(contents, 1, sizeof(contents), f), >, 10);
+    fclose(f);
+    g_assert_cmpstr(contents, ==,
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	"USBDEVFS_CONNECTINFO 0 0B00000000000000\n"
+#else
+	"USBDEVFS_CONNECTINFO 0 0000000B00000000\n"
+#endif
+	"USBDEVFS_REAPURB 0 1 2 0 0 4 4 0 77686174\n"
+	" USBDEVFS_REAPURB 0 1 129 0 0 10 4 0 74686973\n");
+
+    ioctl_tree_free(tree);
+
+    /* lookups of the emulation itself keep the node, but do not count as
+     * executed */
+    tree = get_test_tree();
+    g_assert(ioctl_tree_lookup(tree, USBDEVFS_CONNECTINFO, &ci, &ret) == tree);
+    g_assert_cmpint(ci.devnum, ==, 11);
+    ioctl_tree_get_stats(tree, &stats);
+    g_assert_cmpuint(stats.executed, ==, 0);
+    g_assert_cmpuint(stats.kept, ==, 1);
+    ioctl_tree_free(tree);
+}
+
+static void
+t_coverage_duplicates(void)
+{
+    ioctl_tree *tree;
+    ioctl_tree_stats stats;
+    FILE *f;
+    static const char dup_tree_str[] =
+	"EVIOCGBIT(0) 8 FF00000000000000\n"
+	"USBDEVFS_REAPURB 0 1 2 0 0 4 4 0 77686174\n"
+	" USBDEVFS_REAPURB 0 1 129 0 0 4 4 0 74686973\n"
+	"USBDEVFS_REAPURB 0 1 2 0 0 4 4 0 77686174\n"
+	" USBDEVFS_REAPURB 0 1 129 0 0 4 4 0 74686973\n"
+	"EVIOCGBIT(0) 8 FF00000000000000\n"
+	"EVIOCGBIT(1) 8 FF00000000000000\n";
+
+    f = tmpfile();
+    g_assert_cmpint(fwrite(dup_tree_str, strlen(dup_tree_str), 1, f), ==, 1);
+    rewind(f);
+    tree = ioctl_tree_read(f);
+    fclose(f);
+    g_assert(tree != NULL);
+
+    /* the second output URB and EVIOCGBIT(0); input URBs are never equal,
+     * and EVIOCGBIT(1) is a different ioctl */
+    ioctl_tree_get_stats(tree, &stats);
+    g_assert_cmpuint(stats.nodes, ==, 7);
+    g_assert_cmpuint(stats.duplicates, ==, 2);
+    ioctl_tree_free(tree);
+}
+
 static void
 t_execute_unknown(void)
 {
@@ -574,8 +697,11 @@ main(int argc, char **argv)
     g_test_add_func("/umockdev-ioctl-tree/write", t_write);
     g_test_add_func("/umockdev-ioctl-tree/read", t_read);
     g_test_add_func("/umockdev-ioctl-tree/iteration", t_iteration);
+    g_test_add_func("/umockdev-ioctl-tree/payload_interning", t_payload_interning);
     g_test_add_func("/umockdev-ioctl-tree/execute", t_execute);
     g_test_add_func("/umockdev-ioctl-tree/execute_unknown", t_execute_unknown);
+    g_test_add_func("/umockdev-ioctl-tree/coverage", t_coverage);
+    g_test_add_func("/umockdev-ioctl-tree/coverage_duplicates", t_coverage_duplicates);
 
     g_test_add_func("/umockdev-ioctl-tree/evdev", t_evdev);
 
@@ -809,6 +809,34 @@ t_system_evemu_log ()
 
     DirUtils.remove (workdir);
 }
+
+// line format of --uevents recordings
+static void
+t_uevents_format ()
+{
+    string line = format_uevent (12, "ACTION=add\nDEVPATH=/devices/my dock\nSUBSYSTEM=pci\nSEQNUM=1234\n" +
+                                     "ID_MODEL=Dock 2000\nID_PATH=a\\b\tc\nbogus\n");
+    assert_cmpstr (line, CompareOperator.EQ,
+                   "12 add /devices/my\\040dock SUBSYSTEM=pci ID_MODEL=Dock\\0402000 ID_PATH=a\\\\b\\tc\n");
+
+    // no properties besides the mandatory ones
+    assert_cmpstr (format_uevent (0, "SEQNUM=1\nACTION=remove\nDEVPATH=/devices/dock"), CompareOperator.EQ,
+                   "0 remove /devices/dock\n");
+
+    // umockdev can read it back
+    string path;
+    int fd = checked_open_tmp ("uevents.XXXXXX", out path);
+    Posix.close (fd);
+    var tb = new UMockdev.Testbed ();
+    try {
+        FileUtils.set_contents (path, line);
+        assert (tb.load_uevents (path, 0));
+    } catch (Error e) {
+        error ("Cannot load uevent recording: %s", e.message);
+    }
+    checked_remove (path);
+}
+
 static void
 t_run_invalid_args ()
 {
@@ -917,6 +945,7 @@ main (string[] args)
     Test.add_func ("/umockdev-record/script-log-chatter", t_system_script_log_chatter);
     Test.add_func ("/umockdev-record/script-log-socket", t_system_script_log_chatter_socket_stream);
     Test.add_func ("/umockdev-record/evemu-log", t_system_evemu_log);
+    Test.add_func ("/umockdev-record/uevents-format", t_uevents_format);
 
     // error conditions
     Test.add_func ("/umockdev-record/invalid-args", t_run_invalid_args);
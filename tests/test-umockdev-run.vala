@@ -366,6 +366,131 @@ t_run_record_null ()
     checked_remove (umockdev_file);
 }
 
+static void
+t_run_bundle ()
+{
+    string bundle_file;
+    string sout;
+    string serr;
+    int exit;
+
+    if (!FileUtils.test("/sys/dev/char/1:3", FileTest.EXISTS)) {
+        stdout.printf ("[SKIP: no real /sys on this system] ");
+        stdout.flush ();
+        return;
+    }
+
+    // stat or other programs segfault under Gentoo's sandbox in umockdev
+    if (Environ.get_variable(Environ.get(), "SANDBOX_ON") == "1") {
+        stdout.printf ("[SKIP: crashes in Gentoo's sandbox] ");
+        stdout.flush ();
+        return;
+    }
+
+    // umockdev-record creates the bundle, so start without one
+    Posix.close (checked_open_tmp ("null.XXXXXX.bundle", out bundle_file));
+    checked_remove (bundle_file);
+
+    assert (get_program_out ("true", umockdev_record_command + "--bundle " + bundle_file + " /dev/null",
+                             out sout, out serr, out exit));
+    assert_cmpstr (serr, CompareOperator.EQ, "");
+    assert_cmpstr (sout, CompareOperator.EQ, "");
+    assert_cmpint (exit, CompareOperator.EQ, 0);
+
+    // recording the same device again replaces it, another one gets added
+    assert (get_program_out ("true", umockdev_record_command + "-b " + bundle_file + " /dev/null",
+                             out sout, out serr, out exit));
+    assert_cmpint (exit, CompareOperator.EQ, 0);
+    assert (get_program_out ("true", umockdev_record_command + "-b " + bundle_file + " /dev/zero",
+                             out sout, out serr, out exit));
+    assert_cmpint (exit, CompareOperator.EQ, 0);
+
+    check_program_out ("true", "--bundle " + bundle_file + " -- stat -c '%n %F %t %T' /dev/null /dev/zero",
+                       "/dev/null character special file 1 3\n/dev/zero character special file 1 5\n");
+
+    // not a bundle
+    check_program_error ("true", "--bundle /etc/passwd -- true", "Cannot load bundle /etc/passwd");
+
+    // a compressed member without data cannot have 2^56 bytes
+    var data = new ByteArray ();
+    data.append ("UMDBNDL".data);
+    data.append ({0, 1, 0, 0, 0, 1, 0, 0, 0,
+                  1, 1, 0, 0, 44, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1});
+    try {
+        FileUtils.set_data (bundle_file, data.data);
+    } catch (FileError e) {
+        error ("Failed to write %s: %s", bundle_file, e.message);
+    }
+    check_program_error ("true", "--bundle " + bundle_file + " -- true", "invalid size or compression");
+
+    // unknown member kind
+    data.data[16] = 42;
+    try {
+        FileUtils.set_data (bundle_file, data.data);
+    } catch (FileError e) {
+        error ("Failed to write %s: %s", bundle_file, e.message);
+    }
+    check_program_error ("true", "--bundle " + bundle_file + " -- true", "unknown kind of bundle member 42");
+
+    checked_remove (bundle_file);
+}
+
+static void
+t_run_minimize ()
+{
+    string umockdev_file, min_file, trace_file, contents;
+
+    Posix.close (checked_open_tmp ("ttyS.XXXXXX.umockdev", out umockdev_file));
+    Posix.close (checked_open_tmp ("ttyS.XXXXXX.min.umockdev", out min_file));
+    Posix.close (checked_open_tmp ("ttyS.XXXXXX.trace", out trace_file));
+
+    checked_file_set_contents (umockdev_file, """P: /devices/platform/serial8250/tty/ttyS0
+N: ttyS0
+E: DEVNAME=/dev/ttyS0
+E: SUBSYSTEM=tty
+A: dev=4:64
+A: foo=bar
+A: unused=1
+
+P: /devices/platform/serial8250/tty/ttyS1
+N: ttyS1
+E: DEVNAME=/dev/ttyS1
+E: SUBSYSTEM=tty
+A: dev=4:65
+""");
+
+    // only ttyS0 and its accessed attribute remain
+    check_program_out ("true", "-d " + umockdev_file + " --trace " + trace_file + " --minimize " + min_file +
+                       " -- cat /sys/class/tty/ttyS0/foo", "bar");
+    try {
+        FileUtils.get_contents (min_file, out contents);
+    } catch (FileError e) {
+        error ("Cannot read %s: %s", min_file, e.message);
+    }
+    assert_cmpstr (contents, CompareOperator.EQ, """P: /devices/platform/serial8250/tty/ttyS0
+N: ttyS0
+E: DEVNAME=/dev/ttyS0
+E: SUBSYSTEM=tty
+A: dev=4:64
+A: foo=bar
+
+""");
+
+    try {
+        FileUtils.get_contents (trace_file, out contents);
+    } catch (FileError e) {
+        error ("Cannot read %s: %s", trace_file, e.message);
+    }
+    assert_in ("/sys/class/tty/ttyS0/foo\n", contents);
+
+    // the minimized fixture works for the same program
+    check_program_out ("true", "-d " + min_file + " -- cat /sys/class/tty/ttyS0/foo", "bar");
+
+    checked_remove (umockdev_file);
+    checked_remove (min_file);
+    checked_remove (trace_file);
+}
+
 static void
 t_run_script_chatter ()
 {
@@ -834,6 +959,8 @@ main (string[] args)
 
   // udevadm-record interaction
   Test.add_func ("/umockdev-run/umockdev-record-null-roundtrip", t_run_record_null);
+  Test.add_func ("/umockdev-run/bundle", t_run_bundle);
+  Test.add_func ("/umockdev-run/minimize", t_run_minimize);
 
   // script replay
   Test.add_func ("/umockdev-run/script-chatter", t_run_script_chatter);
@@ -391,6 +391,67 @@ USBDEVFS_CONNECTINFO 42 0000000C01000000
   Posix.close (fd2);
 }
 
+void
+t_usbfs_ioctl_tree_prune ()
+{
+  var tb = new UMockdev.Testbed ();
+  tb_add_from_string (tb, """P: /devices/mycam
+N: 001
+E: SUBSYSTEM=usb
+""");
+
+  string ci1, ci2;
+  if (BYTE_ORDER == ByteOrder.LITTLE_ENDIAN) {
+      ci1 = "USBDEVFS_CONNECTINFO 0 0B00000000000000\n";
+      ci2 = "USBDEVFS_CONNECTINFO 42 0C00000001000000\n";
+  } else {
+      ci1 = "USBDEVFS_CONNECTINFO 0 0000000B00000000\n";
+      ci2 = "USBDEVFS_CONNECTINFO 42 0000000C01000000\n";
+  }
+  string test_tree = ci1 + "USBDEVFS_REAPURB 0 1 129 -1 0 4 4 0 9902AAFF\n" + ci2;
+
+  string tmppath;
+  int fd = checked_open_tmp ("test_ioctl_tree.XXXXXX", out tmppath);
+  assert_cmpint ((int) Posix.write (fd, test_tree, test_tree.length), CompareOperator.GT, 20);
+  Posix.close (fd);
+  try {
+      tb.load_ioctl ("/dev/001", tmppath);
+  } catch (Error e) {
+      error ("Cannot load ioctls: %s", e.message);
+  }
+
+  // use both CONNECTINFOs, but not the URB
+  fd = Posix.open ("/dev/001", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+  var ci = Ioctl.usbdevfs_connectinfo();
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_CONNECTINFO, ref ci), CompareOperator.EQ, 0);
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_CONNECTINFO, ref ci), CompareOperator.EQ, 42);
+  assert_cmpuint (ci.devnum, CompareOperator.EQ, 12);
+  Posix.close (fd);
+
+  uint nodes, kept, duplicates;
+  try {
+      assert (tb.prune_ioctl ("/dev/001", tmppath, out nodes, out kept, out duplicates));
+  } catch (Error e) {
+      error ("Cannot prune ioctls: %s", e.message);
+  }
+  assert_cmpuint (nodes, CompareOperator.EQ, 3);
+  assert_cmpuint (kept, CompareOperator.EQ, 2);
+  assert_cmpuint (duplicates, CompareOperator.EQ, 0);
+
+  string contents;
+  checked_file_get_contents (tmppath, out contents);
+  assert_cmpstr (contents, CompareOperator.EQ, "@DEV /dev/001\n" + ci1 + ci2);
+  checked_remove (tmppath);
+
+  // no ioctl tree for this device
+  try {
+      assert (!tb.prune_ioctl ("/dev/nonexisting", tmppath, out nodes, out kept, out duplicates));
+  } catch (Error e) {
+      error ("Unexpected error: %s", e.message);
+  }
+}
+
 void
 t_usbfs_ioctl_tree_with_default_device ()
 {
@@ -665,6 +726,183 @@ t_usbfs_ioctl_pcap ()
   Posix.close (fd);
 }
 
+static uint64
+get_uint (uint8[] data, size_t offset, int size, bool big_endian)
+{
+  uint64 v = 0;
+  for (int i = 0; i < size; i++)
+      v |= (uint64) data[offset + i] << (big_endian ? (size - 1 - i) * 8 : i * 8);
+  return v;
+}
+
+static void
+append_uint (ByteArray array, uint64 v, int size, bool big_endian)
+{
+  for (int i = 0; i < size; i++)
+      array.append (new uint8[] { (uint8) (v >> (big_endian ? (size - 1 - i) * 8 : i * 8)) });
+}
+
+/* Convert a pcapng recording into a classic pcap file in the given byte order,
+ * including the usbmon headers, as if it had been captured on such a host */
+static uint8[]
+pcapng_to_pcap (uint8[] ng, bool big_endian, bool nsec)
+{
+  // usb_header_mmapped field sizes; the setup packet is raw bytes
+  int[] hdr_fields = { 8, 1, 1, 1, 1, 2, 1, 1, 8, 4, 4, 4, 4, 1, 1, 1, 1, 1, 1, 1, 1, 4, 4, 4, 4 };
+  bool src_be = ng[8] == 0x1a;
+  var pcap = new ByteArray ();
+
+  append_uint (pcap, nsec ? 0xa1b23c4d : 0xa1b2c3d4, 4, big_endian);
+  append_uint (pcap, 2, 2, big_endian);
+  append_uint (pcap, 4, 2, big_endian);
+  append_uint (pcap, 0, 4, big_endian);
+  append_uint (pcap, 0, 4, big_endian);
+  append_uint (pcap, 65535, 4, big_endian);
+  append_uint (pcap, 220, 4, big_endian); // DLT_USB_LINUX_MMAPPED
+
+  for (size_t pos = 0; pos + 12 <= ng.length; pos += (size_t) get_uint (ng, pos + 4, 4, src_be)) {
+      // only enhanced packet blocks
+      if (get_uint (ng, pos, 4, src_be) != 6)
+          continue;
+
+      uint64 ts = get_uint (ng, pos + 12, 4, src_be) << 32 | get_uint (ng, pos + 16, 4, src_be);
+      size_t caplen = (size_t) get_uint (ng, pos + 20, 4, src_be);
+      assert_cmpuint ((uint) caplen, CompareOperator.GE, 64);
+
+      append_uint (pcap, ts / 1000000, 4, big_endian);
+      append_uint (pcap, (ts % 1000000) * (nsec ? 1000 : 1), 4, big_endian);
+      append_uint (pcap, caplen, 4, big_endian);
+      append_uint (pcap, get_uint (ng, pos + 24, 4, src_be), 4, big_endian);
+
+      size_t offset = pos + 28;
+      foreach (int size in hdr_fields) {
+          append_uint (pcap, get_uint (ng, offset, size, src_be), size, big_endian);
+          offset += size;
+      }
+      pcap.append (ng[(int) offset : (int) (pos + 28 + caplen)]);
+  }
+
+  return pcap.data;
+}
+
+/* Replay the beginning of the recording used in t_usbfs_ioctl_pcap() */
+static void
+check_usbkbd_pcap_start (string recording)
+{
+  var tb = new UMockdev.Testbed ();
+  string device;
+  Ioctl.usbdevfs_urb* urb_reap = null;
+
+  checked_file_get_contents (Path.build_filename(rootdir + "/devices/input/usbkbd.pcap.umockdev"), out device);
+  tb_add_from_string (tb, device);
+
+  try {
+      tb.load_pcap ("/sys/devices/pci0000:00/0000:00:14.0/usb1/1-3", recording);
+  } catch (Error e) {
+      error ("Cannot load pcap file: %s", e.message);
+  }
+
+  int fd = Posix.open ("/dev/bus/usb/001/011", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+
+  var urb_buffer_ep1 = new uint8[8];
+  Ioctl.usbdevfs_urb urb_ep1 = {1, 0x81, 0, 0, urb_buffer_ep1, 8, 0};
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_SUBMITURB, ref urb_ep1), CompareOperator.EQ, 0);
+
+  uint8 urb_buffer_setup_set_idle[8] = { 0x21, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+  Ioctl.usbdevfs_urb urb_set_idle = {2, 0x00, 0, 0, urb_buffer_setup_set_idle, 8, 0};
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_SUBMITURB, ref urb_set_idle), CompareOperator.EQ, 0);
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_REAPURB, ref urb_reap), CompareOperator.EQ, 0);
+  assert (urb_reap == &urb_set_idle);
+
+  uint8 urb_buffer_setup_set_report[9] = { 0x21, 0x09, 0x00, 0x02, 0x00, 0x00, 0x01, 0x00, 0x00};
+  Ioctl.usbdevfs_urb urb_set_report = {2, 0x00, 0, 0, urb_buffer_setup_set_report, 9, 0};
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_SUBMITURB, ref urb_set_report), CompareOperator.EQ, 0);
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_REAPURB, ref urb_reap), CompareOperator.EQ, 0);
+  assert (urb_reap == &urb_set_report);
+
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_REAPURB, ref urb_reap), CompareOperator.EQ, -1);
+  assert_cmpint (Posix.errno, CompareOperator.EQ, Posix.EAGAIN);
+
+  Posix.close (fd);
+}
+
+static void
+check_pcap_load_fails (string path, uint8[] contents, string message)
+{
+  var tb = new UMockdev.Testbed ();
+  string device;
+
+  checked_file_get_contents (Path.build_filename(rootdir + "/devices/input/usbkbd.pcap.umockdev"), out device);
+  tb_add_from_string (tb, device);
+
+  try {
+      FileUtils.set_data (path, contents);
+      tb.load_pcap ("/sys/devices/pci0000:00/0000:00:14.0/usb1/1-3", path);
+      assert_not_reached ();
+  } catch (FileError e) {
+      assert (e is FileError.INVAL);
+      assert (e.message.contains (message));
+  } catch (Error e) {
+      error ("Unexpected error: %s", e.message);
+  }
+}
+
+void
+t_usbfs_ioctl_pcap_formats ()
+{
+  uint8[] ng;
+  string tmppath;
+
+  try {
+      FileUtils.get_data (Path.build_filename(rootdir + "/devices/input/usbkbd.pcap.pcapng"), out ng);
+  } catch (FileError e) {
+      error ("Cannot read pcapng file: %s", e.message);
+  }
+  Posix.close (checked_open_tmp ("test_pcap.XXXXXX", out tmppath));
+
+  // classic pcap in both byte orders, so that one of them is always swapped
+  foreach (bool big_endian in new bool[] { false, true }) {
+      foreach (bool nsec in new bool[] { false, true }) {
+          try {
+              FileUtils.set_data (tmppath, pcapng_to_pcap (ng, big_endian, nsec));
+          } catch (FileError e) {
+              error ("Cannot write pcap file: %s", e.message);
+          }
+          check_usbkbd_pcap_start (tmppath);
+      }
+  }
+
+  var pcap = pcapng_to_pcap (ng, false, false);
+
+  check_pcap_load_fails (tmppath, pcap[0:20], "truncated pcap header");
+  check_pcap_load_fails (tmppath, pcap[0:pcap.length - 1], "truncated packet");
+
+  var garbage = pcap[0:pcap.length];
+  garbage[0] = 0x42;
+  check_pcap_load_fails (tmppath, garbage, "not a pcap or pcapng file");
+
+  var linktype = pcap[0:pcap.length];
+  linktype[20] = 1; // DLT_EN10MB
+  check_pcap_load_fails (tmppath, linktype, "unsupported link type");
+
+  // pcapng packet block referring to an interface which was never declared
+  var iface = ng[0:ng.length];
+  bool ng_be = ng[8] == 0x1a;
+  for (size_t pos = 0; pos + 12 <= iface.length; pos += (size_t) get_uint (iface, pos + 4, 4, ng_be)) {
+      if (get_uint (iface, pos, 4, ng_be) == 6) {
+          iface[pos + (ng_be ? 11 : 8)] = 1;
+          break;
+      }
+  }
+  check_pcap_load_fails (tmppath, iface, "unknown or unsupported interface 1");
+
+  // pcapng block length running past the end of the file
+  check_pcap_load_fails (tmppath, ng[0:ng.length - 4], "invalid pcapng block");
+
+  checked_remove (tmppath);
+}
+
 void
 t_spidev_ioctl ()
 {
@@ -730,6 +968,59 @@ t_spidev_ioctl ()
   Posix.close (fd);
 }
 
+void
+t_spidev_binary ()
+{
+  var tb = new UMockdev.Testbed ();
+
+  string device;
+  checked_file_get_contents (Path.build_filename(rootdir + "/devices/spi/elanfingerprint.umockdev"), out device);
+  tb_add_from_string (tb, device);
+
+  /* write 03 ff and read 81 in one transfer, then read 00 5f */
+  string header = "@DEV /dev/spidev0.0 (SPI-BIN)\n";
+  uint8[] records = {
+      3, 2, 0, 0, 0, 0x03, 0xff, 0x81, 0x00,
+      2, 2, 0, 0, 0, 0x00, 0x5f
+  };
+  string recpath;
+  int fd = checked_open_tmp ("test_spi.XXXXXX.bin", out recpath);
+  assert_cmpint ((int) Posix.write (fd, header, header.length), CompareOperator.EQ, header.length);
+  assert_cmpint ((int) Posix.write (fd, records, records.length), CompareOperator.EQ, records.length);
+  Posix.close (fd);
+
+  try {
+      tb.load_ioctl (null, recpath);
+  } catch (Error e) {
+      error ("Cannot load ioctl file: %s", e.message);
+  }
+  FileUtils.unlink (recpath);
+
+  fd = Posix.open ("/dev/spidev0.0", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+
+  var xfer_buf = new uint8[sizeof(Ioctl.spi_ioc_transfer)];
+  uint8[] tx_buf = { 0x03, 0xff };
+  var rx_buf = new uint8[2];
+  Ioctl.spi_ioc_transfer *xfer = xfer_buf;
+
+  Posix.memset (xfer, 0, sizeof (Ioctl.spi_ioc_transfer));
+  xfer[0].tx_buf = (uint64) tx_buf;
+  xfer[0].rx_buf = (uint64) rx_buf;
+  xfer[0].len = 2;
+  assert_cmpint (Posix.ioctl (fd, Ioctl.SPI_IOC_MESSAGE (1), xfer), CompareOperator.GE, 0);
+  assert_cmpuint (rx_buf[0], CompareOperator.EQ, 0x81);
+  assert_cmpuint (rx_buf[1], CompareOperator.EQ, 0x00);
+
+  assert_cmpint ((int) Posix.read (fd, rx_buf, 2), CompareOperator.EQ, 2);
+  assert_cmpuint (rx_buf[1], CompareOperator.EQ, 0x5f);
+
+  /* recording is exhausted */
+  assert_cmpint ((int) Posix.read (fd, rx_buf, 1), CompareOperator.EQ, -1);
+
+  Posix.close (fd);
+}
+
 void
 t_hidraw_ioctl ()
 {
@@ -766,6 +1057,75 @@ t_hidraw_ioctl ()
   Posix.close (fd);
 }
 
+void
+t_hidraw_rules ()
+{
+  var tb = new UMockdev.Testbed ();
+
+  string device;
+  checked_file_get_contents (Path.build_filename(rootdir + "/devices/hidraw/fido2.umockdev"), out device);
+  tb_add_from_string (tb, device);
+
+  // CTAPHID_INIT on the broadcast channel; the answer is padded to the 64
+  // byte input report from the descriptor
+  string rules = """# FIDO
+w 00FFFFFFFF86 FFFFFFFF86001101020304050607080000AA000205010200
+w 000000AA0081 0000AA0081000142
+""";
+  string rulespath;
+  int fd = checked_open_tmp ("test_hidraw.XXXXXX.rules", out rulespath);
+  assert_cmpint ((int) Posix.write (fd, rules, rules.length), CompareOperator.EQ, rules.length);
+  Posix.close (fd);
+
+  try {
+      tb.load_hidraw ("/dev/hidraw5", Path.build_filename(rootdir + "/devices/hidraw/fido2.ioctl"), rulespath);
+  } catch (Error e) {
+      error ("Cannot load hidraw emulation: %s", e.message);
+  }
+  FileUtils.unlink (rulespath);
+
+  fd = Posix.open ("/dev/hidraw5", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+
+  Posix.pollfd[] pfd = { Posix.pollfd () { fd = fd, events = Posix.POLLIN } };
+  assert_cmpint (Posix.poll (pfd, 0), CompareOperator.EQ, 0);
+
+  uint8[] init = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0x86, 0x00, 0x08, 1, 2, 3, 4, 5, 6, 7, 8 };
+  uint8[] report = new uint8[65];
+  Posix.memcpy (report, init, init.length);
+  assert_cmpint ((int) Posix.write (fd, report, 65), CompareOperator.EQ, 65);
+  assert_cmpint (Posix.poll (pfd, 5000), CompareOperator.EQ, 1);
+
+  uint8 buf[100];
+  assert_cmpint ((int) Posix.read (fd, buf, 100), CompareOperator.EQ, 64);
+  assert_cmpuint (buf[4], CompareOperator.EQ, 0x86);
+  assert_cmpuint (buf[14], CompareOperator.EQ, 0x08);
+  assert_cmpuint (buf[17], CompareOperator.EQ, 0xAA);
+  assert_cmpuint (buf[63], CompareOperator.EQ, 0);
+  assert_cmpint (Posix.poll (pfd, 0), CompareOperator.EQ, 0);
+
+  // many transactions on the allocated channel
+  uint8[] ping_init = { 0x00, 0x00, 0x00, 0xAA, 0x00, 0x81, 0x00, 0x01, 0x42 };
+  uint8[] ping = new uint8[65];
+  Posix.memcpy (ping, ping_init, ping_init.length);
+  for (int i = 0; i < 1000; i++) {
+      assert_cmpint ((int) Posix.write (fd, ping, 65), CompareOperator.EQ, 65);
+      assert_cmpint ((int) Posix.read (fd, buf, 64), CompareOperator.EQ, 64);
+      assert_cmpuint (buf[4], CompareOperator.EQ, 0x81);
+      assert_cmpuint (buf[7], CompareOperator.EQ, 0x42);
+  }
+
+  // without a report, non-blocking reads fail like the kernel's
+  Posix.fcntl (fd, Posix.F_SETFL, Posix.O_NONBLOCK);
+  assert_cmpint ((int) Posix.read (fd, buf, 64), CompareOperator.EQ, -1);
+  assert_cmpint (Posix.errno, CompareOperator.EQ, Posix.EAGAIN);
+  assert_cmpint ((int) Posix.write (fd, ping, 65), CompareOperator.EQ, 65);
+  assert_cmpint ((int) Posix.read (fd, buf, 64), CompareOperator.EQ, 64);
+  assert_cmpuint (buf[7], CompareOperator.EQ, 0x42);
+
+  Posix.close (fd);
+}
+
 void
 t_tty_stty ()
 {
@@ -981,6 +1341,67 @@ t_mt_uevent ()
   assert_cmpuint (change_count, CompareOperator.EQ, num_changes);
 }
 
+void
+t_load_uevents ()
+{
+  var tb = new UMockdev.Testbed ();
+  var gudev = new GUdev.Client ({"pci"});
+  var ml = new MainLoop ();
+  string[] actions = {};
+  string[] foo_values = {};
+  bool added = false;
+
+  gudev.uevent.connect((client, action, device) => {
+      actions += action;
+      foo_values += device.get_property ("ID_FOO") ?? "";
+      if (action == "add")
+          added = FileUtils.test ("/sys/devices/dock/uevent", FileTest.EXISTS);
+      if (action == "remove")
+          ml.quit ();
+    });
+
+  string tmppath;
+  int fd = checked_open_tmp ("test_uevents.XXXXXX", out tmppath);
+  string recording = """# docked
+0 add /devices/dock SUBSYSTEM=pci DEVTYPE=dock ID_FOO=a\040b
+20 change /devices/dock SUBSYSTEM=pci DEVTYPE=dock ID_FOO=c
+0 remove /devices/dock SUBSYSTEM=pci DEVTYPE=dock
+""";
+  assert_cmpint ((int) Posix.write (fd, recording, recording.length), CompareOperator.EQ, recording.length);
+  Posix.close (fd);
+
+  int64 start = get_monotonic_time ();
+  try {
+      assert (tb.load_uevents (tmppath, 2.5));
+  } catch (Error e) {
+      error ("Cannot load uevents: %s", e.message);
+  }
+
+  // fallback timeout
+  Timeout.add(3000, () => { ml.quit(); return false; });
+  ml.run ();
+
+  assert_cmpint ((int) (get_monotonic_time () - start), CompareOperator.GE, 49000);
+  assert_cmpstr (string.joinv (" ", actions), CompareOperator.EQ, "add change remove");
+  assert_cmpstr (foo_values[0], CompareOperator.EQ, "a b");
+  assert_cmpstr (foo_values[1], CompareOperator.EQ, "c");
+  // device exists during the replay, but goes away with "remove"
+  assert (added);
+  assert (!FileUtils.test ("/sys/devices/dock", FileTest.EXISTS));
+
+  // malformed recording
+  try {
+      FileUtils.set_contents (tmppath, "0 add dock SUBSYSTEM=pci\n");
+      tb.load_uevents (tmppath);
+      assert_not_reached ();
+  } catch (UMockdev.Error e) {
+      assert (e is UMockdev.Error.PARSE);
+  } catch (Error e) {
+      error ("Unexpected error: %s", e.message);
+  }
+  checked_remove (tmppath);
+}
+
 static bool
 ioctl_custom_handle_ioctl_cb(UMockdev.IoctlBase handler, UMockdev.IoctlClient client)
 {
@@ -1102,6 +1523,473 @@ E: SUBSYSTEM=test
   }
 }
 
+void
+t_ioctl_large_buffer ()
+{
+  var tb = new UMockdev.Testbed ();
+
+  tb_add_from_string (tb, """P: /devices/test
+N: test
+E: SUBSYSTEM=test
+""");
+
+  var handler = new UMockdev.IoctlBase();
+  handler.connect("signal::handle-read", ioctl_custom_handle_read_cb, null);
+  handler.connect("signal::handle-write", ioctl_custom_handle_write_cb, null);
+
+  try {
+      tb.attach_ioctl("/dev/test", handler);
+  } catch (Error e) {
+      error ("Failed to attach ioctl: %s", e.message);
+  }
+
+  int fd = Posix.open ("/dev/test", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+
+  /* large buffers go through shared memory, and it has to grow on the way */
+  foreach (int len in new int[] { 100, 256 * 1024, 3 * 1024 * 1024 + 7, 70 * 1024 }) {
+      var write_buf = new uint8[len];
+      var read_buf = new uint8[len];
+      for (int i = 0; i < len; i++)
+          write_buf[i] = (uint8) (i * 7 + len);
+
+      assert_cmpint ((int) Posix.write (fd, write_buf, len), CompareOperator.EQ, len);
+      assert_cmpint ((int) Posix.read (fd, read_buf, len), CompareOperator.EQ, len);
+      assert_cmpint (Posix.memcmp (read_buf, write_buf, len), CompareOperator.EQ, 0);
+  }
+
+  Posix.close(fd);
+
+  try {
+      tb.detach_ioctl("/dev/test");
+  } catch (Error e) {
+      error ("Failed to detach ioctl: %s", e.message);
+  }
+}
+
+void
+t_ioctl_mmap ()
+{
+  var tb = new UMockdev.Testbed ();
+
+  tb_add_from_string (tb, """P: /devices/test
+N: test
+E: SUBSYSTEM=test
+""");
+
+  var handler = new UMockdev.IoctlBase();
+
+  /* back the region by a plain file; it is normally a memfd */
+  string region_path;
+  int region_fd = checked_open_tmp ("mmap_region.XXXXXX", out region_path);
+  FileUtils.unlink (region_path);
+  assert_cmpint (Posix.ftruncate (region_fd, 8192), CompareOperator.EQ, 0);
+  assert_cmpint ((int) Posix.pwrite (region_fd, "hello".data, 5, 4096), CompareOperator.EQ, 5);
+  handler.add_mmap_region (0x10000, region_fd, 8192);
+
+  try {
+      tb.attach_ioctl("/dev/test", handler);
+  } catch (Error e) {
+      error ("Failed to attach ioctl: %s", e.message);
+  }
+
+  int fd = Posix.open ("/dev/test", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+
+  /* second page of the region, shared with the handler */
+  uint8* map = Posix.mmap (null, 4096, Posix.PROT_READ | Posix.PROT_WRITE, Posix.MAP_SHARED, fd, 0x10000 + 4096);
+  assert ((void*) map != Posix.MAP_FAILED);
+  assert_cmpint (Posix.memcmp (map, "hello", 5), CompareOperator.EQ, 0);
+
+  map[0] = (uint8) 'j';
+  var buf = new uint8[5];
+  assert_cmpint ((int) Posix.pread (region_fd, buf, 5, 4096), CompareOperator.EQ, 5);
+  assert_cmpint (Posix.memcmp (buf, "jello", 5), CompareOperator.EQ, 0);
+  Posix.munmap (map, 4096);
+
+  /* outside of any region */
+  assert (Posix.mmap (null, 4096, Posix.PROT_READ, Posix.MAP_SHARED, fd, 0) == Posix.MAP_FAILED);
+  assert_cmpint (Posix.errno, CompareOperator.EQ, Posix.EINVAL);
+
+  Posix.close (fd);
+  Posix.close (region_fd);
+
+  try {
+      tb.detach_ioctl("/dev/test");
+  } catch (Error e) {
+      error ("Failed to detach ioctl: %s", e.message);
+  }
+  assert (handler.emulate_mmap);
+
+  /* without regions, mmap() goes to the device node without asking */
+  var plain = new UMockdev.IoctlBase();
+  assert (!plain.emulate_mmap);
+  try {
+      tb.attach_ioctl("/dev/test", plain);
+  } catch (Error e) {
+      error ("Failed to attach ioctl: %s", e.message);
+  }
+  fd = Posix.open ("/dev/test", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+  map = Posix.mmap (null, 4096, Posix.PROT_READ, Posix.MAP_SHARED, fd, 0x10000);
+  if ((void*) map == Posix.MAP_FAILED)
+      assert_cmpint (Posix.errno, CompareOperator.NE, Posix.EINVAL);
+  else
+      Posix.munmap (map, 4096);
+  Posix.close (fd);
+
+  try {
+      tb.detach_ioctl("/dev/test");
+  } catch (Error e) {
+      error ("Failed to detach ioctl: %s", e.message);
+  }
+}
+
+void
+t_ioctl_fork_exec ()
+{
+  var tb = new UMockdev.Testbed ();
+
+  tb_add_from_string (tb, """P: /devices/test
+N: test
+E: SUBSYSTEM=test
+""");
+
+  var handler = new UMockdev.IoctlBase();
+  handler.connect("signal::handle-ioctl", ioctl_custom_handle_ioctl_cb, null);
+
+  try {
+      tb.attach_ioctl("/dev/test", handler);
+  } catch (Error e) {
+      error ("Failed to attach ioctl: %s", e.message);
+  }
+
+  int fd = Posix.open ("/dev/test", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+  int status;
+
+  /* parent and forked child use the fd at the same time */
+  Posix.pid_t pid = Posix.fork ();
+  assert_cmpint (pid, CompareOperator.NE, -1);
+  if (pid == 0) {
+      for (int i = 0; i < 200; i++)
+          if (Posix.ioctl (fd, 1, 0x10000 + i) != 0x10000 + i)
+              Posix._exit (1);
+      Posix._exit (0);
+  }
+  for (int i = 0; i < 200; i++)
+      assert_cmpint (Posix.ioctl (fd, 1, 0x20000 + i), CompareOperator.EQ, 0x20000 + i);
+  assert_cmpint (Posix.waitpid (pid, out status, 0), CompareOperator.EQ, pid);
+  assert (Process.if_exited (status));
+  assert_cmpint (Process.exit_status (status), CompareOperator.EQ, 0);
+
+  /* the emulation survives exec() */
+  pid = Posix.fork ();
+  assert_cmpint (pid, CompareOperator.NE, -1);
+  if (pid == 0) {
+      string myexe = Posix.realpath("/proc/self/exe");
+      string[] argv = { myexe, "--test-inherited-fd", fd.to_string() };
+      Posix.execv(myexe, argv);
+      error ("execv /proc/self/exe = %s failed: %m", myexe);
+  }
+  assert_cmpint (Posix.waitpid (pid, out status, 0), CompareOperator.EQ, pid);
+  assert (Process.if_exited (status));
+  assert_cmpint (Process.exit_status (status), CompareOperator.EQ, 0);
+
+  assert_cmpint (Posix.ioctl (fd, 1, 42), CompareOperator.EQ, 42);
+  Posix.close (fd);
+
+  try {
+      tb.detach_ioctl("/dev/test");
+  } catch (Error e) {
+      error ("Failed to detach ioctl: %s", e.message);
+  }
+}
+
+static bool
+ioctl_cache_handle_ioctl_cb(UMockdev.IoctlBase handler, UMockdev.IoctlClient client)
+{
+    int *calls = handler.get_data<int*>("calls");
+
+    try {
+        if (client.request == Ioctl.EVIOCGKEYCODE) {
+            var data = client.arg.resolve(0, 2 * sizeof(uint32));
+            ((uint32*) data.data)[1] = ((uint32*) data.data)[0] + 0x200;
+            (*calls)++;
+            client.complete(0, 0);
+            return true;
+        }
+
+        var data = client.arg.resolve(0, sizeof(uint32));
+        *(uint32*) data.data = 0x100 + (*calls)++;
+        client.complete(0, 0);
+    } catch (Error e) {
+        error ("cannot resolve client arg: %s", e.message);
+    }
+    return true;
+}
+
+void
+t_ioctl_cache ()
+{
+  var tb = new UMockdev.Testbed ();
+
+  tb_add_from_string (tb, """P: /devices/test
+N: test
+E: SUBSYSTEM=test
+""");
+
+  int calls = 0;
+  var handler = new UMockdev.IoctlBase();
+  handler.set_data<int*>("calls", &calls);
+  handler.connect("signal::handle-ioctl", ioctl_cache_handle_ioctl_cb, null);
+  handler.cache_stateless = true;
+
+  try {
+      tb.attach_ioctl("/dev/test", handler);
+  } catch (Error e) {
+      error ("Failed to attach ioctl: %s", e.message);
+  }
+
+  int fd = Posix.open ("/dev/test", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+  uint32 caps = 0;
+
+  /* stateless ioctls get answered by the handler only once */
+  for (int i = 0; i < 3; i++) {
+      assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_GET_CAPABILITIES, ref caps), CompareOperator.EQ, 0);
+      assert_cmpuint (caps, CompareOperator.EQ, 0x100);
+  }
+  assert_cmpint (calls, CompareOperator.EQ, 1);
+
+  /* other fds on the same device share the cache */
+  int fd2 = Posix.open ("/dev/test", Posix.O_RDWR, 0);
+  assert_cmpint (fd2, CompareOperator.GE, 0);
+  assert_cmpint (Posix.ioctl (fd2, Ioctl.USBDEVFS_GET_CAPABILITIES, ref caps), CompareOperator.EQ, 0);
+  assert_cmpuint (caps, CompareOperator.EQ, 0x100);
+  assert_cmpint (calls, CompareOperator.EQ, 1);
+  Posix.close (fd2);
+
+  /* until the handler invalidates it */
+  handler.invalidate_cache ();
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_GET_CAPABILITIES, ref caps), CompareOperator.EQ, 0);
+  assert_cmpuint (caps, CompareOperator.EQ, 0x101);
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_GET_CAPABILITIES, ref caps), CompareOperator.EQ, 0);
+  assert_cmpint (calls, CompareOperator.EQ, 2);
+
+  /* some _IOR ioctls take input, which the cache needs to tell apart */
+  uint32 keycode[2] = { 30, 0 };
+  assert_cmpint (Posix.ioctl (fd, Ioctl.EVIOCGKEYCODE, keycode), CompareOperator.EQ, 0);
+  assert_cmpuint (keycode[1], CompareOperator.EQ, 0x200 + 30);
+  keycode[0] = 48;
+  keycode[1] = 0;
+  assert_cmpint (Posix.ioctl (fd, Ioctl.EVIOCGKEYCODE, keycode), CompareOperator.EQ, 0);
+  assert_cmpuint (keycode[1], CompareOperator.EQ, 0x200 + 48);
+  keycode[0] = 30;
+  keycode[1] = 0;
+  assert_cmpint (Posix.ioctl (fd, Ioctl.EVIOCGKEYCODE, keycode), CompareOperator.EQ, 0);
+  assert_cmpuint (keycode[1], CompareOperator.EQ, 0x200 + 30);
+  assert_cmpint (calls, CompareOperator.EQ, 4);
+
+  /* ioctls with state are always passed on */
+  int iface = 0;
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_CLAIMINTERFACE, ref iface), CompareOperator.EQ, 0);
+  assert_cmpint (Posix.ioctl (fd, Ioctl.USBDEVFS_CLAIMINTERFACE, ref iface), CompareOperator.EQ, 0);
+  assert_cmpint (calls, CompareOperator.EQ, 6);
+
+  Posix.close (fd);
+
+  try {
+      tb.detach_ioctl("/dev/test");
+  } catch (Error e) {
+      error ("Failed to detach ioctl: %s", e.message);
+  }
+}
+
+void
+t_ioctl_abstract_socket ()
+{
+  var tb = new UMockdev.Testbed ();
+  /* longer than a socket path can be */
+  string name = string.nfill (120, 'x');
+
+  tb_add_from_string (tb, """P: /devices/test
+N: %s
+E: SUBSYSTEM=test
+""".printf (name));
+
+  var handler = new UMockdev.IoctlBase();
+  handler.connect("signal::handle-ioctl", ioctl_custom_handle_ioctl_cb, null);
+
+  try {
+      tb.attach_ioctl("/dev/" + name, handler);
+  } catch (Error e) {
+      error ("Failed to attach ioctl: %s", e.message);
+  }
+
+  /* the handler's socket is not in the testbed directory */
+  assert (Environment.get_variable ("UMOCKDEV_CHANNEL") != null);
+  assert (!FileUtils.test (Path.build_filename (tb.get_root_dir (), "ioctl", "dev", name), FileTest.EXISTS));
+
+  int fd = Posix.open ("/dev/" + name, Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+  assert_cmpint (Posix.ioctl (fd, 1, 0xdeadbeef), CompareOperator.EQ, (int) 0xdeadbeef);
+  Posix.close (fd);
+
+  try {
+      tb.detach_ioctl("/dev/" + name);
+  } catch (Error e) {
+      error ("Failed to detach ioctl: %s", e.message);
+  }
+}
+
+void
+t_ioctl_abstract_socket_boundary ()
+{
+  var tb = new UMockdev.Testbed ();
+
+  /* "umockdev.<16 hex digits>/ioctl/dev/" is 36 bytes; names around 71 bytes
+   * are right at the edge of the 106 usable bytes of sun_path */
+  for (int len = 69; len <= 72; ++len) {
+      string name = string.nfill (len, 'b');
+      var handler = new UMockdev.IoctlBase();
+      handler.connect("signal::handle-ioctl", ioctl_custom_handle_ioctl_cb, null);
+
+      tb_add_from_string (tb, """P: /devices/boundary%i
+N: %s
+E: SUBSYSTEM=test
+""".printf (len, name));
+
+      try {
+          tb.attach_ioctl("/dev/" + name, handler);
+      } catch (Error e) {
+          error ("Failed to attach ioctl: %s", e.message);
+      }
+
+      int fd = Posix.open ("/dev/" + name, Posix.O_RDWR, 0);
+      assert_cmpint (fd, CompareOperator.GE, 0);
+      assert_cmpint (Posix.ioctl (fd, 1, 0xdeadbeef), CompareOperator.EQ, (int) 0xdeadbeef);
+      Posix.close (fd);
+
+      try {
+          tb.detach_ioctl("/dev/" + name);
+      } catch (Error e) {
+          error ("Failed to detach ioctl: %s", e.message);
+      }
+  }
+}
+
+void
+t_v4l2_stream ()
+{
+  var tb = new UMockdev.Testbed ();
+
+  tb_add_from_string (tb, """P: /devices/usb/video4linux/video0
+N: video0
+E: DEVNAME=/dev/video0
+E: SUBSYSTEM=video4linux
+A: dev=81:0
+""");
+
+  // frames which do not fit into the size fields
+  try {
+      tb.load_v4l2 ("/dev/video0", null, 100000, 100000, "RGB3", 100);
+      assert_not_reached ();
+  } catch (FileError e) {
+      assert (e is FileError.INVAL);
+  } catch (Error e) {
+      error ("Unexpected error: %s", e.message);
+  }
+
+  try {
+      tb.load_v4l2 ("/dev/video0", null, 64, 48, "YUYV", 100);
+  } catch (Error e) {
+      error ("Cannot load V4L2 emulation: %s", e.message);
+  }
+
+  int fd = Posix.open ("/dev/video0", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+
+  var cap = Ioctl.v4l2_capability ();
+  assert_cmpint (Posix.ioctl (fd, Ioctl.VIDIOC_QUERYCAP, ref cap), CompareOperator.EQ, 0);
+  assert_cmpuint (cap.device_caps & Ioctl.V4L2_CAP_STREAMING, CompareOperator.EQ, Ioctl.V4L2_CAP_STREAMING);
+
+  /* the only mode wins */
+  var fmt = Ioctl.v4l2_format ();
+  fmt.type = Ioctl.V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  fmt.pix.width = 1920;
+  fmt.pix.height = 1080;
+  assert_cmpint (Posix.ioctl (fd, Ioctl.VIDIOC_S_FMT, ref fmt), CompareOperator.EQ, 0);
+  assert_cmpuint (fmt.pix.width, CompareOperator.EQ, 64);
+  assert_cmpuint (fmt.pix.height, CompareOperator.EQ, 48);
+  assert_cmpuint (fmt.pix.sizeimage, CompareOperator.EQ, 64 * 48 * 2);
+
+  var req = Ioctl.v4l2_requestbuffers ();
+  req.count = 2;
+  req.type = Ioctl.V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = Ioctl.V4L2_MEMORY_MMAP;
+  assert_cmpint (Posix.ioctl (fd, Ioctl.VIDIOC_REQBUFS, ref req), CompareOperator.EQ, 0);
+  assert_cmpuint (req.count, CompareOperator.EQ, 2);
+
+  uint8*[] maps = new uint8*[2];
+  for (uint i = 0; i < 2; i++) {
+      var buf = Ioctl.v4l2_buffer ();
+      buf.index = i;
+      buf.type = Ioctl.V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buf.memory = Ioctl.V4L2_MEMORY_MMAP;
+      assert_cmpint (Posix.ioctl (fd, Ioctl.VIDIOC_QUERYBUF, ref buf), CompareOperator.EQ, 0);
+      assert_cmpuint (buf.length, CompareOperator.EQ, 64 * 48 * 2);
+      maps[i] = Posix.mmap (null, buf.length, Posix.PROT_READ, Posix.MAP_SHARED, fd, buf.offset);
+      assert ((void*) maps[i] != Posix.MAP_FAILED);
+      assert_cmpint (Posix.ioctl (fd, Ioctl.VIDIOC_QBUF, ref buf), CompareOperator.EQ, 0);
+  }
+
+  uint32 type = Ioctl.V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  assert_cmpint (Posix.ioctl (fd, Ioctl.VIDIOC_STREAMON, ref type), CompareOperator.EQ, 0);
+
+  /* frames arrive at the configured rate, in the shared buffers */
+  int64 start = get_monotonic_time ();
+  for (uint n = 0; n < 5; n++) {
+      var buf = Ioctl.v4l2_buffer ();
+      buf.type = Ioctl.V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buf.memory = Ioctl.V4L2_MEMORY_MMAP;
+      assert_cmpint (Posix.ioctl (fd, Ioctl.VIDIOC_DQBUF, ref buf), CompareOperator.EQ, 0);
+      assert_cmpuint (buf.index, CompareOperator.EQ, n % 2);
+      /* frames may get dropped on a slow machine */
+      assert_cmpuint (buf.sequence, CompareOperator.GE, n);
+      assert_cmpuint (buf.bytesused, CompareOperator.EQ, 64 * 48 * 2);
+      /* moving gradient: Y at (x, y) is x + y + 4 * sequence */
+      assert_cmpuint (maps[buf.index][2 * 64 * 3 + 2 * 5], CompareOperator.EQ, (3 + 5 + 4 * buf.sequence) & 0xff);
+      assert_cmpuint (maps[buf.index][1], CompareOperator.EQ, 128);
+      assert_cmpint (Posix.ioctl (fd, Ioctl.VIDIOC_QBUF, ref buf), CompareOperator.EQ, 0);
+  }
+  assert_cmpint (get_monotonic_time () - start, CompareOperator.GE, 35000);
+
+  /* non-blocking: poll() reports ready frames, and DQBUF does not wait */
+  Posix.fcntl (fd, Posix.F_SETFL, Posix.O_NONBLOCK);
+  Posix.pollfd[] pfd = { Posix.pollfd () { fd = fd, events = Posix.POLLIN } };
+  for (uint n = 0; n < 2; n++) {
+      var buf = Ioctl.v4l2_buffer ();
+      buf.type = Ioctl.V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buf.memory = Ioctl.V4L2_MEMORY_MMAP;
+      assert_cmpint (Posix.poll (pfd, 5000), CompareOperator.EQ, 1);
+      assert_cmpint (Posix.ioctl (fd, Ioctl.VIDIOC_DQBUF, ref buf), CompareOperator.EQ, 0);
+  }
+  /* without queued buffers no frame can become ready */
+  assert_cmpint (Posix.poll (pfd, 50), CompareOperator.EQ, 0);
+  var nbuf = Ioctl.v4l2_buffer ();
+  nbuf.type = Ioctl.V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  nbuf.memory = Ioctl.V4L2_MEMORY_MMAP;
+  assert_cmpint (Posix.ioctl (fd, Ioctl.VIDIOC_DQBUF, ref nbuf), CompareOperator.EQ, -1);
+  assert_cmpint (Posix.errno, CompareOperator.EQ, Posix.EAGAIN);
+
+  assert_cmpint (Posix.ioctl (fd, Ioctl.VIDIOC_STREAMOFF, ref type), CompareOperator.EQ, 0);
+
+  Posix.munmap (maps[0], 64 * 48 * 2);
+  Posix.munmap (maps[1], 64 * 48 * 2);
+  Posix.close (fd);
+}
+
 int
 main (string[] args)
 {
@@ -1114,6 +2002,8 @@ main (string[] args)
   for (int i = 0; i < args.length; i++) {
       if (args[i] == "--test-outside-testbed")
           return is_test_inside_testbed(int.parse(args[i+1]));
+      if (args[i] == "--test-inherited-fd")
+          return Posix.ioctl(int.parse(args[i+1]), 1, 0x1234) == 0x1234 ? 0 : 1;
   }
   Test.init (ref args);
   /* tests for mocking /sys */
@@ -1128,15 +2018,21 @@ main (string[] args)
   /* tests for mocking ioctls */
   Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_static", t_usbfs_ioctl_static);
   Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_tree", t_usbfs_ioctl_tree);
+  Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_tree_prune", t_usbfs_ioctl_tree_prune);
   Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_tree_with_default_device", t_usbfs_ioctl_tree_with_default_device);
   Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_tree_override_default_device", t_usbfs_ioctl_tree_override_default_device);
   Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_tree_xz", t_usbfs_ioctl_tree_xz);
 
   Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_pcap", t_usbfs_ioctl_pcap);
+  Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_pcap_formats", t_usbfs_ioctl_pcap_formats);
 
   Test.add_func ("/umockdev-testbed-vala/spidev_ioctl", t_spidev_ioctl);
+  Test.add_func ("/umockdev-testbed-vala/spidev_binary", t_spidev_binary);
 
   Test.add_func ("/umockdev-testbed-vala/hidraw_ioctl", t_hidraw_ioctl);
+  Test.add_func ("/umockdev-testbed-vala/hidraw_rules", t_hidraw_rules);
+
+  Test.add_func ("/umockdev-testbed-vala/v4l2_stream", t_v4l2_stream);
 
   /* tests for mocking TTYs */
   Test.add_func ("/umockdev-testbed-vala/tty_stty", t_tty_stty);
@@ -1149,9 +2045,16 @@ main (string[] args)
   /* tests for multi-thread safety */
   Test.add_func ("/umockdev-testbed-vala/mt_parallel_attr_distinct", t_mt_parallel_attr_distinct);
   Test.add_func ("/umockdev-testbed-vala/mt_uevent", t_mt_uevent);
+  Test.add_func ("/umockdev-testbed-vala/load_uevents", t_load_uevents);
 
   /* test IoctlBase attachment and signals */
   Test.add_func ("/umockdev-testbed-vala/ioctl_custom", t_ioctl_custom);
+  Test.add_func ("/umockdev-testbed-vala/ioctl_large_buffer", t_ioctl_large_buffer);
+  Test.add_func ("/umockdev-testbed-vala/ioctl_mmap", t_ioctl_mmap);
+  Test.add_func ("/umockdev-testbed-vala/ioctl_fork_exec", t_ioctl_fork_exec);
+  Test.add_func ("/umockdev-testbed-vala/ioctl_cache", t_ioctl_cache);
+  Test.add_func ("/umockdev-testbed-vala/ioctl_abstract_socket", t_ioctl_abstract_socket);
+  Test.add_func ("/umockdev-testbed-vala/ioctl_abstract_socket_boundary", t_ioctl_abstract_socket_boundary);
 
   return Test.run();
 }
@@ -28,14 +28,28 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
 #include <sys/un.h>
 #include <sys/vfs.h>
+#include <sys/wait.h>
 #include <linux/usbdevice_fs.h>
 #include <linux/input.h>
 #include <linux/magic.h>
+#include <linux/fs.h>
+#include <linux/serial.h>
+#include <termios.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
 
 #include <libudev.h>
 #include <gudev/gudev.h>
@@ -541,6 +555,223 @@ t_testbed_set_attribute(UMockdevTestbedFixture * fixture, UNUSED_DATA)
     g_assert_cmpint(memcmp(contents, "\x01\x00\xFF\x00\x05\x40\xA0", 7), ==, 0);
 }
 
+struct notify_data {
+    UMockdevTestbed *testbed;
+    const gchar *syspath;
+};
+
+static gpointer
+t_testbed_notify_attribute_thread(gpointer data)
+{
+    struct notify_data *d = data;
+
+    g_usleep(50000);
+    umockdev_testbed_set_attribute(d->testbed, d->syspath, "value", "1");
+    umockdev_testbed_notify_attribute(d->testbed, d->syspath, "value");
+    return NULL;
+}
+
+static void
+t_testbed_notify_attribute(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    struct pollfd pfd;
+    struct epoll_event ev;
+    struct notify_data data;
+    struct timespec ts = { 0, 0 };
+    struct timeval tv = { 0, 0 };
+    struct stat st_before, st_after;
+    GThread *thread;
+    fd_set exceptfds;
+    char buf[10];
+    int fd, fd2, epfd, pipefds[2];
+
+    g_autofree gchar *syspath = umockdev_testbed_add_device(
+            fixture->testbed, "gpio", "gpio1", NULL,
+            "value", "0", NULL,
+            NULL);
+    g_autofree gchar *attrpath = g_build_filename(syspath, "value", NULL);
+
+    fd = g_open(attrpath, O_RDONLY, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(read(fd, buf, sizeof buf), ==, 1);
+    g_assert_cmpint(buf[0], ==, '0');
+
+    /* nothing pending */
+    pfd.fd = fd;
+    pfd.events = POLLPRI;
+    g_assert_cmpint(poll(&pfd, 1, 0), ==, 0);
+
+    /* wakes up a waiting poll(), until the attribute is read again */
+    data.testbed = fixture->testbed;
+    data.syspath = syspath;
+    thread = g_thread_new("notify", t_testbed_notify_attribute_thread, &data);
+    g_assert_cmpint(poll(&pfd, 1, 5000), ==, 1);
+    g_assert_cmpint(pfd.revents, ==, POLLPRI | POLLERR);
+    g_thread_join(thread);
+    g_assert_cmpint(poll(&pfd, 1, 0), ==, 1);
+    g_assert_cmpint(ppoll(&pfd, 1, &ts, NULL), ==, 1);
+    g_assert_cmpint(pfd.revents, ==, POLLPRI | POLLERR);
+    FD_ZERO(&exceptfds);
+    FD_SET(fd, &exceptfds);
+    g_assert_cmpint(select(fd + 1, NULL, NULL, &exceptfds, &tv), ==, 1);
+    g_assert(FD_ISSET(fd, &exceptfds));
+
+    /* reading gets the new value, without replacing the program's fd */
+    g_assert_cmpint(fstat(fd, &st_before), ==, 0);
+    g_assert_cmpint(lseek(fd, 0, SEEK_SET), ==, 0);
+    g_assert_cmpint(read(fd, buf, sizeof buf), ==, 1);
+    g_assert_cmpint(buf[0], ==, '1');
+    g_assert_cmpint(read(fd, buf, sizeof buf), ==, 0);
+    g_assert_cmpint(fstat(fd, &st_after), ==, 0);
+    g_assert_cmpuint(st_before.st_ino, ==, st_after.st_ino);
+    g_assert_cmpint(poll(&pfd, 1, 0), ==, 0);
+    g_assert_cmpint(ppoll(&pfd, 1, &ts, NULL), ==, 0);
+    FD_ZERO(&exceptfds);
+    FD_SET(fd, &exceptfds);
+    g_assert_cmpint(select(fd + 1, NULL, NULL, &exceptfds, &tv), ==, 0);
+
+    /* epoll */
+    epfd = epoll_create1(0);
+    g_assert_cmpint(epfd, >=, 0);
+    ev.events = EPOLLPRI;
+    ev.data.u64 = 42;
+    g_assert_cmpint(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev), ==, 0);
+    g_assert_cmpint(epoll_wait(epfd, &ev, 1, 0), ==, 0);
+    umockdev_testbed_notify_attribute(fixture->testbed, syspath, "value");
+    g_assert_cmpint(epoll_wait(epfd, &ev, 1, 5000), ==, 1);
+    g_assert_cmpuint(ev.data.u64, ==, 42);
+    g_assert_cmpuint(ev.events, ==, EPOLLPRI | EPOLLERR);
+    g_assert_cmpint(pread(fd, buf, sizeof buf, 0), ==, 1);
+    g_assert_cmpint(epoll_wait(epfd, &ev, 1, 0), ==, 0);
+
+    /* other fds with the same data keep their events */
+    g_assert_cmpint(pipe(pipefds), ==, 0);
+    ev.events = EPOLLIN;
+    ev.data.u64 = 42;
+    g_assert_cmpint(epoll_ctl(epfd, EPOLL_CTL_ADD, pipefds[0], &ev), ==, 0);
+    g_assert_cmpint(write(pipefds[1], "x", 1), ==, 1);
+    g_assert_cmpint(epoll_wait(epfd, &ev, 1, 5000), ==, 1);
+    g_assert_cmpuint(ev.data.u64, ==, 42);
+    g_assert_cmpuint(ev.events, ==, EPOLLIN);
+    close(pipefds[0]);
+    close(pipefds[1]);
+
+    close(epfd);
+    close(fd);
+
+    /* attributes whose paths only differ in '/' vs. '_' have their own
+     * notifications */
+    g_autofree gchar *syspath2 = umockdev_testbed_add_device(
+            fixture->testbed, "gpio", "gpio1_value", NULL,
+            "x", "0", NULL,
+            NULL);
+    g_autofree gchar *attrpath2 = g_build_filename(syspath2, "x", NULL);
+    g_autofree gchar *attrpath3 = g_build_filename(syspath, "value_x", NULL);
+    umockdev_testbed_set_attribute(fixture->testbed, syspath, "value_x", "0");
+    fd = g_open(attrpath3, O_RDONLY, 0);
+    g_assert_cmpint(fd, >=, 0);
+    fd2 = g_open(attrpath2, O_RDONLY, 0);
+    g_assert_cmpint(fd2, >=, 0);
+    umockdev_testbed_notify_attribute(fixture->testbed, syspath2, "x");
+    pfd.fd = fd;
+    g_assert_cmpint(poll(&pfd, 1, 0), ==, 0);
+    pfd.fd = fd2;
+    g_assert_cmpint(poll(&pfd, 1, 0), ==, 1);
+    close(fd2);
+    close(fd);
+}
+
+static gchar *
+t_testbed_attribute_func_cb(const gchar *devpath, const gchar *name, gpointer user_data)
+{
+    int *count = user_data;
+
+    g_assert_cmpstr(name, ==, "energy_now");
+    return g_strdup_printf("%i\n", 1000 + (*count)++);
+}
+
+static void
+t_testbed_set_attribute_func(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    int count = 0;
+    char buf[20];
+    gchar *contents;
+    int fd;
+
+    g_autofree gchar *syspath = umockdev_testbed_add_device(
+            fixture->testbed, "power_supply", "BAT0", NULL,
+            "energy_now", "0", NULL,
+            NULL);
+    g_autofree gchar *attrpath = g_build_filename(syspath, "energy_now", NULL);
+
+    /* the file gets the first value */
+    umockdev_testbed_set_attribute_func(fixture->testbed, syspath, "energy_now",
+                                        t_testbed_attribute_func_cb, &count, NULL);
+    g_assert_cmpint(count, ==, 1);
+    g_assert(g_file_get_contents(attrpath, &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "1000\n");
+    g_free(contents);
+
+    /* every read from the start computes it again, partial reads continue
+     * in the same value */
+    fd = g_open(attrpath, O_RDONLY, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(read(fd, buf, 2), ==, 2);
+    g_assert_cmpint(read(fd, buf + 2, sizeof buf - 2), ==, 3);
+    g_assert_cmpint(read(fd, buf, sizeof buf), ==, 0);
+    g_assert_cmpint(memcmp(buf, "1001\n", 5), ==, 0);
+    g_assert_cmpint(lseek(fd, 0, SEEK_SET), ==, 0);
+    g_assert_cmpint(read(fd, buf, sizeof buf), ==, 5);
+    g_assert_cmpint(memcmp(buf, "1002\n", 5), ==, 0);
+    g_assert_cmpint(pread(fd, buf, sizeof buf, 0), ==, 5);
+    g_assert_cmpint(memcmp(buf, "1003\n", 5), ==, 0);
+    close(fd);
+    g_assert_cmpint(count, ==, 4);
+
+    /* the file is left alone */
+    g_assert(g_file_get_contents(attrpath, &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "1000\n");
+    g_free(contents);
+
+    /* back to the file */
+    umockdev_testbed_set_attribute_func(fixture->testbed, syspath, "energy_now", NULL, NULL, NULL);
+    fd = g_open(attrpath, O_RDONLY, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(read(fd, buf, sizeof buf), ==, 5);
+    g_assert_cmpint(memcmp(buf, "1000\n", 5), ==, 0);
+    close(fd);
+    g_assert_cmpint(count, ==, 4);
+
+    /* socket names of long paths get hashed */
+    g_autofree gchar *longpath = umockdev_testbed_add_device(
+            fixture->testbed, "power_supply", "BAT1_with_a_name_long_enough_for_a_hashed_socket_name", NULL,
+            "energy_now", "0", NULL,
+            NULL);
+    g_autofree gchar *longattr = g_build_filename(longpath, "energy_now", NULL);
+    umockdev_testbed_set_attribute_func(fixture->testbed, longpath, "energy_now",
+                                        t_testbed_attribute_func_cb, &count, NULL);
+    g_assert_cmpint(count, ==, 5);
+    fd = g_open(longattr, O_RDONLY, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(read(fd, buf, 2), ==, 2);
+    g_assert_cmpint(memcmp(buf, "10", 2), ==, 0);
+    g_assert_cmpint(count, ==, 6);
+
+    /* forked children share the file position */
+    pid_t pid = fork();
+    g_assert_cmpint(pid, >=, 0);
+    if (pid == 0)
+        _exit(read(fd, buf, sizeof buf) == 3 ? 0 : 1);
+    int status;
+    g_assert_cmpint(waitpid(pid, &status, 0), ==, pid);
+    g_assert(WIFEXITED(status));
+    g_assert_cmpint(WEXITSTATUS(status), ==, 0);
+    g_assert_cmpint(lseek(fd, 0, SEEK_CUR), ==, 5);
+    g_assert_cmpint(read(fd, buf, sizeof buf), ==, 0);
+    close(fd);
+    umockdev_testbed_set_attribute_func(fixture->testbed, longpath, "energy_now", NULL, NULL, NULL);
+}
+
 static void
 t_testbed_set_property(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
@@ -1411,6 +1642,123 @@ t_testbed_dev_access(UMockdevTestbedFixture * fixture, UNUSED_DATA)
     }
 }
 
+static void
+t_testbed_relative_paths(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    g_autofree gchar *orig_cwd = g_get_current_dir();
+    g_autofree gchar *syspath = NULL;
+    g_autofree gchar *linkdir = NULL;
+    g_autofree gchar *linkpath = NULL;
+    gchar *contents;
+    int dirfd;
+
+    syspath = umockdev_testbed_add_device(fixture->testbed, "hwmon", "relative1", NULL,
+					  "name", "coretemp", NULL, NULL);
+    g_assert(syspath);
+
+    g_assert_cmpint(chdir("/"), ==, 0);
+    g_assert(g_file_get_contents("sys/devices/relative1/name", &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "coretemp");
+    g_free(contents);
+    g_assert(g_file_get_contents("./sys//class/hwmon/relative1/name", &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "coretemp");
+    g_free(contents);
+
+    /* inside the testbed */
+    g_assert_cmpint(chdir("/sys/class/hwmon"), ==, 0);
+    g_assert(g_file_get_contents("relative1/name", &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "coretemp");
+    g_free(contents);
+    /* ".." after a symlink goes to its physical parent */
+    g_assert(g_file_get_contents("relative1/../relative1/name", &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "coretemp");
+    g_free(contents);
+
+    dirfd = g_open("/sys/devices", O_RDONLY | O_DIRECTORY, 0);
+    g_assert_cmpint(dirfd, >=, 0);
+    g_assert_cmpint(chdir("/"), ==, 0);
+    g_assert_cmpint(fchdir(dirfd), ==, 0);
+    close(dirfd);
+    g_assert(g_file_get_contents("relative1/name", &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "coretemp");
+    g_free(contents);
+
+    /* through a symlink into the testbed */
+    linkdir = g_dir_make_tmp("relative.XXXXXX", NULL);
+    g_assert(linkdir);
+    linkpath = g_build_filename(linkdir, "c", NULL);
+    g_assert_cmpint(symlink("/sys/class", linkpath), ==, 0);
+    g_assert_cmpint(chdir(linkdir), ==, 0);
+    g_assert(g_file_get_contents("c/hwmon/relative1/name", &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "coretemp");
+    g_free(contents);
+
+    g_assert_cmpint(chdir(orig_cwd), ==, 0);
+    g_assert_cmpint(unlink(linkpath), ==, 0);
+    g_assert_cmpint(rmdir(linkdir), ==, 0);
+}
+
+static void
+t_testbed_dirfd_paths(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    g_autofree gchar *syspath = NULL;
+    GStatBuf st;
+    char buf[100];
+    int rootfd, classfd, fd;
+    DIR *dir;
+
+    syspath = umockdev_testbed_add_device(fixture->testbed, "hwmon", "dirfd1", NULL,
+					  "name", "coretemp", NULL, NULL);
+    g_assert(syspath);
+
+    /* relative to / */
+    rootfd = g_open("/", O_RDONLY | O_DIRECTORY, 0);
+    g_assert_cmpint(rootfd, >=, 0);
+    fd = openat(rootfd, "sys/devices/dirfd1/name", O_RDONLY);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(read(fd, buf, sizeof(buf)), ==, 9);
+    g_assert(strncmp(buf, "coretemp\n", 9) == 0);
+    close(fd);
+
+    /* relative to a directory in the testbed, through a symlink */
+    classfd = openat(rootfd, "sys/class/hwmon", O_RDONLY | O_DIRECTORY);
+    g_assert_cmpint(classfd, >=, 0);
+    fd = openat(classfd, "dirfd1/name", O_RDONLY);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+    g_assert_cmpint(fstatat(classfd, "dirfd1/name", &st, 0), ==, 0);
+    g_assert(S_ISREG(st.st_mode));
+    g_assert_cmpint(faccessat(classfd, "dirfd1/name", R_OK, 0), ==, 0);
+    g_assert_cmpint(faccessat(classfd, "nonexisting", R_OK, 0), ==, -1);
+    g_assert_cmpint(errno, ==, ENOENT);
+    close(classfd);
+    close(rootfd);
+
+    /* opendir() */
+    dir = opendir("/sys/devices");
+    g_assert(dir);
+    fd = openat(dirfd(dir), "dirfd1/name", O_RDONLY);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+    closedir(dir);
+
+    /* directory fds which are not recorded go through /proc/self/fd */
+    rootfd = g_open("/", O_PATH, 0);
+    g_assert_cmpint(rootfd, >=, 0);
+    fd = openat(rootfd, "sys/devices/dirfd1/name", O_RDONLY);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(read(fd, buf, sizeof(buf)), ==, 9);
+    g_assert(strncmp(buf, "coretemp\n", 9) == 0);
+    close(fd);
+
+    classfd = dup(rootfd);
+    g_assert_cmpint(classfd, >=, 0);
+    close(rootfd);
+    g_assert_cmpint(fstatat(classfd, "sys/devices/dirfd1/name", &st, 0), ==, 0);
+    g_assert(S_ISREG(st.st_mode));
+    close(classfd);
+}
+
 static void
 t_testbed_add_from_string_dev_char(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
@@ -1471,6 +1819,116 @@ t_testbed_add_from_string_dev_char(UMockdevTestbedFixture * fixture, UNUSED_DATA
     g_assert_cmpint(st.st_rdev, ==, makedev(189, 2));
 }
 
+static void
+t_testbed_lazy_node(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    GError *error = NULL;
+    g_autofree gchar *node = NULL;
+    char buf[10];
+    GStatBuf st;
+    int fd, master;
+
+    g_assert(umockdev_testbed_add_from_string(fixture->testbed,
+					      "P: /devices/ttyACM0\nN: ttyACM0\n"
+					      "E: SUBSYSTEM=tty\nE: DEVNAME=/dev/ttyACM0\n"
+					      "A: dev=166:0\n", &error));
+    g_assert_no_error(error);
+
+    /* the PTY only gets created when the device gets opened */
+    node = g_build_filename(fixture->root_dir, "dev", "ttyACM0", NULL);
+    g_assert_cmpint(g_lstat(node, &st), ==, 0);
+    g_assert(S_ISREG(st.st_mode));
+    g_assert_cmpint(g_stat("/dev/ttyACM0", &st), ==, 0);
+    g_assert(S_ISCHR(st.st_mode));
+
+    fd = g_open("/dev/ttyACM0", O_RDWR | O_NOCTTY, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert(isatty(fd));
+    g_assert_cmpint(g_lstat(node, &st), ==, 0);
+    g_assert(S_ISLNK(st.st_mode));
+
+    master = umockdev_testbed_get_dev_fd(fixture->testbed, "/dev/ttyACM0");
+    g_assert_cmpint(master, >=, 0);
+    g_assert_cmpint(write(master, "hello", 5), ==, 5);
+    g_assert_cmpint(read(fd, buf, sizeof(buf)), ==, 5);
+    g_assert_cmpint(memcmp(buf, "hello", 5), ==, 0);
+    close(fd);
+
+    /* socket backed node */
+    umockdev_testbed_set_node_backing(fixture->testbed, "hidraw", UMOCKDEV_NODE_BACKING_SOCKET);
+    g_assert(umockdev_testbed_add_from_string(fixture->testbed,
+					      "P: /devices/hidraw0\nN: hidraw0\n"
+					      "E: SUBSYSTEM=hidraw\nE: DEVNAME=/dev/hidraw0\n"
+					      "A: dev=240:0\n", &error));
+    g_assert_no_error(error);
+
+    fd = g_open("/dev/hidraw0", O_RDWR, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert(!isatty(fd));
+    master = umockdev_testbed_get_dev_fd(fixture->testbed, "/dev/hidraw0");
+    g_assert_cmpint(master, >=, 0);
+
+    g_assert_cmpint(write(fd, "ping", 4), ==, 4);
+    g_assert_cmpint(read(master, buf, sizeof(buf)), ==, 4);
+    g_assert_cmpint(memcmp(buf, "ping", 4), ==, 0);
+    g_assert_cmpint(write(master, "pong", 4), ==, 4);
+    g_assert_cmpint(read(fd, buf, sizeof(buf)), ==, 4);
+    g_assert_cmpint(memcmp(buf, "pong", 4), ==, 0);
+    close(fd);
+
+    g_assert_cmpint(g_stat("/dev/hidraw0", &st), ==, 0);
+    g_assert(S_ISCHR(st.st_mode));
+    g_assert_cmpint(st.st_rdev, ==, makedev(240, 0));
+
+    /* removing the device closes the testbed's copy of the client end */
+    g_assert_cmpint(send(master, "x", 1, MSG_NOSIGNAL), ==, 1);
+    umockdev_testbed_remove_device(fixture->testbed, "/sys/devices/hidraw0");
+    g_assert_cmpint(send(master, "x", 1, MSG_NOSIGNAL), ==, -1);
+    g_assert_cmpint(errno, ==, EPIPE);
+}
+
+static void
+t_testbed_isatty(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    GError *error = NULL;
+    int tty, usb;
+
+    /* only PTYs of major 4 devices are TTYs */
+    g_assert(umockdev_testbed_add_from_string(fixture->testbed,
+					      "P: /devices/ttyS1\nN: ttyS1\n"
+					      "E: SUBSYSTEM=tty\nE: DEVNAME=/dev/ttyS1\nA: dev=4:65\n\n"
+					      "P: /devices/lp0\nN: usb/lp0\n"
+					      "E: SUBSYSTEM=usbmisc\nE: DEVNAME=/dev/usb/lp0\nA: dev=180:0\n", &error));
+    g_assert_no_error(error);
+
+    tty = g_open("/dev/ttyS1", O_RDWR | O_NOCTTY, 0);
+    g_assert_cmpint(tty, >=, 0);
+    usb = g_open("/dev/usb/lp0", O_RDWR | O_NOCTTY, 0);
+    g_assert_cmpint(usb, >=, 0);
+
+    /* repeated calls are answered from the cache */
+    for (int i = 0; i < 3; ++i) {
+	g_assert(isatty(tty));
+	g_assert(!isatty(usb));
+    }
+
+    /* dup2() replaces the fd and what it is */
+    g_assert_cmpint(dup2(tty, usb), ==, usb);
+    g_assert(isatty(usb));
+    close(usb);
+
+    usb = g_open("/dev/usb/lp0", O_RDWR | O_NOCTTY, 0);
+    g_assert_cmpint(usb, >=, 0);
+    g_assert(!isatty(usb));
+
+    /* also when this happens behind the preload's back, like with
+     * close_range() */
+    g_assert_cmpint(syscall(SYS_dup3, tty, usb, 0), ==, usb);
+    g_assert(isatty(usb));
+    close(usb);
+    close(tty);
+}
+
 static void
 t_testbed_add_from_string_dev_block(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
@@ -1527,6 +1985,372 @@ t_testbed_add_from_string_dev_block(UMockdevTestbedFixture * fixture, UNUSED_DAT
 #endif
 }
 
+static void
+t_testbed_block_data(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    GError *error = NULL;
+    g_autofree gchar *image = NULL;
+    g_autofree gchar *contents = NULL;
+    gsize length;
+    guint64 size64 = 0;
+    int blksize = 0;
+    guint64 range[2];
+    char buf[4096];
+    gint64 start;
+    int fd, image_fd;
+
+    g_assert(umockdev_testbed_add_from_string(fixture->testbed,
+					      "P: /devices/block/disk\nN: disk\n"
+					      "E: SUBSYSTEM=block\nE: DEVNAME=/dev/disk\n"
+					      "E: DEVTYPE=disk\n", &error));
+    g_assert_no_error(error);
+
+    /* not a block device */
+    g_assert(!umockdev_testbed_load_block(fixture->testbed, "/dev/nonexisting", NULL, 1048576, 512, 0, 0, &error));
+    g_assert_error(error, UMOCKDEV_ERROR, UMOCKDEV_ERROR_VALUE);
+    g_clear_error(&error);
+
+    /* empty sparse disk */
+    g_assert(umockdev_testbed_load_block(fixture->testbed, "/dev/disk", NULL, 64 * 1048576, 4096, 0, 0, &error));
+    g_assert_no_error(error);
+
+    fd = g_open("/dev/disk", O_RDWR, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(ioctl(fd, BLKGETSIZE64, &size64), ==, 0);
+    g_assert_cmpuint(size64, ==, 64 * 1048576);
+    g_assert_cmpint(ioctl(fd, BLKSSZGET, &blksize), ==, 0);
+    g_assert_cmpint(blksize, ==, 4096);
+    g_assert_cmpint(ioctl(fd, BLKFLSBUF, 0), ==, 0);
+    g_assert_cmpint(ioctl(fd, BLKRRPART, 0), ==, 0);
+    g_assert_cmpint(lseek(fd, 0, SEEK_END), ==, 64 * 1048576);
+
+    memset(buf, 0xAA, sizeof buf);
+    g_assert_cmpint(pwrite(fd, buf, sizeof buf, 1048576), ==, sizeof buf);
+    memset(buf, 0, sizeof buf);
+    g_assert_cmpint(pread(fd, buf, sizeof buf, 1048576), ==, sizeof buf);
+    g_assert_cmpint(buf[0], ==, (char) 0xAA);
+    g_assert_cmpint(buf[4095], ==, (char) 0xAA);
+
+    /* discard needs to be block aligned, and zeroes */
+    range[0] = 1048576;
+    range[1] = 100;
+    g_assert_cmpint(ioctl(fd, BLKDISCARD, range), ==, -1);
+    g_assert_cmpint(errno, ==, EINVAL);
+    range[1] = 4096;
+    g_assert_cmpint(ioctl(fd, BLKDISCARD, range), ==, 0);
+    g_assert_cmpint(pread(fd, buf, sizeof buf, 1048576), ==, sizeof buf);
+    g_assert_cmpint(buf[0], ==, 0);
+    g_assert_cmpint(buf[4095], ==, 0);
+    close(fd);
+
+    /* overlay over an image, which does not get changed */
+    image_fd = g_file_open_tmp("disk.XXXXXX.img", &image, &error);
+    g_assert_no_error(error);
+    memset(buf, 'x', sizeof buf);
+    g_assert_cmpint(write(image_fd, buf, sizeof buf), ==, sizeof buf);
+    close(image_fd);
+
+    g_assert(umockdev_testbed_add_from_string(fixture->testbed,
+					      "P: /devices/block/slow\nN: slow\n"
+					      "E: SUBSYSTEM=block\nE: DEVNAME=/dev/slow\n", &error));
+    g_assert_no_error(error);
+    /* 50 ms per request */
+    g_assert(umockdev_testbed_load_block(fixture->testbed, "/dev/slow", image, 0, 512, 50000, 0, &error));
+    g_assert_no_error(error);
+
+    fd = g_open("/dev/slow", O_RDWR, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(ioctl(fd, BLKGETSIZE64, &size64), ==, 0);
+    g_assert_cmpuint(size64, ==, 4096);
+
+    start = g_get_monotonic_time();
+    g_assert_cmpint(read(fd, buf, 512), ==, 512);
+    g_assert_cmpint(g_get_monotonic_time() - start, >=, 50000);
+    g_assert_cmpint(buf[0], ==, 'x');
+
+    memset(buf, 'y', 512);
+    g_assert_cmpint(pwrite(fd, buf, 512, 0), ==, 512);
+    g_assert_cmpint(pread(fd, buf, 1, 0), ==, 1);
+    g_assert_cmpint(buf[0], ==, 'y');
+    close(fd);
+
+    g_assert(g_file_get_contents(image, &contents, &length, &error));
+    g_assert_no_error(error);
+    g_assert_cmpuint(length, ==, 4096);
+    g_assert_cmpint(contents[0], ==, 'x');
+    unlink(image);
+}
+
+static void
+t_testbed_serial(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    GError *error = NULL;
+    struct termios ios;
+    struct serial_icounter_struct icount;
+    char buf[100];
+    gint64 start;
+    int lines, fd, master;
+
+    g_assert(umockdev_testbed_add_from_string(fixture->testbed,
+					      "P: /devices/ttyS0\nN: ttyS0\n"
+					      "E: DEVNAME=/dev/ttyS0\nE: SUBSYSTEM=tty\nA: dev=4:64\n", &error));
+    g_assert_no_error(error);
+    g_assert(umockdev_testbed_load_serial(fixture->testbed, "/dev/ttyS0", &error));
+    g_assert_no_error(error);
+    master = umockdev_testbed_get_dev_fd(fixture->testbed, "/dev/ttyS0");
+
+    fd = g_open("/dev/ttyS0", O_RDWR | O_NOCTTY, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert(isatty(fd));
+
+    /* 9600 8N1 transfers 960 bytes/s */
+    g_assert_cmpint(tcgetattr(fd, &ios), ==, 0);
+    cfmakeraw(&ios);
+    cfsetspeed(&ios, B9600);
+    g_assert_cmpint(tcsetattr(fd, TCSANOW, &ios), ==, 0);
+    g_assert_cmpint(tcgetattr(fd, &ios), ==, 0);
+    g_assert_cmpint(cfgetospeed(&ios), ==, B9600);
+
+    start = g_get_monotonic_time();
+    g_assert_cmpint(write(fd, "0123456789", 10), ==, 10);
+    g_assert_cmpint(write(fd, "0123456789", 10), ==, 10);
+    g_assert_cmpint(g_get_monotonic_time() - start, >=, 18000);
+    g_assert_cmpint(read(master, buf, sizeof buf), ==, 20);
+
+    g_assert_cmpint(write(master, "hello", 5), ==, 5);
+    start = g_get_monotonic_time();
+    g_assert_cmpint(read(fd, buf, sizeof buf), ==, 5);
+    g_assert_cmpint(g_get_monotonic_time() - start, >=, 5000);
+    g_assert(strncmp(buf, "hello", 5) == 0);
+
+    /* non-blocking reads without pending data fail right away */
+    g_assert_cmpint(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK), ==, 0);
+    errno = 0;
+    g_assert_cmpint(read(fd, buf, sizeof buf), ==, -1);
+    g_assert_cmpint(errno, ==, EAGAIN);
+    g_assert_cmpint(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK), ==, 0);
+
+    /* modem lines */
+    g_assert_cmpint(ioctl(fd, TIOCMGET, &lines), ==, 0);
+    g_assert_cmpint(lines, ==, TIOCM_DTR | TIOCM_RTS);
+    lines = TIOCM_RTS;
+    g_assert_cmpint(ioctl(fd, TIOCMBIC, &lines), ==, 0);
+    g_assert_cmpuint(umockdev_testbed_get_serial_lines(fixture->testbed, "/dev/ttyS0"), ==, TIOCM_DTR);
+
+    umockdev_testbed_set_serial_lines(fixture->testbed, "/dev/ttyS0", TIOCM_CTS | TIOCM_DSR);
+    g_assert_cmpint(ioctl(fd, TIOCMGET, &lines), ==, 0);
+    g_assert_cmpint(lines, ==, TIOCM_DTR | TIOCM_CTS | TIOCM_DSR);
+    umockdev_testbed_set_serial_lines(fixture->testbed, "/dev/ttyS0", TIOCM_DSR);
+    memset(&icount, 0, sizeof icount);
+    g_assert_cmpint(ioctl(fd, TIOCGICOUNT, &icount), ==, 0);
+    g_assert_cmpint(icount.cts, ==, 2);
+    g_assert_cmpint(icount.dsr, ==, 1);
+    g_assert_cmpint(icount.tx, ==, 20);
+    g_assert_cmpint(icount.rx, ==, 5);
+
+    /* B0 hangs up */
+    cfsetspeed(&ios, B0);
+    g_assert_cmpint(tcsetattr(fd, TCSANOW, &ios), ==, 0);
+    g_assert_cmpint(ioctl(fd, TIOCMGET, &lines), ==, 0);
+    g_assert_cmpint(lines, ==, TIOCM_DSR);
+
+    close(fd);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+static void
+t_testbed_io_uring(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    GError *error = NULL;
+    struct io_uring_params p;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqe;
+    char *sq_ring, *cq_ring;
+    unsigned *sq_array, head, tail;
+    struct serial_icounter_struct icount;
+    struct termios ios;
+    char buf[512];
+    gint64 start;
+    int ring, fd, master;
+
+    memset(&p, 0, sizeof p);
+    ring = syscall(__NR_io_uring_setup, 4, &p);
+    if (ring < 0) {
+	g_test_skip("io_uring is not available");
+	return;
+    }
+    sq_ring = mmap(NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, ring, IORING_OFF_SQ_RING);
+    g_assert(sq_ring != MAP_FAILED);
+    cq_ring = mmap(NULL, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, ring, IORING_OFF_CQ_RING);
+    g_assert(cq_ring != MAP_FAILED);
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED, ring, IORING_OFF_SQES);
+    g_assert(sqes != MAP_FAILED);
+
+    /* a throttled block device, so that emulation is visible */
+    g_assert(umockdev_testbed_add_from_string(fixture->testbed,
+					      "P: /devices/block/slow\nN: slow\n"
+					      "E: SUBSYSTEM=block\nE: DEVNAME=/dev/slow\n", &error));
+    g_assert_no_error(error);
+    g_assert(umockdev_testbed_load_block(fixture->testbed, "/dev/slow", NULL, 1048576, 512, 50000, 0, &error));
+    g_assert_no_error(error);
+    fd = g_open("/dev/slow", O_RDWR, 0);
+    g_assert_cmpint(fd, >=, 0);
+    memset(buf, 'z', sizeof buf);
+    g_assert_cmpint(pwrite(fd, buf, sizeof buf, 512), ==, sizeof buf);
+    memset(buf, 0, sizeof buf);
+
+    /* a read from the device and a NOP, which goes to the kernel */
+    memset(sqes, 0, 2 * sizeof(struct io_uring_sqe));
+    sqes[0].opcode = IORING_OP_READ;
+    sqes[0].fd = fd;
+    sqes[0].addr = (uintptr_t) buf;
+    sqes[0].len = sizeof buf;
+    sqes[0].off = 512;
+    sqes[0].user_data = 1;
+    sqes[1].opcode = IORING_OP_NOP;
+    sqes[1].user_data = 2;
+    sq_array = (unsigned *) (sq_ring + p.sq_off.array);
+    sq_array[0] = 0;
+    sq_array[1] = 1;
+    __atomic_store_n((unsigned *) (sq_ring + p.sq_off.tail), 2, __ATOMIC_RELEASE);
+
+    start = g_get_monotonic_time();
+    g_assert_cmpint(syscall(__NR_io_uring_enter, ring, 2, 2, IORING_ENTER_GETEVENTS, NULL, 0), ==, 2);
+    g_assert_cmpint(g_get_monotonic_time() - start, >=, 50000);
+
+    head = *(unsigned *) (cq_ring + p.cq_off.head);
+    tail = __atomic_load_n((unsigned *) (cq_ring + p.cq_off.tail), __ATOMIC_ACQUIRE);
+    g_assert_cmpuint(tail - head, ==, 2);
+    for (; head != tail; ++head) {
+	cqe = (struct io_uring_cqe *) (cq_ring + p.cq_off.cqes) + (head & *(unsigned *) (cq_ring + p.cq_off.ring_mask));
+	if (cqe->user_data == 1)
+	    g_assert_cmpint(cqe->res, ==, sizeof buf);
+	else
+	    g_assert_cmpint(cqe->res, ==, 0);
+    }
+    g_assert_cmpint(buf[0], ==, 'z');
+    g_assert_cmpint(buf[511], ==, 'z');
+
+    /* a read which is linked after a NOP cannot be run before it */
+    memset(sqes, 0, 2 * sizeof(struct io_uring_sqe));
+    sqes[0].opcode = IORING_OP_NOP;
+    sqes[0].flags = IOSQE_IO_LINK;
+    sqes[0].user_data = 3;
+    sqes[1].opcode = IORING_OP_READ;
+    sqes[1].fd = fd;
+    sqes[1].addr = (uintptr_t) buf;
+    sqes[1].len = sizeof buf;
+    sqes[1].off = 512;
+    sqes[1].user_data = 4;
+    sq_array[2] = 0;
+    sq_array[3] = 1;
+    __atomic_store_n((unsigned *) (sq_ring + p.sq_off.tail), 4, __ATOMIC_RELEASE);
+
+    g_assert_cmpint(syscall(__NR_io_uring_enter, ring, 2, 2, IORING_ENTER_GETEVENTS, NULL, 0), ==, 2);
+    tail = __atomic_load_n((unsigned *) (cq_ring + p.cq_off.tail), __ATOMIC_ACQUIRE);
+    g_assert_cmpuint(tail - head, ==, 2);
+    for (; head != tail; ++head) {
+	cqe = (struct io_uring_cqe *) (cq_ring + p.cq_off.cqes) + (head & *(unsigned *) (cq_ring + p.cq_off.ring_mask));
+	if (cqe->user_data == 4)
+	    g_assert_cmpint(cqe->res, ==, -EOPNOTSUPP);
+	else
+	    g_assert_cmpint(cqe->res, ==, 0);
+    }
+    close(fd);
+
+    /* a read from a serial port waits for data in the background, without
+     * holding up the submission; like for any stream device, the offset
+     * does not matter */
+    g_assert(umockdev_testbed_add_from_string(fixture->testbed,
+					      "P: /devices/ttyS0\nN: ttyS0\n"
+					      "E: DEVNAME=/dev/ttyS0\nE: SUBSYSTEM=tty\nA: dev=4:64\n", &error));
+    g_assert_no_error(error);
+    g_assert(umockdev_testbed_load_serial(fixture->testbed, "/dev/ttyS0", &error));
+    g_assert_no_error(error);
+    master = umockdev_testbed_get_dev_fd(fixture->testbed, "/dev/ttyS0");
+    fd = g_open("/dev/ttyS0", O_RDWR | O_NOCTTY, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(tcgetattr(fd, &ios), ==, 0);
+    cfmakeraw(&ios);
+    g_assert_cmpint(tcsetattr(fd, TCSANOW, &ios), ==, 0);
+
+    memset(buf, 0, sizeof buf);
+    memset(sqes, 0, sizeof(struct io_uring_sqe));
+    sqes[0].opcode = IORING_OP_READ;
+    sqes[0].fd = fd;
+    sqes[0].addr = (uintptr_t) buf;
+    sqes[0].len = sizeof buf;
+    sqes[0].off = 0;
+    sqes[0].user_data = 5;
+    sq_array[0] = 0;
+    __atomic_store_n((unsigned *) (sq_ring + p.sq_off.tail), 5, __ATOMIC_RELEASE);
+
+    g_assert_cmpint(syscall(__NR_io_uring_enter, ring, 1, 0, 0, NULL, 0), ==, 1);
+    g_usleep(20000);
+    g_assert_cmpuint(__atomic_load_n((unsigned *) (cq_ring + p.cq_off.tail), __ATOMIC_ACQUIRE), ==, head);
+
+    g_assert_cmpint(write(master, "hello", 5), ==, 5);
+    g_assert_cmpint(syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0), ==, 0);
+    tail = __atomic_load_n((unsigned *) (cq_ring + p.cq_off.tail), __ATOMIC_ACQUIRE);
+    g_assert_cmpuint(tail - head, ==, 1);
+    cqe = (struct io_uring_cqe *) (cq_ring + p.cq_off.cqes) + (head & *(unsigned *) (cq_ring + p.cq_off.ring_mask));
+    g_assert_cmpuint(cqe->user_data, ==, 5);
+    g_assert_cmpint(cqe->res, ==, 5);
+    g_assert(strncmp(buf, "hello", 5) == 0);
+    head = tail;
+    /* it went through the handler, not straight to the PTY */
+    memset(&icount, 0, sizeof icount);
+    g_assert_cmpint(ioctl(fd, TIOCGICOUNT, &icount), ==, 0);
+    g_assert_cmpint(icount.rx, ==, 5);
+
+    close(fd);
+    close(ring);
+}
+
+static void
+t_testbed_io_uring_foreign(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    GError *error = NULL;
+    struct io_uring_params p;
+    int ring, fd;
+
+    memset(&p, 0, sizeof p);
+    ring = syscall(__NR_io_uring_setup, 4, &p);
+    if (ring < 0) {
+	g_test_skip("io_uring is not available");
+	return;
+    }
+    close(ring);
+
+    if (g_test_subprocess()) {
+	/* like liburing, which issues the system calls itself */
+	long (*raw_syscall) (long, ...) = dlsym(dlopen("libc.so.6", RTLD_LAZY), "syscall");
+
+	g_assert(umockdev_testbed_add_from_string(fixture->testbed,
+						  "P: /devices/ttyS0\nN: ttyS0\n"
+						  "E: DEVNAME=/dev/ttyS0\nE: SUBSYSTEM=tty\nA: dev=4:64\n", &error));
+	g_assert_no_error(error);
+	g_assert(umockdev_testbed_load_serial(fixture->testbed, "/dev/ttyS0", &error));
+	g_assert_no_error(error);
+
+	memset(&p, 0, sizeof p);
+	ring = raw_syscall(__NR_io_uring_setup, 4, &p);
+	g_assert_cmpint(ring, >=, 0);
+	fd = g_open("/dev/ttyS0", O_RDWR | O_NOCTTY, 0);
+	g_assert_cmpint(fd, >=, 0);
+	close(fd);
+	close(ring);
+	return;
+    }
+    g_test_trap_subprocess(NULL, 0, 0);
+    g_test_trap_assert_passed();
+    g_test_trap_assert_stderr("*WARNING*io_uring fd * was not set up through libc's syscall()*");
+}
+#endif
+
 static void
 t_testbed_dev_query_gudev(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
@@ -2093,6 +2917,97 @@ t_testbed_replay_evemu_events_default_device(UMockdevTestbedFixture * fixture, U
   close(fd);
 }
 
+static void
+t_testbed_evdev_state(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+  gboolean success;
+  GError *error = NULL;
+  int fd;
+  g_autofree char *ioctlpath = NULL;
+  g_autofree char *evpath = NULL;
+  struct input_event ev;
+  struct input_absinfo absinfo;
+  unsigned char keys[8];
+  int32_t mtslots[3];
+  /* recorded state: KEY_1 is down; ABS_X is 0 with range 0..1000; two MT
+   * slots with ABS_MT_POSITION_X 100/200 and ABS_MT_TRACKING_ID 3/-1 */
+  static const char* test_ioctl = "@DEV /dev/input/event1\n"
+                                  "EVIOCGKEY 8 0400000000000000\n"
+                                  "EVIOCGABS(0) 0 0000000000000000E8030000000000000000000000000000\n"
+                                  "EVIOCGABS(47) 0 000000000000000001000000000000000000000000000000\n"
+                                  "EVIOCGMTSLOTS 0 3500000064000000C8000000\n"
+                                  "EVIOCGMTSLOTS 0 3900000003000000FFFFFFFF\n";
+  static const char* test_events = "E: 1234.500000 0001 001e 1\n"   /* KEY_A down */
+                                   "E: 1234.500000 0003 0000 500\n" /* ABS_X */
+                                   "E: 1234.500000 0000 0000 0\n"   /* SYN */
+                                   "E: 1234.600000 0001 001e 0\n"   /* KEY_A up */
+                                   "E: 1234.600000 0003 0000 700\n" /* ABS_X */
+                                   "E: 1234.600000 0000 0000 0\n";  /* SYN */
+
+  if (G_BYTE_ORDER != G_LITTLE_ENDIAN) {
+      g_test_skip("ioctl record is little-endian");
+      return;
+  }
+
+  umockdev_testbed_add_from_string(fixture->testbed,
+          "P: /devices/event1\nN: input/event1\n"
+          "E: DEVNAME=/dev/input/event1\nE: SUBSYSTEM=input\n", &error);
+  g_assert_no_error(error);
+
+  fd = g_file_open_tmp("test_evdev.XXXXXX.ioctl", &ioctlpath, &error);
+  g_assert_no_error(error);
+  g_assert_cmpint(write(fd, test_ioctl, strlen(test_ioctl)), ==, strlen(test_ioctl));
+  close(fd);
+  success = umockdev_testbed_load_ioctl(fixture->testbed, NULL, ioctlpath, &error);
+  g_assert_no_error(error);
+  g_assert(success);
+  g_unlink (ioctlpath);
+
+  fd = g_file_open_tmp("test_evemu.XXXXXX", &evpath, &error);
+  g_assert_no_error(error);
+  g_assert_cmpint(write(fd, test_events, strlen(test_events)), ==, strlen(test_events));
+  close(fd);
+  success = umockdev_testbed_load_evemu_events(fixture->testbed, "/dev/input/event1", evpath, &error);
+  g_assert_no_error(error);
+  g_assert(success);
+  g_unlink (evpath);
+
+  fd = g_open("/dev/input/event1", O_RDONLY, 0);
+  g_assert_cmpint(fd, >=, 0);
+
+  /* recorded MT slot values are answered for the requested code */
+  mtslots[0] = ABS_MT_TRACKING_ID;
+  g_assert_cmpint(ioctl(fd, EVIOCGMTSLOTS(sizeof(mtslots)), mtslots), ==, 0);
+  g_assert_cmpint(mtslots[1], ==, 3);
+  g_assert_cmpint(mtslots[2], ==, -1);
+  mtslots[0] = ABS_MT_POSITION_X;
+  g_assert_cmpint(ioctl(fd, EVIOCGMTSLOTS(sizeof(mtslots)), mtslots), ==, 0);
+  g_assert_cmpint(mtslots[1], ==, 100);
+  g_assert_cmpint(mtslots[2], ==, 200);
+
+  /* once the first report is readable, the state reflects it */
+  for (int i = 0; i < 3; ++i)
+      g_assert_cmpint(read(fd, &ev, sizeof(ev)), ==, sizeof(ev));
+  memset(keys, 0, sizeof(keys));
+  g_assert_cmpint(ioctl(fd, EVIOCGKEY(sizeof(keys)), keys), ==, sizeof(keys));
+  g_assert_cmpint(keys[0], ==, 0x04);
+  g_assert_cmpint(keys[KEY_A / 8], ==, 1 << (KEY_A % 8));
+  g_assert_cmpint(ioctl(fd, EVIOCGABS(ABS_X), &absinfo), ==, 0);
+  g_assert_cmpint(absinfo.value, ==, 500);
+  g_assert_cmpint(absinfo.maximum, ==, 1000);
+
+  /* key release; the stateless ioctl cache must not keep the old state */
+  for (int i = 0; i < 3; ++i)
+      g_assert_cmpint(read(fd, &ev, sizeof(ev)), ==, sizeof(ev));
+  g_assert_cmpint(ioctl(fd, EVIOCGKEY(sizeof(keys)), keys), ==, sizeof(keys));
+  g_assert_cmpint(keys[0], ==, 0x04);
+  g_assert_cmpint(keys[KEY_A / 8], ==, 0);
+  g_assert_cmpint(ioctl(fd, EVIOCGABS(ABS_X), &absinfo), ==, 0);
+  g_assert_cmpint(absinfo.value, ==, 700);
+
+  close(fd);
+}
+
 static void
 t_testbed_clear(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
@@ -2342,6 +3257,10 @@ main(int argc, char **argv)
 	       t_testbed_child_device, t_testbed_fixture_teardown);
     g_test_add("/umockdev-testbed/set_attribute", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
 	       t_testbed_set_attribute, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/notify_attribute", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_notify_attribute, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/set_attribute_func", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_set_attribute_func, t_testbed_fixture_teardown);
     g_test_add("/umockdev-testbed/set_property", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
 	       t_testbed_set_property, t_testbed_fixture_teardown);
     g_test_add("/umockdev-testbed/add_from_string", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
@@ -2379,10 +3298,28 @@ main(int argc, char **argv)
     /* tests for mocking /dev */
     g_test_add("/umockdev-testbed/dev_access", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
 	       t_testbed_dev_access, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/relative_paths", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_relative_paths, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/dirfd_paths", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_dirfd_paths, t_testbed_fixture_teardown);
     g_test_add("/umockdev-testbed/add_from_string_dev_char", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
 	       t_testbed_add_from_string_dev_char, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/lazy_node", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_lazy_node, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/isatty", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_isatty, t_testbed_fixture_teardown);
     g_test_add("/umockdev-testbed/add_from_string_dev_block", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
 	       t_testbed_add_from_string_dev_block, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/block_data", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_block_data, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/serial", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_serial, t_testbed_fixture_teardown);
+#ifdef HAVE_LINUX_IO_URING_H
+    g_test_add("/umockdev-testbed/io_uring", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_io_uring, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/io_uring_foreign", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_io_uring_foreign, t_testbed_fixture_teardown);
+#endif
     g_test_add("/umockdev-testbed/dev_query_gudev", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
 	       t_testbed_dev_query_gudev, t_testbed_fixture_teardown);
 
@@ -2403,6 +3340,8 @@ main(int argc, char **argv)
 	       t_testbed_replay_evemu_events, t_testbed_fixture_teardown);
     g_test_add("/umockdev-testbed/replay_evemu_events_default_device", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
 	       t_testbed_replay_evemu_events_default_device, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/evdev_state", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_evdev_state, t_testbed_fixture_teardown);
 
     /* misc */
     g_test_add("/umockdev-testbed/clear", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,